@@ -43,6 +43,51 @@ BOOL WINAPI PatBlt( HDC hdc, INT left, INT top,
 }
 
 
+/***********************************************************************
+ *           get_blt_dcs
+ *
+ * Lock the destination and source DCs of a blit, with both visRgns
+ * updated.  DCs have locks of their own, so they are taken in handle
+ * order to keep two threads blitting between the same pair of DCs in
+ * opposite directions from deadlocking.  *src is NULL if the source DC
+ * is invalid; both must be released with GDI_ReleaseObj.
+ */
+static DC *get_blt_dcs( HDC hdcDst, HDC hdcSrc, DC **src )
+{
+    DC *dcDst;
+
+    if ((*src = DC_GetDCUpdate( hdcSrc ))) GDI_ReleaseObj( hdcSrc );
+
+    if (hdcDst <= hdcSrc)
+    {
+        dcDst = DC_GetDCUpdate( hdcDst );
+        *src = dcDst ? DC_GetDCPtr( hdcSrc ) : NULL;
+        return dcDst;
+    }
+
+    /* DC_GetDCUpdate may call up to USER, so it can't be called with the
+     * source held; update first, then lock both and retry if the
+     * destination became dirty again in the meantime */
+    for (;;)
+    {
+        if (!(dcDst = DC_GetDCUpdate( hdcDst )))
+        {
+            *src = NULL;
+            return NULL;
+        }
+        GDI_ReleaseObj( hdcDst );
+        *src = DC_GetDCPtr( hdcSrc );
+        if (!(dcDst = DC_GetDCPtr( hdcDst ))) break;
+        if (!(dcDst->flags & DC_DIRTY)) return dcDst;
+        GDI_ReleaseObj( hdcDst );
+        if (*src) GDI_ReleaseObj( hdcSrc );
+    }
+    if (*src) GDI_ReleaseObj( hdcSrc );
+    *src = NULL;
+    return NULL;
+}
+
+
 /***********************************************************************
  *           BitBlt    (GDI.34)
  */
@@ -63,11 +108,8 @@ BOOL WINAPI BitBlt( HDC hdcDst, INT xDst, INT yDst, INT width,
     BOOL ret = FALSE;
     DC *dcDst, *dcSrc;
 
-    if ((dcSrc = DC_GetDCUpdate( hdcSrc ))) GDI_ReleaseObj( hdcSrc );
-    /* FIXME: there is a race condition here */
-    if ((dcDst = DC_GetDCUpdate( hdcDst )))
+    if ((dcDst = get_blt_dcs( hdcDst, hdcSrc, &dcSrc )))
     {
-        dcSrc = DC_GetDCPtr( hdcSrc );
         TRACE("hdcSrc=%04x %d,%d %d bpp->hdcDest=%04x %d,%d %dx%dx%d rop=%06lx\n",
               hdcSrc, xSrc, ySrc, dcSrc ? dcSrc->bitsPerPixel : 0,
               hdcDst, xDst, yDst, width, height, dcDst ? dcDst->bitsPerPixel : 0, rop);
@@ -106,12 +148,8 @@ BOOL WINAPI StretchBlt( HDC hdcDst, INT xDst, INT yDst,
     BOOL ret = FALSE;
     DC *dcDst, *dcSrc;
 
-    if ((dcSrc = DC_GetDCUpdate( hdcSrc ))) GDI_ReleaseObj( hdcSrc );
-    /* FIXME: there is a race condition here */
-    if ((dcDst = DC_GetDCUpdate( hdcDst )))
+    if ((dcDst = get_blt_dcs( hdcDst, hdcSrc, &dcSrc )))
     {
-        dcSrc = DC_GetDCPtr( hdcSrc );
-
         TRACE("%04x %d,%d %dx%dx%d -> %04x %d,%d %dx%dx%d rop=%06lx\n",
               hdcSrc, xSrc, ySrc, widthSrc, heightSrc,
               dcSrc ? dcSrc->bitsPerPixel : 0, hdcDst, xDst, yDst,
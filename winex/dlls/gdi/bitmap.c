@@ -193,7 +193,11 @@ HBITMAP WINAPI CreateCompatibleBitmap( HDC hdc, INT width, INT height)
 	else
 	   hbmpRet = CreateBitmap( width, height, 1, dc->bitsPerPixel, NULL );
 	if(dc->funcs->pCreateBitmap)
+	{
+	    GDI_EnterDriver();
 	    dc->funcs->pCreateBitmap( hbmpRet );
+	    GDI_LeaveDriver();
+	}
     }
     TRACE("\t\t%04x\n", hbmpRet);
     GDI_ReleaseObj(hdc);
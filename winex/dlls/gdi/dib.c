@@ -1013,6 +1013,9 @@ HGLOBAL DIB_CreateDIBFromBitmap(HDC hdc, HBITMAP hBmp)
     height = pBmp->bitmap.bmHeight;
     depth = pBmp->bitmap.bmBitsPixel;
 
+    /* GetDIBits locks the DC, which can't be done with the bitmap held */
+    GDI_ReleaseObj( hBmp );
+
     /*
      * A packed DIB contains a BITMAPINFO structure followed immediately by
      * an optional color palette and the pixel data.
@@ -1033,7 +1036,7 @@ HGLOBAL DIB_CreateDIBFromBitmap(HDC hdc, HBITMAP hBmp)
     if ( !hPackedDIB )
     {
         WARN("Could not allocate packed DIB!\n");
-        goto END;
+        return 0;
     }
 
     /* A packed DIB starts with a BITMAPINFOHEADER */
@@ -1072,7 +1075,5 @@ HGLOBAL DIB_CreateDIBFromBitmap(HDC hdc, HBITMAP hBmp)
         hPackedDIB = 0;
     }
 
-END:
-    GDI_ReleaseObj( hBmp );
     return hPackedDIB;
 }
@@ -23,12 +23,13 @@ struct graphics_driver
     struct graphics_driver *prev;
     HMODULE                 module;  /* module handle */
     unsigned int            count;   /* reference count */
-    DC_FUNCTIONS            funcs;
+    DC_FUNCTIONS            funcs;   /* what the DCs call, see below */
+    DC_FUNCTIONS            real;    /* the driver's own entry points */
 };
 
 static struct graphics_driver *first_driver;
 static struct graphics_driver *display_driver;
-static const DC_FUNCTIONS *win16_driver;
+static struct graphics_driver *win16_driver;
 static CRITICAL_SECTION driver_section;
 
 void initialize_driver(void)
@@ -42,6 +43,301 @@ void deinitialize_driver(void)
 }
 
 
+/* The drivers behind this table were written for a GDI that held
+ * GDI_level around everything, and DCs now have locks of their own.  So
+ * each entry point that takes a DC goes through a thunk that holds
+ * GDI_level around the real call, the DC lock already being held by the
+ * caller.  The thunk finds the real entry point from dc->funcs.  This
+ * means drawing on different DCs still serializes on GDI_level; only
+ * the work GDI does itself around the driver calls runs concurrently.
+ *
+ * The few entry points that don't take a DC are left alone: BitmapBits
+ * and DeleteObject are called with the bitmap, hence GDI_level, held;
+ * CreateBitmap and DeviceCapabilities callers take GDI_EnterDriver
+ * themselves; EnumDeviceFonts and ExtDeviceMode call back into the
+ * application and never ran under the GDI lock.  The metafile drivers
+ * don't come through here, they only record into the DC they are given.
+ */
+static inline const DC_FUNCTIONS *get_real_funcs( DC *dc )
+{
+    return &CONTAINING_RECORD( dc->funcs, struct graphics_driver, funcs )->real;
+}
+
+#define DRIVER_THUNK(type,name,args,params) \
+static type driver_##name args \
+{ \
+    type ret; \
+    GDI_EnterDriver(); \
+    ret = get_real_funcs( dc )->p##name params; \
+    GDI_LeaveDriver(); \
+    return ret; \
+}
+
+#define VOID_THUNK(name,args,params) \
+static void driver_##name args \
+{ \
+    GDI_EnterDriver(); \
+    get_real_funcs( dc )->p##name params; \
+    GDI_LeaveDriver(); \
+}
+
+DRIVER_THUNK( INT, AbortDoc, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, AbortPath, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, AngleArc, (DC *dc, INT arg1, INT arg2, DWORD arg3, FLOAT arg4, FLOAT arg5),
+              (dc, arg1, arg2, arg3, arg4, arg5) )
+DRIVER_THUNK( BOOL, Arc, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, INT arg5, INT arg6,
+                          INT arg7, INT arg8),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8) )
+DRIVER_THUNK( BOOL, ArcTo, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, INT arg5,
+                            INT arg6, INT arg7, INT arg8),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8) )
+DRIVER_THUNK( BOOL, BeginPath, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, BitBlt, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, DC *dcSrc,
+                             INT arg6, INT arg7, DWORD arg8),
+              (dc, arg1, arg2, arg3, arg4, dcSrc, arg6, arg7, arg8) )
+DRIVER_THUNK( INT, ChoosePixelFormat, (DC *dc, const PIXELFORMATDESCRIPTOR *arg1), (dc, arg1) )
+DRIVER_THUNK( BOOL, Chord, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, INT arg5,
+                            INT arg6, INT arg7, INT arg8),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8) )
+DRIVER_THUNK( BOOL, CloseFigure, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, CreateDC, (DC *dc, LPCSTR arg1, LPCSTR arg2, LPCSTR arg3,
+                               const DEVMODEA *arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( HBITMAP, CreateDIBSection, (DC *dc, BITMAPINFO *arg1, UINT arg2, LPVOID *arg3,
+                                          HANDLE arg4, DWORD arg5, DWORD arg6),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6) )
+DRIVER_THUNK( BOOL, DeleteDC, (DC *dc), (dc) )
+DRIVER_THUNK( INT, DescribePixelFormat, (DC *dc, INT arg1, UINT arg2,
+                                         PIXELFORMATDESCRIPTOR *arg3),
+              (dc, arg1, arg2, arg3) )
+DRIVER_THUNK( BOOL, Ellipse, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( INT, EndDoc, (DC *dc), (dc) )
+DRIVER_THUNK( INT, EndPage, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, EndPath, (DC *dc), (dc) )
+DRIVER_THUNK( INT, ExcludeClipRect, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( INT, ExtEscape, (DC *dc, INT arg1, INT arg2, LPCVOID arg3, INT arg4,
+                               LPVOID arg5),
+              (dc, arg1, arg2, arg3, arg4, arg5) )
+DRIVER_THUNK( BOOL, ExtFloodFill, (DC *dc, INT arg1, INT arg2, COLORREF arg3, UINT arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( BOOL, ExtTextOut, (DC *dc, INT arg1, INT arg2, UINT arg3, const RECT *arg4,
+                                 LPCWSTR arg5, UINT arg6, const INT *arg7, BOOL arg8),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8) )
+DRIVER_THUNK( BOOL, FillPath, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, FillRgn, (DC *dc, HRGN arg1, HBRUSH arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, FlattenPath, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, FrameRgn, (DC *dc, HRGN arg1, HBRUSH arg2, INT arg3, INT arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( BOOL, GetCharWidth, (DC *dc, UINT arg1, UINT arg2, LPINT arg3),
+              (dc, arg1, arg2, arg3) )
+DRIVER_THUNK( BOOL, GetDCOrgEx, (DC *dc, LPPOINT arg1), (dc, arg1) )
+DRIVER_THUNK( INT, GetDeviceCaps, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( BOOL, GetDeviceGammaRamp, (DC *dc, LPVOID arg1), (dc, arg1) )
+DRIVER_THUNK( COLORREF, GetPixel, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( INT, GetPixelFormat, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, GetTextExtentPoint, (DC *dc, LPCWSTR arg1, INT arg2, LPSIZE arg3),
+              (dc, arg1, arg2, arg3) )
+DRIVER_THUNK( BOOL, GetTextMetrics, (DC *dc, TEXTMETRICW *arg1), (dc, arg1) )
+DRIVER_THUNK( INT, IntersectClipRect, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( BOOL, InvertRgn, (DC *dc, HRGN arg1), (dc, arg1) )
+DRIVER_THUNK( BOOL, LineTo, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, MoveTo, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( INT, OffsetClipRgn, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, OffsetViewportOrg, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, OffsetWindowOrg, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, PaintRgn, (DC *dc, HRGN arg1), (dc, arg1) )
+DRIVER_THUNK( BOOL, PatBlt, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, DWORD arg5),
+              (dc, arg1, arg2, arg3, arg4, arg5) )
+DRIVER_THUNK( BOOL, Pie, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, INT arg5, INT arg6,
+                          INT arg7, INT arg8),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8) )
+DRIVER_THUNK( BOOL, PolyBezier, (DC *dc, const POINT *arg1, DWORD arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, PolyBezierTo, (DC *dc, const POINT *arg1, DWORD arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, PolyDraw, (DC *dc, const POINT *arg1, const BYTE *arg2, DWORD arg3),
+              (dc, arg1, arg2, arg3) )
+DRIVER_THUNK( BOOL, PolyPolygon, (DC *dc, const POINT *arg1, const INT *arg2, UINT arg3),
+              (dc, arg1, arg2, arg3) )
+DRIVER_THUNK( BOOL, PolyPolyline, (DC *dc, const POINT *arg1, const DWORD *arg2, DWORD arg3),
+              (dc, arg1, arg2, arg3) )
+DRIVER_THUNK( BOOL, Polygon, (DC *dc, const POINT *arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, Polyline, (DC *dc, const POINT *arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, PolylineTo, (DC *dc, const POINT *arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( UINT, RealizePalette, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, Rectangle, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( BOOL, RestoreDC, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( BOOL, RoundRect, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, INT arg5,
+                                INT arg6),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6) )
+DRIVER_THUNK( INT, SaveDC, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, ScaleViewportExt, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( BOOL, ScaleWindowExt, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4),
+              (dc, arg1, arg2, arg3, arg4) )
+DRIVER_THUNK( BOOL, SelectClipPath, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( INT, SelectClipRgn, (DC *dc, HRGN arg1), (dc, arg1) )
+DRIVER_THUNK( HANDLE, SelectObject, (DC *dc, HANDLE arg1), (dc, arg1) )
+DRIVER_THUNK( HPALETTE, SelectPalette, (DC *dc, HPALETTE arg1, BOOL arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( COLORREF, SetBkColor, (DC *dc, COLORREF arg1), (dc, arg1) )
+DRIVER_THUNK( INT, SetBkMode, (DC *dc, INT arg1), (dc, arg1) )
+VOID_THUNK( SetDeviceClipping, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, SetDeviceGammaRamp, (DC *dc, LPVOID arg1), (dc, arg1) )
+DRIVER_THUNK( INT, SetDIBitsToDevice, (DC *dc, INT arg1, INT arg2, DWORD arg3, DWORD arg4,
+                                       INT arg5, INT arg6, UINT arg7, UINT arg8, LPCVOID arg9,
+                                       const BITMAPINFO *arg10, UINT arg11),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9, arg10, arg11) )
+DRIVER_THUNK( INT, SetMapMode, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( DWORD, SetMapperFlags, (DC *dc, DWORD arg1), (dc, arg1) )
+DRIVER_THUNK( COLORREF, SetPixel, (DC *dc, INT arg1, INT arg2, COLORREF arg3),
+              (dc, arg1, arg2, arg3) )
+DRIVER_THUNK( BOOL, SetPixelFormat, (DC *dc, INT arg1, const PIXELFORMATDESCRIPTOR *arg2),
+              (dc, arg1, arg2) )
+DRIVER_THUNK( INT, SetPolyFillMode, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( INT, SetROP2, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( INT, SetRelAbs, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( INT, SetStretchBltMode, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( UINT, SetTextAlign, (DC *dc, UINT arg1), (dc, arg1) )
+DRIVER_THUNK( INT, SetTextCharacterExtra, (DC *dc, INT arg1), (dc, arg1) )
+DRIVER_THUNK( DWORD, SetTextColor, (DC *dc, DWORD arg1), (dc, arg1) )
+DRIVER_THUNK( INT, SetTextJustification, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, SetViewportExt, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, SetViewportOrg, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, SetWindowExt, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( BOOL, SetWindowOrg, (DC *dc, INT arg1, INT arg2), (dc, arg1, arg2) )
+DRIVER_THUNK( INT, StartDoc, (DC *dc, const DOCINFOA *arg1), (dc, arg1) )
+DRIVER_THUNK( INT, StartPage, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, StretchBlt, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, DC *dcSrc,
+                                 INT arg6, INT arg7, INT arg8, INT arg9, DWORD arg10),
+              (dc, arg1, arg2, arg3, arg4, dcSrc, arg6, arg7, arg8, arg9, arg10) )
+DRIVER_THUNK( INT, StretchDIBits, (DC *dc, INT arg1, INT arg2, INT arg3, INT arg4, INT arg5,
+                                   INT arg6, INT arg7, INT arg8, const void *arg9,
+                                   const BITMAPINFO *arg10, UINT arg11, DWORD arg12),
+              (dc, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9, arg10, arg11, arg12) )
+DRIVER_THUNK( BOOL, StrokeAndFillPath, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, StrokePath, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, SwapBuffers, (DC *dc), (dc) )
+DRIVER_THUNK( BOOL, WidenPath, (DC *dc), (dc) )
+
+#undef VOID_THUNK
+#undef DRIVER_THUNK
+
+
+/**********************************************************************
+ *	     init_driver_funcs
+ *
+ * Fill the table the DCs use from the real entry points.
+ */
+static void init_driver_funcs( struct graphics_driver *driver )
+{
+#define THUNK(name) driver->funcs.p##name = driver->real.p##name ? driver_##name : NULL
+#define DIRECT(name) driver->funcs.p##name = driver->real.p##name
+
+    THUNK(AbortDoc);
+    THUNK(AbortPath);
+    THUNK(AngleArc);
+    THUNK(Arc);
+    THUNK(ArcTo);
+    THUNK(BeginPath);
+    THUNK(BitBlt);
+    DIRECT(BitmapBits);
+    THUNK(ChoosePixelFormat);
+    THUNK(Chord);
+    THUNK(CloseFigure);
+    DIRECT(CreateBitmap);
+    THUNK(CreateDC);
+    THUNK(CreateDIBSection);
+    THUNK(DeleteDC);
+    DIRECT(DeleteObject);
+    THUNK(DescribePixelFormat);
+    DIRECT(DeviceCapabilities);
+    THUNK(Ellipse);
+    THUNK(EndDoc);
+    THUNK(EndPage);
+    THUNK(EndPath);
+    DIRECT(EnumDeviceFonts);
+    THUNK(ExcludeClipRect);
+    DIRECT(ExtDeviceMode);
+    THUNK(ExtEscape);
+    THUNK(ExtFloodFill);
+    THUNK(ExtTextOut);
+    THUNK(FillPath);
+    THUNK(FillRgn);
+    THUNK(FlattenPath);
+    THUNK(FrameRgn);
+    THUNK(GetCharWidth);
+    THUNK(GetDCOrgEx);
+    THUNK(GetDeviceCaps);
+    THUNK(GetDeviceGammaRamp);
+    THUNK(GetPixel);
+    THUNK(GetPixelFormat);
+    THUNK(GetTextExtentPoint);
+    THUNK(GetTextMetrics);
+    THUNK(IntersectClipRect);
+    THUNK(InvertRgn);
+    THUNK(LineTo);
+    THUNK(MoveTo);
+    THUNK(OffsetClipRgn);
+    THUNK(OffsetViewportOrg);
+    THUNK(OffsetWindowOrg);
+    THUNK(PaintRgn);
+    THUNK(PatBlt);
+    THUNK(Pie);
+    THUNK(PolyBezier);
+    THUNK(PolyBezierTo);
+    THUNK(PolyDraw);
+    THUNK(PolyPolygon);
+    THUNK(PolyPolyline);
+    THUNK(Polygon);
+    THUNK(Polyline);
+    THUNK(PolylineTo);
+    THUNK(RealizePalette);
+    THUNK(Rectangle);
+    THUNK(RestoreDC);
+    THUNK(RoundRect);
+    THUNK(SaveDC);
+    THUNK(ScaleViewportExt);
+    THUNK(ScaleWindowExt);
+    THUNK(SelectClipPath);
+    THUNK(SelectClipRgn);
+    THUNK(SelectObject);
+    THUNK(SelectPalette);
+    THUNK(SetBkColor);
+    THUNK(SetBkMode);
+    THUNK(SetDeviceClipping);
+    THUNK(SetDeviceGammaRamp);
+    THUNK(SetDIBitsToDevice);
+    THUNK(SetMapMode);
+    THUNK(SetMapperFlags);
+    THUNK(SetPixel);
+    THUNK(SetPixelFormat);
+    THUNK(SetPolyFillMode);
+    THUNK(SetROP2);
+    THUNK(SetRelAbs);
+    THUNK(SetStretchBltMode);
+    THUNK(SetTextAlign);
+    THUNK(SetTextCharacterExtra);
+    THUNK(SetTextColor);
+    THUNK(SetTextJustification);
+    THUNK(SetViewportExt);
+    THUNK(SetViewportOrg);
+    THUNK(SetWindowExt);
+    THUNK(SetWindowOrg);
+    THUNK(StartDoc);
+    THUNK(StartPage);
+    THUNK(StretchBlt);
+    THUNK(StretchDIBits);
+    THUNK(StrokeAndFillPath);
+    THUNK(StrokePath);
+    THUNK(SwapBuffers);
+    THUNK(WidenPath);
+#undef DIRECT
+#undef THUNK
+}
+
+
 /**********************************************************************
  *	     create_driver
  *
@@ -59,7 +355,7 @@ static struct graphics_driver *create_driver( HMODULE module )
 
     /* fill the function table */
 
-#define GET_FUNC(name) driver->funcs.p##name = (void*)GetProcAddress( module, #name )
+#define GET_FUNC(name) driver->real.p##name = (void*)GetProcAddress( module, #name )
 
     GET_FUNC(AbortDoc);
     GET_FUNC(AbortPath);
@@ -160,6 +456,7 @@ static struct graphics_driver *create_driver( HMODULE module )
     GET_FUNC(SwapBuffers);
     GET_FUNC(WidenPath);
 #undef GET_FUNC
+    init_driver_funcs( driver );
 
     /* add it to the list */
     driver->prev = NULL;
@@ -169,6 +466,33 @@ static struct graphics_driver *create_driver( HMODULE module )
 }
 
 
+/**********************************************************************
+ *	     create_win16_driver
+ *
+ * Wrap the built-in driver for 16-bit printer drivers like the others.
+ */
+static struct graphics_driver *create_win16_driver(void)
+{
+    const DC_FUNCTIONS *funcs = WIN16DRV_Init();
+    struct graphics_driver *driver;
+
+    if (!funcs) return NULL;
+    if (!(driver = HeapAlloc( GetProcessHeap(), 0, sizeof(*driver)))) return NULL;
+    driver->next   = NULL;
+    driver->prev   = NULL;
+    driver->module = 0;
+    driver->count  = 1;
+    driver->real   = *funcs;
+    init_driver_funcs( driver );
+    return driver;
+}
+
+static inline BOOL is_win16_driver( const DC_FUNCTIONS *funcs )
+{
+    return win16_driver && funcs == &win16_driver->funcs;
+}
+
+
 /**********************************************************************
  *	     load_display_driver
  *
@@ -245,9 +569,9 @@ const DC_FUNCTIONS *DRIVER_load_driver( LPCSTR name )
 
     if (!(module = LoadLibraryA( name )))
     {
-        if (!win16_driver) win16_driver = WIN16DRV_Init();
+        if (!win16_driver) win16_driver = create_win16_driver();
         RtlLeaveCriticalSection( &driver_section );
-        return win16_driver;
+        return win16_driver ? &win16_driver->funcs : NULL;
     }
 
     if (!(driver = create_driver( module )))
@@ -273,7 +597,7 @@ const DC_FUNCTIONS *DRIVER_get_driver( const DC_FUNCTIONS *funcs )
     struct graphics_driver *driver;
 
     RtlEnterCriticalSection( &driver_section );
-    if (funcs != win16_driver)
+    if (!is_win16_driver( funcs ))
     {
         for (driver = first_driver; driver; driver = driver->next)
             if (&driver->funcs == funcs) break;
@@ -296,7 +620,7 @@ void DRIVER_release_driver( const DC_FUNCTIONS *funcs )
 
     RtlEnterCriticalSection( &driver_section );
 
-    if (funcs == win16_driver) goto done;
+    if (is_win16_driver( funcs )) goto done;
 
     for (driver = first_driver; driver; driver = driver->next)
         if (&driver->funcs == funcs) break;
@@ -449,8 +773,12 @@ DWORD WINAPI GDI_CallDeviceCapabilities16( LPCSTR lpszDevice, LPCSTR lpszPort,
     if ((dc = DC_GetDCPtr( hdc )))
     {
         if (dc->funcs->pDeviceCapabilities)
+        {
+            GDI_EnterDriver();
             ret = dc->funcs->pDeviceCapabilities( buf, lpszDevice, lpszPort,
                                                   fwCapability, lpszOutput, lpdm );
+            GDI_LeaveDriver();
+        }
         GDI_ReleaseObj( hdc );
     }
     DeleteDC( hdc );
@@ -1188,9 +1188,22 @@ BOOL WINAPI GetTextExtentExPointW( HDC hdc, LPCWSTR str, INT count,
     int index, nFit, extent;
     SIZE tSize;
     BOOL ret = FALSE;
+    DC *dc;
 
     TRACE("(%08x, %s, %d)\n",hdc,debugstr_wn(str,count),maxExt);
 
+    /* the font engine does the whole string in one go */
+    if (!(dc = DC_GetDCPtr( hdc ))) return FALSE;
+    if (dc->gdiFont)
+    {
+        ret = WineEngGetTextExtentExPoint( dc->gdiFont, str, count, maxExt,
+                                           lpnFit, alpDx, size );
+        GDI_ReleaseObj( hdc );
+        TRACE("returning %d %ld x %ld\n",lpnFit ? *lpnFit : count,size->cx,size->cy);
+        return ret;
+    }
+    GDI_ReleaseObj( hdc );
+
     size->cx = size->cy = nFit = extent = 0;
     for(index = 0; index < count; index++)
     {
@@ -25,6 +25,16 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
 #ifdef __APPLE__
 /* FIXME HACK - getting garbage from fcPatternGet ATM */
@@ -145,8 +155,8 @@ MAKE_FUNCPTR(FT_Get_Next_Char);
 #undef MAKE_FUNCPTR
 
 static FT_Library library = 0;
+static CRITICAL_SECTION freetype_cs; /* see the entry points at the end */
 
-/* if modifying this, you must modify the cache file structure. */
 typedef struct tagFace {
     WCHAR *StyleName;
     char *file;
@@ -156,21 +166,27 @@ typedef struct tagFace {
     int SizeIndex;
     DWORD fsCsb[2]; /* codepage bitfield from FONTSIGNATURE */
     struct tagFace *next;
-
-    /* cache: */
-    time_t lastModified; /* of file */
 } Face;
 
-/* if modifying this, you must modify the cache file structure. */
+/* what a font file provides for one face, or one size of a bitmap face.
+ * If modifying this, you must modify the font cache file structure. */
+typedef struct {
+    const WCHAR *FamilyName;
+    const WCHAR *StyleName;
+    BOOL scalable;
+    BOOL Italic;
+    BOOL Bold;
+    INT Height;
+    int SizeIndex;
+    DWORD fsCsb[2];
+} FaceDesc;
+
 typedef struct tagFamily {
     WCHAR *FamilyName;
     Face *FirstFace;
     BOOL ScalableFamily; /* to simplify things an entire family will be either
                             scalable or not */
     struct tagFamily *next;
-
-    /* cache: */
-    BOOL IsCacheEntry;
 } Family;
 
 typedef struct
@@ -196,13 +212,22 @@ struct tagGdiFont {
     INT orientation;
     GM *gm;
     DWORD gmsize;
-    HFONT hfont;
+    DWORD *glyph_map; /* see get_glyph_index */
     SHORT yMax;
     SHORT yMin;
     INT fixedSize;
     TEXTMETRICW *cachedMetrics;
     XFORM xform;
-    struct tagGdiFont *next;
+    Face *face; /* for the glyph bitmap cache, and to reopen ft_face */
+    LONG height; /* what ft_face was opened with */
+
+    /* instance cache, see WineEngCreateFontInstance */
+    LOGFONTW lf;
+    DWORD hash;
+    LONG refs; /* number of HFONTs using it */
+    BOOL cached;
+    struct tagGdiFont *hash_next;
+    struct tagGdiFont *lru_prev, *lru_next; /* fonts with an open ft_face */
 };
 
 typedef struct TAGftFontAlias
@@ -217,7 +242,13 @@ static ftFontAlias *ftAliasTable = NULL;
 
 #define INIT_GM_SIZE 128
 
-static GdiFont GdiFontList = NULL;
+#define FONT_HASH_SIZE 256 /* must be a power of 2 */
+#define FONT_DEFAULT_MAX_FACES 64
+
+static GdiFont font_hash[FONT_HASH_SIZE];
+static GdiFont font_lru_head, font_lru_tail; /* most recently used first */
+static DWORD font_open_faces;
+static DWORD font_max_faces = FONT_DEFAULT_MAX_FACES;
 
 static Family *FontList = NULL;
 
@@ -280,322 +311,853 @@ static WCHAR *defSans = Arial;
 
 /* -------------- CACHE STUFF ------------------ */
 
+static BOOL AddFontFileToList(const char *file);
+static BOOL ReadFontDir(const char *dirname);
+static BOOL AddFaceToList(const char *file, const FaceDesc *desc);
+
 #ifdef USE_FONT_CACHE
-#define FTFONTCACHE_VERSION 2
+#define FTFONTCACHE_VERSION 3
 const char *CacheFileName = "ftfontcache";
 
-typedef struct tagIgnoredFiles
-{
-    char *filename;
-    time_t lastModified;
-
-    struct tagIgnoredFiles *next;
-} IgnoredFiles;
-
-/* File format is as follows, it is not endian-safe, and may not be safe accross
- * other different machines, such as machines with non-standard integer sizes.
- * All data is dumped as binary for simplicity. It is assumed that the cache will
- * always be used on the same machine, anyhow. The cache does carry a small safety
- * net, in that it tells us the size of each element, and the version, in text.
- * If modifying this, please ensure you increase the FTFONTCACHE_VERSION.
- * This stuff comes from Face and Family structures, which it basically
- * serializes.
- * Lengths of strings are binary lengths not including \0.
+/* The cache remembers, for every font file we have looked at, the faces
+ * FreeType found in it, keyed on the file's path, size and modification
+ * time.  A file whose key still matches is not opened again, its faces are
+ * added to the font list straight from the cache.  Files FreeType can't
+ * load, or without any face, get an entry as well so that they are skipped
+ * too.  Only new or modified files are ever handed to FT_New_Face.
+ *
+ * It also remembers the entries of every directory scanned by ReadFontDir,
+ * along with the directory's modification time.  As long as that hasn't
+ * changed nothing was added to, removed from or renamed in it, so the
+ * cached entries are used instead of reading and stat'ing the directory
+ * again.  The files themselves are still checked against their key.
+ *
+ * The file is mapped and used in place, nothing is read into memory up
+ * front.  It is not endian-safe and may not be safe accross machines with
+ * different integer sizes; the cache is only ever used on the machine that
+ * wrote it.  The header carries the version and the size of the records,
+ * anything that doesn't match is simply rebuilt.  If modifying any of the
+ * font_cache_* structures, please increase the FTFONTCACHE_VERSION.
  *
- * - version of file [string: "ftfontcache version %i\n"],
- * - sizeof(int), sizeof(char), sizeof(WCHAR), sizeof(BOOL), sizeof(INT), sizeof(time_t)
- *       [string: "%i, %i, %i, %i, %i, %i\n"]
- * - number of family cache entries [int],
- * - entries: [ - scalable [BOOL],
- *              - number of faces,
- *              - faces [ - len of stylename (length of string) [int],
- *                        - stylename [WCHAR[]],
- *                        - len of filename [int],
- *                        - filename [char[]],
- *                        - italic [BOOL],
- *                        - bold [BOOL],
- *                        - height [INT],
- *                        - sizeindex [INT],
- *                        - fscb [INT[2]],
- *                        - filewritetime [time_t]
- *                      ]
- *            ]
- * - number of entries in ignored file cache [int],
- * - entries: [ - len of filename (length of string) [int],
- *              - filename [char[]],
- *              - filewritetime [time_t]
- *            ]
+ * - header [struct font_cache_header],
+ * - directories [struct font_cache_dir[num_dirs]],
+ * - directory entries [struct font_cache_child[num_children]],
+ * - files [struct font_cache_file[num_files]],
+ * - faces [struct font_cache_face[num_faces]],
+ * - hash buckets of the files, then of the directories
+ *       [DWORD[2 * FONT_CACHE_HASH_SIZE]],
+ * - strings, \0 terminated, the WCHAR ones aligned,
+ * - a terminating WCHAR \0.
+ *
+ * Strings are referenced by their offset from the start of the file.  Hash
+ * buckets and chains hold a record index plus one, 0 ends the chain.
+ * The file is rewritten, through a temporary file, only when something
+ * differs from what was found in it.
  */
 
-Family *cachedFontList = NULL;
-IgnoredFiles *ignoredFilesList = NULL;
+#define FONT_CACHE_MAGIC "ftfontcache\n"
+#define FONT_CACHE_HASH_SIZE 1024 /* must be a power of 2 */
+
+struct font_cache_header
+{
+    char magic[12];
+    DWORD version;
+    DWORD record_sizes;    /* see FONT_CACHE_RECORD_SIZES */
+    DWORD total_size;
+    DWORD num_dirs;
+    DWORD num_children;
+    DWORD num_files;
+    DWORD num_faces;
+};
+
+struct font_cache_dir
+{
+    DWORD path;
+    DWORD hash_next;
+    LONGLONG mtime;
+    LONGLONG scanned;      /* when the entries were read */
+    DWORD first_child;
+    DWORD num_children;
+};
 
-BOOL buildingCache = FALSE;
-BOOL ignoringCache = FALSE;
-HANDLE cacheMutex;
+struct font_cache_child
+{
+    DWORD path;
+    BOOL is_dir;
+};
 
-BOOL using_cache = TRUE;
+#define FONT_CACHE_FILE_LOADED 0x0001 /* FreeType could open the file */
 
-BOOL rebuildCache = FALSE;
+struct font_cache_file
+{
+    DWORD path;
+    DWORD hash_next;
+    LONGLONG size;
+    LONGLONG mtime;
+    DWORD flags;
+    DWORD first_face;
+    DWORD num_faces;
+};
 
-static void SetRebuildCache()
+struct font_cache_face
 {
-    IgnoredFiles *cur = ignoredFilesList;
+    DWORD family;          /* WCHAR string */
+    DWORD style;           /* WCHAR string */
+    BOOL scalable;
+    BOOL italic;
+    BOOL bold;
+    INT height;
+    INT size_index;
+    DWORD fsCsb[2];
+};
 
-    TRACE("rebuilding cache, will delete ignored files list\n");
+#define FONT_CACHE_RECORD_SIZES \
+    ((sizeof(struct font_cache_dir) << 24) | (sizeof(struct font_cache_child) << 16) | \
+     (sizeof(struct font_cache_file) << 8) | sizeof(struct font_cache_face))
 
-    rebuildCache = TRUE;
+/* files and directories we had to look at ourselves during this scan */
+typedef struct tagFontCacheFile
+{
+    char *path;
+    LONGLONG size;
+    LONGLONG mtime;
+    DWORD flags;
+    FaceDesc *faces;
+    DWORD num_faces;
+    struct tagFontCacheFile *next;
+} FontCacheFile;
 
-    while (cur)
-    {
-        IgnoredFiles *next = cur->next;
-        HeapFree(GetProcessHeap(), 0, cur->filename);
-        HeapFree(GetProcessHeap(), 0, cur);
-        cur = next;
-    }
-    ignoredFilesList = NULL;
+typedef struct
+{
+    char *path;
+    BOOL is_dir;
+} FontCacheChild;
+
+typedef struct tagFontCacheDir
+{
+    char *path;
+    LONGLONG mtime;
+    LONGLONG scanned;
+    FontCacheChild *children;
+    DWORD num_children;
+    DWORD max_children;
+    struct tagFontCacheDir *next;
+} FontCacheDir;
+
+static HANDLE cacheMutex;
+static BOOL buildingCache = FALSE; /* we hold cacheMutex until the cache is written */
+static BOOL using_cache = FALSE;   /* between FontListCache_Start and _End */
+static BOOL cache_dirty = FALSE;
+
+/* the mapped cache file */
+static const char *cache_map;
+static DWORD cache_map_size;
+static const struct font_cache_header *cache_header;
+static const struct font_cache_dir *cache_dirs;
+static const struct font_cache_child *cache_children;
+static const struct font_cache_file *cache_files;
+static const struct font_cache_face *cache_faces;
+static const DWORD *cache_file_hash, *cache_dir_hash;
+static DWORD cache_strings;
+static BYTE *cache_file_used, *cache_dir_used;
+static DWORD cache_files_used, cache_dirs_used;
+
+static FontCacheFile *new_files[FONT_CACHE_HASH_SIZE];
+static FontCacheDir *new_dirs[FONT_CACHE_HASH_SIZE];
+
+static DWORD FontCache_Hash(const char *path)
+{
+    DWORD hash = 0;
+    while (*path) hash = hash * 31 + (unsigned char)*path++;
+    return hash & (FONT_CACHE_HASH_SIZE - 1);
 }
 
-static void RebuildIgnoredCache()
+static char *FontCache_FileName(const char *suffix)
 {
-    TRACE("will rebuild ignored cache\n");
-    rebuildCache = TRUE;
+    const char *confdir = get_config_dir();
+    char *filename = HeapAlloc(GetProcessHeap(), 0, strlen(confdir) + 1 +
+                               strlen(CacheFileName) + strlen(suffix) + 1);
+
+    if (filename)
+        sprintf(filename, "%s/%s%s", confdir, CacheFileName, suffix);
+    return filename;
 }
 
-static BOOL ReadCacheFile()
+static char *FontCache_StrDupA(const char *str)
 {
-    char *filename;
-    char const *confdir;
-    FILE *cacheFile;
-    int version, n;
-    int num_families, num_ignore;
-    int i;
+    char *ret = HeapAlloc(GetProcessHeap(), 0, strlen(str) + 1);
+    if (ret) strcpy(ret, str);
+    return ret;
+}
 
-    confdir = get_config_dir();
-    filename = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                         strlen(confdir) + 1 + strlen(CacheFileName) + 1);
-    strcpy(filename, confdir);
-    filename[strlen(filename)] = '/';
-    strcat(filename, CacheFileName);
+static WCHAR *FontCache_StrDupW(const WCHAR *str)
+{
+    WCHAR *ret = HeapAlloc(GetProcessHeap(), 0, (strlenW(str) + 1) * sizeof(WCHAR));
+    if (ret) strcpyW(ret, str);
+    return ret;
+}
+
+/* strings in the mapping; the file ends with a WCHAR \0, so they are
+ * terminated even if the offset is garbage */
+static const char *FontCache_StringA(DWORD offset)
+{
+    if (offset < cache_strings || offset >= cache_map_size) return NULL;
+    return cache_map + offset;
+}
+
+static const WCHAR *FontCache_StringW(DWORD offset)
+{
+    if (offset < cache_strings || offset >= cache_map_size || (offset & 1)) return NULL;
+    return (const WCHAR *)(cache_map + offset);
+}
+
+static BOOL FontCache_MappedFace(DWORD index, FaceDesc *desc)
+{
+    const struct font_cache_face *face = &cache_faces[index];
+
+    desc->FamilyName = FontCache_StringW(face->family);
+    desc->StyleName = FontCache_StringW(face->style);
+    desc->scalable = face->scalable;
+    desc->Italic = face->italic;
+    desc->Bold = face->bold;
+    desc->Height = face->height;
+    desc->SizeIndex = face->size_index;
+    desc->fsCsb[0] = face->fsCsb[0];
+    desc->fsCsb[1] = face->fsCsb[1];
+    return desc->FamilyName && desc->StyleName;
+}
 
-    cacheFile = fopen(filename, "r");
+static BOOL FontCache_Map(void)
+{
+    const struct font_cache_header *header;
+    struct stat st;
+    char *filename;
+    void *map;
+    DWORD size;
+    int fd;
+
+    if (!(filename = FontCache_FileName(""))) return FALSE;
+    fd = open(filename, O_RDONLY);
     HeapFree(GetProcessHeap(), 0, filename);
+    if (fd == -1) return FALSE;
 
-    if (!cacheFile)
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(*header) + sizeof(WCHAR) ||
+        st.st_size > 0x7fffffff)
+    {
+        close(fd);
+        goto format_error;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        WARN("could not map font cache file\n");
         return FALSE;
+    }
+    cache_map = map;
+    cache_map_size = st.st_size;
+
+    TRACE("mapped font cache file, %lu bytes\n", cache_map_size);
+
+    /* check the basics (ie the file is the right version, made on this
+     * machine), and that the tables lie within the file */
+    header = (const struct font_cache_header *)cache_map;
+    if (memcmp(header->magic, FONT_CACHE_MAGIC, sizeof(header->magic)) ||
+        header->version != FTFONTCACHE_VERSION ||
+        header->record_sizes != FONT_CACHE_RECORD_SIZES ||
+        header->total_size != cache_map_size || (cache_map_size & 1) ||
+        *(const WCHAR *)(cache_map + cache_map_size - sizeof(WCHAR)) ||
+        header->num_dirs > 0x100000 || header->num_children > 0x100000 ||
+        header->num_files > 0x100000 || header->num_faces > 0x100000)
+        goto format_error;
+
+    size = sizeof(*header);
+    cache_dirs = (const struct font_cache_dir *)(cache_map + size);
+    size += header->num_dirs * sizeof(*cache_dirs);
+    cache_children = (const struct font_cache_child *)(cache_map + size);
+    size += header->num_children * sizeof(*cache_children);
+    cache_files = (const struct font_cache_file *)(cache_map + size);
+    size += header->num_files * sizeof(*cache_files);
+    cache_faces = (const struct font_cache_face *)(cache_map + size);
+    size += header->num_faces * sizeof(*cache_faces);
+    cache_file_hash = (const DWORD *)(cache_map + size);
+    cache_dir_hash = cache_file_hash + FONT_CACHE_HASH_SIZE;
+    size += 2 * FONT_CACHE_HASH_SIZE * sizeof(DWORD);
+    if (size > cache_map_size) goto format_error;
+    cache_strings = size;
+    cache_header = header;
+
+    cache_file_used = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, header->num_files + 1);
+    cache_dir_used = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, header->num_dirs + 1);
+    if (!cache_file_used || !cache_dir_used)
+    {
+        HeapFree(GetProcessHeap(), 0, cache_file_used);
+        HeapFree(GetProcessHeap(), 0, cache_dir_used);
+        cache_file_used = cache_dir_used = NULL;
+        cache_header = NULL;
+        munmap((void *)cache_map, cache_map_size);
+        cache_map = NULL;
+        return FALSE;
+    }
 
-    TRACE("reading font cache file\n");
-
-    /* read the file */
-
-    /* check the basics (ie the file is the right version, made on this machine) */
-    if((fscanf(cacheFile, "ftfontcache version %i\n", &version) != 1) ||
-       (version != FTFONTCACHE_VERSION) ||
-       (fscanf(cacheFile, "%i", &n) != 1) ||
-       (n != sizeof(int)) ||
-       (fscanf(cacheFile, ", %i", &n) != 1) ||
-       (n != sizeof(char)) ||
-       (fscanf(cacheFile, ", %i", &n) != 1) ||
-       (n != sizeof(WCHAR)) ||
-       (fscanf(cacheFile, ", %i", &n) != 1) ||
-       (n != sizeof(BOOL)) ||
-       (fscanf(cacheFile, ", %i", &n) != 1) ||
-       (n != sizeof(INT)) ||
-       (fscanf(cacheFile, ", %i", &n) != 1) ||
-       (n != sizeof(time_t)) ||
-       (fgetc(cacheFile) != '\n') )
-    {
-        goto filetype_error;
-    }
-
-    /* now get down to the good stuff */
-#define SAFE_READ(p,str) do { if (fread(&p, sizeof(p), 1, cacheFile) != 1) { ERR("Corrupt cache: " str ); goto read_error; } } while(0)
-#define SAFE_READ_PN(p, n, str)  do { if (n && fread(p, n, 1, cacheFile) != 1) { ERR("Corrupt cache: " str ); goto read_error; } } while(0)
-    SAFE_READ(num_families,"num_families");
-    for (i = 0; i < num_families; i++)
-    {
-        int j, num_faces;
-        Family *new_family = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                       sizeof(Family));
-        new_family->IsCacheEntry = TRUE;
-        new_family->next = cachedFontList;
-        cachedFontList = new_family;
-        SAFE_READ(n,"FamilyName length");
-        new_family->FamilyName = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                          sizeof(WCHAR) * (n + 1));
-        SAFE_READ_PN(new_family->FamilyName, n * sizeof(WCHAR),"FamilyName");
-        SAFE_READ(new_family->ScalableFamily,"ScalableFamily");
-        SAFE_READ(num_faces,"num_faces");
-        TRACE("family '%s' has %i faces, about to read (scalable? %i)\n",
-                debugstr_w(new_family->FamilyName),
-                num_faces, new_family->ScalableFamily);
-        for (j = 0; j < num_faces; j++)
-        {
-            Face *new_face = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                       sizeof(Face));
-            new_face->next = new_family->FirstFace;
-            new_family->FirstFace = new_face;
-            SAFE_READ(n,"StyleName length");
-            new_face->StyleName = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                            sizeof(WCHAR) * (n + 1));
-            SAFE_READ_PN(new_face->StyleName, n * sizeof(WCHAR), "StyleName");
-            SAFE_READ(n,"face file length");
-            new_face->file = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                       sizeof(char) * (n + 1));
-            SAFE_READ_PN(new_face->file, n * sizeof(char),"face file");
-            SAFE_READ(new_face->Italic,"Italic");
-            SAFE_READ(new_face->Bold,"Bold");
-            SAFE_READ(new_face->Height,"Height");
-            SAFE_READ(new_face->SizeIndex,"SizeIndex");
-            SAFE_READ(new_face->fsCsb[0],"fsCsb[0]");
-            SAFE_READ(new_face->fsCsb[1],"fsCsb[1]");
-            SAFE_READ(new_face->lastModified,"lastModified");
-        }
+    TRACE("font cache has %lu files in %lu directories\n",
+          header->num_files, header->num_dirs);
+    return TRUE;
+
+format_error:
+    WARN("font cache file format has changed or it is corrupt, will rebuild it\n");
+    if (cache_map) munmap((void *)cache_map, cache_map_size);
+    cache_map = NULL;
+    cache_map_size = 0;
+    return FALSE;
+}
+
+/* returns the index of the entry for path in the mapping, or -1 */
+static int FontCache_FindMappedFile(const char *path)
+{
+    DWORD next, steps = 0;
+
+    if (!cache_header) return -1;
+    next = cache_file_hash[FontCache_Hash(path)];
+    while (next && next <= cache_header->num_files && steps++ < cache_header->num_files)
+    {
+        const char *name = FontCache_StringA(cache_files[next - 1].path);
+        if (name && !strcmp(name, path)) return next - 1;
+        next = cache_files[next - 1].hash_next;
+    }
+    return -1;
+}
+
+static int FontCache_FindMappedDir(const char *path)
+{
+    DWORD next, steps = 0;
+
+    if (!cache_header) return -1;
+    next = cache_dir_hash[FontCache_Hash(path)];
+    while (next && next <= cache_header->num_dirs && steps++ < cache_header->num_dirs)
+    {
+        const char *name = FontCache_StringA(cache_dirs[next - 1].path);
+        if (name && !strcmp(name, path)) return next - 1;
+        next = cache_dirs[next - 1].hash_next;
     }
+    return -1;
+}
+
+/* Adds the faces of file to the font list if the cache knows them, and
+ * sets *ret to what AddFontFileToList should return.  Returns FALSE if the
+ * file has to be opened. */
+static BOOL FontCache_AddFile(const char *file, const struct stat *st, BOOL *ret)
+{
+    const struct font_cache_file *rec;
+    FontCacheFile *cur;
+    FaceDesc desc;
+    DWORD i;
+    int index;
 
-    SAFE_READ(num_ignore,"num_ignore");
-    for (i = 0; i < num_ignore; i++)
+    if (!using_cache) return FALSE;
+
+    for (cur = new_files[FontCache_Hash(file)]; cur; cur = cur->next)
     {
-        IgnoredFiles *new = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                      sizeof(IgnoredFiles));
-        new->next = ignoredFilesList;
-        ignoredFilesList = new;
+        if (strcmp(cur->path, file)) continue;
+        if (cur->size != st->st_size || cur->mtime != st->st_mtime) return FALSE;
+        for (i = 0; i < cur->num_faces; i++)
+            AddFaceToList(file, &cur->faces[i]);
+        *ret = (cur->flags & FONT_CACHE_FILE_LOADED) != 0;
+        return TRUE;
+    }
 
-        SAFE_READ(n,"(ignore)filename size");
-        new->filename = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                  sizeof(char) * (n+1));
-        SAFE_READ_PN(new->filename, n * sizeof(char), "(ignore)filename");
-        SAFE_READ(new->lastModified,"(ignore)lastModified");
+    if ((index = FontCache_FindMappedFile(file)) == -1) return FALSE;
+    rec = &cache_files[index];
+    if (rec->size != st->st_size || rec->mtime != st->st_mtime)
+    {
+        TRACE("%s has changed\n", debugstr_a(file));
+        return FALSE;
     }
+    if (rec->num_faces > cache_header->num_faces ||
+        rec->first_face > cache_header->num_faces - rec->num_faces)
+        return FALSE;
+    for (i = 0; i < rec->num_faces; i++)
+        if (!FontCache_MappedFace(rec->first_face + i, &desc)) return FALSE;
 
-#undef SAFE_READ
-#undef SAFE_READ_PN
+    for (i = 0; i < rec->num_faces; i++)
+    {
+        FontCache_MappedFace(rec->first_face + i, &desc);
+        AddFaceToList(file, &desc);
+    }
+    if (!cache_file_used[index])
+    {
+        cache_file_used[index] = 1;
+        cache_files_used++;
+    }
 
-    fclose(cacheFile);
-    TRACE("cache file read successfuly\n");
+    TRACE("loaded %lu faces from cache for file %s\n", rec->num_faces, debugstr_a(file));
+    *ret = (rec->flags & FONT_CACHE_FILE_LOADED) != 0;
     return TRUE;
+}
 
-filetype_error:
-    WARN("font cache file format has changed\n");
-read_error:
-    WARN("could not read font cache file, will delete it\n");
-    fclose(cacheFile);
-    unlink(filename);
-    return FALSE;
+static void FontCache_FreeFile(FontCacheFile *file)
+{
+    DWORD i;
+
+    for (i = 0; i < file->num_faces; i++)
+    {
+        HeapFree(GetProcessHeap(), 0, (WCHAR *)file->faces[i].FamilyName);
+        HeapFree(GetProcessHeap(), 0, (WCHAR *)file->faces[i].StyleName);
+    }
+    HeapFree(GetProcessHeap(), 0, file->faces);
+    file->faces = NULL;
+    file->num_faces = 0;
 }
 
-static void WriteCacheFile()
+/* remembers the faces found in a file that had to be opened */
+static void FontCache_StoreFile(const char *file, const struct stat *st, DWORD flags,
+                                const FaceDesc *faces, DWORD num_faces)
 {
-    char *filename;
-    char const *confdir;
-    FILE *cacheFile;
-    Family *cur_family;
-    IgnoredFiles *cur_ignored;
-    int n;
+    FontCacheFile *cur, **bucket = &new_files[FontCache_Hash(file)];
+    DWORD i;
+    int index;
 
-    TRACE("trying to write cache file\n");
+    if (!using_cache) return;
+    cache_dirty = TRUE;
 
-    confdir = get_config_dir();
-    filename = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                         strlen(confdir) + 1 + strlen(CacheFileName) + 1);
-    strcpy(filename, confdir);
-    filename[strlen(filename)] = '/';
-    strcat(filename, CacheFileName);
+    /* the entry in the mapping, if any, is out of date */
+    if ((index = FontCache_FindMappedFile(file)) != -1 && cache_file_used[index])
+    {
+        cache_file_used[index] = 0;
+        cache_files_used--;
+    }
 
-    cacheFile = fopen(filename, "w");
-    HeapFree(GetProcessHeap(), 0, filename);
+    for (cur = *bucket; cur; cur = cur->next)
+        if (!strcmp(cur->path, file)) break;
+    if (cur)
+        FontCache_FreeFile(cur);
+    else
+    {
+        if (!(cur = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*cur)))) return;
+        if (!(cur->path = FontCache_StrDupA(file)))
+        {
+            HeapFree(GetProcessHeap(), 0, cur);
+            return;
+        }
+        cur->next = *bucket;
+        *bucket = cur;
+    }
+    cur->size = st->st_size;
+    cur->mtime = st->st_mtime;
+    cur->flags = flags;
+
+    if (!num_faces) return;
+    cur->faces = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, num_faces * sizeof(*faces));
+    if (!cur->faces) return;
+    for (i = 0; i < num_faces; i++)
+    {
+        cur->faces[i] = faces[i];
+        cur->faces[i].FamilyName = FontCache_StrDupW(faces[i].FamilyName);
+        cur->faces[i].StyleName = FontCache_StrDupW(faces[i].StyleName);
+        cur->num_faces++;
+        if (!cur->faces[i].FamilyName || !cur->faces[i].StyleName)
+        {
+            /* don't leave a partial entry behind, the file will be opened
+             * again next time */
+            FontCache_FreeFile(cur);
+            cur->size = -1;
+            return;
+        }
+    }
+}
 
-    if (!cacheFile)
+/* Reads the entries of dirname from the cache if it hasn't changed since
+ * they were stored.  Returns FALSE if the directory has to be read. */
+static BOOL FontCache_ReadDir(const char *dirname, const struct stat *st)
+{
+    const struct font_cache_dir *rec;
+    FontCacheDir *cur;
+    DWORD i;
+    int index;
+
+    if (!using_cache) return FALSE;
+
+    /* The modification time only has a resolution of a second, an entry
+     * added in the same second as we read the directory wouldn't show.  So
+     * entries read in the second the directory was last changed are never
+     * trusted. */
+    for (cur = new_dirs[FontCache_Hash(dirname)]; cur; cur = cur->next)
     {
-        ERR("couldn't not create font cache file\n");
-        return;
+        if (strcmp(cur->path, dirname)) continue;
+        if (cur->mtime != st->st_mtime || cur->mtime >= cur->scanned) return FALSE;
+        for (i = 0; i < cur->num_children; i++)
+        {
+            if (cur->children[i].is_dir) ReadFontDir(cur->children[i].path);
+            else AddFontFileToList(cur->children[i].path);
+        }
+        return TRUE;
     }
 
-    /* write the basic info */
-    fprintf(cacheFile, "ftfontcache version %i\n", FTFONTCACHE_VERSION);
-    fprintf(cacheFile, "%i, %i, %i, %i, %i, %i\n",
-            sizeof(int), sizeof(char), sizeof(WCHAR),
-            sizeof(BOOL), sizeof(INT), sizeof(time_t));
+    if ((index = FontCache_FindMappedDir(dirname)) == -1) return FALSE;
+    rec = &cache_dirs[index];
+    if (rec->mtime != st->st_mtime || rec->mtime >= rec->scanned)
+    {
+        TRACE("%s has changed\n", debugstr_a(dirname));
+        return FALSE;
+    }
+    if (rec->num_children > cache_header->num_children ||
+        rec->first_child > cache_header->num_children - rec->num_children)
+        return FALSE;
+    for (i = 0; i < rec->num_children; i++)
+        if (!FontCache_StringA(cache_children[rec->first_child + i].path)) return FALSE;
 
-    /* write the rest */
-#define WRITE(p,str) do { if (fwrite(&p, sizeof(p), 1, cacheFile) != 1) { ERR("Problem writing cache: " str ); } } while(0)
-#define WRITE_PN(p, n, str)  do { if (n && fwrite(p, n, 1, cacheFile) != 1) { ERR("Problem writing cache: " str ); } } while(0)
+    if (!cache_dir_used[index])
+    {
+        cache_dir_used[index] = 1;
+        cache_dirs_used++;
+    }
 
-    cur_family = FontList;
-    n = 0;
-    while (cur_family)
+    TRACE("using %lu cached entries for %s\n", rec->num_children, debugstr_a(dirname));
+    for (i = 0; i < rec->num_children; i++)
     {
-        n++;
-        cur_family = cur_family->next;
+        const struct font_cache_child *child = &cache_children[rec->first_child + i];
+        if (child->is_dir) ReadFontDir(FontCache_StringA(child->path));
+        else AddFontFileToList(FontCache_StringA(child->path));
     }
-    WRITE(n,"num_families");
+    return TRUE;
+}
 
-    cur_family = FontList;
-    while (cur_family)
+/* starts recording the entries of a directory that had to be read */
+static FontCacheDir *FontCache_NewDir(const char *dirname, const struct stat *st)
+{
+    FontCacheDir *cur, **bucket = &new_dirs[FontCache_Hash(dirname)];
+    DWORD i;
+    int index;
+
+    if (!using_cache) return NULL;
+    cache_dirty = TRUE;
+
+    if ((index = FontCache_FindMappedDir(dirname)) != -1 && cache_dir_used[index])
     {
-        int n;
-        Face *cur_face;
-        n = strlenW(cur_family->FamilyName);
-        WRITE(n,"FamilyName length");
-        WRITE_PN(cur_family->FamilyName, n * sizeof(WCHAR),"FamilyName");
-        WRITE(cur_family->ScalableFamily,"ScalableFamily");
+        cache_dir_used[index] = 0;
+        cache_dirs_used--;
+    }
 
-        cur_face = cur_family->FirstFace;
-        n = 0;
-        while (cur_face)
+    for (cur = *bucket; cur; cur = cur->next)
+        if (!strcmp(cur->path, dirname)) break;
+    if (cur)
+    {
+        for (i = 0; i < cur->num_children; i++)
+            HeapFree(GetProcessHeap(), 0, cur->children[i].path);
+        cur->num_children = 0;
+    }
+    else
+    {
+        if (!(cur = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*cur)))) return NULL;
+        if (!(cur->path = FontCache_StrDupA(dirname)))
         {
-            n++;
-            cur_face = cur_face->next;
+            HeapFree(GetProcessHeap(), 0, cur);
+            return NULL;
         }
-        WRITE(n,"num faces");
+        cur->next = *bucket;
+        *bucket = cur;
+    }
+    cur->mtime = st->st_mtime;
+    cur->scanned = time(NULL);
+    return cur;
+}
+
+static void FontCache_AddChild(FontCacheDir *dir, const char *path, BOOL is_dir)
+{
+    if (!dir) return;
+
+    if (dir->num_children == dir->max_children)
+    {
+        DWORD count = dir->max_children ? dir->max_children * 2 : 16;
+        FontCacheChild *children;
 
-        cur_face = cur_family->FirstFace;
-        while (cur_face)
+        if (dir->children)
+            children = HeapReAlloc(GetProcessHeap(), 0, dir->children, count * sizeof(*children));
+        else
+            children = HeapAlloc(GetProcessHeap(), 0, count * sizeof(*children));
+        if (!children) goto failed;
+        dir->children = children;
+        dir->max_children = count;
+    }
+    if (!(dir->children[dir->num_children].path = FontCache_StrDupA(path))) goto failed;
+    dir->children[dir->num_children++].is_dir = is_dir;
+    return;
+
+failed:
+    /* an incomplete list must not be used, have it read again next time */
+    dir->scanned = dir->mtime;
+}
+
+/* the cache file is built in two passes over the same code, the first one
+ * (with buf NULL) only measures it */
+typedef struct
+{
+    char *buf;
+    DWORD *file_hash, *dir_hash;
+    struct font_cache_dir *dirs;
+    struct font_cache_child *children;
+    struct font_cache_file *files;
+    struct font_cache_face *faces;
+    DWORD num_dirs, num_children, num_files, num_faces;
+    DWORD strings;         /* offset of the next string */
+} FontCacheWriter;
+
+static DWORD FontCache_PutStringA(FontCacheWriter *w, const char *str)
+{
+    DWORD ret = w->strings, len = strlen(str) + 1;
+
+    if (w->buf) memcpy(w->buf + ret, str, len);
+    w->strings += len;
+    return ret;
+}
+
+static DWORD FontCache_PutStringW(FontCacheWriter *w, const WCHAR *str)
+{
+    DWORD ret, len = (strlenW(str) + 1) * sizeof(WCHAR);
+
+    ret = w->strings = (w->strings + 1) & ~1;
+    if (w->buf) memcpy(w->buf + ret, str, len);
+    w->strings += len;
+    return ret;
+}
+
+static struct font_cache_file *FontCache_PutFile(FontCacheWriter *w, const char *path,
+                                                 LONGLONG size, LONGLONG mtime, DWORD flags)
+{
+    struct font_cache_file *rec = w->buf ? &w->files[w->num_files] : NULL;
+    DWORD offset = FontCache_PutStringA(w, path);
+
+    w->num_files++;
+    if (!rec) return NULL;
+    rec->path = offset;
+    rec->size = size;
+    rec->mtime = mtime;
+    rec->flags = flags;
+    rec->first_face = w->num_faces;
+    rec->num_faces = 0;
+    rec->hash_next = w->file_hash[FontCache_Hash(path)];
+    w->file_hash[FontCache_Hash(path)] = w->num_files;
+    return rec;
+}
+
+static void FontCache_PutFace(FontCacheWriter *w, struct font_cache_file *file,
+                              const FaceDesc *desc)
+{
+    struct font_cache_face *rec = w->buf ? &w->faces[w->num_faces] : NULL;
+    DWORD family = FontCache_PutStringW(w, desc->FamilyName);
+    DWORD style = FontCache_PutStringW(w, desc->StyleName);
+
+    w->num_faces++;
+    if (!rec) return;
+    rec->family = family;
+    rec->style = style;
+    rec->scalable = desc->scalable;
+    rec->italic = desc->Italic;
+    rec->bold = desc->Bold;
+    rec->height = desc->Height;
+    rec->size_index = desc->SizeIndex;
+    rec->fsCsb[0] = desc->fsCsb[0];
+    rec->fsCsb[1] = desc->fsCsb[1];
+    file->num_faces++;
+}
+
+static struct font_cache_dir *FontCache_PutDir(FontCacheWriter *w, const char *path,
+                                               LONGLONG mtime, LONGLONG scanned)
+{
+    struct font_cache_dir *rec = w->buf ? &w->dirs[w->num_dirs] : NULL;
+    DWORD offset = FontCache_PutStringA(w, path);
+
+    w->num_dirs++;
+    if (!rec) return NULL;
+    rec->path = offset;
+    rec->mtime = mtime;
+    rec->scanned = scanned;
+    rec->first_child = w->num_children;
+    rec->num_children = 0;
+    rec->hash_next = w->dir_hash[FontCache_Hash(path)];
+    w->dir_hash[FontCache_Hash(path)] = w->num_dirs;
+    return rec;
+}
+
+static void FontCache_PutChild(FontCacheWriter *w, struct font_cache_dir *dir,
+                               const char *path, BOOL is_dir)
+{
+    struct font_cache_child *rec = w->buf ? &w->children[w->num_children] : NULL;
+    DWORD offset = FontCache_PutStringA(w, path);
+
+    w->num_children++;
+    if (!rec) return;
+    rec->path = offset;
+    rec->is_dir = is_dir;
+    dir->num_children++;
+}
+
+/* puts everything seen during this scan, taken from the mapping where it
+ * was still valid */
+static void FontCache_PutAll(FontCacheWriter *w)
+{
+    struct font_cache_file *file;
+    struct font_cache_dir *dir;
+    FontCacheFile *cur_file;
+    FontCacheDir *cur_dir;
+    FaceDesc desc;
+    DWORD i, j;
+
+    for (i = 0; cache_header && i < cache_header->num_dirs; i++)
+    {
+        const struct font_cache_dir *rec = &cache_dirs[i];
+
+        if (!cache_dir_used[i]) continue;
+        dir = FontCache_PutDir(w, FontCache_StringA(rec->path), rec->mtime, rec->scanned);
+        for (j = 0; j < rec->num_children; j++)
         {
-            n = strlenW(cur_face->StyleName);
-            WRITE(n,"StyleName length");
-            WRITE_PN(cur_face->StyleName, n * sizeof(WCHAR),"StyleName");
-            n = strlen(cur_face->file);
-            WRITE(n,"face file length");
-            WRITE_PN(cur_face->file, n,"face file");
-            WRITE(cur_face->Italic,"Italic");
-            WRITE(cur_face->Bold,"Bold");
-            WRITE(cur_face->Height,"Height");
-            WRITE(cur_face->SizeIndex,"SizeIndex");
-            WRITE(cur_face->fsCsb[0],"fsCsb[0]");
-            WRITE(cur_face->fsCsb[1],"fsCsb[1]");
-            WRITE(cur_face->lastModified,"lastModified");
-            cur_face = cur_face->next;
+            const struct font_cache_child *child = &cache_children[rec->first_child + j];
+            FontCache_PutChild(w, dir, FontCache_StringA(child->path), child->is_dir);
         }
-
-        cur_family = cur_family->next;
     }
+    for (i = 0; i < FONT_CACHE_HASH_SIZE; i++)
+        for (cur_dir = new_dirs[i]; cur_dir; cur_dir = cur_dir->next)
+        {
+            dir = FontCache_PutDir(w, cur_dir->path, cur_dir->mtime, cur_dir->scanned);
+            for (j = 0; j < cur_dir->num_children; j++)
+                FontCache_PutChild(w, dir, cur_dir->children[j].path, cur_dir->children[j].is_dir);
+        }
 
-    cur_ignored = ignoredFilesList;
-    n = 0;
-    while (cur_ignored)
+    for (i = 0; cache_header && i < cache_header->num_files; i++)
     {
-        n++;
-        cur_ignored = cur_ignored->next;
+        const struct font_cache_file *rec = &cache_files[i];
+
+        if (!cache_file_used[i]) continue;
+        file = FontCache_PutFile(w, FontCache_StringA(rec->path), rec->size, rec->mtime,
+                                 rec->flags);
+        for (j = 0; j < rec->num_faces; j++)
+        {
+            FontCache_MappedFace(rec->first_face + j, &desc);
+            FontCache_PutFace(w, file, &desc);
+        }
     }
-    WRITE(n,"ignored");
+    for (i = 0; i < FONT_CACHE_HASH_SIZE; i++)
+        for (cur_file = new_files[i]; cur_file; cur_file = cur_file->next)
+        {
+            if (cur_file->size == -1) continue;
+            file = FontCache_PutFile(w, cur_file->path, cur_file->size, cur_file->mtime,
+                                     cur_file->flags);
+            for (j = 0; j < cur_file->num_faces; j++)
+                FontCache_PutFace(w, file, &cur_file->faces[j]);
+        }
+}
+
+static void FontCache_Write(void)
+{
+    struct font_cache_header *header;
+    FontCacheWriter w;
+    char *filename, *tmpname;
+    DWORD size, done;
+    int fd, res;
+
+    TRACE("trying to write cache file\n");
+
+    /* measure */
+    memset(&w, 0, sizeof(w));
+    FontCache_PutAll(&w);
+
+    size = sizeof(*header);
+    size += w.num_dirs * sizeof(*w.dirs);
+    size += w.num_children * sizeof(*w.children);
+    size += w.num_files * sizeof(*w.files);
+    size += w.num_faces * sizeof(*w.faces);
+    size += 2 * FONT_CACHE_HASH_SIZE * sizeof(DWORD);
+    size += ((w.strings + 1) & ~1) + sizeof(WCHAR);
 
-    cur_ignored = ignoredFilesList;
-    while (cur_ignored)
+    if (!(w.buf = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size)))
     {
-        n = strlen(cur_ignored->filename);
-        WRITE(n,"ignored filename length");
-        WRITE_PN(cur_ignored->filename, n,"ignored filename");
-        WRITE(cur_ignored->lastModified,"ignored lastModified");
+        ERR("no memory for the font cache file\n");
+        return;
+    }
+    header = (struct font_cache_header *)w.buf;
+    memcpy(header->magic, FONT_CACHE_MAGIC, sizeof(header->magic));
+    header->version = FTFONTCACHE_VERSION;
+    header->record_sizes = FONT_CACHE_RECORD_SIZES;
+    header->total_size = size;
+    header->num_dirs = w.num_dirs;
+    header->num_children = w.num_children;
+    header->num_files = w.num_files;
+    header->num_faces = w.num_faces;
+
+    w.dirs = (struct font_cache_dir *)(header + 1);
+    w.children = (struct font_cache_child *)(w.dirs + w.num_dirs);
+    w.files = (struct font_cache_file *)(w.children + w.num_children);
+    w.faces = (struct font_cache_face *)(w.files + w.num_files);
+    w.file_hash = (DWORD *)(w.faces + w.num_faces);
+    w.dir_hash = w.file_hash + FONT_CACHE_HASH_SIZE;
+    w.strings = (char *)(w.dir_hash + FONT_CACHE_HASH_SIZE) - w.buf;
+    w.num_dirs = w.num_children = w.num_files = w.num_faces = 0;
+
+    /* and fill it in */
+    FontCache_PutAll(&w);
+
+    filename = FontCache_FileName("");
+    tmpname = FontCache_FileName(".tmp");
+    if (!filename || !tmpname || (fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        ERR("couldn't create font cache file\n");
+        goto done;
+    }
+    for (done = 0; done < size; done += res)
+        if ((res = write(fd, w.buf + done, size - done)) <= 0) break;
+    close(fd);
 
-        cur_ignored = cur_ignored->next;
+    if (done < size || rename(tmpname, filename) == -1)
+    {
+        ERR("problem writing font cache file\n");
+        unlink(tmpname);
     }
-#undef WRITE
-#undef WRITE_PN
+    else
+        TRACE("Finished writing cache file, %lu files in %lu directories\n",
+              header->num_files, header->num_dirs);
+
+done:
+    HeapFree(GetProcessHeap(), 0, tmpname);
+    HeapFree(GetProcessHeap(), 0, filename);
+    HeapFree(GetProcessHeap(), 0, w.buf);
+}
+
+static void FontCache_Free(void)
+{
+    DWORD i, j;
 
-    TRACE("Finished writing cache file\n");
+    for (i = 0; i < FONT_CACHE_HASH_SIZE; i++)
+    {
+        while (new_files[i])
+        {
+            FontCacheFile *next = new_files[i]->next;
+            FontCache_FreeFile(new_files[i]);
+            HeapFree(GetProcessHeap(), 0, new_files[i]->path);
+            HeapFree(GetProcessHeap(), 0, new_files[i]);
+            new_files[i] = next;
+        }
+        while (new_dirs[i])
+        {
+            FontCacheDir *next = new_dirs[i]->next;
+            for (j = 0; j < new_dirs[i]->num_children; j++)
+                HeapFree(GetProcessHeap(), 0, new_dirs[i]->children[j].path);
+            HeapFree(GetProcessHeap(), 0, new_dirs[i]->children);
+            HeapFree(GetProcessHeap(), 0, new_dirs[i]->path);
+            HeapFree(GetProcessHeap(), 0, new_dirs[i]);
+            new_dirs[i] = next;
+        }
+    }
 
-    fclose(cacheFile);
+    if (cache_map)
+    {
+        munmap((void *)cache_map, cache_map_size);
+        HeapFree(GetProcessHeap(), 0, cache_file_used);
+        HeapFree(GetProcessHeap(), 0, cache_dir_used);
+    }
+    cache_map = NULL;
+    cache_header = NULL;
+    cache_file_used = cache_dir_used = NULL;
+    cache_files_used = cache_dirs_used = 0;
 }
 
 static const char *FREETYPE_FONTCACHE_MUTEX_NAME =
@@ -615,7 +1177,6 @@ static void FontListCache_Start()
     if (!cacheMutex)
     {
         ERR("failed to create mutex, ignoring cache\n");
-        ignoringCache = TRUE;
         return;
     }
     if (cacheMutex && GetLastError() == ERROR_ALREADY_EXISTS)
@@ -628,44 +1189,78 @@ static void FontListCache_Start()
     {
         /* too long, ignore cache */
         ERR("mutex wait timeout, ignoring cache\n");
-        ignoringCache = TRUE;
         return;
     }
-    if (ReadCacheFile())
+    using_cache = TRUE;
+    cache_dirty = FALSE;
+    if (FontCache_Map())
     {
         ReleaseMutex(cacheMutex);
     }
     else
     {
+        /* no cache file, we must build it ourselves; others wait for it */
         buildingCache = TRUE;
-        cachedFontList = NULL;
-        /* no cache file, we must build it ourselves */
     }
 }
 
 static void FontListCache_End()
 {
-    if (rebuildCache)
+    if (!using_cache) goto done;
+
+    /* anything from the cache that wasn't seen again is gone */
+    if (cache_header && (cache_files_used != cache_header->num_files ||
+                         cache_dirs_used != cache_header->num_dirs))
+        cache_dirty = TRUE;
+
+    if (buildingCache || cache_dirty)
     {
-        DWORD result = WaitForSingleObject(cacheMutex, 6 * 10000);
+        if (!buildingCache && WaitForSingleObject(cacheMutex, 6 * 10000) != WAIT_OBJECT_0)
             /* wait at most one minute */
-        if (result != WAIT_OBJECT_0)
-        {
             ERR("can't write cache file, couldn't get lock\n");
-            goto done;
+        else
+        {
+            FontCache_Write();
+            ReleaseMutex(cacheMutex);
         }
     }
-    else if (!buildingCache) goto done;
-
-    WriteCacheFile();
-
-    ReleaseMutex(cacheMutex);
+    FontCache_Free();
+    using_cache = buildingCache = FALSE;
 done:
-    CloseHandle(cacheMutex);
+    if (cacheMutex) CloseHandle(cacheMutex);
+    cacheMutex = 0;
 }
 
 #else /* USE_FONT_CACHE */
 
+#define FONT_CACHE_FILE_LOADED 0x0001
+
+typedef struct tagFontCacheDir FontCacheDir;
+
+static BOOL FontCache_AddFile(const char *file, const struct stat *st, BOOL *ret)
+{
+    return FALSE;
+}
+
+static void FontCache_StoreFile(const char *file, const struct stat *st, DWORD flags,
+                                const FaceDesc *faces, DWORD num_faces)
+{
+}
+
+static BOOL FontCache_ReadDir(const char *dirname, const struct stat *st)
+{
+    return FALSE;
+}
+
+static FontCacheDir *FontCache_NewDir(const char *dirname, const struct stat *st)
+{
+    return NULL;
+}
+
+static void FontCache_AddChild(FontCacheDir *dir, const char *path, BOOL is_dir)
+{
+}
+
 static void FontListCache_Start()
 {
 }
@@ -713,10 +1308,80 @@ static Family *FindFamilyA(const CHAR *familyName, BOOL fuzzyMatch)
     return ret;
 }
 
+/* Index of the family and alias names for FindFamilyOrAlias, rebuilt on
+ * the next lookup after a family or an alias was added. */
+#define FAMILY_HASH_SIZE 512 /* must be a power of 2 */
+
+typedef struct tagFamilyName {
+    const WCHAR *name;
+    Family *family;
+    struct tagFamilyName *next;
+} FamilyName;
+
+static FamilyName *family_hash[FAMILY_HASH_SIZE];
+static FamilyName *family_names; /* storage for the entries */
+static BOOL family_hash_valid;
+
+static DWORD hash_family_name(const WCHAR *name)
+{
+    DWORD hash = 0;
+    while (*name) hash = hash * 31 + tolowerW(*name++);
+    return hash & (FAMILY_HASH_SIZE - 1);
+}
+
+static BOOL add_family_name(FamilyName *entry, const WCHAR *name, Family *family)
+{
+    FamilyName **bucket = &family_hash[hash_family_name(name)], *cur;
+
+    /* the first one wins, as with a search of the lists */
+    for (cur = *bucket; cur; cur = cur->next)
+        if (strcmpiW(cur->name, name) == 0) return FALSE;
+
+    entry->name = name;
+    entry->family = family;
+    entry->next = *bucket;
+    *bucket = entry;
+    return TRUE;
+}
+
+static void build_family_hash(void)
+{
+    Family *family;
+    ftFontAlias *alias;
+    FamilyName *entry;
+    DWORD count = 0;
+
+    for (family = FontList; family; family = family->next) count++;
+    for (alias = ftAliasTable; alias; alias = alias->next) count++;
+
+    if (family_names) HeapFree(GetProcessHeap(), 0, family_names);
+    memset(family_hash, 0, sizeof(family_hash));
+    family_names = HeapAlloc(GetProcessHeap(), 0, (count + 1) * sizeof(*family_names));
+    if (!family_names) return;
+
+    /* families take precedence over aliases */
+    entry = family_names;
+    for (family = FontList; family; family = family->next)
+        if (add_family_name(entry, family->FamilyName, family)) entry++;
+    for (alias = ftAliasTable; alias; alias = alias->next)
+        if (add_family_name(entry, alias->faTypeFace, alias->faRealFamily)) entry++;
+
+    family_hash_valid = TRUE;
+}
+
 static Family *FindFamilyOrAlias(WCHAR *familyName)
 {
     Family *ret;
     ftFontAlias *alias;
+    FamilyName *entry;
+
+    if (!family_hash_valid) build_family_hash();
+    if (family_hash_valid)
+    {
+        for (entry = family_hash[hash_family_name(familyName)]; entry; entry = entry->next)
+            if (strcmpiW(familyName, entry->name) == 0) return entry->family;
+        return NULL;
+    }
 
     if ((ret = FindFamilyW(familyName, FALSE)))
         return ret;
@@ -761,6 +1426,7 @@ static void FTAlias_CreateAlias(WCHAR *typeFace, Family *faRealFamily)
 
     alias->next = ftAliasTable;
     ftAliasTable = alias;
+    family_hash_valid = FALSE;
 }
 
 #ifdef HAVE_FONTCONFIG
@@ -1169,196 +1835,342 @@ static void FTAlias_Init()
     }
 }
 
-#ifdef USE_FONT_CACHE
-static BOOL AddFaceFromCache(Family *cache_family, Face *cache_face)
+
+/*************************************************************
+ * Glyph bitmap cache
+ *
+ * Most of the time spent in GetGlyphOutline goes into loading the glyph
+ * and scan converting its outline.  The rendered bitmaps are kept here,
+ * keyed on everything that goes into them, so that GdiFonts of the same
+ * face and size share them.  The least recently used ones are dropped
+ * once the cache grows beyond WINEGLYPHCACHE kilobytes (0 disables it).
+ * Setting WINEGLYPHCACHESTATS prints the hit counts at exit.
+ */
+#define GLYPH_CACHE_HASH_SIZE   1024    /* must be a power of 2 */
+#define GLYPH_CACHE_DEFAULT_KB  4096
+
+typedef struct tagGlyphCacheEntry {
+    struct tagGlyphCacheEntry *hash_next;
+    struct tagGlyphCacheEntry *lru_prev, *lru_next; /* most recent first */
+    DWORD hash;
+    const Face *face;
+    FT_UShort x_ppem, y_ppem;
+    DWORD xscale; /* bits of xform.eM11 */
+    INT orientation;
+    UINT glyph;
+    BOOL gray;
+    GLYPHMETRICS gm;
+    DWORD size; /* of bits */
+    BYTE bits[1];
+} GlyphCacheEntry;
+
+static CRITICAL_SECTION glyph_cache_cs;
+static GlyphCacheEntry *glyph_cache_hash[GLYPH_CACHE_HASH_SIZE];
+static GlyphCacheEntry *glyph_cache_lru_head, *glyph_cache_lru_tail;
+static DWORD glyph_cache_limit; /* in bytes, 0 if disabled */
+static DWORD glyph_cache_used;
+static DWORD glyph_cache_hits, glyph_cache_misses, glyph_cache_evictions;
+
+static void GlyphCache_ReportStats(void)
 {
-    Family *family = FontList;
-    Family **insert = &FontList;
+    fprintf(stderr, "Glyph bitmap cache: hits %lu misses %lu evictions %lu, %lu bytes used\n",
+            glyph_cache_hits, glyph_cache_misses, glyph_cache_evictions, glyph_cache_used);
+}
 
-    Face **insertface;
+static void GlyphCache_Init(void)
+{
+    static BOOL initialized;
+    const char *env;
+    int kb;
+
+    if (initialized) return;
+    initialized = TRUE;
+
+    env = getenv("WINEGLYPHCACHE");
+    kb = env ? atoi(env) : GLYPH_CACHE_DEFAULT_KB;
+    glyph_cache_limit = kb > 0 ? kb * 1024 : 0;
+    CRITICAL_SECTION_DEFINE(&glyph_cache_cs);
+    if (getenv("WINEGLYPHCACHESTATS")) atexit(GlyphCache_ReportStats);
+}
 
-    /* much of this code is semi-duplicate from
-     * AddFontFileToList, can't avoid it.
-     * Its different enough to need rewriting/duplicating,
-     * but similar in what it does, i suppose.
-     */
+static inline DWORD GlyphCache_Hash(const Face *face, FT_UShort y_ppem, UINT glyph)
+{
+    DWORD hash = (DWORD)(UINT_PTR)face >> 4;
+    hash = hash * 31 + y_ppem;
+    hash = hash * 31 + glyph;
+    return hash ^ (hash >> 10);
+}
+
+/* fill in the key of an entry, returns FALSE if the font can't be cached */
+static BOOL GlyphCache_SetKey(GlyphCacheEntry *key, GdiFont font, UINT glyph, BOOL gray)
+{
+    if (!glyph_cache_limit || !font->face || !font->ft_face->size) return FALSE;
+
+    key->face = font->face;
+    key->x_ppem = font->ft_face->size->metrics.x_ppem;
+    key->y_ppem = font->ft_face->size->metrics.y_ppem;
+    memcpy(&key->xscale, &font->xform.eM11, sizeof(key->xscale));
+    key->orientation = font->orientation;
+    key->glyph = glyph;
+    key->gray = gray;
+    key->hash = GlyphCache_Hash(key->face, key->y_ppem, glyph);
+    return TRUE;
+}
+
+static inline BOOL GlyphCache_KeyEqual(const GlyphCacheEntry *a, const GlyphCacheEntry *b)
+{
+    return a->hash == b->hash && a->face == b->face && a->glyph == b->glyph &&
+           a->x_ppem == b->x_ppem && a->y_ppem == b->y_ppem &&
+           a->xscale == b->xscale && a->orientation == b->orientation &&
+           a->gray == b->gray;
+}
+
+/* must be called with glyph_cache_cs held */
+static void GlyphCache_Remove(GlyphCacheEntry *entry)
+{
+    GlyphCacheEntry **pp = &glyph_cache_hash[entry->hash & (GLYPH_CACHE_HASH_SIZE - 1)];
+
+    while (*pp != entry) pp = &(*pp)->hash_next;
+    *pp = entry->hash_next;
+
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else glyph_cache_lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else glyph_cache_lru_tail = entry->lru_prev;
+
+    glyph_cache_used -= entry->size;
+    HeapFree(GetProcessHeap(), 0, entry);
+}
+
+/*************************************************************
+ * GlyphCache_Get
+ *
+ * Look up a rendered bitmap.  On a hit, returns its metrics and size, and
+ * copies the bits if buf is big enough.
+ */
+static BOOL GlyphCache_Get(GdiFont font, UINT glyph, BOOL gray, LPGLYPHMETRICS lpgm,
+                           LPVOID buf, DWORD buflen, DWORD *needed)
+{
+    GlyphCacheEntry key, *entry;
+
+    if (!GlyphCache_SetKey(&key, font, glyph, gray)) return FALSE;
+
+    EnterCriticalSection(&glyph_cache_cs);
+    for (entry = glyph_cache_hash[key.hash & (GLYPH_CACHE_HASH_SIZE - 1)]; entry;
+         entry = entry->hash_next)
+        if (GlyphCache_KeyEqual(entry, &key)) break;
+
+    if (!entry)
+    {
+        glyph_cache_misses++;
+        LeaveCriticalSection(&glyph_cache_cs);
+        return FALSE;
+    }
+    glyph_cache_hits++;
+
+    /* move it to the front of the LRU list */
+    if (entry->lru_prev)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+        if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+        else glyph_cache_lru_tail = entry->lru_prev;
+        entry->lru_prev = NULL;
+        entry->lru_next = glyph_cache_lru_head;
+        glyph_cache_lru_head->lru_prev = entry;
+        glyph_cache_lru_head = entry;
+    }
+
+    memcpy(lpgm, &entry->gm, sizeof(*lpgm));
+    *needed = entry->size;
+    if (buf && buflen >= entry->size) memcpy(buf, entry->bits, entry->size);
+    LeaveCriticalSection(&glyph_cache_cs);
+    return TRUE;
+}
+
+/*************************************************************
+ * GlyphCache_NewEntry
+ *
+ * Allocate an entry for a bitmap about to be rendered, or return NULL if
+ * it shouldn't be cached.  The bitmap goes into its bits, then the entry
+ * is handed to GlyphCache_Insert.
+ */
+static GlyphCacheEntry *GlyphCache_NewEntry(GdiFont font, UINT glyph, BOOL gray,
+                                            const GLYPHMETRICS *lpgm, DWORD size)
+{
+    GlyphCacheEntry key, *entry;
+
+    if (!GlyphCache_SetKey(&key, font, glyph, gray)) return NULL;
+    /* one huge glyph shouldn't flush everything else */
+    if (size > glyph_cache_limit / 16) return NULL;
+
+    entry = HeapAlloc(GetProcessHeap(), 0, FIELD_OFFSET(GlyphCacheEntry, bits[size]));
+    if (!entry) return NULL;
+    memcpy(entry, &key, FIELD_OFFSET(GlyphCacheEntry, gm));
+    memcpy(&entry->gm, lpgm, sizeof(entry->gm));
+    entry->size = size;
+    return entry;
+}
+
+static void GlyphCache_Insert(GlyphCacheEntry *entry)
+{
+    GlyphCacheEntry **bucket = &glyph_cache_hash[entry->hash & (GLYPH_CACHE_HASH_SIZE - 1)];
+    GlyphCacheEntry *cur;
+
+    EnterCriticalSection(&glyph_cache_cs);
+    for (cur = *bucket; cur; cur = cur->hash_next)
+    {
+        if (GlyphCache_KeyEqual(cur, entry))
+        {
+            /* somebody else rendered it meanwhile */
+            LeaveCriticalSection(&glyph_cache_cs);
+            HeapFree(GetProcessHeap(), 0, entry);
+            return;
+        }
+    }
 
-    while (family)
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = glyph_cache_lru_head;
+    if (glyph_cache_lru_head) glyph_cache_lru_head->lru_prev = entry;
+    else glyph_cache_lru_tail = entry;
+    glyph_cache_lru_head = entry;
+    glyph_cache_used += entry->size;
+
+    while (glyph_cache_used > glyph_cache_limit && glyph_cache_lru_tail != entry)
     {
-        if (!strcmpW(family->FamilyName, cache_family->FamilyName))
+        GlyphCache_Remove(glyph_cache_lru_tail);
+        glyph_cache_evictions++;
+    }
+    LeaveCriticalSection(&glyph_cache_cs);
+}
+
+/* drop the bitmaps of a face that is going away */
+static void GlyphCache_FlushFace(const Face *face)
+{
+    GlyphCacheEntry *entry, *next;
+
+    if (!glyph_cache_limit) return;
+
+    EnterCriticalSection(&glyph_cache_cs);
+    for (entry = glyph_cache_lru_head; entry; entry = next)
+    {
+        next = entry->lru_next;
+        if (entry->face == face) GlyphCache_Remove(entry);
+    }
+    LeaveCriticalSection(&glyph_cache_cs);
+}
+
+/* font instances of a face that is going away can't reopen it */
+static void ForgetFaceFonts(const Face *face)
+{
+    GdiFont font;
+    int i;
+
+    for (i = 0; i < FONT_HASH_SIZE; i++)
+        for (font = font_hash[i]; font; font = font->hash_next)
+            if (font->face == face) font->face = NULL;
+}
+
+static void DeleteFamilyFaces(Family *family)
+{
+    Face *cur = family->FirstFace;
+    while (cur)
+    {
+        Face *prev = cur;
+        cur = cur->next;
+        GlyphCache_FlushFace(prev);
+        ForgetFaceFonts(prev);
+        HeapFree(GetProcessHeap(), 0, prev->StyleName);
+        HeapFree(GetProcessHeap(), 0, prev->file);
+        HeapFree(GetProcessHeap(), 0, prev);
+    }
+    family->FirstFace = NULL;
+}
+
+static BOOL AddFaceToList(const char *file, const FaceDesc *desc)
+{
+    Family *family = FontList;
+    Family **insert = &FontList;
+    Face **insertface;
+
+    while(family) {
+        if(!strcmpW(family->FamilyName, desc->FamilyName))
             break;
         insert = &family->next;
         family = family->next;
     }
-    if (!family)
-    {
+    if(!family) {
         family = *insert = HeapAlloc(GetProcessHeap(), 0, sizeof(*family));
-        family->FamilyName = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                       (strlenW(cache_family->FamilyName) + 1) * sizeof(WCHAR));
-        strcpyW(family->FamilyName, cache_family->FamilyName);
-        family->ScalableFamily = cache_family->ScalableFamily;
+        family->FamilyName = HeapAlloc(GetProcessHeap(), 0,
+                                       (strlenW(desc->FamilyName) + 1) * sizeof(WCHAR));
+        strcpyW(family->FamilyName, desc->FamilyName);
+        family->ScalableFamily = desc->scalable;
         family->FirstFace = NULL;
         family->next = NULL;
-    }
-    else
-    { /* check they are the same */
-        if (family->ScalableFamily != cache_family->ScalableFamily)
-        {
-            SetRebuildCache();
-            TRACE("family differs, not using\n");
-            return FALSE;
-        }
+        family_hash_valid = FALSE;
+    } else if (desc->scalable && !family->ScalableFamily) { /* overwrite with scalable */
+        DeleteFamilyFaces(family);
+        family->ScalableFamily = TRUE;
+    } else if (!desc->scalable && family->ScalableFamily) {
+        /* ignore non-scalable if scalable exists */
+        return FALSE;
     }
 
-    /* check the face doesn't already exist */
-    for (insertface = &family->FirstFace; *insertface;
-         insertface = &(*insertface)->next)
-    {
-        if (!strcmpW((*insertface)->StyleName, cache_face->StyleName) &&
-            (family->ScalableFamily ||
-             (*insertface)->Height == cache_face->Height))
+    for(insertface = &family->FirstFace; *insertface;
+        insertface = &(*insertface)->next) {
+        if(!strcmpW((*insertface)->StyleName, desc->StyleName) &&
+                (desc->scalable || (*insertface)->Height == desc->Height))
         {
-            SetRebuildCache();
-            TRACE("face already exists, not adding cached face (%s)\n",
-                  debugstr_w(cache_face->StyleName));
+            WARN("Already loaded font %s %s (%i)\n",
+                 debugstr_w(family->FamilyName),
+                 debugstr_w(desc->StyleName),
+                 (*insertface)->Height);
             return FALSE;
         }
     }
     *insertface = HeapAlloc(GetProcessHeap(), 0, sizeof(**insertface));
     (*insertface)->StyleName = HeapAlloc(GetProcessHeap(), 0,
-                                  (strlenW(cache_face->StyleName) + 1) * sizeof(WCHAR));
-    strcpyW((*insertface)->StyleName, cache_face->StyleName);
-    (*insertface)->file = HeapAlloc(GetProcessHeap(), 0, strlen(cache_face->file)+1);
-    strcpy((*insertface)->file, cache_face->file);
+                                         (strlenW(desc->StyleName) + 1) * sizeof(WCHAR));
+    strcpyW((*insertface)->StyleName, desc->StyleName);
+    (*insertface)->file = HeapAlloc(GetProcessHeap(),0,strlen(file)+1);
+    strcpy((*insertface)->file, file);
     (*insertface)->next = NULL;
-    (*insertface)->Italic = cache_face->Italic;
-    (*insertface)->Bold = cache_face->Bold;
-    (*insertface)->Height = cache_face->Height;
-    (*insertface)->SizeIndex = cache_face->SizeIndex;
-
-    (*insertface)->fsCsb[0] = cache_face->fsCsb[0];
-    (*insertface)->fsCsb[1] = cache_face->fsCsb[1];
-    (*insertface)->lastModified = cache_face->lastModified;
+    (*insertface)->Italic = desc->Italic;
+    (*insertface)->Bold = desc->Bold;
+    (*insertface)->Height = desc->Height;
+    (*insertface)->SizeIndex = desc->SizeIndex;
+    (*insertface)->fsCsb[0] = desc->fsCsb[0];
+    (*insertface)->fsCsb[1] = desc->fsCsb[1];
 
+    TRACE("Added font to family: %s, style: %s, height: %i (-1 means scalable)\n",
+            debugstr_w(family->FamilyName),
+            debugstr_w((*insertface)->StyleName),
+            (*insertface)->Height);
     return TRUE;
 }
-#endif /* USE_FONT_CACHE */
-
-static void DeleteFamilyFaces(Family *family)
-{
-    Face *cur = family->FirstFace;
-    while (cur)
-    {
-        Face *prev = cur;
-        cur = cur->next;
-        HeapFree(GetProcessHeap(), 0, prev->StyleName);
-        HeapFree(GetProcessHeap(), 0, prev->file);
-        HeapFree(GetProcessHeap(), 0, prev);
-    }
-    family->FirstFace = NULL;
-}
 
 static BOOL AddFontFileToList(const char *file)
 {
     FT_Face ft_face;
     WCHAR *FamilyW, *StyleW;
-    DWORD len;
-    Family *family = FontList;
-    Family **insert = &FontList;
-    Face **insertface;
+    DWORD len, fsCsb[2];
     FT_Error err;
-    int i, size;
-    BOOL scalable;
-    struct stat stat_buf;
+    FaceDesc *faces;
+    int i, num_faces, num_sizes;
     int faces_from_file = 0;
-    time_t fileLastModified;
-
-#ifdef USE_FONT_CACHE
-    int faces_from_cache = 0;
-    Family *cur_cache_family;
-    Family *prev_cache_family = NULL;
-
-    IgnoredFiles *cur_ignore_cache;
-    IgnoredFiles *prev_ignore_cache = NULL;
-#endif
-
-    stat(file, &stat_buf);
-    fileLastModified = stat_buf.st_mtime;
+    BOOL scalable, ret;
+    struct stat stat_buf;
 
-#ifdef USE_FONT_CACHE
-    /* check if we should ignore the file */
-    cur_ignore_cache = ignoredFilesList;
-    while (cur_ignore_cache && using_cache && !ignoringCache)
+    if (stat(file, &stat_buf) == -1)
     {
-        IgnoredFiles *next = cur_ignore_cache->next;
-
-        if (strcmp(file, cur_ignore_cache->filename) == 0)
-        {
-            if (cur_ignore_cache->lastModified == fileLastModified)
-            {
-                return TRUE;
-            }
-            else /* remove file from ignore list */
-            {
-                HeapFree(GetProcessHeap(), 0, cur_ignore_cache->filename);
-                HeapFree(GetProcessHeap(), 0, cur_ignore_cache);
-                if (prev_ignore_cache) prev_ignore_cache->next = next;
-                else ignoredFilesList = next;
-                RebuildIgnoredCache();
-            }
-        }
-
-        cur_ignore_cache = next;
+        WARN("Can't stat %s\n", debugstr_a(file));
+        return FALSE;
     }
 
-    cur_cache_family = cachedFontList;
-    while (cur_cache_family && using_cache && !ignoringCache)
-    {
-        Face *cur_cache_face = cur_cache_family->FirstFace;
-        Face *prev_cache_face = NULL;
-        Family *next_family = cur_cache_family->next;
-        while (cur_cache_face && using_cache)
-        {
-            Face *next_face = cur_cache_face->next;
-            if (fileLastModified == cur_cache_face->lastModified &&
-                strcmp(cur_cache_face->file, file) == 0)
-                /* although it makes sense to check the filename first, its slower */
-                /* if the file we are trying is cached with the same date */
-            {
-                using_cache = AddFaceFromCache(cur_cache_family, cur_cache_face);
-                if (using_cache) faces_from_cache++;
-                else TRACE("cache broke somewhere, will stop using it and rebuild\n");
-                /* delete the face from the cache, since its used
-                 * and we want to speed up other searches. */
-                HeapFree(GetProcessHeap(), 0, cur_cache_face->StyleName);
-                HeapFree(GetProcessHeap(), 0, cur_cache_face->file);
-                if (prev_cache_face) prev_cache_face->next = cur_cache_face->next;
-                else cur_cache_family->FirstFace = cur_cache_face->next;
-                HeapFree(GetProcessHeap(), 0, cur_cache_face);
-
-                if (!cur_cache_family->FirstFace) /* all faces deleted, delete the family */
-                {
-                    HeapFree(GetProcessHeap(), 0, cur_cache_family->FamilyName);
-                    if (prev_cache_family) prev_cache_family->next = cur_cache_family->next;
-                    else cachedFontList = cur_cache_family->next;
-                    HeapFree(GetProcessHeap(), 0, cur_cache_family);
-                    cur_cache_family = NULL;
-                }
-                cur_cache_face = NULL;
-            }
-            if (cur_cache_face) prev_cache_face = cur_cache_face;
-            cur_cache_face = next_face;
-        }
-        if (cur_cache_family) prev_cache_family = cur_cache_family;
-        cur_cache_family = next_family;
-    }
-    if (faces_from_cache)
-    {
-        TRACE("loaded %i faces from cache for file %s.\n",
-              faces_from_cache, debugstr_a(file));
-        return TRUE;
-    }
-#endif /* USE_FONT_CACHE */
+    /* only files the cache doesn't know, or that changed, get opened */
+    if (FontCache_AddFile(file, &stat_buf, &ret))
+        return ret;
 
     TRACE("Loading font file %s\n", debugstr_a(file));
 
@@ -1367,97 +2179,41 @@ static BOOL AddFontFileToList(const char *file)
          * This is not an error condition.
          */
         WARN("Unable to load font file %s err = %x\n", debugstr_a(file), err);
+        FontCache_StoreFile(file, &stat_buf, 0, NULL, 0);
         return FALSE;
     }
 
     scalable = FT_IS_SCALABLE(ft_face);
 
-    len = MultiByteToWideChar(CP_ACP, 0, ft_face->family_name, -1, NULL, 0);
-    FamilyW = HeapAlloc(GetProcessHeap(), 0, len * sizeof(WCHAR));
-    MultiByteToWideChar(CP_ACP, 0, ft_face->family_name, -1, FamilyW, len);
-
-    TRACE("familyW: %s\n", debugstr_w(FamilyW));
-
-    while(family) {
-        if(!strcmpW(family->FamilyName, FamilyW))
-            break;
-        insert = &family->next;
-        family = family->next;
-    }
-    if(!family) {
-        family = *insert = HeapAlloc(GetProcessHeap(), 0, sizeof(*family));
-        family->FamilyName = FamilyW;
-        family->ScalableFamily = scalable;
-        family->FirstFace = NULL;
-        family->next = NULL;
-    } else {
-        HeapFree(GetProcessHeap(), 0, FamilyW);
-        if (scalable && !family->ScalableFamily) /* overwrite with scalable */
-        {
-            DeleteFamilyFaces(family);
-        }
-        else if (!scalable && family->ScalableFamily)
-        { /* ignore non-scalable if scalable exists */
-            pFT_Done_Face(ft_face);
-            return FALSE;
-        }
-    }
-
-    size = -1;
+    num_sizes = 0;
     if (!scalable && ft_face->num_fixed_sizes)
     {
         TRACE("family isn't scalable\n");
-        size = 0;
+        num_sizes = ft_face->num_fixed_sizes;
     }
     else if (!scalable)
         WARN("non scalable font has no fixed sizes?\n");
+    num_faces = num_sizes ? num_sizes : 1;
+
+    len = MultiByteToWideChar(CP_ACP, 0, ft_face->family_name, -1, NULL, 0);
+    FamilyW = HeapAlloc(GetProcessHeap(), 0, len * sizeof(WCHAR));
+    MultiByteToWideChar(CP_ACP, 0, ft_face->family_name, -1, FamilyW, len);
+
+    TRACE("familyW: %s\n", debugstr_w(FamilyW));
 
-add_face:
     len = MultiByteToWideChar(CP_ACP, 0, ft_face->style_name, -1, NULL, 0);
     StyleW = HeapAlloc(GetProcessHeap(), 0, len * sizeof(WCHAR));
     MultiByteToWideChar(CP_ACP, 0, ft_face->style_name, -1, StyleW, len);
 
-    for(insertface = &family->FirstFace; *insertface;
-        insertface = &(*insertface)->next) {
-        if(!strcmpW((*insertface)->StyleName, StyleW) &&
-                (scalable ||
-                  (*insertface)->Height == ft_face->available_sizes[size].height))
-        {
-            WARN("Already loaded font %s %s (%i)\n",
-                 debugstr_w(family->FamilyName),
-                 debugstr_w(StyleW),
-                 (*insertface)->Height);
-            HeapFree(GetProcessHeap(), 0, StyleW);
-            StyleW = NULL;
-            goto done_face;
-        }
-    }
-    *insertface = HeapAlloc(GetProcessHeap(), 0, sizeof(**insertface));
-    (*insertface)->StyleName = StyleW;
-    (*insertface)->file = HeapAlloc(GetProcessHeap(),0,strlen(file)+1);
-    strcpy((*insertface)->file, file);
-    (*insertface)->next = NULL;
-    (*insertface)->Italic = (ft_face->style_flags & FT_STYLE_FLAG_ITALIC) ? 1 : 0;
-    (*insertface)->Bold = (ft_face->style_flags & FT_STYLE_FLAG_BOLD) ? 1 : 0;
-    (*insertface)->Height = size == -1 ? -1 : ft_face->available_sizes[size].height;
-    (*insertface)->SizeIndex = size;
-
-    (*insertface)->fsCsb[0] = (*insertface)->fsCsb[1] = 0;
-
-    faces_from_file++;
-    TRACE("Added font to family: %s, style: %s, height: %i (-1 means scalable)\n",
-            debugstr_w(family->FamilyName),
-            debugstr_w((*insertface)->StyleName),
-            (*insertface)->Height);
-
+    fsCsb[0] = fsCsb[1] = 0;
     if (FT_IS_SFNT(ft_face)) /* true type font */
     {
         TT_OS2 *pOS2;
         pOS2 = pFT_Get_Sfnt_Table(ft_face, ft_sfnt_os2);
         if(pOS2)
         {
-            (*insertface)->fsCsb[0] = pOS2->ulCodePageRange1;
-            (*insertface)->fsCsb[1] = pOS2->ulCodePageRange2;
+            fsCsb[0] = pOS2->ulCodePageRange1;
+            fsCsb[1] = pOS2->ulCodePageRange2;
         }
     }
     else
@@ -1465,15 +2221,14 @@ add_face:
         WARN("do charmaps for this font type\n");
     }
 
-    if((*insertface)->fsCsb[0] == 0) { /* let's see if we can find any interesting cmaps */
-        for(i = 0; i < ft_face->num_charmaps &&
-              !(*insertface)->fsCsb[0]; i++) {
+    if(fsCsb[0] == 0) { /* let's see if we can find any interesting cmaps */
+        for(i = 0; i < ft_face->num_charmaps && !fsCsb[0]; i++) {
             switch(ft_face->charmaps[i]->encoding) {
             case ft_encoding_unicode:
-                (*insertface)->fsCsb[0] = 1;
+                fsCsb[0] = 1;
                 break;
             case ft_encoding_symbol:
-                (*insertface)->fsCsb[0] = 1L << 31;
+                fsCsb[0] = 1L << 31;
                 break;
             default:
                 break;
@@ -1481,40 +2236,37 @@ add_face:
         }
     }
 
-    (*insertface)->lastModified = fileLastModified;
-done_face:
-    if (!scalable)
+    faces = HeapAlloc(GetProcessHeap(), 0, num_faces * sizeof(*faces));
+    for (i = 0; i < num_faces; i++)
     {
-        size++;
-        if (size < ft_face->num_fixed_sizes)
-            goto add_face;
+        faces[i].FamilyName = FamilyW;
+        faces[i].StyleName = StyleW;
+        faces[i].scalable = scalable;
+        faces[i].Italic = (ft_face->style_flags & FT_STYLE_FLAG_ITALIC) ? 1 : 0;
+        faces[i].Bold = (ft_face->style_flags & FT_STYLE_FLAG_BOLD) ? 1 : 0;
+        faces[i].Height = num_sizes ? ft_face->available_sizes[i].height : -1;
+        faces[i].SizeIndex = num_sizes ? i : -1;
+        faces[i].fsCsb[0] = fsCsb[0];
+        faces[i].fsCsb[1] = fsCsb[1];
     }
 
     pFT_Done_Face(ft_face);
 
-    if (faces_from_file == 0) /* add file to ignore list */
-    {
-#ifdef USE_FONT_CACHE
-        IgnoredFiles *newIgnore = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                            sizeof(IgnoredFiles));
-        newIgnore->filename = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                                        strlen(file) + 1);
-        strcpy(newIgnore->filename, file);
-        newIgnore->lastModified = fileLastModified;
-        newIgnore->next = ignoredFilesList;
-        ignoredFilesList = newIgnore;
-        RebuildIgnoredCache();
-#endif /* USE_FONT_CACHE */
+    for (i = 0; i < num_faces; i++)
+        if (AddFaceToList(file, &faces[i])) faces_from_file++;
+
+    FontCache_StoreFile(file, &stat_buf, FONT_CACHE_FILE_LOADED, faces, num_faces);
+
+    if (faces_from_file == 0)
         TRACE("ignoring file (%s) with family (%s)\n",
-              debugstr_a(file), debugstr_w(family->FamilyName));
-    }
+              debugstr_a(file), debugstr_w(FamilyW));
     else
-        TRACE("Added font %s %s (%i faces)\n", debugstr_w(family->FamilyName),
+        TRACE("Added font %s %s (%i faces)\n", debugstr_w(FamilyW),
               debugstr_w(StyleW), faces_from_file);
-#ifdef USE_FONT_CACHE
-    if (faces_from_file)
-        SetRebuildCache();
-#endif
+
+    HeapFree(GetProcessHeap(), 0, faces);
+    HeapFree(GetProcessHeap(), 0, StyleW);
+    HeapFree(GetProcessHeap(), 0, FamilyW);
     return TRUE;
 }
 
@@ -1538,19 +2290,30 @@ static int DumpFontList(void)
     return familycount;
 }
 
-static BOOL ReadFontDir(char *dirname)
+static BOOL ReadFontDir(const char *dirname)
 {
     DIR *dir;
     struct dirent *dent;
+    struct stat dir_stat;
+    FontCacheDir *cache_dir = NULL;
+    BOOL have_stat;
     char path[MAX_PATH];
 
     TRACE("Loading fonts from %s\n", debugstr_a(dirname));
 
+    /* nothing was added or removed if the directory didn't change */
+    have_stat = (stat(dirname, &dir_stat) != -1);
+    if (have_stat && FontCache_ReadDir(dirname, &dir_stat))
+        return TRUE;
+
     dir = opendir(dirname);
     if(!dir) {
         ERR("Can't open directory %s\n", debugstr_a(dirname));
         return FALSE;
     }
+    if (have_stat)
+        cache_dir = FontCache_NewDir(dirname, &dir_stat);
+
     while((dent = readdir(dir)) != NULL) {
         struct stat statbuf;
 
@@ -1566,6 +2329,7 @@ static BOOL ReadFontDir(char *dirname)
             WARN("Can't stat %s\n", debugstr_a(path));
             continue;
         }
+        FontCache_AddChild(cache_dir, path, S_ISDIR(statbuf.st_mode));
         if(S_ISDIR(statbuf.st_mode))
             ReadFontDir(path);
         else
@@ -1728,6 +2492,7 @@ BOOL WineEngInit(void)
     char windowsdir[MAX_PATH];
     char unixname[MAX_PATH];
     char *dllpath;
+    const char *env;
 
     if (freetype_so_handle)
     {
@@ -1738,6 +2503,11 @@ BOOL WineEngInit(void)
     {
         TRACE("Trying to load FreeType\n");
     }
+    CRITICAL_SECTION_DEFINE(&freetype_cs);
+
+    GlyphCache_Init();
+    if ((env = getenv("WINEFONTFACES")) && atoi(env) > 0)
+        font_max_faces = atoi(env);
 
 #ifdef __APPLE__
     dllpath = getenv("WINEDLLPATH");
@@ -1949,6 +2719,8 @@ static LONG calc_ppem_for_height(GdiFont font, LONG height)
 }
 
 static LONG load_VDMX(GdiFont, LONG);
+BOOL OpenGlyphAndLoadMetrics(GdiFont font, UINT glyph_index, LPGLYPHMETRICS lpgm,
+                             ftGlyphMetrics *extraMetrics, BOOL justMetrics);
 
 static FT_Face OpenFontFile(GdiFont font, char *file, LONG height)
 {
@@ -1999,19 +2771,164 @@ static GdiFont alloc_font(void)
     ret->gmsize = INIT_GM_SIZE;
     ret->gm = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
                         ret->gmsize * sizeof(*ret->gm));
-    ret->next = NULL;
     return ret;
 }
 
 static void free_font(GdiFont font)
 {
-    pFT_Done_Face(font->ft_face);
+    if (font->ft_face) pFT_Done_Face(font->ft_face);
     if (font->cachedMetrics) HeapFree(GetProcessHeap(), 0, font->cachedMetrics);
+    if (font->glyph_map) HeapFree(GetProcessHeap(), 0, font->glyph_map);
     HeapFree(GetProcessHeap(), 0, font->gm);
     HeapFree(GetProcessHeap(), 0, font);
 }
 
 
+/*************************************************************
+ * Font instance cache
+ *
+ * Font instances are hashed on the LOGFONT and the world transform they
+ * were created for, so equivalent HFONTs share one.  The HFONTs using an
+ * instance are found through font_links.  Instances whose HFONTs have all
+ * been deleted stay around for reuse.  Only WINEFONTFACES instances keep
+ * their FT_Face open: past that the least recently used instance is freed
+ * if no HFONT uses it, or else loses its FT_Face until it is used again
+ * (see load_font_face).
+ */
+typedef struct tagFontLink {
+    HFONT hfont;
+    GdiFont font;
+    struct tagFontLink *next;
+} FontLink;
+
+static FontLink *font_links[FONT_HASH_SIZE];
+
+static DWORD hash_font(const LOGFONTW *lf, const XFORM *xform)
+{
+    const BYTE *p = (const BYTE *)lf;
+    DWORD hash = 0, bits;
+    int i;
+
+    for (i = 0; i < FIELD_OFFSET(LOGFONTW, lfFaceName); i++)
+        hash = hash * 31 + p[i];
+    for (i = 0; i < LF_FACESIZE && lf->lfFaceName[i]; i++)
+        hash = hash * 31 + tolowerW(lf->lfFaceName[i]);
+    memcpy(&bits, &xform->eM11, sizeof(bits));
+    hash = hash * 31 + bits;
+    memcpy(&bits, &xform->eM22, sizeof(bits));
+    hash = hash * 31 + bits;
+    return hash;
+}
+
+static BOOL font_matches(GdiFont font, const LOGFONTW *lf, const XFORM *xform,
+                         DWORD hash)
+{
+    return font->hash == hash &&
+           font->xform.eM11 == xform->eM11 &&
+           font->xform.eM22 == xform->eM22 &&
+           !memcmp(&font->lf, lf, FIELD_OFFSET(LOGFONTW, lfFaceName)) &&
+           !strncmpiW(font->lf.lfFaceName, lf->lfFaceName, LF_FACESIZE);
+}
+
+static void font_unhash(GdiFont font)
+{
+    GdiFont *pp = &font_hash[font->hash & (FONT_HASH_SIZE - 1)];
+
+    while (*pp != font) pp = &(*pp)->hash_next;
+    *pp = font->hash_next;
+}
+
+static void font_lru_unlink(GdiFont font)
+{
+    if (font->lru_prev) font->lru_prev->lru_next = font->lru_next;
+    else font_lru_head = font->lru_next;
+    if (font->lru_next) font->lru_next->lru_prev = font->lru_prev;
+    else font_lru_tail = font->lru_prev;
+}
+
+static void font_lru_push(GdiFont font)
+{
+    font->lru_prev = NULL;
+    font->lru_next = font_lru_head;
+    if (font_lru_head) font_lru_head->lru_prev = font;
+    else font_lru_tail = font;
+    font_lru_head = font;
+}
+
+/* close the least recently used FT_Faces beyond font_max_faces */
+static void trim_font_faces(GdiFont keep)
+{
+    GdiFont victim;
+
+    while (font_open_faces > font_max_faces && font_lru_tail && font_lru_tail != keep)
+    {
+        victim = font_lru_tail;
+        font_lru_unlink(victim);
+        font_open_faces--;
+        if (!victim->refs)
+        {
+            TRACE("freeing unused GdiFont %p\n", victim);
+            font_unhash(victim);
+            free_font(victim);
+        }
+        else
+        {
+            TRACE("closing the face of GdiFont %p\n", victim);
+            pFT_Done_Face(victim->ft_face);
+            victim->ft_face = NULL;
+        }
+    }
+}
+
+/*************************************************************
+ * load_font_face
+ *
+ * Make sure the FT_Face of a font is open, reopening it if it was closed
+ * to make room for others.
+ */
+static BOOL load_font_face(GdiFont font)
+{
+    if (font->ft_face)
+    {
+        if (font->cached && font != font_lru_head)
+        {
+            font_lru_unlink(font);
+            font_lru_push(font);
+        }
+        return TRUE;
+    }
+
+    if (!font->face)
+    {
+        WARN("the face of GdiFont %p is gone\n", font);
+        return FALSE;
+    }
+
+    TRACE("reopening %s for GdiFont %p\n", font->face->file, font);
+    if (!OpenFontFile(font, font->face->file, font->height)) return FALSE;
+    if (font->charset == SYMBOL_CHARSET)
+        pFT_Select_Charmap(font->ft_face, ft_encoding_symbol);
+
+    font_lru_push(font);
+    font_open_faces++;
+    trim_font_faces(font);
+    return TRUE;
+}
+
+static void add_font_link(HFONT hfont, GdiFont font)
+{
+    FontLink **bucket = &font_links[((UINT_PTR)hfont >> 2) & (FONT_HASH_SIZE - 1)];
+    FontLink *link = HeapAlloc(GetProcessHeap(), 0, sizeof(*link));
+
+    if (!link) return;
+    link->hfont = hfont;
+    link->font = font;
+    link->next = *bucket;
+    *bucket = link;
+    font->refs++;
+}
+
+
 /*************************************************************
  * load_VDMX
  *
@@ -2158,13 +3075,13 @@ static LONG load_VDMX(GdiFont font, LONG height)
 }
 
 /*************************************************************
- * WineEngAddFontResourceEx
+ * freetype_AddFontResourceEx
  *
  * FIXME: since the font list is a global, it is per-process. So adding
  *        a font won't add it to other processes. We will need to do wineserver
  *        stuff for this.
  */
-INT WineEngAddFontResourceEx(LPCWSTR str, DWORD fl, PVOID pv)
+static INT freetype_AddFontResourceEx(LPCWSTR str, DWORD fl, PVOID pv)
 {
     DWORD len;
     LPSTR astr;
@@ -2204,10 +3121,10 @@ BOOL WineEngRemoveFontResourceEx(LPCWSTR str, DWORD fl, PVOID pv)
 
 
 /*************************************************************
- * WineEngCreateFontInstance
+ * freetype_CreateFontInstance
  *
  */
-GdiFont WineEngCreateFontInstance(DC *dc, HFONT hfont)
+static GdiFont freetype_CreateFontInstance(DC *dc, HFONT hfont)
 {
     GdiFont ret;
     Face *face;
@@ -2218,6 +3135,8 @@ GdiFont WineEngCreateFontInstance(DC *dc, HFONT hfont)
     LOGFONTW *plf = &font->logfont;
     Face *bestBiggerFace, *bestSmallerFace;
     int biggerDiff, smallerDiff;
+    FontLink *link;
+    DWORD hash;
 
     float height;
 
@@ -2228,12 +3147,24 @@ GdiFont WineEngCreateFontInstance(DC *dc, HFONT hfont)
           plf->lfEscapement);
 
     /* check the cache first */
-    for(ret = GdiFontList; ret; ret = ret->next) {
-        if(ret->hfont == hfont &&
-                ret->xform.eM11 == dc->xformWorld2Vport.eM11 &&
-                ret->xform.eM22 == dc->xformWorld2Vport.eM22) {
+    for(link = font_links[((UINT_PTR)hfont >> 2) & (FONT_HASH_SIZE - 1)]; link;
+        link = link->next) {
+        if(link->hfont == hfont &&
+                link->font->xform.eM11 == dc->xformWorld2Vport.eM11 &&
+                link->font->xform.eM22 == dc->xformWorld2Vport.eM22) {
+            GDI_ReleaseObj(hfont);
+            TRACE("returning cached GdiFont(%p) for hFont %x\n", link->font, hfont);
+            return link->font;
+        }
+    }
+
+    /* then for an instance of an equivalent font */
+    hash = hash_font(plf, &dc->xformWorld2Vport);
+    for(ret = font_hash[hash & (FONT_HASH_SIZE - 1)]; ret; ret = ret->hash_next) {
+        if(font_matches(ret, plf, &dc->xformWorld2Vport, hash)) {
             GDI_ReleaseObj(hfont);
-            TRACE("returning cached GdiFont(%p) for hFont %x\n", ret, hfont);
+            TRACE("sharing GdiFont(%p) with hFont %x\n", ret, hfont);
+            add_font_link(hfont, ret);
             return ret;
         }
     }
@@ -2247,6 +3178,8 @@ GdiFont WineEngCreateFontInstance(DC *dc, HFONT hfont)
 
     ret = alloc_font();
     memcpy(&(ret->xform), &(dc->xformWorld2Vport), sizeof(XFORM));
+    memcpy(&(ret->lf), plf, sizeof(LOGFONTW));
+    ret->hash = hash;
 
     strcpyW(FaceName, plf->lfFaceName);
 
@@ -2353,11 +3286,13 @@ GdiFont WineEngCreateFontInstance(DC *dc, HFONT hfont)
     }
     ret->fixedSize = face->SizeIndex;
     ret->charset = get_nearest_charset(face, plf->lfCharSet);
+    ret->face = face;
 
     TRACE("Choosen %s %s (%i)\n", debugstr_w(family->FamilyName),
           debugstr_w(face->StyleName),
           face->Height);
 
+    ret->height = height;
     ret->ft_face = OpenFontFile(ret, face->file, height);
 
     if(ret->charset == SYMBOL_CHARSET)
@@ -2366,9 +3301,15 @@ GdiFont WineEngCreateFontInstance(DC *dc, HFONT hfont)
     GDI_ReleaseObj(hfont);
 
     TRACE("caching: ftFont=%p  hfont=%x\n", ret, hfont);
-    ret->hfont = hfont;
-    ret->next = GdiFontList;
-    GdiFontList = ret;
+    ret->cached = TRUE;
+    ret->hash_next = font_hash[hash & (FONT_HASH_SIZE - 1)];
+    font_hash[hash & (FONT_HASH_SIZE - 1)] = ret;
+    add_font_link(hfont, ret);
+    if(ret->ft_face) {
+        font_lru_push(ret);
+        font_open_faces++;
+        trim_font_faces(ret);
+    }
 
     return ret;
 }
@@ -2376,45 +3317,52 @@ GdiFont WineEngCreateFontInstance(DC *dc, HFONT hfont)
 static void DumpGdiFontList(void)
 {
     GdiFont ftFont;
+    int i;
 
     TRACE("---------- ftFont Cache ----------\n");
-    for(ftFont = GdiFontList; ftFont; ftFont = ftFont->next) {
-        FONTOBJ *font = GDI_GetObjPtr(ftFont->hfont, FONT_MAGIC);
-        LOGFONTW *plf = &font->logfont;
-        TRACE("ftFont=%p  hfont=%x (%s)\n",
-               ftFont, ftFont->hfont, debugstr_w(plf->lfFaceName));
-        GDI_ReleaseObj(ftFont->hfont);
+    for(i = 0; i < FONT_HASH_SIZE; i++) {
+        for(ftFont = font_hash[i]; ftFont; ftFont = ftFont->hash_next) {
+            TRACE("ftFont=%p  refs=%ld%s (%s)\n",
+                   ftFont, ftFont->refs, ftFont->ft_face ? "" : " closed",
+                   debugstr_w(ftFont->lf.lfFaceName));
+        }
     }
 }
 
 /*************************************************************
- * WineEngDestroyFontInstance
+ * freetype_DestroyFontInstance
  *
  * free the ftFont associated with this handle
  *
  */
-BOOL WineEngDestroyFontInstance(HFONT handle)
+static BOOL freetype_DestroyFontInstance(HFONT handle)
 {
+    FontLink **pp = &font_links[((UINT_PTR)handle >> 2) & (FONT_HASH_SIZE - 1)];
+    FontLink *link;
     GdiFont ftFont;
-    GdiFont ftPrev = NULL;
+    BOOL ret = FALSE;
 
     TRACE("destroying hfont=%x\n", handle);
     if(TRACE_ON(font))
         DumpGdiFontList();
 
-    for(ftFont = GdiFontList; ftFont; ftFont = ftFont->next) {
-        if(ftFont->hfont == handle) {
-            if(ftPrev)
-                ftPrev->next = ftFont->next;
-            else
-                GdiFontList = ftFont->next;
-
+    while((link = *pp)) {
+        if(link->hfont != handle) {
+            pp = &link->next;
+            continue;
+        }
+        *pp = link->next;
+        ftFont = link->font;
+        HeapFree(GetProcessHeap(), 0, link);
+        ret = TRUE;
+
+        /* an unused instance is kept for reuse while it has an open face */
+        if(!--ftFont->refs && !ftFont->ft_face) {
+            font_unhash(ftFont);
             free_font(ftFont);
-            return TRUE;
         }
-        ftPrev = ftFont;
     }
-    return FALSE;
+    return ret;
 }
 
 static void GetEnumStructs(Face *face, LPENUMLOGFONTEXW pelf,
@@ -2524,24 +3472,61 @@ static void GetEnumStructs(Face *face, LPENUMLOGFONTEXW pelf,
     return;
 }
 
-/* returns TRUE if we should continue with the enumeration */
-BOOL EnumFace(DEVICEFONTENUMPROC proc, LPARAM lparam, Face *face, DWORD *pRet, LPWSTR fakeName)
+/* a face to enumerate, copied out of the font list under freetype_cs */
+struct enum_face
 {
-    ENUMLOGFONTEXW elf;
+    ENUMLOGFONTEXW   elf;
     NEWTEXTMETRICEXW ntm;
-    DWORD type, ret = 1;
-    FONTSIGNATURE fs;
-    CHARSETINFO csi;
-    int i;
+    DWORD            type;
+    DWORD            fsCsb0;
+};
+
+struct enum_face_list
+{
+    struct enum_face *faces;
+    int               count;
+    int               size;
+};
+
+/* must be called with freetype_cs held */
+static void AddEnumFace(struct enum_face_list *list, Face *face, LPCWSTR fakeName)
+{
+    struct enum_face *entry;
 
-    GetEnumStructs(face, &elf, &ntm, &type);
+    if (list->count == list->size)
+    {
+        int size = list->size ? list->size * 2 : 16;
+        struct enum_face *faces;
+
+        if (list->faces)
+            faces = HeapReAlloc(GetProcessHeap(), 0, list->faces, size * sizeof(*faces));
+        else
+            faces = HeapAlloc(GetProcessHeap(), 0, size * sizeof(*faces));
+        if (!faces) return;
+        list->faces = faces;
+        list->size = size;
+    }
+    entry = &list->faces[list->count++];
+    GetEnumStructs(face, &entry->elf, &entry->ntm, &entry->type);
     if (fakeName)
     {
-        strncmpW(elf.elfLogFont.lfFaceName, fakeName, LF_FACESIZE);
-        elf.elfLogFont.lfFaceName[LF_FACESIZE-1] = '\0';
+        lstrcpynW(entry->elf.elfLogFont.lfFaceName, fakeName, LF_FACESIZE);
     }
+    entry->fsCsb0 = face->fsCsb[0];
+}
+
+/* returns TRUE if we should continue with the enumeration */
+static BOOL EnumFace(DEVICEFONTENUMPROC proc, LPARAM lparam, struct enum_face *face, DWORD *pRet)
+{
+    ENUMLOGFONTEXW elf = face->elf;
+    NEWTEXTMETRICEXW ntm = face->ntm;
+    DWORD type = face->type, ret = 1;
+    FONTSIGNATURE fs;
+    CHARSETINFO csi;
+    int i;
+
     for(i = 0; i < 32; i++) {
-        if(face->fsCsb[0] & (1L << i)) {
+        if(face->fsCsb0 & (1L << i)) {
             fs.fsCsb[0] = 1L << i;
             fs.fsCsb[1] = 0;
             if(!TranslateCharsetInfo(fs.fsCsb, &csi,
@@ -2575,44 +3560,46 @@ BOOL EnumFace(DEVICEFONTENUMPROC proc, LPARAM lparam, Face *face, DWORD *pRet, L
 /*************************************************************
  * WineEngEnumFonts
  *
+ * The matching faces are copied out under freetype_cs and proc is called
+ * without it: proc may well call back into GDI, and another thread adding
+ * a font can free the faces in the list meanwhile.
  */
 DWORD WineEngEnumFonts(LPLOGFONTW plf, DEVICEFONTENUMPROC proc,
                        LPARAM lparam)
 {
+    struct enum_face_list list = { NULL, 0, 0 };
     Family *family;
     Face *face;
     ftFontAlias *alias;
     DWORD ret = 1;
+    int i;
 
     TRACE("facename = %s charset %d\n", debugstr_w(plf->lfFaceName), plf->lfCharSet);
+    EnterCriticalSection(&freetype_cs);
     if(plf->lfFaceName[0]) {
         for(family = FontList; family; family = family->next) {
             if(!strcmpiW(plf->lfFaceName, family->FamilyName)) {
-                for(face = family->FirstFace; face; face = face->next) {
-                    if (!EnumFace(proc, lparam, face, &ret, NULL))
-                        goto end;
-                }
+                for(face = family->FirstFace; face; face = face->next)
+                    AddEnumFace(&list, face, NULL);
             }
         }
         for (alias = ftAliasTable; alias; alias = alias->next) {
             if (!strcmpiW(plf->lfFaceName, alias->faTypeFace)) {
-                for (face = alias->faRealFamily->FirstFace; face; face = face->next) {
-                    if (!EnumFace(proc, lparam, face, &ret, alias->faTypeFace))
-                        goto end;
-                }
+                for (face = alias->faRealFamily->FirstFace; face; face = face->next)
+                    AddEnumFace(&list, face, alias->faTypeFace);
             }
         }
     } else {
-        for(family = FontList; family; family = family->next) {
-            if (!EnumFace(proc, lparam, family->FirstFace, &ret, NULL))
-                goto end;
-        }
-        for (alias = ftAliasTable; alias; alias = alias->next) {
-            if (!EnumFace(proc, lparam, alias->faRealFamily->FirstFace, &ret, alias->faTypeFace))
-                goto end;
-        }
+        for(family = FontList; family; family = family->next)
+            AddEnumFace(&list, family->FirstFace, NULL);
+        for (alias = ftAliasTable; alias; alias = alias->next)
+            AddEnumFace(&list, alias->faRealFamily->FirstFace, alias->faTypeFace);
     }
-end:
+    LeaveCriticalSection(&freetype_cs);
+
+    for (i = 0; i < list.count; i++)
+        if (!EnumFace(proc, lparam, &list.faces[i], &ret)) break;
+    HeapFree(GetProcessHeap(), 0, list.faces);
     return ret;
 }
 
@@ -2627,11 +3614,45 @@ static void FTVectorToPOINTFX(FT_Vector *vec, POINTFX *pt)
     return;
 }
 
+/* Size of the per font direct-mapped cache of character to glyph index
+ * lookups.  Each entry holds the character in the high word and its glyph
+ * index in the low word, empty entries are all ones. */
+#define GLYPH_MAP_SIZE 512 /* must be a power of 2 */
+
 static FT_UInt get_glyph_index(GdiFont font, UINT glyph)
 {
-    if(font->charset == SYMBOL_CHARSET && glyph < 0x100)
-        glyph = glyph + 0xf000;
-    return pFT_Get_Char_Index(font->ft_face, glyph);
+    DWORD *entry = NULL;
+    FT_UInt ret;
+
+    if (glyph < 0xffff)
+    {
+        if (!font->glyph_map &&
+            (font->glyph_map = HeapAlloc(GetProcessHeap(), 0,
+                                         GLYPH_MAP_SIZE * sizeof(DWORD))))
+            memset(font->glyph_map, 0xff, GLYPH_MAP_SIZE * sizeof(DWORD));
+        if (font->glyph_map)
+        {
+            entry = &font->glyph_map[glyph & (GLYPH_MAP_SIZE - 1)];
+            if ((*entry >> 16) == glyph) return *entry & 0xffff;
+        }
+    }
+
+    ret = pFT_Get_Char_Index(font->ft_face,
+                             (font->charset == SYMBOL_CHARSET && glyph < 0x100) ?
+                             glyph + 0xf000 : glyph);
+    if (entry && ret <= 0xffff) *entry = (glyph << 16) | ret;
+    return ret;
+}
+
+/* get the metrics of a glyph, from the GM cache if they are there */
+static inline GM *get_glyph_gm(GdiFont font, FT_UInt glyph_index)
+{
+    GLYPHMETRICS gm;
+
+    if (glyph_index < font->gmsize && font->gm[glyph_index].init)
+        return &font->gm[glyph_index];
+    OpenGlyphAndLoadMetrics(font, glyph_index, &gm, NULL, TRUE);
+    return glyph_index < font->gmsize ? &font->gm[glyph_index] : NULL;
 }
 
 BOOL OpenGlyphAndLoadMetrics(GdiFont font, UINT glyph_index, LPGLYPHMETRICS lpgm,
@@ -2853,14 +3874,15 @@ BOOL GetGlyphBitmap(GdiFont font, LPGLYPHMETRICS lpgm, LPVOID buf,
 }
 
 /*************************************************************
- * WineEngGetGlyphIndices
+ * freetype_GetGlyphIndices
  *
  */
-DWORD WineEngGetGlyphIndices(GdiFont font, LPCWSTR lpstr, INT count,
-                             LPWORD pgi, DWORD flags)
+static DWORD freetype_GetGlyphIndices(GdiFont font, LPCWSTR lpstr, INT count,
+                                      LPWORD pgi, DWORD flags)
 {
     DWORD c;
     TRACE("%p, %s, %d, %p, 0x%lx\n", font, debugstr_wn(lpstr, count), count, pgi, flags);
+    if (!load_font_face(font)) return GDI_ERROR;
     for (c=0; c<count; c++) {
         FT_UInt glyph_index = get_glyph_index(font, lpstr[c]);
         /* FIXME: UTF-16 encode */
@@ -2870,27 +3892,81 @@ DWORD WineEngGetGlyphIndices(GdiFont font, LPCWSTR lpstr, INT count,
 }
 
 /*************************************************************
- * WineEngGetGlyphOutline
+ * ScaleGrayBitmap
  *
+ * Scale the 256 levels GetGlyphBitmap renders down to those of format.
  */
-DWORD WineEngGetGlyphOutline(GdiFont font, UINT glyph, UINT format,
-                             LPGLYPHMETRICS lpgm, DWORD buflen, LPVOID buf,
-                             const MAT2* lpmat)
+static void ScaleGrayBitmap(BYTE *buf, UINT format, DWORD width, DWORD height,
+                            DWORD pitch)
 {
-    FT_Face ft_face = font->ft_face;
+    int mult, row, col;
+    BYTE *start, *ptr;
+
+    if(format == GGO_GRAY2_BITMAP)
+        mult = 4;
+    else if(format == GGO_GRAY4_BITMAP)
+        mult = 16;
+    else if(format == GGO_GRAY8_BITMAP)
+        mult = 64;
+    else
+        return;
+
+    start = buf;
+    for(row = 0; row < height; row++) {
+        ptr = start;
+        for(col = 0; col < width; col++, ptr++) {
+            *ptr = ((unsigned int)(*ptr) * mult) / 255;
+        }
+        start += pitch;
+    }
+}
+
+/*************************************************************
+ * freetype_GetGlyphOutline
+ *
+ */
+static DWORD freetype_GetGlyphOutline(GdiFont font, UINT glyph, UINT format,
+                                      LPGLYPHMETRICS lpgm, DWORD buflen, LPVOID buf,
+                                      const MAT2* lpmat)
+{
+    FT_Face ft_face;
     FT_UInt glyph_index;
     DWORD width, height, pitch, needed = 0;
     ftGlyphMetrics extraMetrics; /* freetype metrics that we have to pass around */
+    BOOL bitmap = FALSE;
 
     TRACE("%p, %04x, %08x, %p, %08lx, %p, %p\n", font, glyph, format, lpgm,
           buflen, buf, lpmat);
 
+    if (!load_font_face(font)) return GDI_ERROR;
+    ft_face = font->ft_face;
+
     if(format & GGO_GLYPH_INDEX) {
         glyph_index = glyph;
         format &= ~GGO_GLYPH_INDEX;
     } else
         glyph_index = get_glyph_index(font, glyph);
 
+    switch(format) {
+    case GGO_BITMAP:
+    case GGO_GRAY2_BITMAP:
+    case GGO_GRAY4_BITMAP:
+    case GGO_GRAY8_BITMAP:
+    case WINE_GGO_GRAY16_BITMAP:
+        bitmap = TRUE;
+        break;
+    }
+
+    /* a cached bitmap doesn't need the glyph to be loaded at all */
+    if (bitmap && GlyphCache_Get(font, glyph_index, format != GGO_BITMAP,
+                                 lpgm, buf, buflen, &needed))
+    {
+        if (buf && buflen >= needed)
+            ScaleGrayBitmap(buf, format, lpgm->gmBlackBoxX, lpgm->gmBlackBoxY,
+                            (lpgm->gmBlackBoxX + 3) / 4 * 4);
+        return needed;
+    }
+
     if (!OpenGlyphAndLoadMetrics(font, glyph_index, lpgm, &extraMetrics, FALSE))
         return GDI_ERROR;
 
@@ -2910,40 +3986,35 @@ DWORD WineEngGetGlyphOutline(GdiFont font, UINT glyph, UINT format,
     case GGO_GRAY8_BITMAP:
     case WINE_GGO_GRAY16_BITMAP:
       {
-        int mult, row, col;
-        BYTE *start, *ptr;
+        GlyphCacheEntry *entry;
 
         needed = pitch * height;
+
+        /* render it for the cache even if this is just a size query, the
+         * bitmap itself usually gets asked for next */
+        entry = GlyphCache_NewEntry(font, glyph_index, format != GGO_BITMAP,
+                                    lpgm, needed);
+        if (entry)
+        {
+            if (!GetGlyphBitmap(font, lpgm, entry->bits, lpmat,
+                                &extraMetrics, format != GGO_BITMAP,
+                                width, height, pitch))
+            {
+                HeapFree(GetProcessHeap(), 0, entry);
+                return GDI_ERROR;
+            }
+            if (buf && buflen >= needed) memcpy(buf, entry->bits, needed);
+            GlyphCache_Insert(entry);
+        }
+
         if (!buf || buflen < needed) return needed;
 
-        if (!GetGlyphBitmap(font, lpgm, buf, lpmat,
-                            &extraMetrics, format != GGO_BITMAP,
-                            width, height, pitch))
+        if (!entry && !GetGlyphBitmap(font, lpgm, buf, lpmat,
+                                      &extraMetrics, format != GGO_BITMAP,
+                                      width, height, pitch))
             return GDI_ERROR;
 
-        if (format == GGO_BITMAP)
-            break;
-        if(format == GGO_GRAY2_BITMAP)
-            mult = 4;
-        else if(format == GGO_GRAY4_BITMAP)
-            mult = 16;
-        else if(format == GGO_GRAY8_BITMAP)
-            mult = 64;
-        else if(format == WINE_GGO_GRAY16_BITMAP)
-            break;
-        else {
-            assert(0);
-            break;
-        }
-
-        start = buf;
-        for(row = 0; row < height; row++) {
-            ptr = start;
-            for(col = 0; col < width; col++, ptr++) {
-                *ptr = ((unsigned int)(*ptr) * mult) / 255;
-            }
-            start += pitch;
-        }
+        ScaleGrayBitmap(buf, format, width, height, pitch);
         break;
       }
 
@@ -3212,10 +4283,10 @@ BOOL WineEngGetTextMetrics_TT(GdiFont font, LPTEXTMETRICW ptm)
 
 
 /*************************************************************
- * WineEngGetTextMetrics
+ * freetype_GetTextMetrics
  *
  */
-BOOL WineEngGetTextMetrics(GdiFont font, LPTEXTMETRICW ptm)
+static BOOL freetype_GetTextMetrics(GdiFont font, LPTEXTMETRICW ptm)
 {
     BOOL ret;
     TRACE("font=%p, ptm=%p\n", font, ptm);
@@ -3227,6 +4298,7 @@ BOOL WineEngGetTextMetrics(GdiFont font, LPTEXTMETRICW ptm)
         return TRUE;
     }
 
+    if (!load_font_face(font)) return FALSE;
     if (FT_IS_SFNT(font->ft_face))
         ret = WineEngGetTextMetrics_TT(font, ptm);
     else
@@ -3242,12 +4314,12 @@ BOOL WineEngGetTextMetrics(GdiFont font, LPTEXTMETRICW ptm)
 }
 
 /*************************************************************
- * WineEngGetOutlineTextMetrics
+ * freetype_GetOutlineTextMetrics
  */
-UINT WineEngGetOutlineTextMetrics(GdiFont font, UINT cbSize,
-                                  OUTLINETEXTMETRICW *potm)
+static UINT freetype_GetOutlineTextMetrics(GdiFont font, UINT cbSize,
+                                           OUTLINETEXTMETRICW *potm)
 {
-    FT_Face ft_face = font->ft_face;
+    FT_Face ft_face;
     UINT needed, lenfam, lensty, ret;
     TT_OS2 *pOS2;
     TT_HoriHeader *pHori;
@@ -3258,6 +4330,8 @@ UINT WineEngGetOutlineTextMetrics(GdiFont font, UINT cbSize,
 
     TRACE("font=%p\n", font);
 
+    if (!load_font_face(font)) return 0;
+    ft_face = font->ft_face;
     if (!FT_IS_SFNT(font->ft_face)) return 0;
 
     needed = sizeof(*potm);
@@ -3382,14 +4456,15 @@ UINT WineEngGetOutlineTextMetrics(GdiFont font, UINT cbSize,
 }
 
 /*************************************************************
- * WineEngGetCharABCWidth
+ * freetype_GetCharABCWidth
  */
-BOOL WineEngGetCharABCWidth(GdiFont font, UINT firstChar,
-                            UINT lastChar, LPABC abc)
+static BOOL freetype_GetCharABCWidth(GdiFont font, UINT firstChar,
+                                     UINT lastChar, LPABC abc)
 {
     GLYPHMETRICS gm;
     int i;
     TRACE("(%p, %i, %i, %p)\n", font, firstChar, lastChar, abc);
+    if (!load_font_face(font)) return FALSE;
 
     for (i=firstChar;i<=lastChar;i++) {
         UINT glyphIndex = get_glyph_index(font, i);
@@ -3405,14 +4480,15 @@ BOOL WineEngGetCharABCWidth(GdiFont font, UINT firstChar,
 }
 
 /*************************************************************
- * WineEngGetCharABCWidthI
+ * freetype_GetCharABCWidthI
  */
-BOOL WineEngGetCharABCWidthI(GdiFont font, UINT first,
-                             UINT count, LPWORD pgi, LPABC abc)
+static BOOL freetype_GetCharABCWidthI(GdiFont font, UINT first,
+                                      UINT count, LPWORD pgi, LPABC abc)
 {
     GLYPHMETRICS gm;
     int i;
     TRACE("(%p, %i, %i, %p, %p)\n", font, first, count, pgi, abc);
+    if (!load_font_face(font)) return FALSE;
 
     for (i=0; i<count; i++) {
         UINT glyphIndex = pgi ? pgi[i] : (first + i);
@@ -3429,14 +4505,15 @@ BOOL WineEngGetCharABCWidthI(GdiFont font, UINT first,
 
 
 /*************************************************************
- * WineEngGetCharWidthI
+ * freetype_GetCharWidthI
  */
-BOOL WineEngGetCharWidthI(GdiFont font, UINT first,
-                          UINT count, LPWORD pgi, LPINT lpBuffer)
+static BOOL freetype_GetCharWidthI(GdiFont font, UINT first,
+                                   UINT count, LPWORD pgi, LPINT lpBuffer)
 {
     GLYPHMETRICS gm;
     int i;
     TRACE("(%p, %i, %i, %p, %p)\n", font, first, count, pgi, lpBuffer);
+    if (!load_font_face(font)) return FALSE;
 
     for (i=0; i<count; i++) {
         UINT glyphIndex = pgi ? pgi[i] : (first + i);
@@ -3450,95 +4527,108 @@ BOOL WineEngGetCharWidthI(GdiFont font, UINT first,
 }
 
 /*************************************************************
- * WineEngGetCharWidth
+ * freetype_GetCharWidth
  *
  */
-BOOL WineEngGetCharWidth(GdiFont font, UINT firstChar, UINT lastChar,
-                         LPINT buffer)
+static BOOL freetype_GetCharWidth(GdiFont font, UINT firstChar, UINT lastChar,
+                                  LPINT buffer)
 {
     UINT c;
-    GLYPHMETRICS gm;
-    FT_UInt glyph_index;
+    GM *gm;
 
     TRACE("%p, %d, %d, %p\n", font, firstChar, lastChar, buffer);
+    if (!load_font_face(font)) return FALSE;
 
     for(c = firstChar; c <= lastChar; c++) {
-        glyph_index = get_glyph_index(font, c);
-        OpenGlyphAndLoadMetrics(font, glyph_index, &gm, NULL, TRUE);
-        buffer[c - firstChar] = font->gm[glyph_index].adv;
+        gm = get_glyph_gm(font, get_glyph_index(font, c));
+        buffer[c - firstChar] = gm ? gm->adv : 0;
     }
     return TRUE;
 }
 
 /*************************************************************
- * WineEngGetTextExtentPoint
+ * freetype_GetTextExtentExPoint
  *
+ * Sums up the advances of a string from the GM cache, FreeType only gets
+ * to see glyphs that aren't in there yet.  If pnfit is set, it receives
+ * the number of characters that fit into max_ext; dxs receives the
+ * extent of each of them.
  */
-BOOL WineEngGetTextExtentPoint(GdiFont font, LPCWSTR wstr, INT count,
-                               LPSIZE size)
+static BOOL freetype_GetTextExtentExPoint(GdiFont font, LPCWSTR wstr, INT count,
+                                          INT max_ext, LPINT pnfit, LPINT dxs,
+                                          LPSIZE size)
 {
-    UINT idx;
-    GLYPHMETRICS gm;
+    INT idx, nfit = 0;
     TEXTMETRICW tm;
-    FT_UInt glyph_index;
-
-    TRACE("%p, %s, %d, %p\n", font, debugstr_wn(wstr, count), count,
-          size);
+    GM *gm;
 
-    /* FIXME: replace this with just WineEngGetGlyphIndices
-     * and WineEngGetTextExtentPointI, perhaps */
+    TRACE("%p, %s, %d, %d, %p\n", font, debugstr_wn(wstr, count), count,
+          max_ext, size);
+    if (!load_font_face(font)) return FALSE;
 
     size->cx = 0;
     WineEngGetTextMetrics(font, &tm);
     size->cy = tm.tmHeight;
 
     for(idx = 0; idx < count; idx++) {
-        glyph_index = get_glyph_index(font, wstr[idx]);
-        OpenGlyphAndLoadMetrics(font, glyph_index, &gm, NULL, TRUE);
-        size->cx += font->gm[glyph_index].adv;
-        TRACE("char '%c' has width: %i, size->cx now: %li\n", (CHAR)wstr[idx],
-              font->gm[glyph_index].adv, size->cx);
-        if (size->cy < font->gm[glyph_index].gm.gmBlackBoxY)
-        {
-            WARN("broken font(?) - text metrics height too small. was %li, now %i\n",
-                  size->cy, font->gm[glyph_index].gm.gmBlackBoxY);
-            size->cy = font->gm[glyph_index].gm.gmBlackBoxY;
+        gm = get_glyph_gm(font, get_glyph_index(font, wstr[idx]));
+        if (gm) {
+            size->cx += gm->adv;
+            if (size->cy < gm->gm.gmBlackBoxY)
+            {
+                WARN("broken font(?) - text metrics height too small. was %li, now %i\n",
+                      size->cy, gm->gm.gmBlackBoxY);
+                size->cy = gm->gm.gmBlackBoxY;
+            }
+        }
+        /* it is allowed to be equal */
+        if (!pnfit || size->cx <= max_ext) {
+            nfit++;
+            if (dxs) dxs[idx] = size->cx;
         }
     }
-    TRACE("return %ld,%ld\n", size->cx, size->cy);
+    if (pnfit) *pnfit = nfit;
+    TRACE("return %d, %ld,%ld\n", nfit, size->cx, size->cy);
     return TRUE;
 }
 
 /*************************************************************
- * WineEngGetTextExtentPointI
+ * freetype_GetTextExtentPoint
  *
  */
-BOOL WineEngGetTextExtentPointI(GdiFont font, LPWORD pgi, INT count,
-                                LPSIZE size)
+static BOOL freetype_GetTextExtentPoint(GdiFont font, LPCWSTR wstr, INT count,
+                                        LPSIZE size)
+{
+    return WineEngGetTextExtentExPoint(font, wstr, count, 0, NULL, NULL, size);
+}
+
+/*************************************************************
+ * freetype_GetTextExtentPointI
+ *
+ */
+static BOOL freetype_GetTextExtentPointI(GdiFont font, LPWORD pgi, INT count,
+                                         LPSIZE size)
 {
     UINT idx;
-    GLYPHMETRICS gm;
     TEXTMETRICW tm;
-    FT_UInt glyph_index;
+    GM *gm;
 
     TRACE("%p, %p, %d, %p\n", font, pgi, count,
           size);
+    if (!load_font_face(font)) return FALSE;
 
     size->cx = 0;
     WineEngGetTextMetrics(font, &tm);
     size->cy = tm.tmHeight;
 
     for(idx = 0; idx < count; idx++) {
-        glyph_index = pgi[idx];
-        OpenGlyphAndLoadMetrics(font, glyph_index, &gm, NULL, TRUE);
-        size->cx += font->gm[glyph_index].adv;
-        TRACE("glyph %d has width: %i, size->cx now: %li\n", glyph_index,
-              font->gm[glyph_index].adv, size->cx);
-        if (size->cy < font->gm[glyph_index].gm.gmBlackBoxY)
+        if (!(gm = get_glyph_gm(font, pgi[idx]))) continue;
+        size->cx += gm->adv;
+        if (size->cy < gm->gm.gmBlackBoxY)
         {
             WARN("broken font(?) - text metrics height too small. was %li, now %i\n",
-                  size->cy, font->gm[glyph_index].gm.gmBlackBoxY);
-            size->cy = font->gm[glyph_index].gm.gmBlackBoxY;
+                  size->cy, gm->gm.gmBlackBoxY);
+            size->cy = gm->gm.gmBlackBoxY;
         }
     }
     TRACE("return %ld,%ld\n", size->cx, size->cy);
@@ -3546,19 +4636,22 @@ BOOL WineEngGetTextExtentPointI(GdiFont font, LPWORD pgi, INT count,
 }
 
 /*************************************************************
- * WineEngGetFontData
+ * freetype_GetFontData
  *
  */
-DWORD WineEngGetFontData(GdiFont font, DWORD table, DWORD offset, LPVOID buf,
-                         DWORD cbData)
+static DWORD freetype_GetFontData(GdiFont font, DWORD table, DWORD offset, LPVOID buf,
+                                  DWORD cbData)
 {
-    FT_Face ft_face = font->ft_face;
+    FT_Face ft_face;
     DWORD len;
     FT_Error err;
 
     TRACE("font=%p, table=%08lx, offset=%08lx, buf=%p, cbData=%lx\n",
         font, table, offset, buf, cbData);
 
+    if (!load_font_face(font)) return GDI_ERROR;
+    ft_face = font->ft_face;
+
     if(!FT_IS_SFNT(ft_face))
         return GDI_ERROR;
 
@@ -3599,6 +4692,229 @@ DWORD WineEngGetFontData(GdiFont font, DWORD table, DWORD offset, LPVOID buf,
     return len;
 }
 
+/*************************************************************
+ * Entry points
+ *
+ * The font engine's globals (the font list, the font instances and their
+ * glyph metrics, the open FT_Faces) are protected by freetype_cs.  DCs are
+ * locked individually, so the GDI lock doesn't cover them anymore.
+ * freetype_cs comes after the DC and GDI object locks in the lock order:
+ * nothing in here takes either of them while holding it, except for
+ * freetype_CreateFontInstance which has the font object locked up front.
+ */
+
+/*************************************************************
+ * WineEngAddFontResourceEx
+ */
+INT WineEngAddFontResourceEx(LPCWSTR str, DWORD fl, PVOID pv)
+{
+    INT ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_AddFontResourceEx(str, fl, pv);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngCreateFontInstance
+ */
+GdiFont WineEngCreateFontInstance(DC *dc, HFONT hfont)
+{
+    FONTOBJ *font;
+    GdiFont ret;
+
+    /* the font object is locked first, see freetype_cs */
+    if (!(font = GDI_GetObjPtr(hfont, FONT_MAGIC))) return NULL;
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_CreateFontInstance(dc, hfont);
+    LeaveCriticalSection(&freetype_cs);
+    GDI_ReleaseObj(hfont);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngDestroyFontInstance
+ */
+BOOL WineEngDestroyFontInstance(HFONT handle)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_DestroyFontInstance(handle);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetGlyphIndices
+ */
+DWORD WineEngGetGlyphIndices(GdiFont font, LPCWSTR lpstr, INT count, LPWORD pgi,
+                             DWORD flags)
+{
+    DWORD ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetGlyphIndices(font, lpstr, count, pgi, flags);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetGlyphOutline
+ */
+DWORD WineEngGetGlyphOutline(GdiFont font, UINT glyph, UINT format,
+                             LPGLYPHMETRICS lpgm, DWORD buflen, LPVOID buf,
+                             const MAT2* lpmat)
+{
+    DWORD ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetGlyphOutline(font, glyph, format, lpgm, buflen, buf, lpmat);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetTextMetrics
+ */
+BOOL WineEngGetTextMetrics(GdiFont font, LPTEXTMETRICW ptm)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetTextMetrics(font, ptm);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetOutlineTextMetrics
+ */
+UINT WineEngGetOutlineTextMetrics(GdiFont font, UINT cbSize,
+                                  OUTLINETEXTMETRICW *potm)
+{
+    UINT ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetOutlineTextMetrics(font, cbSize, potm);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetCharABCWidth
+ */
+BOOL WineEngGetCharABCWidth(GdiFont font, UINT firstChar, UINT lastChar,
+                            LPABC abc)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetCharABCWidth(font, firstChar, lastChar, abc);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetCharABCWidthI
+ */
+BOOL WineEngGetCharABCWidthI(GdiFont font, UINT first, UINT count, LPWORD pgi,
+                             LPABC abc)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetCharABCWidthI(font, first, count, pgi, abc);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetCharWidthI
+ */
+BOOL WineEngGetCharWidthI(GdiFont font, UINT first, UINT count, LPWORD pgi,
+                          LPINT lpBuffer)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetCharWidthI(font, first, count, pgi, lpBuffer);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetCharWidth
+ */
+BOOL WineEngGetCharWidth(GdiFont font, UINT firstChar, UINT lastChar,
+                         LPINT buffer)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetCharWidth(font, firstChar, lastChar, buffer);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetTextExtentExPoint
+ */
+BOOL WineEngGetTextExtentExPoint(GdiFont font, LPCWSTR wstr, INT count,
+                                 INT max_ext, LPINT pnfit, LPINT dxs,
+                                 LPSIZE size)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetTextExtentExPoint(font, wstr, count, max_ext, pnfit, dxs, size);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetTextExtentPoint
+ */
+BOOL WineEngGetTextExtentPoint(GdiFont font, LPCWSTR wstr, INT count,
+                               LPSIZE size)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetTextExtentPoint(font, wstr, count, size);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetTextExtentPointI
+ */
+BOOL WineEngGetTextExtentPointI(GdiFont font, LPWORD pgi, INT count,
+                                LPSIZE size)
+{
+    BOOL ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetTextExtentPointI(font, pgi, count, size);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
+/*************************************************************
+ * WineEngGetFontData
+ */
+DWORD WineEngGetFontData(GdiFont font, DWORD table, DWORD offset, LPVOID buf,
+                         DWORD cbData)
+{
+    DWORD ret;
+
+    EnterCriticalSection(&freetype_cs);
+    ret = freetype_GetFontData(font, table, offset, buf, cbData);
+    LeaveCriticalSection(&freetype_cs);
+    return ret;
+}
+
 #else /* HAVE_FREETYPE */
 
 BOOL WineEngInit(void)
@@ -3692,6 +5008,14 @@ BOOL WineEngGetTextExtentPoint(GdiFont font, LPCWSTR wstr, INT count,
     return FALSE;
 }
 
+BOOL WineEngGetTextExtentExPoint(GdiFont font, LPCWSTR wstr, INT count,
+                                 INT max_ext, LPINT pnfit, LPINT dxs,
+                                 LPSIZE size)
+{
+    WARN("Called but no FreeType support!\n");
+    return FALSE;
+}
+
 DWORD WineEngGetFontData(GdiFont font, DWORD table, DWORD offset, LPVOID buf,
                          DWORD cbData)
 {
@@ -25,6 +25,7 @@
 #include "palette.h"
 #include "pen.h"
 #include "region.h"
+#include "thread.h"
 #include "wine/debug.h"
 #include "gdi.h"
 
@@ -156,8 +157,230 @@ static HFONT create_stock_font( char const *fontName, const LOGFONTW *font, HKEY
 }
 
 
+/* Objects that don't fit or don't belong in the 16-bit GDI heap live in
+ * large_handles[].  The DCs among them have a lock of their own, so threads
+ * drawing on different DCs don't serialize on GDI_level; all other objects,
+ * including everything on the 16-bit heap, are still protected by GDI_level,
+ * which the drivers and the 16-bit entry points rely on.
+ *
+ * Slot locks are created the first time a DC lands in a slot and are never
+ * freed, so a stale large_locks[] entry is always safe to enter; the entry is
+ * checked again once the lock is held.  A DC lock may be held when taking
+ * GDI_level, never the other way around: release any other object before
+ * locking a DC.
+ *
+ * The loaded drivers still run under GDI_level (see driver.c), so drawing
+ * itself is serialized as before; the DC locks only take GDI's own DC
+ * bookkeeping (mapping modes, clipping, paths, object selection) and the
+ * font engine out from under it.  WINEGDISTATS reports the driver calls
+ * apart so the two can be told apart.  Drivers mustn't lock a DC other
+ * than the ones they are handed.
+ * lock_large_handle complains when that order is broken, and the number of DC
+ * locks each thread holds is kept in its TEB for GDI_CheckNotLock.
+ */
+#define FIRST_LARGE_HANDLE 16
+#define MAX_LARGE_HANDLES ((GDI_HEAP_SIZE >> 2) - FIRST_LARGE_HANDLE)
+static GDIOBJHDR *large_handles[MAX_LARGE_HANDLES];
+static CRITICAL_SECTION *large_locks[MAX_LARGE_HANDLES];  /* NULL: uses GDI_level */
+static CRITICAL_SECTION *slot_locks[MAX_LARGE_HANDLES];
+static BOOL use_object_locks = TRUE;
+
+/* Free large handle slots, kept in a bounded lock-free FIFO queue.  Each cell
+ * carries a sequence number telling whether it is ready to be written (seq ==
+ * pos) or read (seq == pos + 1) by the producer/consumer at position pos.
+ * Handing slots out in FIFO order keeps freed handles from being reused right
+ * away, as the old round-robin scan did. */
+#define FREE_SLOTS_SIZE 16384  /* power of 2, >= MAX_LARGE_HANDLES */
+static struct
+{
+    LONG seq;
+    LONG slot;
+} free_slots[FREE_SLOTS_SIZE];
+static LONG free_slots_head, free_slots_tail;
+
+/* lock statistics, enabled with WINEGDISTATS */
+static BOOL gdi_lock_stats;
+static LONG gdi_level_count, gdi_level_waits;
+static LONG driver_count, driver_waits;
+static LONG dc_lock_count, dc_lock_waits;
+
+static void report_lock_stats(void)
+{
+    fprintf( stderr, "GDI locks: GDI_level %ld acquired for objects, %ld contended; DC locks %ld acquired, %ld contended\n",
+             gdi_level_count, gdi_level_waits, dc_lock_count, dc_lock_waits );
+    fprintf( stderr, "GDI locks: driver calls %ld under GDI_level, %ld contended\n",
+             driver_count, driver_waits );
+}
+
+static void push_free_slot( int slot )
+{
+    LONG pos = free_slots_tail;
+
+    for (;;)
+    {
+        LONG cell = pos & (FREE_SLOTS_SIZE - 1);
+        LONG diff = (LONG)((DWORD)free_slots[cell].seq - (DWORD)pos);
+
+        if (!diff)
+        {
+            if (InterlockedCompareExchange( &free_slots_tail, (DWORD)pos + 1, pos ) == pos)
+            {
+                free_slots[cell].slot = slot;
+                InterlockedExchange( &free_slots[cell].seq, (DWORD)pos + 1 );
+                return;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* can't happen, the queue holds every slot */
+            ERR( "free slot queue full, leaking slot %d\n", slot );
+            return;
+        }
+        pos = free_slots_tail;
+    }
+}
+
+/* returns -1 when all the slots are in use */
+static int pop_free_slot(void)
+{
+    LONG pos = free_slots_head;
+
+    for (;;)
+    {
+        LONG cell = pos & (FREE_SLOTS_SIZE - 1);
+        LONG diff = (LONG)((DWORD)free_slots[cell].seq - ((DWORD)pos + 1));
+
+        if (!diff)
+        {
+            if (InterlockedCompareExchange( &free_slots_head, (DWORD)pos + 1, pos ) == pos)
+            {
+                int slot = free_slots[cell].slot;
+                InterlockedExchange( &free_slots[cell].seq, (DWORD)pos + FREE_SLOTS_SIZE );
+                return slot;
+            }
+        }
+        else if (diff < 0) return -1;
+        pos = free_slots_head;
+    }
+}
+
+static void init_free_slots(void)
+{
+    int i;
+
+    for (i = 0; i < FREE_SLOTS_SIZE; i++) free_slots[i].seq = i;
+    for (i = 0; i < MAX_LARGE_HANDLES; i++) push_free_slot( i );
+}
+
+static void enter_gdi_level_counted( LONG *count, LONG *waits )
+{
+    if (gdi_lock_stats)
+    {
+        InterlockedIncrement( count );
+        if (TryEnterCriticalSection( &GDI_level.crst ))
+        {
+            /* keep the syslevel bookkeeping right */
+            _EnterSysLevel( &GDI_level );
+            LeaveCriticalSection( &GDI_level.crst );
+            return;
+        }
+        InterlockedIncrement( waits );
+    }
+    _EnterSysLevel( &GDI_level );
+}
+
+static inline void enter_gdi_level(void)
+{
+    enter_gdi_level_counted( &gdi_level_count, &gdi_level_waits );
+}
+
+static void enter_dc_lock( CRITICAL_SECTION *cs )
+{
+    NtCurrentTeb()->gdi_dc_locks++;
+    if (gdi_lock_stats)
+    {
+        InterlockedIncrement( &dc_lock_count );
+        if (TryEnterCriticalSection( cs )) return;
+        InterlockedIncrement( &dc_lock_waits );
+    }
+    EnterCriticalSection( cs );
+}
+
+static void leave_dc_lock( CRITICAL_SECTION *cs )
+{
+    NtCurrentTeb()->gdi_dc_locks--;
+    LeaveCriticalSection( cs );
+}
+
+static inline BOOL is_dc_magic( WORD magic )
+{
+    switch(magic)
+    {
+    case DC_MAGIC:
+    case DISABLED_DC_MAGIC:
+    case META_DC_MAGIC:
+    case METAFILE_DC_MAGIC:
+    case ENHMETAFILE_DC_MAGIC:
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* index in large_handles[] of a large heap handle, -1 if out of range */
+static inline int large_handle_index( HGDIOBJ handle )
+{
+    int i = ((UINT_PTR)handle >> 2) - FIRST_LARGE_HANDLE;
+    return (i >= 0 && i < MAX_LARGE_HANDLES) ? i : -1;
+}
+
+/* the lock currently protecting a handle */
+static inline CRITICAL_SECTION *handle_lock( HGDIOBJ handle )
+{
+    int i;
+
+    if (!((UINT_PTR)handle & 2) && (i = large_handle_index( handle )) != -1 && large_locks[i])
+        return large_locks[i];
+    return &GDI_level.crst;
+}
+
+/***********************************************************************
+ *           lock_large_handle
+ *
+ * Take the lock protecting a large heap slot.  Returns the slot lock, or
+ * NULL if GDI_level was taken instead.
+ */
+static CRITICAL_SECTION *lock_large_handle( int i )
+{
+    for (;;)
+    {
+        CRITICAL_SECTION *cs = large_locks[i];
+
+        if (cs)
+        {
+            if (_ConfirmSysLevel( &GDI_level ) && cs->OwningThread != GetCurrentThreadId())
+                ERR( "locking a DC with GDI_level held, this can deadlock\n" );
+            enter_dc_lock( cs );
+            if (large_locks[i] == cs) return cs;
+            leave_dc_lock( cs );  /* the DC went away meanwhile */
+        }
+        else
+        {
+            enter_gdi_level();
+            if (!large_locks[i]) return NULL;
+            _LeaveSysLevel( &GDI_level );
+        }
+    }
+}
+
+static void unlock_large_handle( CRITICAL_SECTION *cs )
+{
+    if (cs) leave_dc_lock( cs );
+    else _LeaveSysLevel( &GDI_level );
+}
+
+
 #define TRACE_SEC(handle,text) \
-   TRACE("(%04x): " text " %ld\n", (handle), GDI_level.crst.RecursionCount)
+   TRACE("(%04x): " text " %ld\n", (handle), handle_lock(handle)->RecursionCount)
 
 
 /***********************************************************************
@@ -212,11 +435,19 @@ BOOL GDI_Init(void)
     HINSTANCE16 instance;
     HKEY hkey;
     GDIOBJHDR *ptr;
+    const char *env;
     int i;
 
-    
     create_gdi_syslevel_cs();
-    
+    init_free_slots();
+
+    if ((env = getenv("WINEGDILOCKS")) && *env == '0') use_object_locks = FALSE;
+    if (getenv("WINEGDISTATS"))
+    {
+        gdi_lock_stats = TRUE;
+        atexit( report_lock_stats );
+    }
+
     initialize_driver();
 
 
@@ -285,42 +516,49 @@ BOOL GDI_Finalize(void)
     return TRUE;
 }
 
-#define FIRST_LARGE_HANDLE 16
-#define MAX_LARGE_HANDLES ((GDI_HEAP_SIZE >> 2) - FIRST_LARGE_HANDLE)
-static GDIOBJHDR *large_handles[MAX_LARGE_HANDLES];
-static int next_large_handle;
-
 /***********************************************************************
  *           alloc_large_heap
  *
- * Allocate a GDI handle from the large heap. Helper for GDI_AllocObject
+ * Allocate a GDI handle from the large heap. Helper for GDI_AllocObject.
+ * The object is returned with its lock held.
  */
-inline static GDIOBJHDR *alloc_large_heap( WORD size, HGDIOBJ *handle )
+inline static GDIOBJHDR *alloc_large_heap( WORD size, WORD magic, HGDIOBJ *handle )
 {
-    int i;
+    CRITICAL_SECTION *cs = NULL;
     GDIOBJHDR *obj;
+    int i;
 
-    for (i = next_large_handle + 1; i < MAX_LARGE_HANDLES; i++)
-        if (!large_handles[i]) goto found;
-    for (i = 0; i <= next_large_handle; i++)
-        if (!large_handles[i]) goto found;
     *handle = 0;
-    return NULL;
+    if ((i = pop_free_slot()) == -1) return NULL;
+    if (!(obj = HeapAlloc( GetProcessHeap(), 0, size )))
+    {
+        push_free_slot( i );
+        return NULL;
+    }
 
- found:
-    if ((obj = HeapAlloc( GetProcessHeap(), 0, size )))
+    if (use_object_locks && is_dc_magic( magic ))
     {
-        large_handles[i] = obj;
-        *handle = (i + FIRST_LARGE_HANDLE) << 2;
-        next_large_handle = i;
+        /* the slot is ours until it's published, nobody else creates its lock */
+        if (!slot_locks[i] && (slot_locks[i] = HeapAlloc( GetProcessHeap(), 0, sizeof(CRITICAL_SECTION) )))
+            CRITICAL_SECTION_DEFINE( slot_locks[i] );
+        cs = slot_locks[i];
     }
+
+    if (cs)
+    {
+        enter_dc_lock( cs );
+        large_locks[i] = cs;
+    }
+    else enter_gdi_level();
+    large_handles[i] = obj;
+    *handle = (i + FIRST_LARGE_HANDLE) << 2;
     return obj;
 }
 
 static inline void* realloc_large_heap( WORD size, HGDIOBJ handle )
 {
-    int i = ((UINT_PTR)handle >> 2) - FIRST_LARGE_HANDLE;
-    if (i >= 0 && i < MAX_LARGE_HANDLES && large_handles[i])
+    int i = large_handle_index( handle );
+    if (i != -1 && large_handles[i])
     {
         large_handles[i] = HeapReAlloc( GetProcessHeap(), 0, large_handles[i], size );
         if( !large_handles[i] ) ERR( "ReAlloc failed for large handle %d\n", i );
@@ -341,7 +579,6 @@ void *GDI_AllocObject( WORD size, WORD magic, HGDIOBJ *handle )
 {
     GDIOBJHDR *obj;
 
-    _EnterSysLevel( &GDI_level );
     switch(magic)
     {
     /* allocate DCs and other large or commonly allocated objects on the larger heap */
@@ -354,10 +591,15 @@ void *GDI_AllocObject( WORD size, WORD magic, HGDIOBJ *handle )
     case ENHMETAFILE_DC_MAGIC:
     case BITMAP_MAGIC:
     case PALETTE_MAGIC:
-        if (!(obj = alloc_large_heap( size, handle ))) goto error;
+        if (!(obj = alloc_large_heap( size, magic, handle ))) goto error;
         break;
     default:
-        if (!(*handle = LOCAL_Alloc( GDI_HeapSel, LMEM_MOVEABLE, size ))) goto error;
+        enter_gdi_level();
+        if (!(*handle = LOCAL_Alloc( GDI_HeapSel, LMEM_MOVEABLE, size )))
+        {
+            _LeaveSysLevel( &GDI_level );
+            goto error;
+        }
         assert( (UINT_PTR)*handle & 2 );
         obj = (GDIOBJHDR *)LOCAL_Lock( GDI_HeapSel, *handle );
         break;
@@ -371,7 +613,6 @@ void *GDI_AllocObject( WORD size, WORD magic, HGDIOBJ *handle )
     return obj;
 
 error:
-    _LeaveSysLevel( &GDI_level );
     *handle = 0;
     return NULL;
 }
@@ -410,6 +651,7 @@ BOOL GDI_FreeObject( HGDIOBJ handle, void *ptr )
     GDIOBJHDR *object = ptr;
 
     object->wMagic = 0;  /* Mark it as invalid */
+    TRACE_SEC( handle, "leave" );
     if ((UINT_PTR)handle & 2)  /* GDI heap handle */
     {
         LOCAL_Unlock( GDI_HeapSel, handle );
@@ -417,15 +659,21 @@ BOOL GDI_FreeObject( HGDIOBJ handle, void *ptr )
     }
     else  /* large heap handle */
     {
-        int i = ((UINT_PTR)handle >> 2) - FIRST_LARGE_HANDLE;
-        if (i >= 0 && i < MAX_LARGE_HANDLES && large_handles[i])
+        int i = large_handle_index( handle );
+        if (i != -1 && large_handles[i])
         {
+            CRITICAL_SECTION *cs = large_locks[i];
+
             HeapFree( GetProcessHeap(), 0, large_handles[i] );
             large_handles[i] = NULL;
+            large_locks[i] = NULL;
+            unlock_large_handle( cs );
+            /* only hand the slot out again once its lock has been dropped */
+            push_free_slot( i );
+            return TRUE;
         }
-        else ERR( "Invalid handle %x\n", handle );
+        ERR( "Invalid handle %x\n", handle );
     }
-    TRACE_SEC( handle, "leave" );
     _LeaveSysLevel( &GDI_level );
     return TRUE;
 }
@@ -441,11 +689,11 @@ BOOL GDI_FreeObject( HGDIOBJ handle, void *ptr )
 void *GDI_GetObjPtr( HGDIOBJ handle, WORD magic )
 {
     GDIOBJHDR *ptr = NULL;
-
-    _EnterSysLevel( &GDI_level );
+    CRITICAL_SECTION *cs = NULL;
 
     if ((UINT_PTR)handle & 2)  /* GDI heap handle */
     {
+        enter_gdi_level();
         ptr = (GDIOBJHDR *)LOCAL_Lock( GDI_HeapSel, handle );
         if (ptr)
         {
@@ -460,17 +708,19 @@ void *GDI_GetObjPtr( HGDIOBJ handle, WORD magic )
     }
     else  /* large heap handle */
     {
-        int i = ((UINT_PTR)handle >> 2) - FIRST_LARGE_HANDLE;
-        if (i >= 0 && i < MAX_LARGE_HANDLES)
+        int i = large_handle_index( handle );
+        if (i != -1)
         {
+            cs = lock_large_handle( i );
             ptr = large_handles[i];
             if (ptr && (magic != MAGIC_DONTCARE) && (GDIMAGIC(ptr->wMagic) != magic)) ptr = NULL;
         }
+        else enter_gdi_level();
     }
 
     if (!ptr)
     {
-        _LeaveSysLevel( &GDI_level );
+        unlock_large_handle( cs );
         SetLastError( ERROR_INVALID_HANDLE );
         WARN( "Invalid handle %x\n", handle );
     }
@@ -486,9 +736,12 @@ void *GDI_GetObjPtr( HGDIOBJ handle, WORD magic )
  */
 void GDI_ReleaseObj( HGDIOBJ handle )
 {
+    CRITICAL_SECTION *cs = handle_lock( handle );
+
     if ((UINT_PTR)handle & 2) LOCAL_Unlock( GDI_HeapSel, handle );
     TRACE_SEC( handle, "leave" );
-    _LeaveSysLevel( &GDI_level );
+    if (cs != &GDI_level.crst) leave_dc_lock( cs );
+    else _LeaveSysLevel( &GDI_level );
 }
 
 
@@ -498,6 +751,32 @@ void GDI_ReleaseObj( HGDIOBJ handle )
 void GDI_CheckNotLock(void)
 {
     _CheckNotSysLevel( &GDI_level );
+    if (NtCurrentTeb()->gdi_dc_locks)
+    {
+        ERR( "Holding %ld DC locks\n", NtCurrentTeb()->gdi_dc_locks );
+        DbgBreakPoint();
+    }
+}
+
+
+/***********************************************************************
+ *           GDI_EnterDriver
+ *
+ * Serialize a call into a graphics driver, see driver.c.  The caller may
+ * hold DC locks, which come before GDI_level in the lock order.
+ */
+void GDI_EnterDriver(void)
+{
+    enter_gdi_level_counted( &driver_count, &driver_waits );
+}
+
+
+/***********************************************************************
+ *           GDI_LeaveDriver
+ */
+void GDI_LeaveDriver(void)
+{
+    _LeaveSysLevel( &GDI_level );
 }
 
 
@@ -19,6 +19,7 @@
 #include "wine/module.h"
 #include "task.h"
 #include "wine/hardware.h"
+#include "wine/threadpool.h"
 #include "wine/debug.h"
 
 WINE_DEFAULT_DEBUG_CHANNEL(iocomp);
@@ -29,6 +30,8 @@ extern void create_syslevel_cs(void);
 extern void create_console_cs(void);
 extern void create_profile_cs(void);
 extern void create_file_cs(void);
+extern void create_dosfs_cs(void);
+extern void DEBUG_StartTraceWriter(void);
 
 
 /***********************************************************************
@@ -49,6 +52,10 @@ static BOOL process_attach(void)
 
     /* Setup file stuff */
     create_file_cs();
+    create_dosfs_cs();
+
+    /* Start writing out the trace rings, if enabled */
+    DEBUG_StartTraceWriter();
 
     /* Setup codepage info */
     CODEPAGE_Init();
@@ -114,6 +121,7 @@ BOOL WINAPI MAIN_KernelInit( HINSTANCE hinst, DWORD reason, LPVOID reserved )
         return process_attach();
     case DLL_PROCESS_DETACH:
         WriteOutProfiles16();
+        CleanupThreadPool( reserved != NULL );
         break;
     }
     return TRUE;
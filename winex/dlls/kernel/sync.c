@@ -36,6 +36,9 @@
 
 WINE_DEFAULT_DEBUG_CHANNEL(win32);
 
+extern void SYNC_MirrorEvent( HANDLE handle, BOOL manual_reset, BOOL signaled );
+extern NTSTATUS SYNC_EventOperation( HANDLE handle, enum event_op op );
+
 /*
  * Events
  */
@@ -91,6 +94,8 @@ HANDLE WINAPI CreateEventW( SECURITY_ATTRIBUTES *sa, BOOL manual_reset,
         SetLastError(0);
         wine_server_call_err( req );
         ret = reply->handle;
+        if (ret && !len && !req->inherit)
+            SYNC_MirrorEvent( ret, manual_reset, initial_state );
     }
     SERVER_END_REQ;
     return ret;
@@ -156,15 +161,10 @@ HANDLE WINAPI OpenEventW( DWORD access, BOOL inherit, LPCWSTR name )
  */
 static BOOL EVENT_Operation( HANDLE handle, enum event_op op )
 {
-    BOOL ret;
-    SERVER_START_REQ( event_op )
-    {
-        req->handle = handle;
-        req->op     = op;
-        ret = !wine_server_call_err( req );
-    }
-    SERVER_END_REQ;
-    return ret;
+    NTSTATUS status = SYNC_EventOperation( handle, op );
+
+    if (status) SetLastError( RtlNtStatusToDosError(status) );
+    return !status;
 }
 
 
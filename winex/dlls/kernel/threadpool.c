@@ -10,6 +10,8 @@
 
 #include "config.h"
 
+#include <stdio.h>
+
 #include "windef.h"
 #include "winbase.h"
 #include "winternl.h"
@@ -19,82 +21,574 @@
 WINE_DEFAULT_DEBUG_CHANNEL(threadpool);
 
 
+/* Layout of the pool:
+
+   Work items queued from outside the pool go to a shared injection queue.
+   Each worker owns a deque; it moves items from the injection queue into
+   its deque in batches, pushes items queued from its own callbacks onto
+   the bottom, and pops from the bottom. An idle worker steals from the
+   top of the other workers' deques before going to sleep.
+
+   The pool starts at one worker per processor and grows whenever every
+   worker is busy and some of them are stuck in WT_EXECUTELONGFUNCTION or
+   otherwise long running callbacks, so short items keep flowing. Workers
+   that stay idle for WORKER_IDLE_TIMEOUT exit again, down to that
+   minimum.
+
+   Queuing is what normally triggers growth, so a gate thread keeps
+   checking every GATE_INTERVAL for as long as items are waiting and no
+   worker is idle. Items queued behind blocked workers (possibly waiting on
+   those very items) get a thread even if nothing else is ever queued.
+
+   I/O completions for BindIoCompletionCallback are received by a single
+   dispatcher thread waiting on the completion port and run on the pool as
+   ordinary work items. */
+
+#define MAX_WORKER_THREADS   128
+#define WORKER_IDLE_TIMEOUT  20000   /* ms before a surplus idle worker exits */
+#define LONG_CALLBACK_TIME   50      /* ms after which a callback counts as blocked */
+#define GATE_INTERVAL        LONG_CALLBACK_TIME  /* ms between checks of a stalled pool */
+#define INJECT_BATCH         8       /* items taken from the injection queue at once */
+#define WORK_ITEM_CHUNK      64      /* work items allocated per HeapAlloc */
+
+
 /* Why this value? the only items that post to the completion port are either
-   tasks that we add, or ones bound with BindIoCompletionCallback. There, we'll
-   pass in the function to be called as the completion key. Since no user
-   function will be our worker thread main, this gives a safe identifier */
-#define MAGIC_COMP_KEY ((ULONG_PTR)&WorkerThreadMain)
+   the shutdown request that we post, or ones bound with
+   BindIoCompletionCallback. There, we'll pass in the function to be called as
+   the completion key. Since no user function will be our I/O thread main,
+   this gives a safe identifier */
+#define MAGIC_COMP_KEY ((ULONG_PTR)&IoThreadMain)
 
 
-typedef enum {WI_SHUTDOWN, WI_CALLBACK} WorkItemEnum_t;
+typedef enum {WI_CALLBACK, WI_IOCOMPLETION} WorkItemEnum_t;
 
-typedef struct {
+typedef struct _WorkItem_t {
+   SLIST_ENTRY FreeEntry;          /* link in the free list; must be first */
+   struct _WorkItem_t *Prev;       /* towards the top of a deque */
+   struct _WorkItem_t *Next;       /* towards the bottom of a deque */
    WorkItemEnum_t Type;
+   ULONG Flags;
    union {
       struct {
          LPTHREAD_START_ROUTINE Function;
          PVOID Context;
       } Callback;
       struct {
-         HANDLE hEvent;
-      } Shutdown;
+         LPOVERLAPPED_COMPLETION_ROUTINE Function;
+         DWORD Error;
+         DWORD NumBytes;
+         LPOVERLAPPED pOverlapped;
+      } IoCompletion;
    };
 } WorkItem_t;
 
+/* Work item storage is never returned to the heap until CleanupThreadPool */
+typedef struct _WorkItemChunk_t {
+   struct _WorkItemChunk_t *Next;
+   WorkItem_t Items[WORK_ITEM_CHUNK];
+} WorkItemChunk_t;
+
+typedef struct {
+   CRITICAL_SECTION Lock;
+   WorkItem_t *Top;                /* oldest item; stolen from here */
+   WorkItem_t *Bottom;             /* newest item */
+   volatile LONG Count;
+} WorkDeque_t;
+
+/* Worker slots are never freed, so thieves can look at any of them */
+typedef struct {
+   WorkDeque_t Deque;
+   HANDLE hThread;
+   volatile LONG Active;
+   volatile DWORD ItemStart;       /* tick count the current item started, 0 if none */
+   volatile LONG ItemIsLong;       /* current item was queued with WT_EXECUTELONGFUNCTION */
+} Worker_t;
+
+
+static volatile LONG PoolState = 0;  /* 0 = not started, 1 = starting, 2 = running */
+static CRITICAL_SECTION PoolLock;    /* worker slots and work item chunks */
+static WorkDeque_t InjectQueue;
+static Worker_t Workers[MAX_WORKER_THREADS];
+static DWORD NumWorkerSlots = 0;     /* slots ever used */
+static volatile LONG NumWorkerThreads = 0;
+static volatile LONG NumIdleWorkers = 0;
+static DWORD MinWorkerThreads = 0;
+static HANDLE hWakeSemaphore = 0;
+static DWORD WorkerTlsIndex = TLS_OUT_OF_INDEXES;
+static volatile LONG ShuttingDown = 0;
+static HANDLE hShutdownEvent = 0;
+static SLIST_HEADER FreeWorkItems;
+static WorkItemChunk_t *WorkItemChunks = NULL;
+static volatile DWORD LastGrowCheck = 0;
+static HANDLE hGateEvent = 0;        /* auto reset; wakes the gate thread */
+static HANDLE hGateThread = 0;
+static volatile LONG GateWatching = 0;
+
 static HANDLE hCompPort = INVALID_HANDLE_VALUE;
-static DWORD  NumWorkerThreads = 0;
+static HANDLE hIoThread = 0;
 
 
-static DWORD WINAPI WorkerThreadMain (PVOID pData)
+static DWORD WINAPI IoThreadMain (PVOID pData);
+static DWORD WINAPI WorkerThreadMain (PVOID pData);
+static DWORD WINAPI GateThreadMain (PVOID pData);
+
+
+/******************************************************************************
+ * Work item storage
+ */
+static WorkItem_t *AllocWorkItem (void)
 {
-   while (TRUE)
+   WorkItem_t *pWorkItem;
+   WorkItemChunk_t *pChunk;
+   DWORD i;
+
+   pWorkItem = (WorkItem_t *)InterlockedPopEntrySList (&FreeWorkItems);
+   if (pWorkItem)
+      return pWorkItem;
+
+   pChunk = HeapAlloc (GetProcessHeap (), 0, sizeof (WorkItemChunk_t));
+   if (!pChunk)
+      return NULL;
+
+   EnterCriticalSection (&PoolLock);
+   pChunk->Next = WorkItemChunks;
+   WorkItemChunks = pChunk;
+   LeaveCriticalSection (&PoolLock);
+
+   /* Keep the first one, recycle the rest */
+   for (i = 1; i < WORK_ITEM_CHUNK; i++)
+      InterlockedPushEntrySList (&FreeWorkItems, &pChunk->Items[i].FreeEntry);
+
+   return &pChunk->Items[0];
+}
+
+static void FreeWorkItem (WorkItem_t *pWorkItem)
+{
+   InterlockedPushEntrySList (&FreeWorkItems, &pWorkItem->FreeEntry);
+}
+
+
+/******************************************************************************
+ * Deque operations; all take the deque's lock
+ */
+static void DequePushBottom (WorkDeque_t *pDeque, WorkItem_t *pWorkItem)
+{
+   EnterCriticalSection (&pDeque->Lock);
+   pWorkItem->Next = NULL;
+   pWorkItem->Prev = pDeque->Bottom;
+   if (pDeque->Bottom)
+      pDeque->Bottom->Next = pWorkItem;
+   else
+      pDeque->Top = pWorkItem;
+   pDeque->Bottom = pWorkItem;
+   pDeque->Count++;
+   LeaveCriticalSection (&pDeque->Lock);
+}
+
+static WorkItem_t *DequePopBottom (WorkDeque_t *pDeque)
+{
+   WorkItem_t *pWorkItem;
+
+   if (!pDeque->Count)
+      return NULL;
+
+   EnterCriticalSection (&pDeque->Lock);
+   pWorkItem = pDeque->Bottom;
+   if (pWorkItem)
    {
-      DWORD NumBytes = 0;
-      ULONG_PTR CompletionKey = 0;
-      LPOVERLAPPED pOverlapped = NULL;
-      BOOL Ret;
-      WorkItem_t *pWorkItem;
+      pDeque->Bottom = pWorkItem->Prev;
+      if (pDeque->Bottom)
+         pDeque->Bottom->Next = NULL;
+      else
+         pDeque->Top = NULL;
+      pDeque->Count--;
+   }
+   LeaveCriticalSection (&pDeque->Lock);
 
-      Ret = GetQueuedCompletionStatus (hCompPort, &NumBytes, &CompletionKey,
-                                       &pOverlapped, INFINITE);
+   return pWorkItem;
+}
+
+/* Detach up to <Max> items from the top of a deque, oldest first */
+static WorkItem_t *DequeTakeTop (WorkDeque_t *pDeque, LONG Max, LONG *pTaken)
+{
+   WorkItem_t *pFirst, *pLast;
+   LONG Taken = 0;
+
+   *pTaken = 0;
+   if (!pDeque->Count)
+      return NULL;
+
+   EnterCriticalSection (&pDeque->Lock);
+   pFirst = pLast = pDeque->Top;
+   if (pFirst)
+   {
+      for (Taken = 1; (Taken < Max) && pLast->Next; Taken++)
+         pLast = pLast->Next;
+
+      pDeque->Top = pLast->Next;
+      if (pDeque->Top)
+         pDeque->Top->Prev = NULL;
+      else
+         pDeque->Bottom = NULL;
+      pDeque->Count -= Taken;
+      pLast->Next = NULL;
+   }
+   LeaveCriticalSection (&pDeque->Lock);
+
+   *pTaken = Taken;
+   return pFirst;
+}
+
+
+/******************************************************************************
+ * Find the next item for worker <pSelf>: its own deque first, then a batch
+ * from the injection queue, then a single item stolen from another worker
+ */
+static WorkItem_t *FindWork (Worker_t *pSelf)
+{
+   WorkItem_t *pWorkItem, *pRest;
+   LONG Taken;
+   DWORD i;
 
-      /* User callback from BindIoCompletionCallback */
-      if (CompletionKey != MAGIC_COMP_KEY)
+   if ((pWorkItem = DequePopBottom (&pSelf->Deque)))
+      return pWorkItem;
+
+   if ((pWorkItem = DequeTakeTop (&InjectQueue, INJECT_BATCH, &Taken)))
+   {
+      /* Keep the oldest, the rest go to our own deque in queued order */
+      for (pRest = pWorkItem->Next; pRest; )
       {
-         LPOVERLAPPED_COMPLETION_ROUTINE pFunc =
-            (LPOVERLAPPED_COMPLETION_ROUTINE)CompletionKey;
+         WorkItem_t *pNext = pRest->Next;
+         DequePushBottom (&pSelf->Deque, pRest);
+         pRest = pNext;
+      }
 
-         TRACE ("Doing I/O completion callback with (%lu, %lu, %p)\n",
-                (Ret ? 0 : GetLastError ()), NumBytes, pOverlapped);
+      /* Let others steal from the batch if they're sleeping */
+      if ((Taken > 1) && NumIdleWorkers)
+         ReleaseSemaphore (hWakeSemaphore, 1, NULL);
+      return pWorkItem;
+   }
+
+   for (i = 0; i < NumWorkerSlots; i++)
+   {
+      if (&Workers[i] == pSelf)
+         continue;
+      if ((pWorkItem = DequeTakeTop (&Workers[i].Deque, 1, &Taken)))
+         return pWorkItem;
+   }
+
+   return NULL;
+}
+
+
+/******************************************************************************
+ * Run one work item on the current worker
+ */
+static void RunWorkItem (Worker_t *pSelf, WorkItem_t *pWorkItem)
+{
+   pSelf->ItemIsLong = (pWorkItem->Flags & WT_EXECUTELONGFUNCTION) ? 1 : 0;
+   pSelf->ItemStart = GetTickCount () | 1;
+
+   switch (pWorkItem->Type)
+   {
+      case WI_CALLBACK:
+         TRACE ("Handling queued work item callback with (%p)\n",
+                pWorkItem->Callback.Context);
 
-         /* FIXME - check that GetLastError () is the correct value to
-            be passing here */
-         if (Ret)
-            pFunc (0, NumBytes, pOverlapped);
-         else
-            pFunc (GetLastError (), NumBytes, pOverlapped);
+         /* FIXME - should we be doing anything with return value? */
+         pWorkItem->Callback.Function (pWorkItem->Callback.Context);
+         TRACE ("Done callback\n");
+         break;
+
+      case WI_IOCOMPLETION:
+         TRACE ("Doing I/O completion callback with (%lu, %lu, %p)\n",
+                pWorkItem->IoCompletion.Error, pWorkItem->IoCompletion.NumBytes,
+                pWorkItem->IoCompletion.pOverlapped);
 
+         pWorkItem->IoCompletion.Function (pWorkItem->IoCompletion.Error,
+                                           pWorkItem->IoCompletion.NumBytes,
+                                           pWorkItem->IoCompletion.pOverlapped);
          TRACE ("Done callback\n");
+         break;
+   }
+
+   pSelf->ItemStart = 0;
+   pSelf->ItemIsLong = 0;
+
+   FreeWorkItem (pWorkItem);
+}
+
+
+static DWORD WINAPI WorkerThreadMain (PVOID pData)
+{
+   Worker_t *pSelf = (Worker_t *)pData;
+
+   TlsSetValue (WorkerTlsIndex, pSelf);
+
+   while (!ShuttingDown)
+   {
+      WorkItem_t *pWorkItem = FindWork (pSelf);
+      DWORD Ret;
+
+      if (pWorkItem)
+      {
+         RunWorkItem (pSelf, pWorkItem);
+         continue;
+      }
+
+      /* Announce we're idle, then look again so an item queued in between
+         isn't missed; the queuer wakes us if it sees us idle */
+      InterlockedIncrement (&NumIdleWorkers);
+      if ((pWorkItem = FindWork (pSelf)))
+      {
+         InterlockedDecrement (&NumIdleWorkers);
+         RunWorkItem (pSelf, pWorkItem);
          continue;
       }
 
-      pWorkItem = (WorkItem_t *)pOverlapped;
-      switch (pWorkItem->Type)
+      Ret = WaitForSingleObject (hWakeSemaphore, WORKER_IDLE_TIMEOUT);
+      InterlockedDecrement (&NumIdleWorkers);
+
+      if ((Ret == WAIT_TIMEOUT) && !pSelf->Deque.Count && !InjectQueue.Count)
       {
-         case WI_SHUTDOWN:
-            SetEvent (pWorkItem->Shutdown.hEvent);
+         BOOL Exit = FALSE;
+
+         EnterCriticalSection (&PoolLock);
+         if (!ShuttingDown && (NumWorkerThreads > MinWorkerThreads))
+         {
+            pSelf->Active = 0;
+            InterlockedDecrement (&NumWorkerThreads);
+            CloseHandle (pSelf->hThread);
+            pSelf->hThread = 0;
+            Exit = TRUE;
+         }
+         LeaveCriticalSection (&PoolLock);
+
+         if (Exit)
+         {
+            TRACE ("Idle worker %p exiting, %ld left\n", pSelf, NumWorkerThreads);
             return 0;
-         case WI_CALLBACK:
-            TRACE ("Handling queued work item callback with (%p)\n",
-                   pWorkItem->Callback.Context);
+         }
+      }
+   }
+
+   /* Let CleanupThreadPool know once the last worker is out */
+   if (!InterlockedDecrement (&NumWorkerThreads))
+      SetEvent (hShutdownEvent);
+
+   return 0;
+}
+
+
+/******************************************************************************
+ * Start another worker thread if there's room. Must hold PoolLock
+ */
+static BOOL AddWorkerThread (void)
+{
+   Worker_t *pWorker = NULL;
+   DWORD i;
+
+   for (i = 0; i < NumWorkerSlots; i++)
+   {
+      if (!Workers[i].Active && !Workers[i].hThread)
+      {
+         pWorker = &Workers[i];
+         break;
+      }
+   }
+
+   if (!pWorker)
+   {
+      if (NumWorkerSlots == MAX_WORKER_THREADS)
+         return FALSE;
+
+      pWorker = &Workers[NumWorkerSlots];
+      CRITICAL_SECTION_DEFINE (&pWorker->Deque.Lock);
+      NumWorkerSlots++;
+   }
 
-            /* FIXME - should we be doing anything with return value? */
-            pWorkItem->Callback.Function (pWorkItem->Callback.Context);
-            TRACE ("Done callback\n");
+   pWorker->Active = 1;
+   pWorker->ItemStart = 0;
+   pWorker->ItemIsLong = 0;
+   pWorker->hThread = CreateThread (NULL, 0, WorkerThreadMain, pWorker, 0, NULL);
+   if (pWorker->hThread == (HANDLE)NULL)
+   {
+      ERR ("Failed to create worker thread!\n");
+      pWorker->Active = 0;
+      return FALSE;
+   }
+
+   InterlockedIncrement (&NumWorkerThreads);
+   TRACE ("Started worker %p, %ld running\n", pWorker, NumWorkerThreads);
+   return TRUE;
+}
+
+
+/******************************************************************************
+ * Start another worker if the busy ones are stuck in long callbacks. Must
+ * hold PoolLock
+ */
+static void GrowPoolIfBlocked (DWORD Now)
+{
+   DWORD i;
+   LONG Blocked = 0;
+
+   for (i = 0; i < NumWorkerSlots; i++)
+   {
+      DWORD Start = Workers[i].ItemStart;
+
+      if (Workers[i].Active && Start &&
+          (Workers[i].ItemIsLong || (Now - Start >= LONG_CALLBACK_TIME)))
+         Blocked++;
+   }
+
+   /* Keep MinWorkerThreads workers available for short items */
+   if (!ShuttingDown && (NumWorkerThreads - Blocked < (LONG)MinWorkerThreads))
+      AddWorkerThread ();
+}
+
+
+/******************************************************************************
+ * Are there items queued that no worker has picked up yet?
+ */
+static BOOL IsWorkPending (void)
+{
+   DWORD i;
+
+   if (InjectQueue.Count)
+      return TRUE;
+   for (i = 0; i < NumWorkerSlots; i++)
+   {
+      if (Workers[i].Deque.Count)
+         return TRUE;
+   }
+   return FALSE;
+}
+
+
+/******************************************************************************
+ * Called after queuing work: wake an idle worker, or decide whether the
+ * pool needs to grow because the busy workers are stuck in long callbacks
+ */
+static void WakeOrGrowPool (void)
+{
+   DWORD Now;
+
+   if (NumIdleWorkers)
+   {
+      ReleaseSemaphore (hWakeSemaphore, 1, NULL);
+      return;
+   }
+
+   /* Every worker is busy; have the gate watch the pool in case they
+      stay that way and nothing else gets queued */
+   if (!GateWatching && !InterlockedExchange ((PLONG)&GateWatching, 1))
+      SetEvent (hGateEvent);
+
+   /* Only look at the workers once per tick, since this happens for every
+      item when lots of short items are queued */
+   Now = GetTickCount ();
+   if ((NumWorkerThreads >= MinWorkerThreads) && (Now == LastGrowCheck))
+      return;
+   LastGrowCheck = Now;
+
+   EnterCriticalSection (&PoolLock);
+   GrowPoolIfBlocked (Now);
+   LeaveCriticalSection (&PoolLock);
+}
+
+
+/******************************************************************************
+ * The gate thread: while items are waiting and no worker is idle, keep
+ * growing the pool past workers that are blocked
+ */
+static DWORD WINAPI GateThreadMain (PVOID pData)
+{
+   while (!ShuttingDown)
+   {
+      WaitForSingleObject (hGateEvent, INFINITE);
+
+      while (!ShuttingDown)
+      {
+         Sleep (GATE_INTERVAL);
+
+         if (!NumIdleWorkers && IsWorkPending ())
+         {
+            EnterCriticalSection (&PoolLock);
+            GrowPoolIfBlocked (GetTickCount ());
+            LeaveCriticalSection (&PoolLock);
+            continue;
+         }
+
+         /* Stop watching, unless an item slipped in meanwhile and its
+            queuer didn't see us stop */
+         GateWatching = 0;
+         if (NumIdleWorkers || !IsWorkPending () ||
+             InterlockedExchange ((PLONG)&GateWatching, 1))
             break;
       }
+   }
+
+   return 0;
+}
+
+
+/******************************************************************************
+ * Queue a work item on the pool
+ */
+static BOOL PostWorkItem (WorkItem_t *pWorkItem)
+{
+   Worker_t *pSelf = (Worker_t *)TlsGetValue (WorkerTlsIndex);
+
+   /* Items queued from a callback stay local, where they're cheapest to
+      get to and can still be stolen */
+   if (pSelf)
+      DequePushBottom (&pSelf->Deque, pWorkItem);
+   else
+      DequePushBottom (&InjectQueue, pWorkItem);
+
+   WakeOrGrowPool ();
+   return TRUE;
+}
 
-      HeapFree (GetProcessHeap (), 0, pWorkItem);
+
+/******************************************************************************
+ * The I/O dispatcher: receives completions for handles bound with
+ * BindIoCompletionCallback and hands them to the pool
+ */
+static DWORD WINAPI IoThreadMain (PVOID pData)
+{
+   while (TRUE)
+   {
+      DWORD NumBytes = 0;
+      ULONG_PTR CompletionKey = 0;
+      LPOVERLAPPED pOverlapped = NULL;
+      BOOL Ret;
+      WorkItem_t *pWorkItem;
+
+      Ret = GetQueuedCompletionStatus (hCompPort, &NumBytes, &CompletionKey,
+                                       &pOverlapped, INFINITE);
+
+      /* Only CleanupThreadPool posts with our own key */
+      if (CompletionKey == MAGIC_COMP_KEY)
+         return 0;
+
+      pWorkItem = AllocWorkItem ();
+      if (!pWorkItem)
+      {
+         ERR ("Out of memory, dropping I/O completion for %p!\n", pOverlapped);
+         continue;
+      }
+
+      /* FIXME - check that GetLastError () is the correct value to
+         be passing here */
+      pWorkItem->Type = WI_IOCOMPLETION;
+      pWorkItem->Flags = 0;
+      pWorkItem->IoCompletion.Function = (LPOVERLAPPED_COMPLETION_ROUTINE)CompletionKey;
+      pWorkItem->IoCompletion.Error = Ret ? 0 : GetLastError ();
+      pWorkItem->IoCompletion.NumBytes = NumBytes;
+      pWorkItem->IoCompletion.pOverlapped = pOverlapped;
+      PostWorkItem (pWorkItem);
    }
 
    return 0;
@@ -108,75 +602,140 @@ static DWORD WINAPI WorkerThreadMain (PVOID pData)
 static BOOL InitializeThreadPool ()
 {
    SYSTEM_INFO si;
-   HANDLE hThread;
-   DWORD i;
 
-   if (hCompPort != INVALID_HANDLE_VALUE)
+   if (PoolState == 2)
       return TRUE;
 
-   /* FIXME - needs to be dynamic based on amount of requests */
+   /* Only one thread sets things up, anyone else waits for it */
+   if (InterlockedCompareExchange ((PLONG)&PoolState, 1, 0) != 0)
+   {
+      while (PoolState == 1)
+         Sleep (0);
+      return (PoolState == 2);
+   }
+
    GetSystemInfo (&si);
-   NumWorkerThreads = si.dwNumberOfProcessors;
-   hCompPort = CreateIoCompletionPort (INVALID_HANDLE_VALUE, (HANDLE)0,
-                                       MAGIC_COMP_KEY,
-                                       NumWorkerThreads);
-   if (hCompPort == (HANDLE)0)
+   MinWorkerThreads = si.dwNumberOfProcessors ? si.dwNumberOfProcessors : 1;
+
+   CRITICAL_SECTION_DEFINE (&PoolLock);
+   CRITICAL_SECTION_DEFINE (&InjectQueue.Lock);
+   InitializeSListHead (&FreeWorkItems);
+   ShuttingDown = 0;
+
+   WorkerTlsIndex = TlsAlloc ();
+   hWakeSemaphore = CreateSemaphoreA (NULL, 0, 0x7fffffff, NULL);
+   hGateEvent = CreateEventA (NULL, FALSE, FALSE, NULL);
+   if ((WorkerTlsIndex == TLS_OUT_OF_INDEXES) || !hWakeSemaphore || !hGateEvent)
    {
-      ERR ("Failed to create completion port!\n");
+      ERR ("Failed to set up the thread pool!\n");
+      PoolState = 0;
       return FALSE;
    }
 
-   /* FIXME - need threads to handle ASYNC I/O requests with callbacks */
-   for (i = 0; i < NumWorkerThreads; i++)
+   hGateThread = CreateThread (NULL, 0, GateThreadMain, NULL, 0, NULL);
+   if (!hGateThread)
+      ERR ("Failed to create the gate thread, stalled items wait for the next one queued\n");
+
+   /* Workers are started on demand by WakeOrGrowPool */
+   PoolState = 2;
+   return TRUE;
+}
+
+
+/******************************************************************************
+ * Helper function to create the completion port and its dispatcher thread
+ * the first time a handle is bound
+ */
+static BOOL InitializeIoCompletion ()
+{
+   HANDLE hPort;
+
+   if (hIoThread)
+      return TRUE;
+
+   EnterCriticalSection (&PoolLock);
+
+   if (!hIoThread)
    {
-      hThread = CreateThread (NULL, 0, WorkerThreadMain, NULL, 0, NULL);
-      if (hThread == (HANDLE)NULL)
+      hPort = CreateIoCompletionPort (INVALID_HANDLE_VALUE, (HANDLE)0,
+                                      MAGIC_COMP_KEY, 1);
+      if (hPort == (HANDLE)0)
+         ERR ("Failed to create completion port!\n");
+      else
       {
-         ERR ("Failed to create worker thread!\n");
-         return FALSE;
+         hCompPort = hPort;
+         hIoThread = CreateThread (NULL, 0, IoThreadMain, NULL, 0, NULL);
+         if (hIoThread == (HANDLE)NULL)
+         {
+            ERR ("Failed to create I/O completion thread!\n");
+            CloseHandle (hCompPort);
+            hCompPort = INVALID_HANDLE_VALUE;
+         }
       }
-      CloseHandle (hThread);
    }
 
-   return TRUE;
+   LeaveCriticalSection (&PoolLock);
+
+   return (hIoThread != 0);
 }
 
 
 /******************************************************************************
- * Helper function to terminate any running threads in the thread pool
- * FIXME - call from somewhere
+ * Helper function to terminate any running threads in the thread pool.
+ * Called on process detach; workers still inside a callback after a short
+ * grace period are left alone. When the whole process is terminating, the
+ * threads are already gone and there's nothing to wait for.
  */
-void CleanupThreadPool ()
+void CleanupThreadPool (BOOL bProcessTerminating)
 {
-   DWORD i;
-   HANDLE hEvent;
+   WorkItemChunk_t *pChunk;
+   DWORD Ret = WAIT_OBJECT_0;
 
-   if (hCompPort == INVALID_HANDLE_VALUE)
+   if ((PoolState != 2) || bProcessTerminating)
       return;
 
-   hEvent = CreateEventA (NULL, TRUE, FALSE, NULL);
-   if (!hEvent)
+   /* Workers acknowledge through the event rather than by exiting, since
+      thread exit needs the loader lock our caller may be holding */
+   hShutdownEvent = CreateEventA (NULL, TRUE, FALSE, NULL);
+   if (!hShutdownEvent)
       return;
 
-   for (i = 0; i < NumWorkerThreads; i++)
+   if (hIoThread)
    {
-      WorkItem_t *pWorkItem =
-         (WorkItem_t *)HeapAlloc (GetProcessHeap (), 0, sizeof (WorkItem_t));
-      if (pWorkItem)
-      {
-         pWorkItem->Type = WI_SHUTDOWN;
-         pWorkItem->Shutdown.hEvent = hEvent;
-         ResetEvent (hEvent);
-         PostQueuedCompletionStatus (hCompPort, 0, MAGIC_COMP_KEY,
-                                     (LPOVERLAPPED)pWorkItem);
-
-         if (WaitForSingleObject (hEvent, 1000) != WAIT_OBJECT_0)
-            ERR ("Worker thread not shutting down properly!\n");
-      }
+      PostQueuedCompletionStatus (hCompPort, 0, MAGIC_COMP_KEY, NULL);
+      if (WaitForSingleObject (hIoThread, 1000) != WAIT_OBJECT_0)
+         ERR ("I/O completion thread not shutting down properly!\n");
    }
 
-   CloseHandle (hEvent);
-   CloseHandle (hCompPort);
+   EnterCriticalSection (&PoolLock);
+   ShuttingDown = 1;
+   SetEvent (hGateEvent);
+   if (NumWorkerThreads)
+   {
+      ReleaseSemaphore (hWakeSemaphore, NumWorkerThreads, NULL);
+      Ret = WAIT_TIMEOUT;
+   }
+   LeaveCriticalSection (&PoolLock);
+
+   if (Ret != WAIT_OBJECT_0)
+      Ret = WaitForSingleObject (hShutdownEvent, 1000);
+
+   if (InjectQueue.Count)
+      WARN ("Discarding %ld queued work items\n", InjectQueue.Count);
+
+   /* Work item storage can only go if nothing might still reference it */
+   if (Ret != WAIT_OBJECT_0)
+   {
+      ERR ("%ld worker threads not shutting down properly!\n", NumWorkerThreads);
+      return;
+   }
+
+   while ((pChunk = WorkItemChunks))
+   {
+      WorkItemChunks = pChunk->Next;
+      HeapFree (GetProcessHeap (), 0, pChunk);
+   }
+   InitializeSListHead (&FreeWorkItems);
 }
 
 
@@ -204,7 +763,7 @@ BOOL WINAPI QueueUserWorkItem (LPTHREAD_START_ROUTINE Function,
    if (!InitializeThreadPool ())
       return FALSE;
 
-   pWorkItem = HeapAlloc (GetProcessHeap (), 0, sizeof (WorkItem_t));
+   pWorkItem = AllocWorkItem ();
    if (!pWorkItem)
    {
       ERR ("Out of memory!\n");
@@ -212,18 +771,11 @@ BOOL WINAPI QueueUserWorkItem (LPTHREAD_START_ROUTINE Function,
    }
 
    pWorkItem->Type = WI_CALLBACK;
+   pWorkItem->Flags = Flags;
    pWorkItem->Callback.Function = Function;
    pWorkItem->Callback.Context = Context;
 
-   if (!PostQueuedCompletionStatus (hCompPort, 0, MAGIC_COMP_KEY,
-                                    (LPOVERLAPPED)pWorkItem))
-   {
-      ERR ("Failed to post work item!\n");
-      HeapFree (GetProcessHeap (), 0, pWorkItem);
-      return FALSE;
-   }
-
-   return TRUE;
+   return PostWorkItem (pWorkItem);
 }
 
 
@@ -246,7 +798,7 @@ BOOL WINAPI BindIoCompletionCallback (HANDLE FileHandle,
       function, and then crashes when used. Since we aim for
       crash-for-crash compatibility, we do no further checking here... */
 
-   if (!InitializeThreadPool ())
+   if (!InitializeThreadPool () || !InitializeIoCompletion ())
       return FALSE;
 
    /* We're going to use the Function as the completion key */
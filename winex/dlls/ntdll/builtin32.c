@@ -32,6 +32,7 @@ WINE_DEFAULT_DEBUG_CHANNEL(module);
 WINE_DECLARE_DEBUG_CHANNEL(relay);
 
 extern void RELAY_SetupDLL( const char *module );
+extern BOOL RELAY_ProfileEnabled(void);
 
 static HMODULE main_module;
 
@@ -116,7 +117,7 @@ static void load_library( void *base, const char *filename )
     wm->refCount++;  /* we don't support freeing builtin dlls (FIXME)*/
 
     /* setup relay debugging entry points */
-    if (TRACE_ON(relay)) RELAY_SetupDLL( (void *)module );
+    if (TRACE_ON(relay) || RELAY_ProfileEnabled()) RELAY_SetupDLL( (void *)module );
 }
 
 
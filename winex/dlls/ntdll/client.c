@@ -33,6 +33,9 @@
 #ifdef HAVE_SYS_STAT_H
 # include <sys/stat.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
 #include <sys/uio.h>
 #include <unistd.h>
 #include <stdarg.h>
@@ -50,7 +53,9 @@
 #include "winerror.h"
 #include "options.h"
 #include "wine/debug.h"
+#include "wine/library.h"
 #include "wine/profile.h"
+#include "ntdll_misc.h"
 
 WINE_DEFAULT_DEBUG_CHANNEL(client);
 
@@ -131,11 +136,88 @@ static void setup_shared_memory_debugging(void);
 static BOOL shared_memory_allowed_calls[ REQ_NB_REQUESTS ] = {FALSE};
 static BOOL use_scheduler = FALSE;
 
-/* #define COLLECT_SHM_STATS */
-#if defined( COLLECT_SHM_STATS )
-static DWORD fast_server_call_stats[ REQ_NB_REQUESTS ] = {0};
-static DWORD slow_server_call_stats[ REQ_NB_REQUESTS ] = {0};
-#endif
+/* Server call profiler.  This is enabled by setting WINESERVERPROF (or the 'ServerCallProfile'
+ * value in the [Wineserver] config section) to the name of a file to write the profile to.  Each
+ * thread keeps its own per-request counters, so recording a call takes no locks.  The profile is
+ * rewritten every WINESERVERPROF_INTERVAL ('ServerCallProfileInterval') seconds by whichever
+ * thread notices the interval has passed, and once more at exit.  The file is tab separated with
+ * one line per thread, request number and path ('shm' or 'socket').  Request numbers are the
+ * REQ_* values of the server protocol version given in the header. */
+#define SERVER_PROF_SOCKET           0  /* sent over the request socket */
+#define SERVER_PROF_SHM              1  /* handled by the shared memory server */
+#define SERVER_PROF_FALLBACK         2  /* the shared memory server punted it to the socket */
+#define SERVER_PROF_CACHED           3  /* answered from a client side snapshot */
+#define SERVER_PROF_NB_PATHS         4
+#define SERVER_PROF_DEFAULT_INTERVAL 5
+
+static const char * const server_prof_path_names[SERVER_PROF_NB_PATHS] =
+{
+    "socket", "shm", "fallback", "cached"
+};
+
+typedef struct
+{
+    ULONG       count;
+    ULONG       max;    /* microseconds */
+    ULONGLONG   total;  /* microseconds */
+} server_call_prof;
+
+typedef struct server_thread_prof
+{
+    struct server_thread_prof *next;
+    DWORD                      tid;
+    server_call_prof           calls[REQ_NB_REQUESTS][SERVER_PROF_NB_PATHS];
+} server_thread_prof;
+
+static char *server_prof_file;
+static ULONGLONG server_prof_interval = SERVER_PROF_DEFAULT_INTERVAL * 1000000;
+static ULONGLONG server_prof_start;
+static ULONGLONG server_prof_next_dump;
+static LONG server_prof_dumping;
+static server_thread_prof *server_prof_threads;
+
+/* Client side snapshots of read-mostly server state.  Some requests are made over and over
+ * again by apps (IsDebuggerPresent(), GetHandleInformation(), etc) and almost always return
+ * the same thing.  The replies to these are kept for a short while and handed back without
+ * leaving the process.  Anything this process does that could change the answer drops the
+ * snapshot right away; changes made by other processes are picked up once it expires.  This
+ * can be turned off with the 'ServerSnapshots' value in the [Wineserver] config section. */
+#define SERVER_SNAPSHOT_TTL          100   /* milliseconds */
+#define SERVER_SNAPSHOT_HANDLES      256   /* must be a power of 2 */
+
+/* the current process's get_process_info reply.  <seq> is odd while it's being updated */
+static struct
+{
+    volatile LONG                   seq;
+    ULONGLONG                       stamp;  /* 0 if there is no snapshot */
+    struct get_process_info_reply   reply;
+} process_snapshot;
+
+/* handle flags snapshots.  Each entry packs the handle into the low 32 bits, the flags into the
+ * next 8, and the low 24 bits of the time stamp into the top.  An entry of 0 is empty */
+static LONGLONG handle_snapshots[SERVER_SNAPSHOT_HANDLES];
+
+/* what server_snapshot_update() needs to know about a request.  The request fields are
+ * overwritten by the reply, so these are saved beforehand */
+struct server_snapshot_op
+{
+    int         req;
+    handle_t    handle;
+    BOOL        store;      /* store the reply as the new snapshot */
+};
+
+static BOOL server_snapshots = FALSE;
+
+/* requests that must keep going through the path their entry in shared_memory_allowed_calls[]
+ * sets up no matter what the config says */
+static const int shm_locked_calls[] =
+{
+    REQ_new_process, REQ_get_new_process_info, REQ_new_thread, REQ_boot_done,
+    REQ_init_process, REQ_init_process_done, REQ_init_thread,
+    REQ_load_dll, REQ_unload_dll, REQ_read_process_memory, REQ_write_process_memory,
+    REQ_get_selector_entry, REQ_create_file, REQ_alloc_file_handle,
+    REQ_select, REQ_shm_select
+};
 
 /* will be set if the preloader reserved memory for the shm server */
 size_t shm_res_size = 0;
@@ -160,46 +242,349 @@ BOOL server_scheduler_active( void )
   return use_scheduler;
 }
 
-#if defined( COLLECT_SHM_STATS )
-/* Dump some very crude stats */
-static void report_collected_shm_stats(void)
+/***********************************************************************
+ *           server_prof_now
+ *
+ * Current time in microseconds for the server call profiler.
+ */
+static inline ULONGLONG server_prof_now(void)
 {
-  unsigned int i;
-  unsigned int highest;
-  DWORD largest;
+    struct timeval tv;
 
-  highest = 0;
-  largest = 0;
+    gettimeofday( &tv, NULL );
+    return (ULONGLONG)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-  fprintf( stderr, "Fast stats:\n" );
-  for( i=0; i < REQ_NB_REQUESTS; i++ )
-  {
-    fprintf( stderr, "[%03u]=%010ld%c", i, fast_server_call_stats[i], ((i+1)%6 ) ? '\t' : '\n' );
-    if( fast_server_call_stats[i] > largest )
+
+/***********************************************************************
+ *           server_prof_dump
+ *
+ * Write the collected server call profile out to the profile file.  The
+ * counters of other threads are read without any locking, so a dump taken
+ * while they are making calls can be off by a call or so.
+ */
+static void server_prof_dump( ULONGLONG now )
+{
+    server_thread_prof *prof;
+    char tmpname[MAX_PATH];
+    FILE *file;
+    int i, path;
+
+    /* somebody else is already writing the profile out */
+    if (InterlockedCompareExchange( &server_prof_dumping, 1, 0 )) return;
+
+    server_prof_next_dump = now + server_prof_interval;
+
+    /* write to a temporary file first so readers never see a partial profile */
+    snprintf( tmpname, sizeof(tmpname), "%s.tmp", server_prof_file );
+    if (!(file = fopen( tmpname, "w" )))
     {
-       largest = fast_server_call_stats[i];
-       highest = i;
+        ERR( "could not write the server call profile to '%s'\n", tmpname );
+        server_prof_dumping = 0;
+        return;
     }
-  } 
-  fprintf( stderr, "\nFastest with largest value is %d at %ld\n", highest, largest );
 
-  highest = 0;
-  largest = 0;
+    fprintf( file, "# pid %d protocol %d elapsed_us %llu\n",
+             (int)getpid(), SERVER_PROTOCOL_VERSION, now - server_prof_start );
+    fprintf( file, "tid\treq\tpath\tcount\ttotal_us\tmax_us\n" );
 
-  fprintf( stderr, "Slow stats:\n" );
-  for( i=0; i < REQ_NB_REQUESTS; i++ )
-  {
-    fprintf( stderr, "[%03u]=%010ld%c", i, slow_server_call_stats[i], ((i+1)%6 ) ? '\t' : '\n' );
-    if( slow_server_call_stats[i] > largest )
+    for (prof = server_prof_threads; prof; prof = prof->next)
     {
-       largest = slow_server_call_stats[i];
-       highest = i;
+        for (i = 0; i < REQ_NB_REQUESTS; i++)
+        {
+            for (path = 0; path < SERVER_PROF_NB_PATHS; path++)
+            {
+                const server_call_prof *call = &prof->calls[i][path];
+
+                if (!call->count) continue;
+                fprintf( file, "%04lx\t%d\t%s\t%lu\t%llu\t%lu\n", prof->tid, i,
+                         server_prof_path_names[path], call->count, call->total, call->max );
+            }
+        }
     }
-  } 
-  fprintf( stderr, "\nSlowest with largest value is %d at %ld\n", highest, largest );
 
+    fclose( file );
+    if (rename( tmpname, server_prof_file ) == -1)
+        ERR( "could not rename '%s' to '%s'\n", tmpname, server_prof_file );
+
+    server_prof_dumping = 0;
 }
-#endif
+
+
+/***********************************************************************
+ *           server_prof_exit
+ *
+ * Write out the final server call profile when the process exits.
+ */
+static void server_prof_exit(void)
+{
+    server_prof_dump( server_prof_now() );
+}
+
+
+/***********************************************************************
+ *           server_prof_enable
+ *
+ * Start profiling server calls into the file <filename>.  <interval> is
+ * the number of seconds between profile dumps, or NULL for the default.
+ */
+static void server_prof_enable( const char *filename, const char *interval )
+{
+    char *name;
+    int seconds;
+
+    if (server_prof_file || !filename || !filename[0]) return;
+
+    if (!(name = malloc( strlen(filename) + 1 )))
+    {
+        ERR( "could not allocate the server call profile file name\n" );
+        return;
+    }
+    strcpy( name, filename );
+
+    if (interval && (seconds = atoi( interval )) > 0)
+        server_prof_interval = (ULONGLONG)seconds * 1000000;
+
+    server_prof_start = server_prof_now();
+    server_prof_next_dump = server_prof_start + server_prof_interval;
+    server_prof_file = name;
+    atexit( server_prof_exit );
+
+    MESSAGE( "wine: profiling server calls into '%s' every %llu seconds\n",
+             server_prof_file, server_prof_interval / 1000000 );
+}
+
+
+/***********************************************************************
+ *           server_prof_record
+ *
+ * Record a server call of type <req> through <path> that started at <start>.
+ */
+static void server_prof_record( int req, int path, ULONGLONG start )
+{
+    TEB *teb = NtCurrentTeb();
+    server_thread_prof *prof = teb->server_prof;
+    server_call_prof *call;
+    ULONGLONG now = server_prof_now();
+    ULONG elapsed = (ULONG)(now - start);
+
+    if (req < 0 || req >= REQ_NB_REQUESTS) return;
+
+    if (!prof)
+    {
+        /* don't use the heap here; it may well be what's making the server call */
+        prof = wine_anon_mmap( NULL, sizeof(*prof), PROT_READ | PROT_WRITE, 0 );
+        if (prof == (server_thread_prof *)-1) return;
+
+        do prof->next = server_prof_threads;
+        while (InterlockedCompareExchangePointer( (PVOID *)&server_prof_threads, prof, prof->next ) != prof->next);
+
+        teb->server_prof = prof;
+    }
+
+    /* the thread id isn't known until the init_thread call has completed */
+    if (!prof->tid) prof->tid = teb->tid;
+
+    call = &prof->calls[req][path];
+    call->count++;
+    call->total += elapsed;
+    if (elapsed > call->max) call->max = elapsed;
+
+    if (now >= server_prof_next_dump) server_prof_dump( now );
+}
+
+
+/***********************************************************************
+ *           snapshot_now
+ *
+ * Current time in milliseconds for the snapshot expiry checks.
+ */
+static inline ULONGLONG snapshot_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+    return (ULONGLONG)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+/***********************************************************************
+ *           handle_snapshot_set
+ *
+ * Replace the handle snapshot entry for <handle> with <value>.  If <value>
+ * is 0, the entry is only cleared if it still belongs to <handle>.
+ */
+static void handle_snapshot_set( handle_t handle, LONGLONG value )
+{
+    LONGLONG *entry = &handle_snapshots[(unsigned int)handle & (SERVER_SNAPSHOT_HANDLES - 1)];
+    LONGLONG old = InterlockedCompareExchange64( entry, 0, 0 );
+    LONGLONG prev;
+
+    for (;;)
+    {
+        if (!value && (handle_t)old != handle) return;
+        if ((prev = InterlockedCompareExchange64( entry, value, old )) == old) return;
+        old = prev;
+    }
+}
+
+
+/***********************************************************************
+ *           process_snapshot_set
+ *
+ * Store <reply> as the current process snapshot, or drop the snapshot if
+ * <reply> is NULL.  Storing a new snapshot is skipped if another thread is
+ * updating it at the same time, but dropping it always goes through.
+ */
+static void process_snapshot_set( const struct get_process_info_reply *reply )
+{
+    LONG seq;
+
+    for (;;)
+    {
+        seq = process_snapshot.seq;
+        if (!(seq & 1) && InterlockedCompareExchange( (LONG *)&process_snapshot.seq, seq + 1, seq ) == seq)
+            break;
+        if (reply) return;
+    }
+
+    if (reply)
+    {
+        process_snapshot.reply = *reply;
+        process_snapshot.stamp = snapshot_now();
+    }
+    else process_snapshot.stamp = 0;
+
+    __asm__ __volatile__( "" : : : "memory" );
+    process_snapshot.seq = seq + 2;
+}
+
+
+/***********************************************************************
+ *           server_snapshot_lookup
+ *
+ * Try to answer the request <req> from a snapshot.  Returns TRUE and fills
+ * in the reply if it could.  Otherwise fills in the rest of <op> (op->req is
+ * set by the caller) with what to do with the reply to the real request.
+ */
+static BOOL server_snapshot_lookup( struct __server_request_info *req, struct server_snapshot_op *op )
+{
+    ULONGLONG now;
+
+    op->handle = 0;
+    op->store  = FALSE;
+
+    switch (op->req)
+    {
+    case REQ_get_process_info:
+    {
+        struct get_process_info_reply reply;
+        LONG seq;
+
+        if (req->u.req.get_process_info_request.handle != (handle_t)GetCurrentProcess()) return FALSE;
+        op->store = TRUE;
+
+        seq = process_snapshot.seq;
+        if (seq & 1) return FALSE;
+        __asm__ __volatile__( "" : : : "memory" );
+        now = process_snapshot.stamp;
+        reply = process_snapshot.reply;
+        __asm__ __volatile__( "" : : : "memory" );
+        if (process_snapshot.seq != seq) return FALSE;
+
+        if (!now || snapshot_now() - now >= SERVER_SNAPSHOT_TTL) return FALSE;
+
+        req->u.reply.get_process_info_reply = reply;
+        return TRUE;
+    }
+
+    case REQ_set_handle_info:
+    {
+        const struct set_handle_info_request *info = &req->u.req.set_handle_info_request;
+        LONGLONG entry;
+
+        op->handle = info->handle;
+
+        /* anything other than a plain query changes the handle's state */
+        if (info->mask || info->fd != -1)
+        {
+            handle_snapshot_set( op->handle, 0 );
+            return FALSE;
+        }
+
+        op->store = TRUE;
+        entry = InterlockedCompareExchange64( &handle_snapshots[(unsigned int)op->handle & (SERVER_SNAPSHOT_HANDLES - 1)], 0, 0 );
+        if (!entry || (handle_t)entry != op->handle) return FALSE;
+        if (((snapshot_now() - (ULONGLONG)(entry >> 40)) & 0xffffff) >= SERVER_SNAPSHOT_TTL) return FALSE;
+
+        req->u.reply.set_handle_info_reply.__header.error = 0;
+        req->u.reply.set_handle_info_reply.__header.reply_size = 0;
+        req->u.reply.set_handle_info_reply.old_flags = (int)((entry >> 32) & 0xff);
+        req->u.reply.set_handle_info_reply.cur_fd = -1;
+        return TRUE;
+    }
+
+    case REQ_close_handle:
+        op->handle = req->u.req.close_handle_request.handle;
+        handle_snapshot_set( op->handle, 0 );
+        return FALSE;
+
+    case REQ_dup_handle:
+        if (req->u.req.dup_handle_request.options & DUP_HANDLE_CLOSE_SOURCE)
+        {
+            op->handle = req->u.req.dup_handle_request.src_handle;
+            handle_snapshot_set( op->handle, 0 );
+        }
+        return FALSE;
+
+    case REQ_set_process_info:
+    case REQ_debug_process:
+    case REQ_terminate_process:
+        process_snapshot_set( NULL );
+        return FALSE;
+    }
+
+    return FALSE;
+}
+
+
+/***********************************************************************
+ *           server_snapshot_update
+ *
+ * Update the snapshots with the reply to the request described by <op>.
+ */
+static void server_snapshot_update( struct __server_request_info *req, const struct server_snapshot_op *op )
+{
+    switch (op->req)
+    {
+    case REQ_get_process_info:
+        if (op->store && !req->u.reply.reply_header.error)
+            process_snapshot_set( &req->u.reply.get_process_info_reply );
+        break;
+
+    case REQ_set_handle_info:
+        if (op->store && !req->u.reply.reply_header.error)
+            handle_snapshot_set( op->handle, (LONGLONG)(unsigned int)op->handle |
+                                 ((LONGLONG)(req->u.reply.set_handle_info_reply.old_flags & 0xff) << 32) |
+                                 ((LONGLONG)(snapshot_now() & 0xffffff) << 40) );
+        else
+            handle_snapshot_set( op->handle, 0 );
+        break;
+
+    case REQ_close_handle:
+    case REQ_dup_handle:
+        /* a query that raced with the close may have put the old state back */
+        if (op->handle) handle_snapshot_set( op->handle, 0 );
+        break;
+
+    case REQ_set_process_info:
+    case REQ_debug_process:
+    case REQ_terminate_process:
+        process_snapshot_set( NULL );
+        break;
+    }
+}
+
 
 inline static DWORD get_config_key( HKEY defkey, HKEY appkey, const char *name,
                                     char *buffer, DWORD size )
@@ -215,20 +600,18 @@ static inline BOOL IS_OPTION_FALSE(ch)
 }
 
 
-/* Check if SHM is enabled for this process in the registry. Would be nicer to do
- * in the server. */
-static BOOL is_shm_disabled( void )
+/* Open the [Wineserver] config section and, if there is one, the app-specific
+ * AppDefaults\\<app>\\Wineserver section.  <appkey> is set to 0 if there is no
+ * app-specific section. */
+static void open_wineserver_config( HKEY *hkey, HKEY *appkey )
 {
     char buffer[MAX_PATH+16];
-    HKEY hkey, appkey = 0;
-    BOOL disabled = TRUE;
     DWORD error;
 
-    /* If we don't have an fd_server socket, we can't do shm. */
-    if( fd_server_socket == -1 ) return TRUE;
+    *appkey = 0;
 
     if (RegCreateKeyExA( HKEY_LOCAL_MACHINE, "Software\\Wine\\Wine\\Config\\Wineserver", 0, NULL,
-                         REG_OPTION_VOLATILE, KEY_ALL_ACCESS, NULL, &hkey, NULL ))
+                         REG_OPTION_VOLATILE, KEY_ALL_ACCESS, NULL, hkey, NULL ))
     {
         ERR("Cannot create config registry key\n" );
         ExitProcess(1);
@@ -245,21 +628,102 @@ static BOOL is_shm_disabled( void )
         strcat( appname, "\\Wineserver" );
         if (!RegOpenKeyA( HKEY_LOCAL_MACHINE, "Software\\Wine\\Wine\\Config\\AppDefaults", &tmpkey ))
         {
-            if (RegOpenKeyA( tmpkey, appname, &appkey )) appkey = 0;
+            if (RegOpenKeyA( tmpkey, appname, appkey )) *appkey = 0;
             RegCloseKey( tmpkey );
         }
     }
 
     else
         ERR("could not retrieve the module file name (reason: '%s')\n", error == 0 ? "bad module" : "buffer too small");
+}
 
 
+/* Check if SHM is enabled for this process in the registry. Would be nicer to do
+ * in the server. */
+static BOOL is_shm_disabled( void )
+{
+    char buffer[MAX_PATH+16];
+    HKEY hkey, appkey;
+    BOOL disabled = TRUE;
+
+    /* If we don't have an fd_server socket, we can't do shm. */
+    if( fd_server_socket == -1 ) return TRUE;
+
+    open_wineserver_config( &hkey, &appkey );
+
     if (!get_config_key( hkey, appkey, "SHMWineserver", buffer, sizeof(buffer) ))
         disabled = IS_OPTION_FALSE( buffer[0] );
 
     return disabled;
 }
 
+
+/* Apply a list of request numbers from the config value <name> to the shared
+ * memory allow-list.  The requests in the list are sent through the shared
+ * memory server if <allow> is TRUE and over the socket otherwise.  The numbers
+ * are the REQ_* values, as written out by the server call profiler.  Requests
+ * in shm_locked_calls[] can't be changed. */
+static void apply_shm_call_list( HKEY hkey, HKEY appkey, const char *name, BOOL allow )
+{
+    char buffer[1024];
+    char *p, *end;
+    long req;
+    unsigned int i;
+
+    if (get_config_key( hkey, appkey, name, buffer, sizeof(buffer) )) return;
+    buffer[sizeof(buffer) - 1] = 0;
+
+    for (p = buffer; *p; p = end)
+    {
+        while (*p && !isdigit( *p )) p++;
+        if (!*p) break;
+
+        req = strtol( p, &end, 10 );
+
+        if (req < 0 || req >= REQ_NB_REQUESTS)
+        {
+            WARN( "ignoring invalid request %ld in '%s'\n", req, name );
+            continue;
+        }
+
+        for (i = 0; i < sizeof(shm_locked_calls) / sizeof(shm_locked_calls[0]); i++)
+            if (shm_locked_calls[i] == req) break;
+
+        if (i < sizeof(shm_locked_calls) / sizeof(shm_locked_calls[0]))
+        {
+            WARN( "request %ld can't be moved %s the shared memory server\n", req, allow ? "to" : "off" );
+            continue;
+        }
+
+        TRACE( "%s request %ld through the shared memory server\n", allow ? "sending" : "not sending", req );
+        shared_memory_allowed_calls[req] = allow;
+    }
+}
+
+
+/* Apply the per-app overrides to the shared memory allow-list.  Denials win
+ * over allows if a request is in both lists. */
+static void setup_shm_allowed_calls( void )
+{
+    HKEY hkey, appkey;
+    int i;
+
+    open_wineserver_config( &hkey, &appkey );
+
+    apply_shm_call_list( hkey, appkey, "SHMAllowRequests", TRUE );
+    apply_shm_call_list( hkey, appkey, "SHMDenyRequests", FALSE );
+
+    if (appkey) RegCloseKey( appkey );
+    RegCloseKey( hkey );
+
+    if (TRACE_ON(client))
+    {
+        TRACE( "requests sent through the shared memory server:\n" );
+        for (i = 0; i < REQ_NB_REQUESTS; i++)
+            if (shared_memory_allowed_calls[i]) TRACE( "    %d\n", i );
+    }
+}
+
 static BOOL is_scheduler_disabled( void )
 {
     char buffer[MAX_PATH+16];
@@ -306,6 +770,52 @@ static BOOL is_scheduler_disabled( void )
     return disabled;
 }
 
+/* Check if the server call profiler was enabled in the registry.  This is only
+ * used if it hasn't already been enabled through the environment. */
+static void check_server_prof_config( void )
+{
+    char buffer[MAX_PATH+16];
+    char interval[16];
+    HKEY hkey;
+
+    if (server_prof_file) return;
+
+    if (RegCreateKeyExA( HKEY_LOCAL_MACHINE, "Software\\Wine\\Wine\\Config\\Wineserver", 0, NULL,
+                         REG_OPTION_VOLATILE, KEY_ALL_ACCESS, NULL, &hkey, NULL ))
+        return;
+
+    if (!get_config_key( hkey, 0, "ServerCallProfile", buffer, sizeof(buffer) ))
+    {
+        buffer[sizeof(buffer) - 1] = 0;
+        if (get_config_key( hkey, 0, "ServerCallProfileInterval", interval, sizeof(interval) ))
+            interval[0] = 0;
+        interval[sizeof(interval) - 1] = 0;
+
+        server_prof_enable( buffer, interval[0] ? interval : NULL );
+    }
+
+    RegCloseKey( hkey );
+}
+
+/* Check if the client side snapshots of server state have been turned off.  They
+ * stay off until the process has finished booting either way. */
+static void check_server_snapshot_config( void )
+{
+    char buffer[16];
+    HKEY hkey, appkey;
+
+    open_wineserver_config( &hkey, &appkey );
+
+    server_snapshots = TRUE;
+    if (!get_config_key( hkey, appkey, "ServerSnapshots", buffer, sizeof(buffer) ))
+        server_snapshots = !IS_OPTION_FALSE( buffer[0] );
+
+    if (appkey) RegCloseKey( appkey );
+    RegCloseKey( hkey );
+
+    TRACE( "client side server snapshots are %s\n", server_snapshots ? "on" : "off" );
+}
+
 /* will be called if the preloader reserved memory for the shm server */
 void set_shared_memory_reserved(size_t size, void *addr)
 {
@@ -327,10 +837,6 @@ void setup_shared_memory_wineserver( int shm_type, size_t shm_size,
 
   if( is_shm_disabled() ) return;
 
-#if defined( COLLECT_SHM_STATS )
-  atexit( report_collected_shm_stats );
-#endif
-
   /* Load the library */
   so_handle = wine_dlopen(wineserver_so_name, RTLD_NOW, error, sizeof(error) );
   if( !so_handle )
@@ -606,6 +1112,9 @@ void setup_shared_memory_wineserver( int shm_type, size_t shm_size,
   /* scheduling */
   shared_memory_allowed_calls[ REQ_set_scheduling_mode ] = TRUE;
 
+  /* let the config move requests on or off the shared memory path */
+  setup_shm_allowed_calls();
+
   setup_shared_memory_debugging();
   set_context_variables( fd_server_socket );
 
@@ -919,6 +1428,24 @@ unsigned int wine_server_call( void *req_ptr )
 {
     struct __server_request_info * const req = req_ptr;
     sigset_t old_set;
+    ULONGLONG start = server_prof_file ? server_prof_now() : 0;
+    struct server_snapshot_op op;
+    int path = SERVER_PROF_SOCKET;
+
+    /* the request header is overwritten by the reply */
+    op.req = req->u.req.request_header.req;
+
+    /* the server signals these events itself, the mirror can't follow them */
+    if (op.req == REQ_set_socket_event)
+        SYNC_ForgetHandle( (HANDLE)req->u.req.set_socket_event_request.event );
+    else if (op.req == REQ_get_socket_event)
+        SYNC_ForgetHandle( (HANDLE)req->u.req.get_socket_event_request.c_event );
+
+    if (server_snapshots && server_snapshot_lookup( req, &op ))
+    {
+        if (start) server_prof_record( op.req, SERVER_PROF_CACHED, start );
+        return 0;
+    }
 
     memset( (char *)&req->u.req + req->size, 0, sizeof(req->u.req) - req->size );
     SYSDEPS_sigprocmask( SIG_BLOCK, &block_set, &old_set );
@@ -933,25 +1460,27 @@ unsigned int wine_server_call( void *req_ptr )
     req->reply_received = TRUE;
 #else
 
-    if( call_supported_through_shared_memory( req->u.req.request_header.req ) )
+    if( call_supported_through_shared_memory( op.req ) )
     {
-#if defined( COLLECT_SHM_STATS )
-        fast_server_call_stats[ req->u.req.request_header.req ]++;
-#endif
+        path = SERVER_PROF_SHM;
         if( send_shared_request( req ) )
+        {
+            path = SERVER_PROF_FALLBACK;
             wait_reply( req );
+        }
     }
     else
     {
-#if defined( COLLECT_SHM_STATS )
-        slow_server_call_stats[ req->u.req.request_header.req ]++;
-#endif
         send_request( req );
         wait_reply( req );
     }
 
 #endif
     SYSDEPS_sigprocmask( SIG_SETMASK, &old_set, NULL );
+
+    if (server_snapshots) server_snapshot_update( req, &op );
+    if (start) server_prof_record( op.req, path, start );
+
     return req->u.reply.reply_header.error;
 }
 
@@ -1580,6 +2109,9 @@ void CLIENT_InitServer(void)
     const char *configdir;
     handle_t dummy_handle;
 
+    /* start the server call profiler as early as possible if it was asked for */
+    server_prof_enable( getenv( "WINESERVERPROF" ), getenv( "WINESERVERPROF_INTERVAL" ) );
+
     /* retrieve the current directory */
     for (size = 512; ; size *= 2)
     {
@@ -1774,6 +2306,8 @@ void CLIENT_InitThread (BOOL IsMainThread)
 void CLIENT_BootDone( int debug_level )
 {
     use_scheduler = !is_scheduler_disabled();
+    check_server_prof_config();
+    check_server_snapshot_config();
 
     SERVER_START_REQ( boot_done )
     {
@@ -10,9 +10,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 #ifdef HAVE_SYS_TYPES_H
 # include <sys/types.h>
 #endif
+#ifdef HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
 #include "winerror.h"
 #include "winternl.h"
 #include "wine/port.h"
@@ -28,8 +35,9 @@ WINE_DECLARE_DEBUG_CHANNEL(relay);
    on locking a CS, although expensive), and they cause crashes on Apple */
 /* #define CS_BACKTRACES */
 
-/* PH: FIXME: Should autodetect */
-const BOOL multiprocessor = FALSE;
+/* Spinning only makes sense if the owner can run while we spin; detected
+   in INIT_CritSects */
+BOOL multiprocessor = FALSE;
 
 extern WORD CreateAndStoreBacktrace(void);
 extern const char* RetrieveBacktrace( WORD dwIndex );
@@ -45,6 +53,10 @@ static CRITICAL_SECTION cs_cs;
 /* This function must be called before any critical sections are used */
 void INIT_CritSects(void)
 {
+#ifdef _SC_NPROCESSORS_ONLN
+    multiprocessor = (sysconf( _SC_NPROCESSORS_ONLN ) > 1);
+#endif
+
     csList.Flink = &csList;
     csList.Blink = &csList;
 
@@ -204,6 +216,114 @@ static LONG interlocked_dec( PLONG dest )
 
 
 
+/***********************************************************************
+ * Futex based waiting
+ *
+ * On Linux a contended section parks on a futex using LockSemaphore as the
+ * futex word instead of creating a server semaphore. The word then holds
+ * the number of pending wake-ups (0 or 1), which can never be mistaken for
+ * a handle; sections made global with MakeCriticalSectionGlobal carry a
+ * real handle and keep using the server semaphore.
+ */
+#if defined(__linux__) && defined(__NR_futex)
+
+static int futex_wait_op = 128; /* FUTEX_WAIT|FUTEX_PRIVATE_FLAG */
+static int futex_wake_op = 129; /* FUTEX_WAKE|FUTEX_PRIVATE_FLAG */
+
+static inline int futex_wait( int *addr, int val, struct timespec *timeout )
+{
+    return syscall( __NR_futex, addr, futex_wait_op, val, timeout, 0, 0 );
+}
+
+static inline int futex_wake( int *addr, int val )
+{
+    return syscall( __NR_futex, addr, futex_wake_op, val, NULL, 0, 0 );
+}
+
+static inline BOOL use_futexes(void)
+{
+    static int supported = -1;
+
+    if (supported == -1)
+    {
+        /* Private futexes only appeared in 2.6.22 */
+        futex_wait( &supported, 10, NULL );
+        if (errno == ENOSYS)
+        {
+            futex_wait_op = 0; /* FUTEX_WAIT */
+            futex_wake_op = 1; /* FUTEX_WAKE */
+            futex_wait( &supported, 10, NULL );
+        }
+        supported = (errno != ENOSYS);
+    }
+    return supported;
+}
+
+#else
+
+static inline BOOL use_futexes(void) { return FALSE; }
+
+#endif
+
+/* Whether LockSemaphore is a futex word rather than a semaphore handle */
+static inline BOOL crit_uses_futex( RTL_CRITICAL_SECTION *crit )
+{
+    return use_futexes() && (ULONG_PTR)crit->LockSemaphore <= 1;
+}
+
+/***********************************************************************
+ *           fast_wait
+ *
+ * Wait for a wake-up posted by fast_wake, spinning for up to SpinCount
+ * iterations before going to sleep in the kernel.
+ */
+static NTSTATUS fast_wait( RTL_CRITICAL_SECTION *crit, DWORD timeout )
+{
+#if defined(__linux__) && defined(__NR_futex)
+    struct timespec ts;
+    ULONG_PTR spin;
+    int val;
+
+    for (spin = crit->SpinCount; spin; spin--)
+    {
+        if (interlocked_cmpxchg( &crit->LockSemaphore, 0, (PVOID)1 ) == (PVOID)1)
+            return STATUS_WAIT_0;
+#ifdef __i386__
+        __asm__ __volatile__( "rep; nop" : : : "memory" );
+#endif
+    }
+
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+
+    while ((val = (int)(ULONG_PTR)interlocked_cmpxchg( &crit->LockSemaphore, 0, (PVOID)1 )) != 1)
+    {
+        /* Signals and spurious wake-ups restart the full timeout, which is
+           fine for the coarse timeouts used here */
+        if (futex_wait( (int *)&crit->LockSemaphore, val, &ts ) == -1 &&
+            errno == ETIMEDOUT)
+            return STATUS_TIMEOUT;
+    }
+    return STATUS_WAIT_0;
+#else
+    return STATUS_NOT_IMPLEMENTED;
+#endif
+}
+
+/***********************************************************************
+ *           fast_wake
+ */
+static NTSTATUS fast_wake( RTL_CRITICAL_SECTION *crit )
+{
+#if defined(__linux__) && defined(__NR_futex)
+    *(volatile int *)&crit->LockSemaphore = 1;
+    futex_wake( (int *)&crit->LockSemaphore, 1 );
+    return STATUS_SUCCESS;
+#else
+    return STATUS_NOT_IMPLEMENTED;
+#endif
+}
+
 /***********************************************************************
  *           get_semaphore
  */
@@ -402,7 +522,8 @@ NTSTATUS WINAPI RtlDeleteCriticalSection( RTL_CRITICAL_SECTION *crit )
     crit->LockCount      = -1;
     crit->RecursionCount = 0;
     crit->OwningThread   = 0;
-    if (crit->LockSemaphore) NtClose( crit->LockSemaphore );
+    if (crit->LockSemaphore && !crit_uses_futex( crit ))
+        NtClose( crit->LockSemaphore );
     crit->LockSemaphore  = 0;
 
     free_debug_info( crit );
@@ -456,6 +577,23 @@ static void display_wait_error( PRTL_CRITICAL_SECTION crit, LPCSTR str )
     }
 }
 
+/***********************************************************************
+ *           wait_semaphore
+ *
+ * Wait for the section to be released, on the futex if possible or on
+ * the server semaphore otherwise.
+ */
+static DWORD wait_semaphore( RTL_CRITICAL_SECTION *crit, DWORD timeout )
+{
+    if (crit_uses_futex( crit ))
+    {
+        NTSTATUS status = fast_wait( crit, timeout );
+        if (status != STATUS_NOT_IMPLEMENTED)
+            return status == STATUS_WAIT_0 ? STATUS_WAIT_0 : WAIT_TIMEOUT;
+    }
+    return WaitForSingleObject( get_semaphore( crit ), timeout );
+}
+
 /***********************************************************************
  *           RtlpWaitForCriticalSection   (NTDLL.@)
  */
@@ -464,7 +602,6 @@ NTSTATUS WINAPI RtlpWaitForCriticalSection( RTL_CRITICAL_SECTION *crit )
     for (;;)
     {
         EXCEPTION_RECORD rec;
-        HANDLE sem = get_semaphore( crit );
         DWORD res;
 	
 #if defined( USE_PTHREADS )
@@ -481,18 +618,18 @@ NTSTATUS WINAPI RtlpWaitForCriticalSection( RTL_CRITICAL_SECTION *crit )
         }
 #endif
 
-        res = WaitForSingleObject( sem, 5000L );
+        res = wait_semaphore( crit, 5000L );
         if ( res == WAIT_TIMEOUT )
         {
             display_wait_error( crit, "Timeout. Retry with 60 secs" );
-            res = WaitForSingleObject( sem, 60000L );
+            res = wait_semaphore( crit, 60000L );
 
 #if defined( USE_PTHREADS )
             /* If critical section is unnamed, assume it has been created by the app
              * and give it more leeway as far as timeouts are concerned.  */
             if ( res == WAIT_TIMEOUT && crit->DebugInfo && !crit->DebugInfo->Spare[1] ) {
                 display_wait_error( crit, "Timeout. Assuming unnamed critsection belongs to app. Retrying" );
-                res = WaitForSingleObject( sem, 2592000L );
+                res = wait_semaphore( crit, 2592000L );
             }
 #endif
 
@@ -500,7 +637,7 @@ NTSTATUS WINAPI RtlpWaitForCriticalSection( RTL_CRITICAL_SECTION *crit )
             if ( res == WAIT_TIMEOUT && TRACE_ON(relay) )
             {
                 display_wait_error( crit, "Timeout. Retry with 5 mins" );
-                res = WaitForSingleObject( sem, 300000L );
+                res = wait_semaphore( crit, 300000L );
             }
 
             if (res == STATUS_WAIT_0)
@@ -526,8 +663,14 @@ NTSTATUS WINAPI RtlpWaitForCriticalSection( RTL_CRITICAL_SECTION *crit )
  */
 NTSTATUS WINAPI RtlpUnWaitCriticalSection( RTL_CRITICAL_SECTION *crit )
 {
-    HANDLE sem = get_semaphore( crit );
-    NTSTATUS res = NtReleaseSemaphore( sem, 1, NULL );
+    HANDLE sem;
+    NTSTATUS res;
+
+    if (crit_uses_futex( crit ) && fast_wake( crit ) == STATUS_SUCCESS)
+        return STATUS_SUCCESS;
+
+    sem = get_semaphore( crit );
+    res = NtReleaseSemaphore( sem, 1, NULL );
     if (res) RtlRaiseStatus( res );
     return res;
 }
@@ -542,21 +685,15 @@ NTSTATUS WINAPI RtlpUnWaitCriticalSection( RTL_CRITICAL_SECTION *crit )
 NTSTATUS WINAPI EnterContestedCriticalSection (RTL_CRITICAL_SECTION *crit,
                                                DWORD dwThreadId)
 {
-   DWORD dwCount;
-
    if (crit->OwningThread == dwThreadId)
    {
       crit->RecursionCount++;
       return STATUS_SUCCESS;
    }
 
-   /* Spin if desired */
-   for (dwCount = crit->SpinCount; dwCount; dwCount--)
-   {
-      if (RtlTryEnterCriticalSection (crit))
-         return STATUS_SUCCESS;
-   }
-
+   /* We are already counted in LockCount, so the section can only become
+      ours through a wake-up from the owner; when waiting on a futex,
+      fast_wait spins for that wake-up before sleeping */
    /* Blocking wait for it */
    RtlpWaitForCriticalSection (crit);
     
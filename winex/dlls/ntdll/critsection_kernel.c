@@ -53,7 +53,11 @@ void WINAPI MakeCriticalSectionGlobal( CRITICAL_SECTION *crit )
 {
     /* let's assume that only one thread at a time will try to do this */
     HANDLE sem = crit->LockSemaphore;
-    if (!sem) NtCreateSemaphore( &sem, SEMAPHORE_ALL_ACCESS, NULL, 0, 1 );
+
+    /* A futex word holds a pending wake-up count rather than a handle; it
+       can't be shared across processes, so carry it over to a semaphore */
+    if ((ULONG_PTR)sem <= 1)
+        NtCreateSemaphore( &sem, SEMAPHORE_ALL_ACCESS, NULL, (ULONG_PTR)sem, 1 );
     crit->LockSemaphore = ConvertToGlobalHandle( sem );
 
     free_debug_info( crit );
@@ -6,12 +6,16 @@
  * Copyright (c) 2002-2005 the ReWind project authors (see LICENSE.ReWind)
  */
 
+#include "config.h"
+#include "wine/port.h"
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <sys/mman.h>
 #ifdef USE_PTHREADS
 #include <pthread.h>
 #endif
@@ -24,6 +28,7 @@
 #include "winternl.h"
 #include "wtypes.h"
 #include "wine/server.h"
+#include "wine/library.h"
 #include "msvcrt/excpt.h"
 
 WINE_DECLARE_DEBUG_CHANNEL(tid);
@@ -33,14 +38,19 @@ WINE_DECLARE_DEBUG_CHANNEL(nolock);
 
 /* ---------------------------------------------------------------------- */
 
+struct trace_ring;
+
 struct debug_info
 {
     char *str_pos;       /* current position in strings buffer */
     char *out_pos;       /* current position in output buffer */
     char  strings[1024]; /* buffer for temporary strings */
     char  output[1024];  /* current output line */
+    struct trace_ring *ring; /* trace ring of the thread, if any */
 };
 
+static const char * const debug_classes[__WINE_DBCL_COUNT] = { "fixme", "err", "warn", "trace" };
+
 static struct debug_info initial_thread_info;  /* debug info for initial thread */
 
 static BOOL deferredTrace = FALSE, traceEnabled = TRUE;
@@ -465,6 +475,706 @@ static char *strrevchr(char *base, char *end, int c){
     return NULL;
 }
 
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Trace rings
+ *
+ * When WINEDEBUGRING is set, trace output doesn't get formatted and written
+ * by the thread producing it.  Each thread instead appends binary records
+ * (the channel, function and format strings followed by the raw arguments,
+ * with %s strings copied in) to a ring of its own, without taking any lock
+ * or allocating anything past the first record.  A writer thread drains the
+ * rings every few milliseconds, decodes the records and writes them out in
+ * bulk.  The strings are copied rather than pointed to because the module
+ * they live in may be unloaded before the writer gets to the record.  A full
+ * ring drops records instead of blocking, and the writer reports how many.
+ * WINEDEBUGRING is the ring size per thread in kilobytes.
+ *
+ * Lines from different threads are only kept in order within a thread, and
+ * whatever is still in the rings when the process dies abnormally is lost.
+ */
+
+#define TRACE_RING_MIN_SIZE   (16 * 1024)
+#define TRACE_MAX_RECORD      1024       /* largest encoded record */
+#define TRACE_MAX_SPEC        32         /* longest conversion spec handled */
+#define TRACE_WRITER_INTERVAL 20         /* ms between writer passes */
+#define TRACE_WRITER_STOP_WAIT 1000      /* ms to wait for the writer at exit */
+
+/* record classes besides the __WINE_DEBUG_CLASS ones */
+#define TRACE_REC_CONT        0xfe       /* wine_dbg_printf output, no prefix */
+#define TRACE_REC_PAD         0xff       /* skip to the start of the ring */
+
+/* record flags */
+#define TRACE_REC_TICK        0x01       /* tick is set */
+#define TRACE_REC_TID         0x02       /* tid is set */
+#define TRACE_REC_TEXT        0x04       /* formatted text instead of arguments */
+
+/* ring states */
+#define TRACE_RING_USED       0
+#define TRACE_RING_DETACHED   1          /* owner thread has exited */
+#define TRACE_RING_FREE       2          /* drained, can be reused */
+
+struct trace_record
+{
+    unsigned short size;      /* size including the header, multiple of 4 */
+    unsigned char  cls;
+    unsigned char  flags;
+    DWORD          tick;
+    DWORD          tid;
+    /* followed by the nul terminated channel, function and format strings
+     * (the formatted text with TRACE_REC_TEXT), then the arguments starting
+     * on a 4 byte boundary */
+};
+
+struct trace_ring
+{
+    struct trace_ring     *next;       /* next ring in trace_rings */
+    LONG                   state;
+    volatile unsigned int  head;       /* only written by the owner thread */
+    volatile unsigned int  tail;       /* only written by the writer */
+    LONG                   dropped;    /* records lost to a full ring */
+    unsigned int           line_len;   /* length of the partial line */
+    char                   line[1024]; /* partial line, for the writer */
+    char                   data[1];
+};
+
+enum trace_arg
+{
+    TRACE_ARG_NONE,
+    TRACE_ARG_INT,
+    TRACE_ARG_LONGLONG,
+    TRACE_ARG_DOUBLE,
+    TRACE_ARG_LDOUBLE,
+    TRACE_ARG_PTR,
+    TRACE_ARG_STR,
+    TRACE_ARG_BAD
+};
+
+struct trace_spec
+{
+    int            len;         /* length of the spec, '%' included */
+    enum trace_arg type;
+    BOOL           star_width;  /* width is an argument */
+    BOOL           star_prec;   /* precision is an argument */
+    int            prec;        /* precision, -1 if none */
+};
+
+static unsigned int trace_ring_size;           /* size of each ring, a power of 2 */
+static struct trace_ring *trace_rings;         /* all the rings ever allocated */
+static volatile BOOL trace_writer_running;
+static volatile BOOL trace_writer_stop;        /* asks the writer to leave its loop */
+static TEB *trace_writer_teb;
+static HANDLE trace_writer_thread_handle;
+static HANDLE trace_writer_done;               /* set once the writer has left its loop */
+static LONG trace_draining;                    /* somebody is draining the rings */
+static char trace_output[64 * 1024];           /* output waiting to be written */
+static unsigned int trace_output_len;
+
+static char *strrevchr(char *base, char *end, int c);
+
+/* are trace rings used for the current thread */
+static inline BOOL trace_ring_active(void)
+{
+    return trace_writer_running && NtCurrentTeb() != trace_writer_teb;
+}
+
+/* parse the conversion spec at <fmt>, which points to the '%' */
+static void trace_parse_spec( const char *fmt, struct trace_spec *spec )
+{
+    const char *p = fmt + 1;
+    int longs = 0;
+
+    spec->type       = TRACE_ARG_BAD;
+    spec->star_width = FALSE;
+    spec->star_prec  = FALSE;
+    spec->prec       = -1;
+
+    if (*p == '%')
+    {
+        spec->type = TRACE_ARG_NONE;
+        spec->len = 2;
+        return;
+    }
+
+    while (*p && strchr( "-+ #0'", *p )) p++;
+    if (*p == '*')
+    {
+        spec->star_width = TRUE;
+        p++;
+    }
+    else while (isdigit( *p )) p++;
+
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            spec->star_prec = TRUE;
+            p++;
+        }
+        else
+        {
+            spec->prec = 0;
+            while (isdigit( *p )) spec->prec = spec->prec * 10 + *p++ - '0';
+        }
+    }
+
+    for (;; p++)
+    {
+        if (*p == 'l') longs++;
+        else if (*p == 'L' || *p == 'q' || *p == 'j') longs += 2;
+        else if (*p != 'h' && *p != 'z' && *p != 't') break;
+    }
+
+    switch (*p)
+    {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+        spec->type = (longs >= 2) ? TRACE_ARG_LONGLONG : TRACE_ARG_INT;
+        break;
+    case 'c':
+        if (!longs) spec->type = TRACE_ARG_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        spec->type = (longs >= 2) ? TRACE_ARG_LDOUBLE : TRACE_ARG_DOUBLE;
+        break;
+    case 'p':
+        spec->type = TRACE_ARG_PTR;
+        break;
+    case 's':
+        if (!longs) spec->type = TRACE_ARG_STR;
+        break;
+    }
+    if (*p) p++;
+
+    spec->len = p - fmt;
+    if (spec->len >= TRACE_MAX_SPEC) spec->type = TRACE_ARG_BAD;
+}
+
+/* copy <str> to <ptr>, cut to fit before <end>; returns the space used */
+static unsigned int trace_copy_str( char *ptr, const char *end, const char *str )
+{
+    unsigned int count, max = end - ptr - 1;
+
+    for (count = 0; count < max && str[count]; count++);
+    memcpy( ptr, str, count );
+    ptr[count] = 0;
+    return count + 1;
+}
+
+/* encode a trace record into <buffer>, returns its size */
+static unsigned int trace_encode( char *buffer, int cls, const char *channel,
+                                  const char *function, const char *format, va_list args )
+{
+    struct trace_record *rec = (struct trace_record *)buffer;
+    char *ptr = (char *)(rec + 1), *end = buffer + TRACE_MAX_RECORD;
+    char *format_copy;
+    struct trace_spec spec;
+    const char *p;
+    va_list copy;
+    int len;
+
+    rec->cls   = cls;
+    rec->flags = 0;
+    if (!format) format = "";
+
+    /* the channel name starts after its flags byte */
+    ptr += trace_copy_str( ptr, end, channel ? channel + 1 : "" );
+    ptr += trace_copy_str( ptr, end, function ? function : "" );
+    format_copy = ptr;
+
+    if (cls != TRACE_REC_CONT)
+    {
+        if (TRACE_ON(timestamp))
+        {
+            rec->flags |= TRACE_REC_TICK;
+            rec->tick = NtGetTickCount();
+        }
+        if (TRACE_ON(tid))
+        {
+            rec->flags |= TRACE_REC_TID;
+            rec->tid = (DWORD)NtCurrentTeb()->tid;
+        }
+    }
+
+    va_copy( copy, args );
+
+    len = strlen( format );
+    if (len >= end - ptr) goto text;
+    memcpy( ptr, format, len + 1 );
+    ptr = buffer + ((ptr + len + 1 - buffer + 3) & ~3);
+
+    for (p = format; (p = strchr( p, '%' )); p += spec.len)
+    {
+        trace_parse_spec( p, &spec );
+        if (spec.type == TRACE_ARG_BAD) goto text;
+        if (spec.type == TRACE_ARG_NONE) continue;
+
+        /* enough for the star arguments and the largest value */
+        if (end - ptr < 2 * sizeof(int) + sizeof(long double) + 4) goto text;
+
+        if (spec.star_width)
+        {
+            int width = va_arg( args, int );
+            memcpy( ptr, &width, sizeof(width) );
+            ptr += sizeof(width);
+        }
+        if (spec.star_prec)
+        {
+            spec.prec = va_arg( args, int );
+            memcpy( ptr, &spec.prec, sizeof(spec.prec) );
+            ptr += sizeof(spec.prec);
+        }
+
+        switch (spec.type)
+        {
+        case TRACE_ARG_INT:
+        {
+            int val = va_arg( args, int );
+            memcpy( ptr, &val, sizeof(val) );
+            ptr += sizeof(val);
+            break;
+        }
+        case TRACE_ARG_LONGLONG:
+        {
+            long long val = va_arg( args, long long );
+            memcpy( ptr, &val, sizeof(val) );
+            ptr += sizeof(val);
+            break;
+        }
+        case TRACE_ARG_DOUBLE:
+        {
+            double val = va_arg( args, double );
+            memcpy( ptr, &val, sizeof(val) );
+            ptr += sizeof(val);
+            break;
+        }
+        case TRACE_ARG_LDOUBLE:
+        {
+            long double val = va_arg( args, long double );
+            memcpy( ptr, &val, sizeof(val) );
+            ptr += (sizeof(val) + 3) & ~3;
+            break;
+        }
+        case TRACE_ARG_PTR:
+        {
+            void *val = va_arg( args, void * );
+            memcpy( ptr, &val, sizeof(val) );
+            ptr += sizeof(val);
+            break;
+        }
+        case TRACE_ARG_STR:
+        {
+            /* the string may well be a wine_dbgstr buffer that gets reused, copy it */
+            const char *str = va_arg( args, const char * );
+            unsigned int max = end - ptr - sizeof(unsigned short) - 1;
+            unsigned short count;
+
+            if (!str) str = "(null)";
+            if (spec.prec >= 0 && spec.prec < max) max = spec.prec;
+            for (count = 0; count < max && str[count]; count++);
+            memcpy( ptr, &count, sizeof(count) );
+            memcpy( ptr + sizeof(count), str, count );
+            ptr[sizeof(count) + count] = 0;
+            ptr += (sizeof(count) + count + 1 + 3) & ~3;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    va_end( copy );
+    rec->size = ptr - buffer;
+    return rec->size;
+
+text:
+    /* something we can't encode, format it right away */
+    rec->flags |= TRACE_REC_TEXT;
+    ptr = format_copy;
+    len = vsnprintf( ptr, end - ptr, format, copy );
+    if (len < 0 || len >= end - ptr) len = end - ptr - 1;
+    ptr[len] = 0;
+    va_end( copy );
+    rec->size = (ptr + len + 1 - buffer + 3) & ~3;
+    return rec->size;
+}
+
+/* get a ring for the current thread */
+static struct trace_ring *trace_ring_attach(void)
+{
+    struct trace_ring *ring;
+
+    /* reuse the ring of a thread that has exited */
+    for (ring = trace_rings; ring; ring = ring->next)
+        if (InterlockedCompareExchange( &ring->state, TRACE_RING_USED, TRACE_RING_FREE ) == TRACE_RING_FREE)
+            return ring;
+
+    /* don't use the heap here; it may well be what's being traced */
+    ring = wine_anon_mmap( NULL, sizeof(*ring) + trace_ring_size, PROT_READ | PROT_WRITE, 0 );
+    if (ring == (struct trace_ring *)-1) return NULL;
+
+    ring->state = TRACE_RING_USED;
+    do ring->next = trace_rings;
+    while (InterlockedCompareExchangePointer( (PVOID *)&trace_rings, ring, ring->next ) != ring->next);
+    return ring;
+}
+
+/* append a record to the ring of the current thread.  Returns the size
+ * of the record, 0 if the ring was full and it got dropped, or -1 if
+ * there's no ring to append to */
+static int trace_ring_record( int cls, const char *channel, const char *function,
+                              const char *format, va_list args )
+{
+    struct debug_info *info = get_info();
+    struct trace_ring *ring = info->ring;
+    char buffer[TRACE_MAX_RECORD];
+    unsigned int size, pos, pad = 0;
+
+    if (!ring && !(ring = info->ring = trace_ring_attach())) return -1;
+
+    size = trace_encode( buffer, cls, channel, function, format, args );
+    pos = ring->head & (trace_ring_size - 1);
+
+    /* records don't wrap around, pad up to the end of the ring instead */
+    if (pos + size > trace_ring_size) pad = trace_ring_size - pos;
+
+    if (trace_ring_size - (ring->head - ring->tail) < pad + size)
+    {
+        InterlockedIncrement( &ring->dropped );
+        return 0;
+    }
+
+    if (pad)
+    {
+        struct trace_record *rec = (struct trace_record *)(ring->data + pos);
+        rec->size = pad;
+        rec->cls = TRACE_REC_PAD;
+        pos = 0;
+    }
+    memcpy( ring->data + pos, buffer, size );
+
+    /* make the record visible to the writer */
+    InterlockedExchange( (LONG *)&ring->head, ring->head + pad + size );
+    return size;
+}
+
+/* write out the collected output */
+static void trace_output_flush(void)
+{
+    if (!trace_output_len) return;
+#ifdef USE_PTHREADS
+    if (!TRACE_ON (nolock))
+        pthread_mutex_lock (&WriteMutex);
+#endif
+    write( 2, trace_output, trace_output_len );
+#ifdef USE_PTHREADS
+    if (!TRACE_ON (nolock))
+        pthread_mutex_unlock (&WriteMutex);
+#endif
+    trace_output_len = 0;
+}
+
+static void trace_output_put( const char *str, unsigned int len )
+{
+    if (len > sizeof(trace_output) - trace_output_len) trace_output_flush();
+    memcpy( trace_output + trace_output_len, str, len );
+    trace_output_len += len;
+}
+
+/* add decoded text to the line of <ring>, complete lines go to the output */
+static void trace_put_text( struct trace_ring *ring, const char *text, unsigned int len )
+{
+    unsigned int count;
+    char *p;
+
+    while (len)
+    {
+        count = min( len, sizeof(ring->line) - ring->line_len );
+        memcpy( ring->line + ring->line_len, text, count );
+        ring->line_len += count;
+        text += count;
+        len -= count;
+
+        if ((p = strrevchr( ring->line, ring->line + ring->line_len - 1, '\n' )))
+        {
+            p++;
+            trace_output_put( ring->line, p - ring->line );
+            ring->line_len -= p - ring->line;
+            memmove( ring->line, p, ring->line_len );
+        }
+        else if (ring->line_len == sizeof(ring->line))
+        {
+            trace_output_put( ring->line, ring->line_len );
+            ring->line_len = 0;
+        }
+    }
+}
+
+/* format a record the way the direct path would have */
+static void trace_decode( struct trace_ring *ring, const struct trace_record *rec )
+{
+    const char *channel = (const char *)(rec + 1);
+    const char *function = channel + strlen( channel ) + 1;
+    const char *format = function + strlen( function ) + 1;
+    const char *ptr, *p;
+    struct trace_spec spec;
+    char buffer[TRACE_MAX_RECORD];
+    char spec_str[TRACE_MAX_SPEC + 24];
+    int i, len, star;
+
+    if (rec->flags & TRACE_REC_TICK)
+        trace_put_text( ring, buffer, sprintf( buffer, "%ld - ", rec->tick ));
+    if (rec->flags & TRACE_REC_TID)
+        trace_put_text( ring, buffer, sprintf( buffer, "%04lx:", rec->tid ));
+    if (rec->cls < __WINE_DBCL_COUNT)
+    {
+        len = snprintf( buffer, sizeof(buffer), "%s:%s:%s ", debug_classes[rec->cls],
+                        channel, function );
+        if (len < 0 || len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+        trace_put_text( ring, buffer, len );
+    }
+
+    if (rec->flags & TRACE_REC_TEXT)
+    {
+        trace_put_text( ring, format, strlen( format ));
+        return;
+    }
+    ptr = (const char *)rec + ((format + strlen( format ) + 1 - (const char *)rec + 3) & ~3);
+
+    while ((p = strchr( format, '%' )))
+    {
+        trace_put_text( ring, format, p - format );
+        trace_parse_spec( p, &spec );
+        format = p + spec.len;
+
+        if (spec.type == TRACE_ARG_NONE)
+        {
+            trace_put_text( ring, "%", 1 );
+            continue;
+        }
+
+        /* rebuild the spec with the star arguments filled in */
+        for (i = len = 0; i < spec.len; i++)
+        {
+            if (p[i] != '*')
+            {
+                spec_str[len++] = p[i];
+                continue;
+            }
+            memcpy( &star, ptr, sizeof(star) );
+            ptr += sizeof(star);
+            len += sprintf( spec_str + len, "%d", star );
+        }
+        spec_str[len] = 0;
+
+        switch (spec.type)
+        {
+        case TRACE_ARG_INT:
+        {
+            int val;
+            memcpy( &val, ptr, sizeof(val) );
+            ptr += sizeof(val);
+            len = snprintf( buffer, sizeof(buffer), spec_str, val );
+            break;
+        }
+        case TRACE_ARG_LONGLONG:
+        {
+            long long val;
+            memcpy( &val, ptr, sizeof(val) );
+            ptr += sizeof(val);
+            len = snprintf( buffer, sizeof(buffer), spec_str, val );
+            break;
+        }
+        case TRACE_ARG_DOUBLE:
+        {
+            double val;
+            memcpy( &val, ptr, sizeof(val) );
+            ptr += sizeof(val);
+            len = snprintf( buffer, sizeof(buffer), spec_str, val );
+            break;
+        }
+        case TRACE_ARG_LDOUBLE:
+        {
+            long double val;
+            memcpy( &val, ptr, sizeof(val) );
+            ptr += (sizeof(val) + 3) & ~3;
+            len = snprintf( buffer, sizeof(buffer), spec_str, val );
+            break;
+        }
+        case TRACE_ARG_PTR:
+        {
+            void *val;
+            memcpy( &val, ptr, sizeof(val) );
+            ptr += sizeof(val);
+            len = snprintf( buffer, sizeof(buffer), spec_str, val );
+            break;
+        }
+        case TRACE_ARG_STR:
+        {
+            unsigned short count;
+            memcpy( &count, ptr, sizeof(count) );
+            len = snprintf( buffer, sizeof(buffer), spec_str, ptr + sizeof(count) );
+            ptr += (sizeof(count) + count + 1 + 3) & ~3;
+            break;
+        }
+        default:
+            len = 0;
+            break;
+        }
+        if (len < 0 || len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+        trace_put_text( ring, buffer, len );
+    }
+    trace_put_text( ring, format, strlen( format ));
+}
+
+/* decode all the records in <ring> */
+static void trace_drain_ring( struct trace_ring *ring, BOOL flush_line )
+{
+    LONG state = ring->state;
+    unsigned int head = (unsigned int)InterlockedCompareExchange( (LONG *)&ring->head, 0, 0 );
+    unsigned int tail = ring->tail;
+    LONG dropped;
+    char buffer[128];
+
+    while (tail != head)
+    {
+        const struct trace_record *rec;
+
+        rec = (const struct trace_record *)(ring->data + (tail & (trace_ring_size - 1)));
+        if (rec->cls != TRACE_REC_PAD) trace_decode( ring, rec );
+        tail += rec->size;
+    }
+    InterlockedExchange( (LONG *)&ring->tail, tail );
+
+    if ((dropped = InterlockedExchange( &ring->dropped, 0 )))
+    {
+        trace_put_text( ring, "\n", ring->line_len ? 1 : 0 );
+        trace_output_put( buffer, sprintf( buffer, "err:debug:trace_drain_ring %ld trace records "
+                                           "dropped, the ring is full\n", dropped ));
+    }
+
+    if (state == TRACE_RING_DETACHED || flush_line)
+    {
+        trace_output_put( ring->line, ring->line_len );
+        ring->line_len = 0;
+    }
+    if (state == TRACE_RING_DETACHED)
+        InterlockedExchange( &ring->state, TRACE_RING_FREE );
+}
+
+/* drain all the rings, returns FALSE if somebody else is already at it */
+static BOOL trace_drain_all( BOOL flush_lines )
+{
+    struct trace_ring *ring;
+
+    if (InterlockedCompareExchange( &trace_draining, 1, 0 )) return FALSE;
+    for (ring = trace_rings; ring; ring = ring->next)
+        if (ring->state != TRACE_RING_FREE) trace_drain_ring( ring, flush_lines );
+    trace_output_flush();
+    trace_draining = 0;
+    return TRUE;
+}
+
+static DWORD CALLBACK trace_writer_thread( LPVOID arg )
+{
+    trace_writer_teb = NtCurrentTeb();
+    trace_writer_running = TRUE;
+
+    while (!trace_writer_stop)
+    {
+        Sleep( TRACE_WRITER_INTERVAL );
+        trace_drain_all( FALSE );
+    }
+    NtSetEvent( trace_writer_done, NULL );
+    return 0;
+}
+
+/* write out what is left in the rings when the process exits */
+static void trace_exit(void)
+{
+    int i;
+
+    trace_writer_running = FALSE;
+
+    /* a writer killed in the middle of a pass never clears trace_draining */
+    if (trace_draining &&
+        WaitForSingleObject( trace_writer_thread_handle, 0 ) == WAIT_OBJECT_0)
+        trace_draining = 0;
+
+    for (i = 0; i < 100; i++)
+    {
+        if (trace_drain_all( TRUE )) break;
+        usleep( 10000 );
+    }
+}
+
+/***********************************************************************
+ *		DEBUG_StartTraceWriter (internal)
+ *
+ * Start the trace ring writer thread if WINEDEBUGRING is set.  Trace output
+ * is written directly until the thread is running.
+ */
+void DEBUG_StartTraceWriter(void)
+{
+    const char *env = getenv( "WINEDEBUGRING" );
+    unsigned int size;
+    HANDLE thread;
+
+    if (!env || !*env || *env == '0') return;
+
+    size = atoi( env ) * 1024;
+    for (trace_ring_size = TRACE_RING_MIN_SIZE; trace_ring_size < size; trace_ring_size <<= 1);
+
+    if (NtCreateEvent( &trace_writer_done, EVENT_ALL_ACCESS, NULL, TRUE, FALSE ) != STATUS_SUCCESS ||
+        !(thread = CreateThread( NULL, 0, trace_writer_thread, NULL, 0, NULL )))
+    {
+        MESSAGE( "wine: could not start the trace writer, writing trace output directly\n" );
+        if (trace_writer_done) NtClose( trace_writer_done );
+        trace_writer_done = 0;
+        trace_ring_size = 0;
+        return;
+    }
+    /* kept open, so trace_exit can tell whether the writer is still alive */
+    trace_writer_thread_handle = thread;
+    atexit( trace_exit );
+}
+
+/***********************************************************************
+ *		DEBUG_StopTraceWriter (internal)
+ *
+ * Have the trace ring writer finish its pass and stop, before the process
+ * kills its threads on the way out; a writer killed in the middle of a
+ * pass would keep the rest of the output from being written.
+ */
+void DEBUG_StopTraceWriter(void)
+{
+    if (!trace_writer_thread_handle || trace_writer_stop) return;
+
+    trace_writer_stop = TRUE;
+    if (WaitForSingleObject( trace_writer_done, TRACE_WRITER_STOP_WAIT ) != WAIT_OBJECT_0)
+        return;  /* still busy, trace_exit will try again */
+
+    trace_drain_all( TRUE );
+    trace_writer_running = FALSE;
+}
+
+/***********************************************************************
+ *		DEBUG_ThreadDetach (internal)
+ *
+ * Hand the trace ring of an exiting thread over to the writer.
+ */
+void DEBUG_ThreadDetach(void)
+{
+    struct debug_info *info = NtCurrentTeb()->debug_info;
+
+    if (info && info->ring)
+    {
+        InterlockedExchange( &info->ring->state, TRACE_RING_DETACHED );
+        info->ring = NULL;
+    }
+}
+
 /***********************************************************************
  *		wine_dbg_vprintf (NTDLL.@)
  */
@@ -477,6 +1187,12 @@ int wine_dbg_vprintf( const char *format, va_list args )
     if (!traceEnabled)
         return 0;
 
+    /* the text isn't formatted on the ring path, so the record size is
+     * returned instead of its length; no caller looks at it */
+    if (trace_ring_active() &&
+        (ret = trace_ring_record( TRACE_REC_CONT, NULL, NULL, format, args )) >= 0)
+        return ret;
+
     info = get_info();
 
     ret = vsnprintf( info->out_pos, sizeof(info->output) - (info->out_pos - info->output),
@@ -618,13 +1334,21 @@ int wine_dbg_switch_trace(BOOL init, BOOL switchIt)
 int wine_dbg_log(enum __WINE_DEBUG_CLASS cls, const char *channel,
                  const char *function, const char *format, ... )
 {
-    static const char *classes[__WINE_DBCL_COUNT] = { "fixme", "err", "warn", "trace" };
     va_list valist;
     int ret = 0;
 
     if (!traceEnabled)
         return 0;
 
+    if (trace_ring_active())
+    {
+        va_start(valist, format);
+        ret = trace_ring_record( cls, channel, function, format, valist );
+        va_end(valist);
+        if (ret >= 0) return ret;
+        ret = 0;
+    }
+
     va_start(valist, format);
 
     if (TRACE_ON(timestamp))
@@ -632,7 +1356,7 @@ int wine_dbg_log(enum __WINE_DEBUG_CLASS cls, const char *channel,
     if (TRACE_ON(tid))
         ret += wine_dbg_printf( "%04lx:", (DWORD)NtCurrentTeb()->tid );
     if (cls < __WINE_DBCL_COUNT)
-        ret += wine_dbg_printf( "%s:%s:%s ", classes[cls], channel + 1, function );
+        ret += wine_dbg_printf( "%s:%s:%s ", debug_classes[cls], channel + 1, function );
     if (format)
         ret += wine_dbg_vprintf( format, valist );
 
@@ -118,6 +118,46 @@ typedef struct
 #endif
 } DOS_DIR;
 
+/* Case-folded name index of one directory, so that DOSFS_FindUnixName
+   doesn't have to rescan big directories for every path component that
+   isn't in the exact case. Indexes are keyed on the directory's dev/inode
+   and thrown away when its mtime changes. As mtime only has a resolution
+   of a second, a negative lookup is only trusted if the index was read
+   after the second the directory was last changed in; otherwise the
+   directory is read again */
+#define DOSFS_DIRCACHE_SIZE      32     /* directories kept indexed */
+
+typedef struct
+{
+    unsigned int  hash;           /* DOSFS_HashName of long_name */
+    int           next;           /* next entry in the same bucket, or -1 */
+    int           short_next;     /* same for the short name buckets */
+    unsigned int  name_off;       /* long name offset in names */
+    BOOL          vfat_short;     /* short_name came from the VFAT ioctl */
+    char          short_name[12]; /* FCB format short name */
+} DOSFS_DIRENTRY;
+
+typedef struct
+{
+    dev_t           dev;
+    ino_t           ino;
+    time_t          mtime;          /* directory mtime when read */
+    time_t          read_time;      /* when the directory was read */
+    DWORD           last_used;
+    unsigned int    count;
+    unsigned int    mask;           /* number of buckets - 1 */
+    int            *buckets;
+    int            *short_buckets;  /* built on the first short name lookup */
+    BOOL            short_case;     /* ignore_case the short names were hashed with */
+    DOSFS_DIRENTRY *entries;
+    char           *names;
+} DOSFS_DIRINDEX;
+
+static DOSFS_DIRINDEX *DOSFS_DirCache[DOSFS_DIRCACHE_SIZE];
+static DWORD DOSFS_DirCacheClock;
+static BOOL DOSFS_DirCacheEnabled = FALSE;
+static CRITICAL_SECTION DOSFS_DirCacheCS;
+
 /* Info structure for FindFirstFile handle */
 typedef struct
 {
@@ -619,6 +659,290 @@ static void DOSFS_Hash( LPCSTR name, LPSTR buffer, BOOL dir_format,
 }
 
 
+/***********************************************************************
+ *           create_dosfs_cs
+ *
+ * Set up the directory index cache. Lookups made before this is called
+ * just scan the directory. WINEDIRCACHE=0 turns the cache off.
+ */
+void create_dosfs_cs(void)
+{
+    const char *env = getenv( "WINEDIRCACHE" );
+
+    InitializeCriticalSection( &DOSFS_DirCacheCS );
+    CRITICAL_SECTION_NAME( &DOSFS_DirCacheCS, "DOSFS_DirCacheCS" );
+    DOSFS_DirCacheEnabled = !env || (*env != '0');
+}
+
+
+/***********************************************************************
+ *           DOSFS_HashName
+ *
+ * Case-insensitive hash of the first 'len' chars of a file name.
+ */
+static unsigned int DOSFS_HashName( LPCSTR name, int len )
+{
+    unsigned int hash = 2166136261U;
+
+    while (len-- > 0)
+        hash = (hash ^ (unsigned char)FILE_tolower(*name++)) * 16777619U;
+    return hash;
+}
+
+
+/***********************************************************************
+ *           DOSFS_FreeDirIndex
+ */
+static void DOSFS_FreeDirIndex( DOSFS_DIRINDEX *index )
+{
+    if (!index) return;
+    HeapFree( GetProcessHeap(), 0, index->buckets );
+    HeapFree( GetProcessHeap(), 0, index->short_buckets );
+    HeapFree( GetProcessHeap(), 0, index->entries );
+    HeapFree( GetProcessHeap(), 0, index->names );
+    HeapFree( GetProcessHeap(), 0, index );
+}
+
+
+/***********************************************************************
+ *           DOSFS_ReadDirIndex
+ *
+ * Read the whole directory into a new index. Returns NULL on failure.
+ */
+static DOSFS_DIRINDEX *DOSFS_ReadDirIndex( LPCSTR path, const struct stat *st )
+{
+    DOSFS_DIRINDEX *index;
+    DOS_DIR *dir;
+    LPCSTR long_name, short_name;
+    unsigned int max_entries = 256, names_size = 4096, names_used = 0, i;
+    void *tmp;
+
+    if (!(index = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*index) )))
+        return NULL;
+    index->dev = st->st_dev;
+    index->ino = st->st_ino;
+    index->mtime = st->st_mtime;
+    index->read_time = time( NULL );
+
+    if (!(index->entries = HeapAlloc( GetProcessHeap(), 0, max_entries * sizeof(DOSFS_DIRENTRY) )) ||
+        !(index->names = HeapAlloc( GetProcessHeap(), 0, names_size )) ||
+        !(dir = DOSFS_OpenDir( path )))
+    {
+        DOSFS_FreeDirIndex( index );
+        return NULL;
+    }
+
+    while (DOSFS_ReadDir( dir, &long_name, &short_name ))
+    {
+        DOSFS_DIRENTRY *entry;
+        unsigned int len;
+
+        if ((dir->state == RDSTATE_REST) &&
+            (!strcmp (long_name, ".") || !strcmp (long_name, "..")))
+            continue;
+
+        len = strlen( long_name ) + 1;
+        if (index->count == max_entries)
+        {
+            if (!(tmp = HeapReAlloc( GetProcessHeap(), 0, index->entries,
+                                     max_entries * 2 * sizeof(DOSFS_DIRENTRY) )))
+                goto error;
+            index->entries = tmp;
+            max_entries *= 2;
+        }
+        while (names_used + len > names_size)
+        {
+            if (!(tmp = HeapReAlloc( GetProcessHeap(), 0, index->names, names_size * 2 )))
+                goto error;
+            index->names = tmp;
+            names_size *= 2;
+        }
+
+        entry = &index->entries[index->count++];
+        entry->hash = DOSFS_HashName( long_name, len - 1 );
+        entry->name_off = names_used;
+        entry->vfat_short = (short_name && short_name[0]);
+        if (entry->vfat_short) memcpy( entry->short_name, short_name, sizeof(entry->short_name) );
+        memcpy( index->names + names_used, long_name, len );
+        names_used += len;
+    }
+    DOSFS_CloseDir( dir );
+
+    /* Keep the chains short; one bucket per entry, rounded up to a power of 2 */
+    for (index->mask = 15; index->mask < index->count; index->mask = index->mask * 2 + 1);
+    if (!(index->buckets = HeapAlloc( GetProcessHeap(), 0, (index->mask + 1) * sizeof(int) )))
+    {
+        DOSFS_FreeDirIndex( index );
+        return NULL;
+    }
+    memset( index->buckets, 0xff, (index->mask + 1) * sizeof(int) );
+
+    /* Insert backwards so each chain is in directory order */
+    for (i = index->count; i-- > 0; )
+    {
+        int *bucket = &index->buckets[index->entries[i].hash & index->mask];
+        index->entries[i].next = *bucket;
+        *bucket = i;
+    }
+
+    TRACE( "indexed %u entries of %s\n", index->count, path );
+    return index;
+
+error:
+    DOSFS_CloseDir( dir );
+    DOSFS_FreeDirIndex( index );
+    return NULL;
+}
+
+
+/***********************************************************************
+ *           DOSFS_IndexShortNames
+ *
+ * Build the short name buckets of an index, hashing the long names the
+ * VFAT ioctl didn't give a short name for.
+ */
+static BOOL DOSFS_IndexShortNames( DOSFS_DIRINDEX *index, BOOL ignore_case )
+{
+    unsigned int i;
+
+    if (index->short_buckets && index->short_case == ignore_case) return TRUE;
+
+    if (!index->short_buckets &&
+        !(index->short_buckets = HeapAlloc( GetProcessHeap(), 0, (index->mask + 1) * sizeof(int) )))
+        return FALSE;
+    memset( index->short_buckets, 0xff, (index->mask + 1) * sizeof(int) );
+    index->short_case = ignore_case;
+
+    for (i = index->count; i-- > 0; )
+    {
+        DOSFS_DIRENTRY *entry = &index->entries[i];
+        int *bucket;
+
+        if (!entry->vfat_short)
+            DOSFS_Hash( index->names + entry->name_off, entry->short_name, TRUE, ignore_case );
+        bucket = &index->short_buckets[DOSFS_HashName( entry->short_name, 11 ) & index->mask];
+        entry->short_next = *bucket;
+        *bucket = i;
+    }
+    return TRUE;
+}
+
+
+/***********************************************************************
+ *           DOSFS_IndexLookup
+ *
+ * Look a name up in an index, first by long name then by short name.
+ * Returns the entry, or NULL.
+ */
+static DOSFS_DIRENTRY *DOSFS_IndexLookup( DOSFS_DIRINDEX *index, LPCSTR name, int len,
+                                          LPCSTR dos_name, BOOL ignore_case )
+{
+    unsigned int hash = DOSFS_HashName( name, len );
+    int i;
+
+    for (i = index->buckets[hash & index->mask]; i != -1; i = index->entries[i].next)
+    {
+        DOSFS_DIRENTRY *entry = &index->entries[i];
+        LPCSTR long_name = index->names + entry->name_off;
+
+        if (entry->hash != hash || long_name[len]) continue;
+        if (ignore_case ? !FILE_strncasecmp( long_name, name, len )
+                        : !strncmp( long_name, name, len ))
+            return entry;
+    }
+
+    if (!dos_name[0] || !DOSFS_IndexShortNames( index, ignore_case )) return NULL;
+
+    hash = DOSFS_HashName( dos_name, 11 );
+    for (i = index->short_buckets[hash & index->mask]; i != -1; i = index->entries[i].short_next)
+    {
+        if (!strcmp( dos_name, index->entries[i].short_name ))
+            return &index->entries[i];
+    }
+    return NULL;
+}
+
+
+/***********************************************************************
+ *           DOSFS_FindInDirIndex
+ *
+ * DOSFS_FindUnixName through the directory index cache. Returns 1 if the
+ * name was found, 0 if it isn't there and -1 if the directory couldn't
+ * be indexed.
+ */
+static int DOSFS_FindInDirIndex( LPCSTR path, LPCSTR name, int len, LPCSTR dos_name,
+                                 LPSTR long_buf, LPSTR short_buf, BOOL ignore_case )
+{
+    DOSFS_DIRINDEX *index = NULL;
+    DOSFS_DIRENTRY *entry;
+    struct stat st;
+    int i, slot = 0, ret = -1;
+    BOOL fresh = FALSE;
+
+    if (stat( *path ? path : "/", &st ) == -1) return -1;
+
+    EnterCriticalSection( &DOSFS_DirCacheCS );
+
+    for (i = 0; i < DOSFS_DIRCACHE_SIZE; i++)
+    {
+        DOSFS_DIRINDEX *cur = DOSFS_DirCache[i];
+
+        if (cur && cur->dev == st.st_dev && cur->ino == st.st_ino)
+        {
+            slot = i;
+            if (cur->mtime == st.st_mtime) index = cur;
+            break;
+        }
+        /* Otherwise remember the least recently used slot */
+        if (!cur || (DOSFS_DirCache[slot] && cur->last_used < DOSFS_DirCache[slot]->last_used))
+            slot = i;
+    }
+
+    for (;;)
+    {
+        if (!index)
+        {
+            DOSFS_FreeDirIndex( DOSFS_DirCache[slot] );
+            DOSFS_DirCache[slot] = index = DOSFS_ReadDirIndex( path, &st );
+            if (!index) break;
+            fresh = TRUE;
+        }
+        index->last_used = ++DOSFS_DirCacheClock;
+
+        if ((entry = DOSFS_IndexLookup( index, name, len, dos_name, ignore_case )))
+        {
+            LPCSTR long_name = index->names + entry->name_off;
+
+            if (long_buf) strcpy( long_buf, long_name );
+            if (short_buf)
+            {
+                if (entry->vfat_short)
+                    DOSFS_ToDosDTAFormat( entry->short_name, short_buf );
+                else
+                    DOSFS_Hash( long_name, short_buf, FALSE, ignore_case );
+            }
+            TRACE("(%s,%s) -> %s (%s)\n",
+                  path, name, long_name, short_buf ? short_buf : "***");
+            ret = 1;
+            break;
+        }
+
+        /* A change made later in the same second as the one the index was
+           read in wouldn't show up in the mtime */
+        if (fresh || index->read_time > index->mtime)
+        {
+            WARN("'%s' not found in '%s'\n", name, path);
+            ret = 0;
+            break;
+        }
+        index = NULL;
+    }
+
+    LeaveCriticalSection( &DOSFS_DirCacheCS );
+    return ret;
+}
+
+
 /***********************************************************************
  *           DOSFS_FindUnixName
  *
@@ -691,6 +1015,13 @@ BOOL DOSFS_FindUnixName (LPCSTR path, LPCSTR name, LPSTR long_buf,
     }
     HeapFree (GetProcessHeap (), 0, full_path);
 
+    if (DOSFS_DirCacheEnabled)
+    {
+        int found = DOSFS_FindInDirIndex( path, name, len, dos_name,
+                                          long_buf, short_buf, ignore_case );
+        if (found != -1) return found;
+    }
+
     if (!(dir = DOSFS_OpenDir( path )))
     {
         WARN("(%s,%s): can't open dir: %s\n",
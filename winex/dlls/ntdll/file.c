@@ -8,6 +8,7 @@
 #include "wine/server.h"
 #include "wine/debug.h"
 #include "ntdll_misc.h"
+#include "wine/file.h"
 
 #include "winternl.h"
 #include "winioctl.h"
@@ -262,6 +263,9 @@ NtSetInformationFile (HANDLE FileHandle, PIO_STATUS_BLOCK IoStatusBlock,
             }
             SERVER_END_REQ;
 
+            /* The handle's fd flags now include FD_FLAG_IOCOMPPORT */
+            FILE_InvalidateHandleFd (FileHandle);
+
             /* Output error if wrong handle type, as may be our problem */
             if (Ret == STATUS_INVALID_PARAMETER)
                ERR ("Failed to set I/O completion port - might be unsupported handle type?\n");
@@ -66,6 +66,7 @@ static DWORD fileio_get_async_status (const async_private *ovp);
 static DWORD fileio_get_async_count (const async_private *ovp);
 static void fileio_set_async_status (async_private *ovp, const DWORD status);
 static void CALLBACK fileio_call_completion_func (ULONG_PTR data);
+DWORD FILE_GetNtStatus (void);
 static void fileio_async_cleanup (async_private *ovp);
 
 static async_ops fileio_async_ops =
@@ -129,6 +130,251 @@ static void fileio_async_cleanup ( struct async_private *ovp )
     HeapFree ( GetProcessHeap(), 0, ovp );
 }
 
+/***********************************************************************
+ *                  Asynchronous file I/O engine
+ *
+ * Regular files always poll ready, so overlapped I/O on them that goes
+ * through the server async queue just ends up being done synchronously by
+ * the issuing thread.  Instead, such requests are queued to a small pool of
+ * I/O threads, which take them in batches (sorted by file and offset) and
+ * complete them the way finish_async does: set the OVERLAPPED status and
+ * event, and queue the completion routine to the issuing thread as an APC.
+ *
+ * Handles bound to a completion port, and requests with neither an event
+ * nor a completion routine (GetOverlappedResult then waits for an APC),
+ * still go through the server.  Requests handed to the I/O threads aren't
+ * seen by CancelIo, but they can't block for long either.  WINEAIO=0 turns
+ * the engine off, and WINEAIOTHREADS sets the number of I/O threads.
+ */
+#define FILE_AIO_THREADS        2
+#define FILE_AIO_MAX_THREADS    16
+#define FILE_AIO_BATCH          16  /* most requests a thread takes at once */
+
+typedef struct file_aio
+{
+    struct file_aio                  *next;
+    int                              fd;        /* owned by the request */
+    dev_t                            dev;       /* file identity, as each request has its own fd */
+    ino_t                            ino;
+    BOOL                             write;
+    char                             *buffer;
+    DWORD                            count;
+    off_t                            offset;
+    LPOVERLAPPED                     overlapped;
+    LPOVERLAPPED_COMPLETION_ROUTINE  completion_func;
+    HANDLE                           thread;    /* issuing thread, for completion_func */
+} file_aio;
+
+static CRITICAL_SECTION file_aio_cs;
+static file_aio *file_aio_head, *file_aio_tail;
+static HANDLE file_aio_event;
+static int file_aio_threads;            /* number of threads to use, 0 if disabled */
+static BOOL file_aio_started = FALSE;
+
+static void CALLBACK fileio_aio_completion_func (ULONG_PTR data)
+{
+    file_aio *aio = (file_aio *) data;
+    TRACE ("data: %p\n", aio);
+
+    aio->completion_func( RtlNtStatusToDosError ( aio->overlapped->Internal ),
+                          aio->overlapped->InternalHigh,
+                          aio->overlapped );
+
+    NtClose ( aio->thread );
+    HeapFree ( GetProcessHeap(), 0, aio );
+}
+
+/* do the I/O for one request and complete it */
+static void FILE_AioRun( file_aio *aio )
+{
+    LPOVERLAPPED overlapped = aio->overlapped;
+    NTSTATUS status = STATUS_SUCCESS;
+    DWORD done = 0;
+    int result;
+
+    TRACE("%s fd %d count %ld ofs %Ld\n", aio->write ? "write" : "read", aio->fd,
+          aio->count, (long long)aio->offset);
+
+    while (done < aio->count)
+    {
+        if (aio->write)
+            result = pwrite( aio->fd, aio->buffer + done, aio->count - done, aio->offset + done );
+        else
+            result = pread( aio->fd, aio->buffer + done, aio->count - done, aio->offset + done );
+
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            status = FILE_GetNtStatus();
+            break;
+        }
+        if (!result) break;  /* end of file */
+        done += result;
+    }
+    if (!aio->write && !done && aio->count && status == STATUS_SUCCESS)
+        status = STATUS_END_OF_FILE;
+    close( aio->fd );
+
+    overlapped->InternalHigh = done;
+    overlapped->Internal = status;
+    if (overlapped->hEvent && overlapped->hEvent != INVALID_HANDLE_VALUE)
+        NtSetEvent( overlapped->hEvent, NULL );
+
+    /* like finish_async, no completion routine if the setup was bad */
+    if (aio->completion_func && status != STATUS_INVALID_PARAMETER &&
+        QueueUserAPC( fileio_aio_completion_func, aio->thread, (ULONG_PTR)aio ))
+        return;
+
+    if (aio->thread) NtClose( aio->thread );
+    HeapFree( GetProcessHeap(), 0, aio );
+}
+
+static DWORD CALLBACK FILE_AioThread( LPVOID arg )
+{
+    file_aio *batch[FILE_AIO_BATCH];
+    int i, j, count;
+    BOOL more;
+
+    for (;;)
+    {
+        WaitForSingleObject( file_aio_event, INFINITE );
+
+        for (;;)
+        {
+            EnterCriticalSection( &file_aio_cs );
+            for (count = 0; count < FILE_AIO_BATCH && file_aio_head; count++)
+            {
+                batch[count] = file_aio_head;
+                if (!(file_aio_head = file_aio_head->next)) file_aio_tail = NULL;
+            }
+            more = (file_aio_head != NULL);
+            LeaveCriticalSection( &file_aio_cs );
+
+            if (!count) break;
+            /* leave the rest to another thread */
+            if (more) NtSetEvent( file_aio_event, NULL );
+
+            /* sort by file and offset, to keep accesses sequential */
+            for (i = 1; i < count; i++)
+            {
+                file_aio *aio = batch[i];
+
+                for (j = i; j > 0; j--)
+                {
+                    file_aio *prev = batch[j - 1];
+
+                    if (prev->dev != aio->dev)
+                    {
+                        if (prev->dev < aio->dev) break;
+                    }
+                    else if (prev->ino != aio->ino)
+                    {
+                        if (prev->ino < aio->ino) break;
+                    }
+                    else if (prev->offset <= aio->offset) break;
+                    batch[j] = prev;
+                }
+                batch[j] = aio;
+            }
+
+            for (i = 0; i < count; i++) FILE_AioRun( batch[i] );
+        }
+    }
+    return 0;
+}
+
+/* start the I/O threads; must hold file_aio_cs */
+static BOOL FILE_AioStart(void)
+{
+    HANDLE thread;
+    int i;
+
+    if (NtCreateEvent( &file_aio_event, EVENT_ALL_ACCESS, NULL, FALSE, FALSE ) != STATUS_SUCCESS)
+    {
+        ERR("could not create the I/O thread event, disabling the async I/O engine\n");
+        file_aio_event = 0;
+        file_aio_threads = 0;
+        return FALSE;
+    }
+
+    for (i = 0; i < file_aio_threads; i++)
+    {
+        if (!(thread = CreateThread( NULL, 0, FILE_AioThread, NULL, 0, NULL ))) break;
+        CloseHandle( thread );
+    }
+    if (!i)
+    {
+        ERR("could not create any I/O thread, disabling the async I/O engine\n");
+        NtClose( file_aio_event );
+        file_aio_event = 0;
+        file_aio_threads = 0;
+        return FALSE;
+    }
+
+    TRACE("started %d I/O threads\n", i);
+    file_aio_started = TRUE;
+    return TRUE;
+}
+
+/***********************************************************************
+ *              FILE_AioSubmit                (INTERNAL)
+ *
+ * Hand an overlapped request on a regular file to the I/O threads. On
+ * success the fd belongs to the request; returns FALSE if the request has
+ * to go through the server instead. <st> is the fd's stat, which
+ * identifies the file for ordering the requests.
+ */
+static BOOL FILE_AioSubmit( int fd, const struct stat *st, BOOL write, LPVOID buffer,
+                            DWORD count, LPOVERLAPPED overlapped,
+                            LPOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine )
+{
+    file_aio *aio;
+
+    if (!file_aio_threads) return FALSE;
+    if (!lpCompletionRoutine &&
+        (!overlapped->hEvent || overlapped->hEvent == INVALID_HANDLE_VALUE))
+        return FALSE;
+
+    if (!(aio = HeapAlloc( GetProcessHeap(), 0, sizeof(*aio) ))) return FALSE;
+    aio->next            = NULL;
+    aio->fd              = fd;
+    aio->dev             = st->st_dev;
+    aio->ino             = st->st_ino;
+    aio->write           = write;
+    aio->buffer          = buffer;
+    aio->count           = count;
+    aio->offset          = OVERLAPPED_OFFSET( overlapped );
+    aio->overlapped      = overlapped;
+    aio->completion_func = lpCompletionRoutine;
+    aio->thread          = 0;
+
+    if (lpCompletionRoutine &&
+        !DuplicateHandle( GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(),
+                          &aio->thread, 0, FALSE, DUPLICATE_SAME_ACCESS ))
+    {
+        HeapFree( GetProcessHeap(), 0, aio );
+        return FALSE;
+    }
+
+    overlapped->Internal = STATUS_PENDING;
+
+    EnterCriticalSection( &file_aio_cs );
+    if (!file_aio_started && !FILE_AioStart())
+    {
+        LeaveCriticalSection( &file_aio_cs );
+        if (aio->thread) NtClose( aio->thread );
+        HeapFree( GetProcessHeap(), 0, aio );
+        return FALSE;
+    }
+    if (file_aio_tail) file_aio_tail->next = aio;
+    else file_aio_head = aio;
+    file_aio_tail = aio;
+    LeaveCriticalSection( &file_aio_cs );
+
+    NtSetEvent( file_aio_event, NULL );
+    return TRUE;
+}
+
 /***********************************************************************/
 
 #if defined(MAP_ANONYMOUS) && !defined(MAP_ANON)
@@ -145,10 +391,127 @@ static HANDLE dos_handles[DOS_TABLE_SIZE];
 
 static CRITICAL_SECTION FILE_sync_cs;
 
+/* Client side cache of the unix fd the server keeps for each file handle,
+ * so that steady state I/O doesn't need a get_handle_fd round trip.  Only
+ * plain files and pipes are cached, as their type and flags can't change
+ * behind our back except through a completion port binding, which
+ * invalidates the entry.  Handles closed by another process with
+ * DuplicateHandle(DUP_HANDLE_CLOSE_SOURCE) aren't noticed; set
+ * WINEFDCACHE=0 to turn the cache off if that's a problem. */
+#define FD_CACHE_SIZE 256   /* must be a power of 2 */
+
+typedef struct
+{
+    handle_t     handle;    /* 0 if the entry is free */
+    int          fd;        /* the handle's fd; owned by the handle, never closed here */
+    unsigned int access;    /* access rights the server has granted so far */
+    int          type;
+    int          flags;
+} FD_CACHE_ENTRY;
+
+static FD_CACHE_ENTRY fd_cache[FD_CACHE_SIZE];
+static CRITICAL_SECTION fd_cache_cs;
+static unsigned int fd_cache_gen;   /* bumped on every invalidation */
+static BOOL fd_cache_enabled = FALSE;
+
 void create_file_cs(void)
 {
+  const char *env = getenv( "WINEFDCACHE" );
+
   InitializeCriticalSection( &FILE_sync_cs );
   CRITICAL_SECTION_NAME( &FILE_sync_cs, "FILE_sync_cs" );
+
+  InitializeCriticalSection( &fd_cache_cs );
+  CRITICAL_SECTION_NAME( &fd_cache_cs, "fd_cache_cs" );
+  fd_cache_enabled = !env || (*env != '0');
+
+  InitializeCriticalSection( &file_aio_cs );
+  CRITICAL_SECTION_NAME( &file_aio_cs, "file_aio_cs" );
+  env = getenv( "WINEAIO" );
+  if (!env || (*env != '0'))
+  {
+      file_aio_threads = FILE_AIO_THREADS;
+      if ((env = getenv( "WINEAIOTHREADS" )) && atoi( env ) > 0)
+          file_aio_threads = min( atoi( env ), FILE_AIO_MAX_THREADS );
+  }
+}
+
+
+/***********************************************************************
+ *              fd_cache_lookup
+ *
+ * Look up the cached fd for <handle>.  Only succeeds if the server has
+ * already granted all of <access> on it.
+ */
+static BOOL fd_cache_lookup( handle_t handle, unsigned int access, int *fd,
+                             enum fd_type *type, int *flags )
+{
+    FD_CACHE_ENTRY *entry = &fd_cache[(unsigned int)handle & (FD_CACHE_SIZE - 1)];
+    BOOL ret = FALSE;
+
+    EnterCriticalSection( &fd_cache_cs );
+    if (entry->handle == handle && !(access & ~entry->access))
+    {
+        *fd = entry->fd;
+        if (type) *type = entry->type;
+        if (flags) *flags = entry->flags;
+        ret = TRUE;
+    }
+    LeaveCriticalSection( &fd_cache_cs );
+    return ret;
+}
+
+
+/***********************************************************************
+ *              fd_cache_store
+ *
+ * Remember the fd the server returned for <handle>.  Nothing is stored if
+ * the cache was invalidated since <gen> was read, as the handle may have
+ * been closed while the request was in flight.
+ */
+static void fd_cache_store( handle_t handle, unsigned int access, int fd,
+                            enum fd_type type, int flags, unsigned int gen )
+{
+    FD_CACHE_ENTRY *entry = &fd_cache[(unsigned int)handle & (FD_CACHE_SIZE - 1)];
+
+    if (type != FD_TYPE_DEFAULT ||
+        (flags & (FD_FLAG_TIMEOUT | FD_FLAG_RECV_SHUTDOWN | FD_FLAG_SEND_SHUTDOWN)))
+        return;
+
+    EnterCriticalSection( &fd_cache_cs );
+    if (gen == fd_cache_gen)
+    {
+        if (entry->handle == handle && entry->fd == fd)
+            entry->access |= access;
+        else
+        {
+            entry->handle = handle;
+            entry->fd     = fd;
+            entry->access = access;
+            entry->type   = type;
+            entry->flags  = flags;
+        }
+    }
+    LeaveCriticalSection( &fd_cache_cs );
+}
+
+
+/***********************************************************************
+ *              FILE_InvalidateHandleFd
+ *
+ * Forget the cached fd for <handle>.  Must be called before anything
+ * that closes the handle or changes its fd flags.
+ */
+void FILE_InvalidateHandleFd( HANDLE handle )
+{
+    FD_CACHE_ENTRY *entry = &fd_cache[(unsigned int)handle & (FD_CACHE_SIZE - 1)];
+
+    if (!fd_cache_enabled) return;
+
+    EnterCriticalSection( &fd_cache_cs );
+    fd_cache_gen++;
+    if (entry->handle == handle) entry->handle = 0;
+    LeaveCriticalSection( &fd_cache_cs );
 }
 
 
@@ -360,8 +723,13 @@ HANDLE FILE_DupUnixHandle( int fd, DWORD access, BOOL inherit )
 int wine_server_handle_to_fd( handle_t handle, unsigned int access, int *unix_fd, enum fd_type *type, int *flags )
 {
     int ret, fd = -1;
+    unsigned int gen = fd_cache_gen;
 
     *unix_fd = -1;
+
+    if (fd_cache_enabled && fd_cache_lookup( handle, access, &fd, type, flags ))
+        goto done;
+
     do
     {
         SERVER_START_REQ( get_handle_fd )
@@ -386,6 +754,10 @@ int wine_server_handle_to_fd( handle_t handle, unsigned int access, int *unix_fd
     if (fd == -1) /* Couldn't get the fd - possibly ejected disk */
         SetLastError( ERROR_NOT_READY);
 
+    if (fd != -1 && fd_cache_enabled && type && flags)
+        fd_cache_store( handle, access, fd, *type, *flags, gen );
+
+done:
     if (fd != -1)
     {
         if ((fd = dup(fd)) == -1)
@@ -1788,6 +2160,12 @@ static BOOL FILE_ReadFileEx(HANDLE hFile, LPVOID buffer, DWORD bytesToRead,
           SetLastError (ERROR_HANDLE_EOF);
           return FALSE;
        }
+
+       /* regular files never block, let the I/O threads do the work */
+       if ((type == FD_TYPE_DEFAULT) && S_ISREG (StatBuf.st_mode) &&
+           !(flags & FD_FLAG_IOCOMPPORT) &&
+           FILE_AioSubmit (fd, &StatBuf, FALSE, buffer, bytesToRead, overlapped, lpCompletionRoutine))
+          return TRUE;
     }
 
     ovp = (async_fileio*) HeapAlloc(GetProcessHeap(), 0, sizeof (async_fileio));
@@ -2156,6 +2534,7 @@ static BOOL FILE_WriteFileEx(HANDLE hFile, LPCVOID buffer, DWORD bytesToWrite,
     int fd;
     DWORD flags;
     enum fd_type type;
+    struct stat StatBuf;
 
     TRACE("file %d to buf %p num %ld %p func %p\n",
 	  hFile, buffer, bytesToWrite, overlapped, lpCompletionRoutine);
@@ -2207,6 +2586,12 @@ static BOOL FILE_WriteFileEx(HANDLE hFile, LPCVOID buffer, DWORD bytesToWrite,
         return FALSE;
     }
 
+    /* regular files never block, let the I/O threads do the work */
+    if ((type == FD_TYPE_DEFAULT) && !(flags & FD_FLAG_IOCOMPPORT) &&
+        !fstat (fd, &StatBuf) && S_ISREG (StatBuf.st_mode) &&
+        FILE_AioSubmit (fd, &StatBuf, TRUE, (LPVOID)buffer, bytesToWrite, overlapped, lpCompletionRoutine))
+        return TRUE;
+
     ovp = (async_fileio*) HeapAlloc(GetProcessHeap(), 0, sizeof (async_fileio));
     if(!ovp)
     {
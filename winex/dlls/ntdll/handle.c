@@ -13,7 +13,9 @@
 #include "wine/server.h"
 #include "winerror.h"
 #include "wine/mem_file.h"
+#include "wine/file.h"
 #include "wine/debug.h"
+#include "ntdll_misc.h"
 
 WINE_DEFAULT_DEBUG_CHANNEL(win32);
 
@@ -67,6 +69,10 @@ BOOL WINAPI GetHandleInformation( HANDLE handle, LPDWORD flags )
 BOOL WINAPI SetHandleInformation( HANDLE handle, DWORD mask, DWORD flags )
 {
     BOOL ret;
+
+    /* an inheritable handle can be changed by child processes */
+    if (mask & flags & HANDLE_FLAG_INHERIT) SYNC_ForgetHandle( handle );
+
     SERVER_START_REQ( set_handle_info )
     {
         req->handle = handle;
@@ -88,6 +94,15 @@ BOOL WINAPI DuplicateHandle( HANDLE source_process, HANDLE source,
                                DWORD access, BOOL inherit, DWORD options )
 {
     BOOL ret;
+
+    if (options & DUP_HANDLE_CLOSE_SOURCE)
+    {
+        FILE_InvalidateHandleFd( source );
+        REG_InvalidateHandle( source );
+    }
+    /* the copy may end up in another process */
+    SYNC_ForgetHandle( source );
+
     SERVER_START_REQ( dup_handle )
     {
         req->src_process = source_process;
@@ -8,8 +8,17 @@
 */
 #include "config.h"
 
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
 #include "winternl.h"
 #include "thread.h"
+#include "services.h"
 #include "wine/debug.h"
 #include "heapfuncs.h"
 
@@ -27,18 +36,93 @@ WINE_DEFAULT_DEBUG_CHANNEL(heap);
 #define HEAP_DEF_SIZE        0x110000   /* Default heap size = 1Mb + 64Kb */
 
 
+/* Per-thread cache parameters. Requests up to HEAP_CACHE_MAX_SIZE bytes
+   (including the trailing user size dword) are rounded up to a multiple of
+   HEAP_CACHE_GRANULARITY and served from a per-thread free list for that
+   size class, only touching the mspace (and its lock) in batches */
+#define HEAP_CACHE_GRANULARITY 16
+#define HEAP_CACHE_BINS        32
+#define HEAP_CACHE_MAX_SIZE    (HEAP_CACHE_BINS * HEAP_CACHE_GRANULARITY)
+#define HEAP_CACHE_BIN_DEPTH   16      /* most blocks held per size class */
+#define HEAP_CACHE_BATCH       8       /* blocks moved per refill/flush */
+
+
+/* Heap usage report. WINEHEAPREPORT names the file to append reports to
+   ("-" for stderr); one is written on SIGQUIT and one at exit. Requested
+   sizes are bucketed by power of two, and the HEAP_REPORT_TOP_SIZES exact
+   sizes holding the most bytes are listed. The signal only flags the
+   report; the service thread polls for it every HEAP_REPORT_POLL ms */
+#define HEAP_REPORT_SIGNAL     SIGQUIT
+#define HEAP_REPORT_POLL       1000
+#define HEAP_REPORT_CLASSES    32
+#define HEAP_REPORT_SIZE_SLOTS 4096    /* must be a power of 2 */
+#define HEAP_REPORT_TOP_SIZES  16
+
+
 /* Structure for holding per-heap information */
-typedef struct {
+typedef struct _HeapInfo_t {
     DWORD            Magic;
     mspace           MSpace;
     DWORD            Flags;
     DWORD            InitialCommit;
     CRITICAL_SECTION CS;
+    /* Lowest and highest block addresses ever handed out by the mspace.
+       Only grows, under CS; read without locking to reject foreign
+       pointers before they reach a thread cache */
+    char            *LowBlock;
+    char            *HighBlock;
+    struct _HeapInfo_t *Next;   /* in gHeapList, under gHeapListCS */
 } HeapInfo_t;
 
 
+/* A cached block is linked through its first dword; the second dword holds
+   gHeapCacheCookie while the block sits in any thread's cache, so a double
+   free is caught even when it comes from another thread */
+typedef struct _HeapCacheBlock_t {
+    struct _HeapCacheBlock_t *Next;
+    LONG                      Cookie;
+} HeapCacheBlock_t;
+
+typedef struct {
+    HeapCacheBlock_t *Head;
+    DWORD             Count;
+} HeapCacheBin_t;
+
+/* Hangs off TEB->heap_cache; only ever touched by its own thread, until
+   the thread dies and it is queued on gOrphanCaches */
+typedef struct _HeapThreadCache_t {
+    HeapCacheBin_t   Bins[HEAP_CACHE_BINS];
+    HEAP_CACHE_STATS Stats;     /* not yet folded into gHeapCacheStats */
+    struct _HeapThreadCache_t *NextOrphan;
+} HeapThreadCache_t;
+
+/* TEB->heap_cache of a thread that has already given its cache back */
+#define HEAP_CACHE_DETACHED ((HeapThreadCache_t *)-1)
+
+
 static HeapInfo_t *gProcessHeap;
 
+/* Every live heap, process heap first, for RtlGetProcessHeaps */
+static HeapInfo_t *gHeapList;
+static CRITICAL_SECTION gHeapListCS;
+
+static const char *gHeapReportFile;
+static volatile LONG gHeapReportPending;
+
+/* One exact requested size in a heap report */
+typedef struct {
+    ULONG Size;
+    ULONG Count;
+} HeapReportSize_t;
+
+static BOOL gHeapCacheEnabled = TRUE;
+static LONG gHeapCacheCookie;
+/* Caches of threads that died without a chance to flush them; emptied by
+   whoever next holds the process heap lock */
+static HeapThreadCache_t *gOrphanCaches;
+/* Written under gProcessHeap->CS, read without it by HEAP_GetCacheStats */
+static HEAP_CACHE_STATS gHeapCacheStats;
+
 
 /* SetLastError for ntdll */
 inline static void set_status( NTSTATUS status )
@@ -67,6 +151,561 @@ inline static HeapInfo_t *get_heap_ptr (HANDLE hHeap)
 }
 
 
+/* Record a block handed out by the mspace; must hold pHeap->CS */
+inline static void note_block (HeapInfo_t *pHeap, void *pMem)
+{
+    if (!pHeap->LowBlock || ((char *)pMem < pHeap->LowBlock))
+        pHeap->LowBlock = pMem;
+    if ((char *)pMem > pHeap->HighBlock)
+        pHeap->HighBlock = pMem;
+}
+
+
+/* Fold the thread's counters into the process totals; must hold the
+   process heap's CS */
+static void cache_merge_stats (HeapThreadCache_t *pCache)
+{
+    gHeapCacheStats.AllocHits   += pCache->Stats.AllocHits;
+    gHeapCacheStats.AllocMisses += pCache->Stats.AllocMisses;
+    gHeapCacheStats.FreeHits    += pCache->Stats.FreeHits;
+    gHeapCacheStats.FreeMisses  += pCache->Stats.FreeMisses;
+    gHeapCacheStats.Refills     += pCache->Stats.Refills;
+    gHeapCacheStats.Flushes     += pCache->Stats.Flushes;
+    memset (&pCache->Stats, 0, sizeof (pCache->Stats));
+}
+
+
+/* Get the calling thread's cache for the process heap, creating it on
+   first use. Returns NULL if caching is disabled or doesn't apply */
+static HeapThreadCache_t *get_thread_cache (HeapInfo_t *pHeap, ULONG flags)
+{
+    HeapThreadCache_t *pCache;
+
+    if ((pHeap != gProcessHeap) || !gHeapCacheEnabled ||
+        (flags & HEAP_CREATE_ALIGN_16))
+        return NULL;
+
+    pCache = NtCurrentTeb()->heap_cache;
+    if (pCache == HEAP_CACHE_DETACHED)
+        return NULL;
+    if (!pCache)
+    {
+        pCache = (HeapThreadCache_t *)calloc (1, sizeof (HeapThreadCache_t));
+        NtCurrentTeb()->heap_cache = pCache;
+    }
+
+    return pCache;
+}
+
+
+/* Return up to <count> blocks from a bin to the mspace. Blocks only got
+   the lock free checks when they entered the cache, so validate them here,
+   where we hold the lock anyway */
+static void cache_flush_bin (HeapInfo_t *pHeap, HeapThreadCache_t *pCache,
+                             HeapCacheBin_t *pBin, DWORD count)
+{
+    HeapCacheBlock_t *pBlock;
+
+    while (count-- && (pBlock = pBin->Head))
+    {
+        pBin->Head = pBlock->Next;
+        pBin->Count--;
+
+        if (!mspace_validate (pHeap->MSpace, pBlock))
+            ERR ("block %p isn't a valid part of heap %p\n", pBlock, pHeap);
+        else
+        {
+            /* Don't let the cookie survive into a later allocation */
+            pBlock->Cookie = 0;
+            mspace_free (pHeap->MSpace, pBlock);
+        }
+    }
+
+    pCache->Stats.Flushes++;
+}
+
+
+/* Return every block in a thread cache to the process heap; must hold
+   pHeap->CS */
+static void cache_empty (HeapInfo_t *pHeap, HeapThreadCache_t *pCache)
+{
+    DWORD i;
+
+    for (i = 0; i < HEAP_CACHE_BINS; i++)
+    {
+        if (pCache->Bins[i].Head)
+            cache_flush_bin (pHeap, pCache, &pCache->Bins[i],
+                             pCache->Bins[i].Count);
+    }
+    cache_merge_stats (pCache);
+}
+
+
+/* Empty and free the caches of threads that died since the last call;
+   must hold pHeap->CS */
+static void cache_reap_orphans (HeapInfo_t *pHeap)
+{
+    HeapThreadCache_t *pCache, *pNext;
+
+    if (!gOrphanCaches)
+        return;
+
+    pCache = InterlockedExchangePointer ((PVOID *)&gOrphanCaches, NULL);
+    for (; pCache; pCache = pNext)
+    {
+        pNext = pCache->NextOrphan;
+        cache_empty (pHeap, pCache);
+        free (pCache);
+    }
+}
+
+
+/* Allocate a block of <size> bytes (already padded for the user size
+   dword) from the thread cache. Returns NULL if the size isn't cached or
+   the mspace is exhausted */
+static void *cache_alloc (HeapInfo_t *pHeap, HeapThreadCache_t *pCache,
+                          ULONG flags, ULONG size)
+{
+    HeapCacheBin_t *pBin;
+    HeapCacheBlock_t *pBlock;
+    ULONG ClassSize;
+
+    if (size > HEAP_CACHE_MAX_SIZE)
+        return NULL;
+
+    pBin = &pCache->Bins[(size - 1) / HEAP_CACHE_GRANULARITY];
+
+    if (!pBin->Head)
+    {
+        /* Refill a batch at once, so the lock is taken once per
+           HEAP_CACHE_BATCH allocations at most */
+        DWORD i;
+
+        ClassSize = ((size - 1) / HEAP_CACHE_GRANULARITY + 1) *
+                    HEAP_CACHE_GRANULARITY;
+        pCache->Stats.AllocMisses++;
+
+        if (!(flags & HEAP_NO_SERIALIZE))
+            RtlEnterCriticalSection (&pHeap->CS);
+
+        for (i = 0; i < HEAP_CACHE_BATCH; i++)
+        {
+            pBlock = mspace_malloc (pHeap->MSpace, ClassSize);
+            if (!pBlock)
+                break;
+            note_block (pHeap, pBlock);
+            pBlock->Next = pBin->Head;
+            pBlock->Cookie = gHeapCacheCookie;
+            pBin->Head = pBlock;
+            pBin->Count++;
+        }
+        pCache->Stats.Refills++;
+        cache_merge_stats (pCache);
+        cache_reap_orphans (pHeap);
+
+        if (!(flags & HEAP_NO_SERIALIZE))
+            RtlLeaveCriticalSection (&pHeap->CS);
+
+        if (!pBin->Head)
+            return NULL;
+    }
+    else
+        pCache->Stats.AllocHits++;
+
+    pBlock = pBin->Head;
+    pBin->Head = pBlock->Next;
+    pBin->Count--;
+    pBlock->Cookie = 0;
+
+    return pBlock;
+}
+
+
+/* Put a block into the thread cache. Returns 1 if the block was cached,
+   0 if it isn't cacheable and should take the normal path, or -1 if it is
+   already in the cache */
+static int cache_free (HeapInfo_t *pHeap, HeapThreadCache_t *pCache,
+                        ULONG flags, PVOID ptr)
+{
+    HeapCacheBin_t *pBin;
+    HeapCacheBlock_t *pBlock = (HeapCacheBlock_t *)ptr;
+    size_t ChunkSize;
+    LONG Cookie;
+
+    /* Anything outside the range the mspace ever returned gets the full
+       validation of the normal path */
+    if (((ULONG_PTR)ptr & (sizeof (void *) - 1)) ||
+        ((char *)ptr < pHeap->LowBlock) || ((char *)ptr > pHeap->HighBlock))
+        return 0;
+
+    /* The range spans gaps between segments and blocks of other heaps, so
+       only a pointer the mspace vouches for is touched; mspace_owns does
+       mspace_validate's segment and size checks without the lock */
+    if (!mspace_owns (pHeap->MSpace, ptr, &ChunkSize))
+        return 0;
+
+    if ((ChunkSize < HEAP_CACHE_GRANULARITY) ||
+        (ChunkSize >= HEAP_CACHE_MAX_SIZE + HEAP_CACHE_GRANULARITY))
+        return 0;
+
+    /* Claim the block for the cache. A block that already carries the
+       cookie is sitting in this or another thread's cache */
+    Cookie = pBlock->Cookie;
+    if ((Cookie == gHeapCacheCookie) ||
+        (InterlockedCompareExchange (&pBlock->Cookie, gHeapCacheCookie,
+                                     Cookie) != Cookie))
+    {
+        ERR ("block %p freed twice in heap %p\n", ptr, pHeap);
+        return -1;
+    }
+
+    /* A chunk is cached in the largest class it can fully satisfy */
+    pBin = &pCache->Bins[ChunkSize / HEAP_CACHE_GRANULARITY - 1];
+
+    if (pBin->Count >= HEAP_CACHE_BIN_DEPTH)
+    {
+        if (!(flags & HEAP_NO_SERIALIZE))
+            RtlEnterCriticalSection (&pHeap->CS);
+
+        cache_flush_bin (pHeap, pCache, pBin, HEAP_CACHE_BATCH);
+        cache_merge_stats (pCache);
+        cache_reap_orphans (pHeap);
+
+        if (!(flags & HEAP_NO_SERIALIZE))
+            RtlLeaveCriticalSection (&pHeap->CS);
+    }
+
+    pBlock->Next = pBin->Head;
+    pBin->Head = pBlock;
+    pBin->Count++;
+    pCache->Stats.FreeHits++;
+
+    return 1;
+}
+
+
+/* Return every block in a thread cache to the process heap */
+static void cache_flush_all (HeapInfo_t *pHeap, HeapThreadCache_t *pCache)
+{
+    RtlEnterCriticalSection (&pHeap->CS);
+    cache_empty (pHeap, pCache);
+    cache_reap_orphans (pHeap);
+    RtlLeaveCriticalSection (&pHeap->CS);
+}
+
+
+/* Dump the cache counters at exit, if requested with WINEHEAPSTATS */
+static void report_heap_cache_stats (void)
+{
+    HEAP_CACHE_STATS Stats;
+
+    HEAP_GetCacheStats (&Stats);
+    fprintf (stderr, "Process heap cache: alloc hits %lu misses %lu, "
+             "free hits %lu misses %lu, refills %lu, flushes %lu\n",
+             Stats.AllocHits, Stats.AllocMisses, Stats.FreeHits,
+             Stats.FreeMisses, Stats.Refills, Stats.Flushes);
+}
+
+
+/***********************************************************************
+ *           HEAP_GetCacheStats
+ *
+ * Retrieve the process heap's per-thread cache counters. Each thread's
+ * counters are folded in whenever it refills or flushes, so these lag
+ * by at most one batch per thread. The totals are read without the heap
+ * lock, so a reporter never waits behind a busy heap; a count being
+ * folded in at the same time may be missed.
+ */
+void HEAP_GetCacheStats (HEAP_CACHE_STATS *stats)
+{
+    HeapThreadCache_t *pCache = NtCurrentTeb()->heap_cache;
+
+    memset (stats, 0, sizeof (*stats));
+    if (!gProcessHeap)
+        return;
+
+    *stats = *(volatile HEAP_CACHE_STATS *)&gHeapCacheStats;
+
+    /* Add the calling thread's own unfolded counts */
+    if (pCache && (pCache != HEAP_CACHE_DETACHED))
+    {
+        stats->AllocHits   += pCache->Stats.AllocHits;
+        stats->AllocMisses += pCache->Stats.AllocMisses;
+        stats->FreeHits    += pCache->Stats.FreeHits;
+        stats->FreeMisses  += pCache->Stats.FreeMisses;
+        stats->Refills     += pCache->Stats.Refills;
+        stats->Flushes     += pCache->Stats.Flushes;
+    }
+}
+
+
+/***********************************************************************
+ *           HEAP_ThreadDetach
+ *
+ * Release the calling thread's heap cache. Called on the way out of every
+ * thread that exits normally; the thread can't cache anything afterwards.
+ */
+void HEAP_ThreadDetach (void)
+{
+    HeapThreadCache_t *pCache = NtCurrentTeb()->heap_cache;
+
+    NtCurrentTeb()->heap_cache = HEAP_CACHE_DETACHED;
+    if (!pCache || (pCache == HEAP_CACHE_DETACHED))
+        return;
+
+    if (gProcessHeap)
+        cache_flush_all (gProcessHeap, pCache);
+    free (pCache);
+}
+
+
+/***********************************************************************
+ *           HEAP_ThreadAbort
+ *
+ * Hand the cache of a thread that is being killed (TerminateThread, or a
+ * lost server connection) to the next thread that takes the process heap
+ * lock. The dying thread may have been interrupted anywhere, so it can't
+ * take the lock itself.
+ */
+void HEAP_ThreadAbort (void)
+{
+    HeapThreadCache_t *pCache = NtCurrentTeb()->heap_cache;
+
+    NtCurrentTeb()->heap_cache = HEAP_CACHE_DETACHED;
+    if (!pCache || (pCache == HEAP_CACHE_DETACHED))
+        return;
+
+    do pCache->NextOrphan = gOrphanCaches;
+    while (InterlockedCompareExchangePointer ((PVOID *)&gOrphanCaches, pCache,
+                                              pCache->NextOrphan) != pCache->NextOrphan);
+}
+
+
+/* Requested size of an in use block; blocks parked in a thread cache still
+   hold their last user's size. Must hold pHeap->CS */
+static ULONG get_user_size (void *pMem)
+{
+    ULONG ChunkSize = mspace_usable_size (pMem);
+    ULONG UserSize;
+
+    if (ChunkSize < sizeof (ULONG))
+        return 0;
+
+    memcpy (&UserSize, (char *)pMem + ChunkSize - sizeof (ULONG),
+            sizeof (ULONG));
+    if (UserSize > ChunkSize - sizeof (ULONG))
+        UserSize = ChunkSize - sizeof (ULONG);
+    return UserSize;
+}
+
+
+/* Count one more block of <Size> bytes in the report's size table. Sizes
+   that don't fit once the table is full are left out of the top list */
+static void report_count_size (HeapReportSize_t *pSizes, ULONG Size)
+{
+    ULONG i = (Size * 2654435761U) & (HEAP_REPORT_SIZE_SLOTS - 1);
+    ULONG n;
+
+    for (n = 0; n < HEAP_REPORT_SIZE_SLOTS; n++)
+    {
+        HeapReportSize_t *pSlot = &pSizes[(i + n) & (HEAP_REPORT_SIZE_SLOTS - 1)];
+
+        if (!pSlot->Count)
+            pSlot->Size = Size;
+        if (pSlot->Size == Size)
+        {
+            pSlot->Count++;
+            return;
+        }
+    }
+}
+
+
+/* Walk one heap and write its usage to <out>. Heaps that are busy are
+   skipped rather than waited for, as the reporting thread may already hold
+   another heap's lock */
+static void report_heap (FILE *out, HeapInfo_t *pHeap, HeapReportSize_t *pSizes)
+{
+    ULONG ClassCount[HEAP_REPORT_CLASSES], ClassBytes[HEAP_REPORT_CLASSES];
+    HeapReportSize_t Top[HEAP_REPORT_TOP_SIZES];
+    ULONG BusyCount = 0, BusyBytes = 0, UserBytes = 0;
+    ULONG FreeCount = 0, FreeBytes = 0, LargestFree = 0;
+    ULONG Footprint, MaxFootprint, Fragmentation = 0;
+    void *pMem = NULL;
+    size_t Size;
+    int InUse;
+    ULONG i, j;
+
+    if (pHeap->Flags & HEAP_NO_SERIALIZE)
+    {
+        fprintf (out, "heap %p: not serialized, skipped\n", pHeap);
+        return;
+    }
+    if (!RtlTryEnterCriticalSection (&pHeap->CS))
+    {
+        fprintf (out, "heap %p: busy, skipped\n", pHeap);
+        return;
+    }
+
+    memset (ClassCount, 0, sizeof (ClassCount));
+    memset (ClassBytes, 0, sizeof (ClassBytes));
+    memset (pSizes, 0, HEAP_REPORT_SIZE_SLOTS * sizeof (*pSizes));
+
+    while (mspace_walk (pHeap->MSpace, &pMem, &Size, &InUse))
+    {
+        if (InUse)
+        {
+            ULONG UserSize = get_user_size (pMem);
+
+            for (i = 0; (i < HEAP_REPORT_CLASSES - 1) && (UserSize >> i); i++);
+            ClassCount[i]++;
+            ClassBytes[i] += UserSize;
+            report_count_size (pSizes, UserSize);
+
+            BusyCount++;
+            BusyBytes += Size;
+            UserBytes += UserSize;
+        }
+        else
+        {
+            FreeCount++;
+            FreeBytes += Size;
+            if (Size > LargestFree)
+                LargestFree = Size;
+        }
+    }
+
+    Footprint = mspace_footprint (pHeap->MSpace);
+    MaxFootprint = mspace_max_footprint (pHeap->MSpace);
+
+    RtlLeaveCriticalSection (&pHeap->CS);
+
+    /* Fragmentation: how much of the free space can't be had in one piece */
+    if (FreeBytes)
+        Fragmentation = 100 - (ULONG)((ULONGLONG)LargestFree * 100 / FreeBytes);
+
+    fprintf (out, "heap %p: footprint %lu (peak %lu), in use %lu blocks %lu bytes "
+             "(%lu requested), free %lu blocks %lu bytes (largest %lu), "
+             "fragmentation %lu%%\n", pHeap, Footprint, MaxFootprint,
+             BusyCount, BusyBytes, UserBytes, FreeCount, FreeBytes,
+             LargestFree, Fragmentation);
+
+    for (i = 0; i < HEAP_REPORT_CLASSES; i++)
+    {
+        if (ClassCount[i])
+            fprintf (out, "  size < %-10lu %8lu blocks %10lu bytes\n",
+                     i < HEAP_REPORT_CLASSES - 1 ? 1UL << i : ~0UL,
+                     ClassCount[i], ClassBytes[i]);
+    }
+
+    /* Keep the sizes holding the most bytes, largest first */
+    memset (Top, 0, sizeof (Top));
+    for (i = 0; i < HEAP_REPORT_SIZE_SLOTS; i++)
+    {
+        ULONGLONG Bytes = (ULONGLONG)pSizes[i].Size * pSizes[i].Count;
+
+        if (!pSizes[i].Count ||
+            (Bytes <= (ULONGLONG)Top[HEAP_REPORT_TOP_SIZES - 1].Size *
+                      Top[HEAP_REPORT_TOP_SIZES - 1].Count))
+            continue;
+
+        for (j = HEAP_REPORT_TOP_SIZES - 1;
+             j && (Bytes > (ULONGLONG)Top[j - 1].Size * Top[j - 1].Count); j--)
+            Top[j] = Top[j - 1];
+        Top[j] = pSizes[i];
+    }
+
+    for (i = 0; (i < HEAP_REPORT_TOP_SIZES) && Top[i].Count; i++)
+        fprintf (out, "  %10lu bytes x %8lu = %10lu\n", Top[i].Size,
+                 Top[i].Count, Top[i].Size * Top[i].Count);
+}
+
+
+/***********************************************************************
+ *           HEAP_Report
+ *
+ * Append a usage report for every heap in the process to the
+ * WINEHEAPREPORT file. Blocks parked in the per-thread caches of the
+ * process heap are counted as in use.
+ */
+void HEAP_Report (void)
+{
+    HeapReportSize_t *pSizes;
+    HEAP_CACHE_STATS Stats;
+    HeapInfo_t *pHeap;
+    FILE *out;
+
+    if (!gHeapReportFile || !gProcessHeap)
+        return;
+
+    if (!strcmp (gHeapReportFile, "-"))
+        out = stderr;
+    else if (!(out = fopen (gHeapReportFile, "a")))
+    {
+        ERR ("can't open heap report file %s\n", gHeapReportFile);
+        return;
+    }
+
+    if (!(pSizes = malloc (HEAP_REPORT_SIZE_SLOTS * sizeof (*pSizes))))
+    {
+        if (out != stderr)
+            fclose (out);
+        return;
+    }
+
+    HEAP_GetCacheStats (&Stats);
+    fprintf (out, "# heap report: pid %d, time %lu\n", getpid (),
+             (unsigned long)time (NULL));
+    fprintf (out, "process heap cache: alloc hits %lu misses %lu, "
+             "free hits %lu misses %lu, refills %lu, flushes %lu\n",
+             Stats.AllocHits, Stats.AllocMisses, Stats.FreeHits,
+             Stats.FreeMisses, Stats.Refills, Stats.Flushes);
+
+    RtlEnterCriticalSection (&gHeapListCS);
+    for (pHeap = gHeapList; pHeap; pHeap = pHeap->Next)
+        report_heap (out, pHeap, pSizes);
+    RtlLeaveCriticalSection (&gHeapListCS);
+
+    free (pSizes);
+    if (out == stderr)
+        fflush (out);
+    else
+        fclose (out);
+}
+
+
+/* Only flag the report; heap_report_tick writes it from the service
+   thread, outside of any allocator call */
+static void heap_report_handler (int sig)
+{
+    gHeapReportPending = 1;
+}
+
+
+/* Write a report requested by signal, if any */
+static void CALLBACK heap_report_tick (ULONG_PTR arg)
+{
+    if (InterlockedExchange ((LONG *)&gHeapReportPending, 0))
+        HEAP_Report ();
+}
+
+
+/***********************************************************************
+ *           HEAP_StartReportService
+ *
+ * Start polling for reports requested with HEAP_REPORT_SIGNAL. Called
+ * once the process can create threads; a signal that arrives earlier is
+ * kept pending until then.
+ */
+void HEAP_StartReportService (void)
+{
+    if (gHeapReportFile &&
+        (SERVICE_AddTimer (HEAP_REPORT_POLL, heap_report_tick, 0) ==
+         INVALID_HANDLE_VALUE))
+        ERR ("can't start heap report service\n");
+}
+
+
 /***********************************************************************
  *           RtlCreateHeap   (NTDLL.@)
  */
@@ -124,8 +763,50 @@ HANDLE NewRtlCreateHeap (ULONG flags, PVOID addr, ULONG reserveSize,
 
    /* Assume first call is to set up process heap */
    if (!gProcessHeap)
+   {
+      const char *env;
+
       gProcessHeap = NewHeap;
 
+      /* The per-thread cache relies on the heap lock for its batches */
+      if ((flags & HEAP_NO_SERIALIZE) ||
+          ((env = getenv ("WINEHEAPCACHE")) && (*env == '0')))
+         gHeapCacheEnabled = FALSE;
+      if (getenv ("WINEHEAPSTATS"))
+         atexit (report_heap_cache_stats);
+      /* Marks blocks sitting in a thread cache. It is odd, so it never
+         matches the free list pointers the mspace leaves behind */
+      gHeapCacheCookie = (LONG)((ULONG)time (NULL) * 0x9e3779b1 ^
+                                (ULONG_PTR)NewHeap) | 1;
+
+      RTL_CRITICAL_SECTION_DEFINE (&gHeapListCS);
+
+      if ((env = getenv ("WINEHEAPREPORT")) && *env)
+      {
+         struct sigaction sig_act;
+
+         gHeapReportFile = env;
+         atexit (HEAP_Report);
+
+         memset (&sig_act, 0, sizeof (sig_act));
+         sig_act.sa_handler = heap_report_handler;
+         sigemptyset (&sig_act.sa_mask);
+         sig_act.sa_flags = SA_RESTART;
+         sigaction (HEAP_REPORT_SIGNAL, &sig_act, NULL);
+      }
+   }
+
+   /* Append, so the process heap stays first */
+   RtlEnterCriticalSection (&gHeapListCS);
+   {
+      HeapInfo_t **ppHeap = &gHeapList;
+
+      while (*ppHeap)
+         ppHeap = &(*ppHeap)->Next;
+      *ppHeap = NewHeap;
+   }
+   RtlLeaveCriticalSection (&gHeapListCS);
+
    TRACE ("=> 0x%x\n", (HANDLE)NewHeap);
    return (HANDLE)NewHeap;
 }
@@ -147,6 +828,17 @@ HANDLE NewRtlDestroyHeap (HANDLE heap)
       return heap;
    }
 
+   RtlEnterCriticalSection (&gHeapListCS);
+   {
+      HeapInfo_t **ppHeap = &gHeapList;
+
+      while (*ppHeap && (*ppHeap != pHeap))
+         ppHeap = &(*ppHeap)->Next;
+      if (*ppHeap)
+         *ppHeap = pHeap->Next;
+   }
+   RtlLeaveCriticalSection (&gHeapListCS);
+
    destroy_mspace (pHeap->MSpace);
    pHeap->Magic = 0;
    if (!(pHeap->Flags & HEAP_NO_SERIALIZE))
@@ -166,7 +858,8 @@ HANDLE NewRtlDestroyHeap (HANDLE heap)
 PVOID NewRtlAllocateHeap (HANDLE heap, ULONG flags, ULONG size)
 {
    HeapInfo_t *pHeap = get_heap_ptr (heap);
-   PVOID pMem;
+   HeapThreadCache_t *pCache;
+   PVOID pMem = NULL;
    ULONG UserSize = size;
    ULONG ChunkSize = 0;
 
@@ -195,20 +888,31 @@ PVOID NewRtlAllocateHeap (HANDLE heap, ULONG flags, ULONG size)
       We put the size at the end of the block (so at ChunkSize - 4). */
    size += sizeof (ULONG);
 
-   if (!(flags & HEAP_NO_SERIALIZE))
-       RtlEnterCriticalSection (&pHeap->CS);
-
-   if (flags & HEAP_CREATE_ALIGN_16)
-      pMem = mspace_memalign (pHeap->MSpace, 16, size);
+   /* Small requests on the process heap are served lock free from the
+      thread's cache */
+   if ((pCache = get_thread_cache (pHeap, flags)) &&
+       (pMem = cache_alloc (pHeap, pCache, flags, size)))
+      ChunkSize = mspace_usable_size (pMem);
    else
-      pMem = mspace_malloc (pHeap->MSpace, size);
+   {
+      if (!(flags & HEAP_NO_SERIALIZE))
+          RtlEnterCriticalSection (&pHeap->CS);
 
-   if (pMem)
-      ChunkSize = mspace_usable_size (pMem);
+      if (flags & HEAP_CREATE_ALIGN_16)
+         pMem = mspace_memalign (pHeap->MSpace, 16, size);
+      else
+         pMem = mspace_malloc (pHeap->MSpace, size);
 
+      if (pMem)
+      {
+         ChunkSize = mspace_usable_size (pMem);
+         note_block (pHeap, pMem);
+      }
 
-   if (!(flags & HEAP_NO_SERIALIZE))
-       RtlLeaveCriticalSection (&pHeap->CS);
+
+      if (!(flags & HEAP_NO_SERIALIZE))
+          RtlLeaveCriticalSection (&pHeap->CS);
+   }
 
    if (!pMem)
    {
@@ -241,6 +945,7 @@ PVOID NewRtlAllocateHeap (HANDLE heap, ULONG flags, ULONG size)
 BOOLEAN NewRtlFreeHeap (HANDLE heap, ULONG flags, PVOID ptr)
 {
    HeapInfo_t *pHeap = get_heap_ptr (heap);
+   HeapThreadCache_t *pCache;
    BOOLEAN Ret = TRUE;
 
    TRACE ("(0x%x, 0x%lx, %p)\n", heap, flags, ptr);
@@ -260,6 +965,22 @@ BOOLEAN NewRtlFreeHeap (HANDLE heap, ULONG flags, PVOID ptr)
 
    flags |= pHeap->Flags;
 
+   if ((pCache = get_thread_cache (pHeap, flags)))
+   {
+      switch (cache_free (pHeap, pCache, flags, ptr))
+      {
+      case 1:
+         TRACE ("=> TRUE\n");
+         return TRUE;
+
+      case -1:
+         set_status (STATUS_INVALID_PARAMETER);
+         TRACE ("=> FALSE\n");
+         return FALSE;
+      }
+      pCache->Stats.FreeMisses++;
+   }
+
    if (!(flags & HEAP_NO_SERIALIZE))
        RtlEnterCriticalSection (&pHeap->CS);
 
@@ -335,7 +1056,10 @@ PVOID NewRtlReAllocateHeap (HANDLE heap, ULONG flags, PVOID ptr,
       pMem = mspace_realloc (pHeap->MSpace, ptr, size,
                              flags & HEAP_REALLOC_IN_PLACE_ONLY ? 1 : 0);
       if (pMem)
+      {
          NewChunkSize = mspace_usable_size (pMem);
+         note_block (pHeap, pMem);
+      }
       else
       {
          if (flags & HEAP_REALLOC_IN_PLACE_ONLY)
@@ -393,6 +1117,11 @@ ULONG NewRtlCompactHeap (HANDLE heap, ULONG flags)
 
    flags |= pHeap->Flags;
 
+   /* Give back whatever this thread has cached so it can be trimmed */
+   if ((pHeap == gProcessHeap) && NtCurrentTeb()->heap_cache &&
+       (NtCurrentTeb()->heap_cache != HEAP_CACHE_DETACHED))
+      cache_flush_all (pHeap, NtCurrentTeb()->heap_cache);
+
    if (!(flags & HEAP_NO_SERIALIZE))
        RtlEnterCriticalSection (&pHeap->CS);
 
@@ -538,13 +1267,53 @@ BOOLEAN NewRtlValidateHeap (HANDLE heap, ULONG flags, PCVOID block)
 /***********************************************************************
  *           RtlWalkHeap    (NTDLL.@)
  *
- * FIXME: the PROCESS_HEAP_ENTRY flag values seem different between this
- *        function and HeapWalk. To be checked.
+ * Steps through the mspace chunks, starting over when lpData is NULL.
+ * Busy entries report the requested size; blocks parked in the process
+ * heap's thread caches show up as busy. No region entries are returned,
+ * as the mspace segments don't map onto them.
  */
 NTSTATUS NewRtlWalkHeap (HANDLE heap, PVOID entry_ptr)
 {
-   FIXME ("(): stub\n");
-   return STATUS_INVALID_PARAMETER;
+   LPPROCESS_HEAP_ENTRY entry = entry_ptr;
+   HeapInfo_t *pHeap = get_heap_ptr (heap);
+   NTSTATUS Ret = STATUS_SUCCESS;
+   void *pMem;
+   size_t Size;
+   int InUse;
+
+   TRACE ("(0x%x, %p)\n", heap, entry_ptr);
+
+   if (!pHeap || !entry)
+      return STATUS_INVALID_PARAMETER;
+
+   if (!(pHeap->Flags & HEAP_NO_SERIALIZE))
+      RtlEnterCriticalSection (&pHeap->CS);
+
+   pMem = entry->lpData;
+   if (!mspace_walk (pHeap->MSpace, &pMem, &Size, &InUse))
+      Ret = STATUS_NO_MORE_ENTRIES;
+   else
+   {
+      memset (entry, 0, sizeof (*entry));
+      entry->lpData = pMem;
+      if (InUse)
+      {
+         entry->cbData = get_user_size (pMem);
+         entry->cbOverhead = min (Size - entry->cbData, 0xff);
+         entry->wFlags = PROCESS_HEAP_ENTRY_BUSY;
+      }
+      else
+      {
+         entry->cbData = Size - sizeof (size_t);
+         entry->cbOverhead = sizeof (size_t);
+      }
+   }
+
+   if (!(pHeap->Flags & HEAP_NO_SERIALIZE))
+      RtlLeaveCriticalSection (&pHeap->CS);
+
+   TRACE ("=> 0x%lx\n", Ret);
+   return Ret;
 }
 
 
@@ -553,6 +1322,23 @@ NTSTATUS NewRtlWalkHeap (HANDLE heap, PVOID entry_ptr)
  */
 ULONG NewRtlGetProcessHeaps (ULONG count, HANDLE *heaps)
 {
-   FIXME ("(): stub\n");
-   return 0;
+   HeapInfo_t *pHeap;
+   ULONG Total = 0;
+
+   TRACE ("(%lu, %p)\n", count, heaps);
+
+   if (!gProcessHeap)
+      return 0;
+
+   RtlEnterCriticalSection (&gHeapListCS);
+   for (pHeap = gHeapList; pHeap; pHeap = pHeap->Next)
+   {
+      if (heaps && (Total < count))
+         heaps[Total] = (HANDLE)pHeap;
+      Total++;
+   }
+   RtlLeaveCriticalSection (&gHeapListCS);
+
+   TRACE ("=> %lu\n", Total);
+   return Total;
 }
@@ -7,6 +7,16 @@
 #ifndef _WINE_HEAPFUNCS_H
 #define _WINE_HEAPFUNCS_H
 
+/* Counters for the process heap's per-thread allocation cache */
+typedef struct {
+    ULONG AllocHits;      /* allocations served from a thread cache */
+    ULONG AllocMisses;    /* allocations that had to refill from the heap */
+    ULONG FreeHits;       /* frees absorbed by a thread cache */
+    ULONG FreeMisses;     /* frees that had to lock the heap */
+    ULONG Refills;        /* batched refills from the mspace */
+    ULONG Flushes;        /* batched flushes back to the mspace */
+} HEAP_CACHE_STATS;
+
 extern HANDLE OldRtlCreateHeap (ULONG flags, PVOID addr, ULONG reserveSize,
                                 ULONG commitSize, PVOID unknown,
                                 PRTL_HEAP_DEFINITION definition);
@@ -40,4 +50,9 @@ extern BOOLEAN NewRtlValidateHeap (HANDLE heap, ULONG flags, PCVOID block);
 extern NTSTATUS NewRtlWalkHeap (HANDLE heap, PVOID entry_ptr);
 extern ULONG NewRtlGetProcessHeaps (ULONG count, HANDLE *heaps);
 
+extern void HEAP_GetCacheStats (HEAP_CACHE_STATS *stats);
+extern void HEAP_ThreadDetach (void);
+extern void HEAP_Report (void);
+extern void HEAP_StartReportService (void);
+
 #endif
@@ -31,6 +31,33 @@
  *          dot, space, or tab.  Files with these extensions will immediately
  *          return failure from MEMFILE_CreateFile(), and normal file access 
  *          methods will be used on them.
+ *
+ *      'MemFileUseMapping' = {Y/N, 1/0, T/F}
+ *          This option backs each cached file with a read-only view of the file
+ *          itself instead of a private heap copy.  Reads are served directly out
+ *          of the view, so the data is only resident once (in the page cache) no
+ *          matter how many handles share it.  Since the cache then only costs
+ *          address space, 'MemFileCacheLimit' and 'MemFileMaxSize' are clamped
+ *          to a fixed address space budget instead of 10% of physical memory.
+ *          If a view cannot be created the file is simply not cached.  This
+ *          option is off by default.
+ *
+ *      'MemFileReadAhead' = {Y/N, 1/0, T/F}
+ *          This option moves the population of large heap backed file buffers
+ *          off of the thread that opened the file.  The buffer is streamed in
+ *          by a background loader thread and reads of the part that has already
+ *          been loaded are served from the cache right away.  Reads beyond the
+ *          loaded part go straight to the file instead of waiting.  Files
+ *          smaller than 256KB are always read in synchronously.  This option
+ *          is on by default.
+ *
+ *      'MemFilePrefetch' = <list>
+ *          This option provides a list of DOS paths to files that the app is
+ *          known to open during startup or level loads.  Each name in the list
+ *          is separated by a semicolon.  The loader thread pulls these files
+ *          into the system's file cache ahead of time so that opening and
+ *          caching them later doesn't stall on the disk.  This option is
+ *          normally set in the app's AppDefaults section.
  *      
  *
  * NVIDIA CORPORATION and its licensors retain all intellectual property
@@ -42,14 +69,27 @@
 
 #include "config.h"
 #include "wine/port.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "windef.h"
 #include "winbase.h"
+#include "winternl.h"
+#include "wine/file.h"
 #include "wine/mem_file.h"
+#include "wine/nt_config.h"
 #include "wine/server.h"
 #include "wine/debug.h"
+#include "wine/exception.h"
 #include "wine/winbase16.h"
 #include "winreg.h"
 #include "wine/unicode.h"
+#include "msvcrt/excpt.h"
 
 
 WINE_DEFAULT_DEBUG_CHANNEL (memfile);
@@ -57,12 +97,22 @@ WINE_DEFAULT_DEBUG_CHANNEL (memfile);
 /* for now, take 10% of total system RAM as the max size for the cache limit.
    This should really go in as a config option expressed in percent */
 #define CACHE_SIZE_CAP(ram)     ((ram) / 10)
+/* mapped file buffers don't use any private memory, but they do eat into the process's
+   address space.  Keep the total mapped cache well below what a 32-bit process can spare */
+#define MAPPED_CACHE_SIZE_CAP   ((LONGLONG)512 * 1048576)
 #define SIZEOF(x)               (sizeof(x) / sizeof((x)[0]))
 #define DEFAULT_DENIED_EXT      "exe;dylib;com;dll;so;reg;sys"
 
+/* files smaller than this are read in synchronously.  Handing them off to the loader
+   thread would cost more than the read itself */
+#define ASYNC_LOAD_MIN_SIZE     (256 * 1024)
+/* the loader thread publishes the loaded size after each chunk of this size */
+#define ASYNC_LOAD_CHUNK_SIZE   (1024 * 1024)
+
 
 typedef struct MemFileData_t MemFileData_t;
 typedef struct FileBuffer_t  FileBuffer_t;
+typedef struct PrefetchRequest_t PrefetchRequest_t;
 
 struct MemFileData_t {
     MemFileData_t * Next;
@@ -79,6 +129,24 @@ struct FileBuffer_t{
     char *          filename;
     LARGE_INTEGER   fileSize;
     BYTE *          buffer;
+    BOOL            mapped;     /* <buffer> is a read-only view of the file, not a heap copy */
+
+    /* background loading state.  <readyBytes> is the number of bytes at the start of <buffer>
+       that are valid.  While <loading> is set, the loader thread holds its own reference to
+       the buffer.  <counted> tracks whether the buffer's size is still part of the total
+       cache size */
+    volatile LONG   readyBytes;
+    BOOL            loading;
+    BOOL            counted;
+    int             loadFd;
+    FileBuffer_t *  nextLoad;
+};
+
+
+/* a file queued up to be pulled into the system's file cache by the loader thread */
+struct PrefetchRequest_t{
+    PrefetchRequest_t * next;
+    char                name[1];
 };
 
 
@@ -93,8 +161,14 @@ typedef struct{
     LARGE_INTEGER       cacheLimit;
     LARGE_INTEGER       maxSize;
     BOOL                disabled;
+    BOOL                useMapping;
     int                 extensionCount;
     char **             deniedList;
+    BOOL                readAhead;
+    HANDLE              loaderEvent;
+    FileBuffer_t *      loadHead;
+    FileBuffer_t *      loadTail;
+    PrefetchRequest_t * prefetchList;
 } MemFileState;
 
 static MemFileState g_memFile = {
@@ -107,8 +181,14 @@ static MemFileState g_memFile = {
         {{104857600}},  /* cache size limit (100MB) */
         {{10485760}},   /* max size of each cached file (10MB) */
         FALSE,          /* disabled? */
+        FALSE,          /* back the cache with file mappings? */
         0,              /* number of denied extensions */
-        NULL            /* denied extensions list */
+        NULL,           /* denied extensions list */
+        TRUE,           /* load large files in the background? */
+        NULL,           /* loader thread wakeup event */
+        NULL,           /* loader queue head */
+        NULL,           /* loader queue tail */
+        NULL            /* pending prefetch requests */
 };
 
 /*******************************************************************/
@@ -116,6 +196,7 @@ static MemFileState g_memFile = {
 
 static VOID MEMFILE_DeleteMemFileByData(MemFileData_t *pData);
 static void MEMFILE_DoPointerSync(MemFileData_t *pData);
+static void MEMFILE_prefetchList(const char *list);
 
 
 /*************** Config Options & Registry Functions ***************/
@@ -440,6 +521,10 @@ static void setupOptions(void){
     WCHAR           memFileCacheLimitKey[] = {'M', 'e', 'm', 'F', 'i', 'l', 'e', 'C', 'a', 'c', 'h', 'e', 'L', 'i', 'm', 'i', 't', 0};
     WCHAR           memFileMaxSizeKey[] = {'M', 'e', 'm', 'F', 'i', 'l', 'e', 'M', 'a', 'x', 'S', 'i', 'z', 'e', 0};
     WCHAR           memFileDeniedExtensionsKey[] = {'M', 'e', 'm', 'F', 'i', 'l', 'e', 'D', 'e', 'n', 'i', 'e', 'd', 'E', 'x', 't', 'e', 'n', 's', 'i', 'o', 'n', 's', 0};
+    WCHAR           memFileUseMappingKey[] = {'M', 'e', 'm', 'F', 'i', 'l', 'e', 'U', 's', 'e', 'M', 'a', 'p', 'p', 'i', 'n', 'g', 0};
+    WCHAR           memFileReadAheadKey[] = {'M', 'e', 'm', 'F', 'i', 'l', 'e', 'R', 'e', 'a', 'd', 'A', 'h', 'e', 'a', 'd', 0};
+    char            prefetch[4096];
+    LONGLONG        sizeCap;
 
 
     if (Nt_regCreateKeyExA(HKEY_LOCAL_MACHINE, configKey, REG_OPTION_VOLATILE, KEY_ALL_ACCESS, &hkey) != STATUS_SUCCESS)
@@ -455,6 +540,16 @@ static void setupOptions(void){
         g_memFile.disabled = !IS_OPTION_TRUE(buffer[0]);
 
 
+    /* check if the cached files should be backed by file mappings instead of heap copies */
+    if (getConfigKey(hkey, memFileUseMappingKey, buffer, sizeof(buffer)))
+        g_memFile.useMapping = IS_OPTION_TRUE(buffer[0]);
+
+
+    /* check if large files should be loaded by the background loader thread */
+    if (getConfigKey(hkey, memFileReadAheadKey, buffer, sizeof(buffer)))
+        g_memFile.readAhead = IS_OPTION_TRUE(buffer[0]);
+
+
     /* get the maximum total size for the cache.  This isn't a hard limit, more of a suggestion */
     if (getConfigKey(hkey, memFileCacheLimitKey, buffer, sizeof(buffer))){
         LARGE_INTEGER   limit = {{0}};
@@ -517,27 +612,47 @@ static void setupOptions(void){
         processDeniedList(DEFAULT_DENIED_EXT);
 
 
+    /* mapped buffers only cost address space => clamp the sizes to a fixed address space budget */
+    if (g_memFile.useMapping){
+        if (g_memFile.maxSize.QuadPart > MAPPED_CACHE_SIZE_CAP){
+            WARN("the max cached file size is too large for the mapped file cache.  Resizing to %lld {maxSize = %lld}\n",
+                    MAPPED_CACHE_SIZE_CAP,
+                    g_memFile.maxSize.QuadPart);
+
+            g_memFile.maxSize.QuadPart = MAPPED_CACHE_SIZE_CAP;
+        }
+
+        if (g_memFile.cacheLimit.QuadPart > MAPPED_CACHE_SIZE_CAP){
+            WARN("the total cache limit is too large for the mapped file cache.  Resizing to %lld {cacheLimit = %lld}\n",
+                    MAPPED_CACHE_SIZE_CAP,
+                    g_memFile.cacheLimit.QuadPart);
+
+            g_memFile.cacheLimit.QuadPart = MAPPED_CACHE_SIZE_CAP;
+        }
+    }
+
     /* retrieve the amount of physical RAM in the system to clamp the cache sizes to a reasonable amount */
-    if (GlobalMemoryStatusEx(&memoryStatus)){
+    else if (GlobalMemoryStatusEx(&memoryStatus)){
+        sizeCap = CACHE_SIZE_CAP(memoryStatus.ullTotalPhys);
 
         /* make sure the max cached file size is a reasonable size given the amount of RAM on the system */
-        if (g_memFile.maxSize.QuadPart > CACHE_SIZE_CAP(memoryStatus.ullTotalPhys)){
+        if (g_memFile.maxSize.QuadPart > sizeCap){
             WARN("the max cached file size is quite large compared to the amount of available RAM.  Resizing to %lld {maxSize = %lld, availableRAM = %llu}\n",
-                    CACHE_SIZE_CAP(memoryStatus.ullTotalPhys),
+                    sizeCap,
                     g_memFile.maxSize.QuadPart,
                     memoryStatus.ullTotalPhys);
 
-            g_memFile.maxSize.QuadPart = CACHE_SIZE_CAP(memoryStatus.ullTotalPhys);
+            g_memFile.maxSize.QuadPart = sizeCap;
         }
 
         /* make sure the cache limit is a reasonable size given the amount of RAM on the system */
-        if (g_memFile.cacheLimit.QuadPart > CACHE_SIZE_CAP(memoryStatus.ullTotalPhys)){
+        if (g_memFile.cacheLimit.QuadPart > sizeCap){
             WARN("the total cache limit is quite large compared to the amount of available RAM.  Resizing to %lld {cacheLimit = %lld, availableRAM = %llu}\n",
-                    CACHE_SIZE_CAP(memoryStatus.ullTotalPhys),
+                    sizeCap,
                     g_memFile.cacheLimit.QuadPart,
                     memoryStatus.ullTotalPhys);
 
-            g_memFile.cacheLimit.QuadPart = CACHE_SIZE_CAP(memoryStatus.ullTotalPhys);
+            g_memFile.cacheLimit.QuadPart = sizeCap;
         }
     }
 
@@ -556,6 +671,8 @@ static void setupOptions(void){
     /* trace out the current values of all the option variables */
     TRACE("MemFile options:\n");
     TRACE("    MemFileDisabled =        %s\n", g_memFile.disabled ? "TRUE" : "FALSE");
+    TRACE("    MemFileUseMapping =      %s\n", g_memFile.useMapping ? "TRUE" : "FALSE");
+    TRACE("    MemFileReadAhead =       %s\n", g_memFile.readAhead ? "TRUE" : "FALSE");
     TRACE("    MemFileCacheLimit =      %lld\n", g_memFile.cacheLimit.QuadPart);
     TRACE("    MemFileMaxSize =         %lld\n", g_memFile.maxSize.QuadPart);
 
@@ -573,6 +690,15 @@ static void setupOptions(void){
     
     
     Nt_regCloseKey( hkey );
+
+
+    /* the prefetch list is app specific => look in the app's AppDefaults section first */
+    if (!g_memFile.disabled && Nt_getSingleConfigValueA("wine", "MemFilePrefetch", TRUE, prefetch, sizeof(prefetch))){
+        prefetch[sizeof(prefetch) - 1] = 0;
+
+        TRACE("    MemFilePrefetch =        '%s'\n", prefetch);
+        MEMFILE_prefetchList(prefetch);
+    }
 }
 /***********************************************************/
 
@@ -856,6 +982,68 @@ static BOOL MEMFILE_isFileIgnored(const char *filename){
 
 /************************* API Functions ****************************/
 
+/* MEMFILE_mapBuffer(): creates a new file buffer whose data is a read-only view of the
+     file <hFile>.  Only the buffer header and filename are allocated from the heap.  The
+     buffer's reference count will start at 1.  Returns NULL if the file could not be
+     mapped.  Returns a pointer to the buffer on success. */
+static FileBuffer_t *MEMFILE_mapBuffer(const char *filename, LARGE_INTEGER fileSize, HANDLE hFile){
+    FileBuffer_t *  buf;
+    HANDLE          hMapping;
+    LPVOID          view;
+    size_t          len = strlen(filename);
+
+
+    hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (hMapping == NULL){
+        WARN("could not create a mapping for '%s' {hFile = %u, error = %ld}\n", filename, hFile, GetLastError());
+
+        return NULL;
+    }
+
+
+    /* the view holds its own reference to the mapping so the handle can go right away */
+    view = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+
+    if (view == NULL){
+        WARN("could not map a view of '%s' {fileSize = %lld, error = %ld}\n", filename, fileSize.QuadPart, GetLastError());
+
+        return NULL;
+    }
+
+
+    buf = (FileBuffer_t *)RtlAllocateHeap(GetProcessHeap(), 0, sizeof(FileBuffer_t) + (len + 1));
+
+    if (buf == NULL){
+        ERR("could not allocate %ld bytes to store the file buffer for '%s'\n", sizeof(FileBuffer_t) + (len + 1), filename);
+        UnmapViewOfFile(view);
+
+        return NULL;
+    }
+
+
+    buf->filename = (char *)(((BYTE *)buf) + sizeof(FileBuffer_t));
+    buf->buffer = (BYTE *)view;
+    buf->mapped = TRUE;
+    buf->readyBytes = fileSize.u.LowPart;
+    buf->loading = FALSE;
+    buf->counted = TRUE;
+    buf->loadFd = -1;
+    buf->nextLoad = NULL;
+
+    buf->refCount = 1;
+    buf->fileSize.QuadPart = fileSize.QuadPart;
+    memcpy(buf->filename, filename, len + 1);
+
+
+    /* update the total cache size.  This tracks address space rather than memory for mapped buffers */
+    g_memFile.totalCacheSize.QuadPart += fileSize.QuadPart;
+
+    return buf;
+}
+
+
 /* MEMFILE_allocBuffer(): creates a new file buffer to hold the contents of a file.
      The total allocated size of the data buffer will be <fileSize>.  The buffer's
      reference count will start at 1.  Returns NULL if the buffer could not be
@@ -880,6 +1068,12 @@ static FileBuffer_t *MEMFILE_allocBuffer(const char *filename, LARGE_INTEGER fil
 
     buf->filename = (char *)(((BYTE *)buf) + sizeof(FileBuffer_t));
     buf->buffer = (BYTE *)(buf->filename + (len + 1));
+    buf->mapped = FALSE;
+    buf->readyBytes = 0;
+    buf->loading = FALSE;
+    buf->counted = TRUE;
+    buf->loadFd = -1;
+    buf->nextLoad = NULL;
 
     buf->refCount = 1;
     buf->fileSize.QuadPart = fileSize.QuadPart;
@@ -909,10 +1103,19 @@ static BOOL MEMFILE_releaseBuffer(FileBuffer_t *buf){
     buf->refCount--;
     TRACE("decremented ref count to %d for '%s'\n", buf->refCount, buf->filename);
 
+    /* only the loader thread still holds a reference => the buffer is as good as gone.  Take it
+       out of the total cache size now so that evicting it actually makes room in the cache */
+    if (buf->counted && buf->refCount <= (buf->loading ? 1 : 0)){
+        g_memFile.totalCacheSize.QuadPart -= buf->fileSize.QuadPart;
+        buf->counted = FALSE;
+    }
+
     /* no other files hold a reference to the file buffer => destroy it */
     if (buf->refCount <= 0){
         TRACE("file buffer is unreferenced.  Destroying... {fileSize = %lld}\n", buf->fileSize.QuadPart);
-        g_memFile.totalCacheSize.QuadPart -= buf->fileSize.QuadPart;
+
+        if (buf->mapped)
+            UnmapViewOfFile(buf->buffer);
      
         RtlFreeHeap(GetProcessHeap(), 0, buf);
 
@@ -926,9 +1129,10 @@ static BOOL MEMFILE_releaseBuffer(FileBuffer_t *buf){
 /* MEMFILE_createBuffer(): searches the cached file list to check if the file with the
      name <filename> has already been cached.  If it is already cached, a pointer to its
      buffer object is returned and the buffer's reference count is incremented.  If not
-     found, a new file buffer is allocated with enough space to store <fileSize> bytes.
-     Returns NULL if the buffer was not found and not enough memory could be allocated. */
-static FileBuffer_t *MEMFILE_createBuffer(const char *filename, LARGE_INTEGER fileSize, BOOL *created){
+     found, a new file buffer is allocated with enough space to store <fileSize> bytes,
+     or a view of <hFile> is mapped if the cache is backed by file mappings.  Returns
+     NULL if the buffer was not found and could not be created. */
+static FileBuffer_t *MEMFILE_createBuffer(const char *filename, LARGE_INTEGER fileSize, HANDLE hFile, BOOL *created){
     MemFileData_t *file = GetMemFileByName(filename, FALSE);
 
 
@@ -936,6 +1140,9 @@ static FileBuffer_t *MEMFILE_createBuffer(const char *filename, LARGE_INTEGER fi
         if (created)
             *created = TRUE;
 
+        if (g_memFile.useMapping)
+            return MEMFILE_mapBuffer(filename, fileSize, hFile);
+
         return MEMFILE_allocBuffer(filename, fileSize);
     }
 
@@ -959,6 +1166,304 @@ static FileBuffer_t *MEMFILE_createBuffer(const char *filename, LARGE_INTEGER fi
 }
 
 
+/********************** Background Loader Functions ***********************/
+
+/* MEMFILE_loadBuffer(): streams the contents of the file buffer <buf> in from its unix
+     file descriptor.  The loaded size is published after each chunk so readers can use
+     the start of the buffer while the rest is still loading.  Loading stops early if the
+     loader holds the only remaining reference to the buffer. */
+static void MEMFILE_loadBuffer(FileBuffer_t *buf){
+    LONG    ready = 0;
+    LONG    size = buf->fileSize.u.LowPart;
+    ssize_t result;
+
+
+    while (ready < size){
+        /* every handle on the file has been closed or evicted => don't bother finishing */
+        if (buf->refCount <= 1){
+            TRACE("abandoning the load of '%s' {readyBytes = %ld, fileSize = %ld}\n", buf->filename, ready, size);
+            break;
+        }
+
+
+        result = pread(buf->loadFd, buf->buffer + ready, min(size - ready, ASYNC_LOAD_CHUNK_SIZE), ready);
+
+        if (result == -1 && errno == EINTR)
+            continue;
+
+        /* the read failed or the file was truncated => readers will go to the file for the rest */
+        if (result <= 0){
+            WARN("could not load '%s' past offset %ld {fileSize = %ld, errno = %d}\n", buf->filename, ready, size, errno);
+            break;
+        }
+
+        ready += result;
+        InterlockedExchange((LONG *)&buf->readyBytes, ready);
+    }
+
+
+    close(buf->loadFd);
+    buf->loadFd = -1;
+
+    TRACE("finished loading '%s' {readyBytes = %ld, fileSize = %ld}\n", buf->filename, ready, size);
+
+
+    /* drop the loader's reference to the buffer */
+    EnterCriticalSection(&g_memFile.cs);
+    buf->loading = FALSE;
+    MEMFILE_releaseBuffer(buf);
+    LeaveCriticalSection(&g_memFile.cs);
+}
+
+
+/* MEMFILE_prefetchFile(): pulls the file named by the prefetch request <req> into the
+     system's file cache.  Nothing is added to the memory file cache itself. */
+static void MEMFILE_prefetchFile(PrefetchRequest_t *req){
+    DOS_FULL_NAME   fullName;
+    struct stat     st;
+    int             fd;
+
+
+    if (!DOSFS_GetFullName(req->name, TRUE, &fullName)){
+        WARN("could not find the prefetch file '%s'\n", req->name);
+        return;
+    }
+
+    fd = open(fullName.long_name, O_RDONLY);
+
+    if (fd == -1){
+        WARN("could not open the prefetch file '%s' {errno = %d}\n", fullName.long_name, errno);
+        return;
+    }
+
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0){
+        TRACE("prefetching '%s' {fileSize = %ld}\n", fullName.long_name, (long)st.st_size);
+
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#else
+        {
+            char    tmp[65536];
+            off_t   pos = 0;
+            ssize_t result;
+
+
+            /* no way to ask for readahead => just read the file through */
+            while ((result = pread(fd, tmp, sizeof(tmp), pos)) > 0 || (result == -1 && errno == EINTR))
+                if (result > 0) pos += result;
+        }
+#endif
+    }
+
+    close(fd);
+}
+
+
+/* MEMFILE_loaderThread(): entry point for the background loader thread.  File buffers
+     queued for loading are always serviced before prefetch requests since a thread may
+     already be reading from them. */
+static DWORD CALLBACK MEMFILE_loaderThread(LPVOID arg){
+    FileBuffer_t *      buf;
+    PrefetchRequest_t * req;
+
+
+    for (;;){
+        WaitForSingleObject(g_memFile.loaderEvent, INFINITE);
+
+        for (;;){
+            buf = NULL;
+            req = NULL;
+
+            EnterCriticalSection(&g_memFile.cs);
+
+            if (g_memFile.loadHead){
+                buf = g_memFile.loadHead;
+                g_memFile.loadHead = buf->nextLoad;
+
+                if (g_memFile.loadHead == NULL)
+                    g_memFile.loadTail = NULL;
+            }
+
+            else if (g_memFile.prefetchList){
+                req = g_memFile.prefetchList;
+                g_memFile.prefetchList = req->next;
+            }
+
+            LeaveCriticalSection(&g_memFile.cs);
+
+
+            if (buf)
+                MEMFILE_loadBuffer(buf);
+
+            else if (req){
+                MEMFILE_prefetchFile(req);
+                RtlFreeHeap(GetProcessHeap(), 0, req);
+            }
+
+            else
+                break;
+        }
+    }
+
+    return 0;
+}
+
+
+/* MEMFILE_startLoader(): starts the background loader thread if it isn't running yet.
+     Returns FALSE if the thread could not be started.  Background loading is turned off
+     in that case.  This must be called while <g_memFile.cs> is held! */
+static BOOL MEMFILE_startLoader(void){
+    HANDLE  hThread;
+
+
+    if (g_memFile.loaderEvent)
+        return TRUE;
+
+    if (!g_memFile.readAhead)
+        return FALSE;
+
+
+    if (NtCreateEvent(&g_memFile.loaderEvent, EVENT_ALL_ACCESS, NULL, FALSE, FALSE) != STATUS_SUCCESS){
+        ERR("could not create the loader thread's event.  Disabling background loading\n");
+        g_memFile.loaderEvent = NULL;
+        g_memFile.readAhead = FALSE;
+
+        return FALSE;
+    }
+
+    hThread = CreateThread(NULL, 0, MEMFILE_loaderThread, NULL, 0, NULL);
+
+    if (hThread == NULL){
+        ERR("could not create the loader thread.  Disabling background loading\n");
+        NtClose(g_memFile.loaderEvent);
+        g_memFile.loaderEvent = NULL;
+        g_memFile.readAhead = FALSE;
+
+        return FALSE;
+    }
+
+    CloseHandle(hThread);
+
+    return TRUE;
+}
+
+
+/* MEMFILE_queueLoad(): hands the population of the new file buffer <buf> off to the
+     loader thread.  The loader reads through its own unix file descriptor so the file
+     pointer of <hFile> is not touched.  Returns FALSE if the buffer should be read in
+     synchronously instead.  This must be called while <g_memFile.cs> is held! */
+static BOOL MEMFILE_queueLoad(FileBuffer_t *buf, HANDLE hFile){
+    int fd;
+
+
+    if (!g_memFile.readAhead || buf->fileSize.QuadPart < ASYNC_LOAD_MIN_SIZE)
+        return FALSE;
+
+    if (!MEMFILE_startLoader())
+        return FALSE;
+
+
+    fd = FILE_GetUnixHandle(hFile, GENERIC_READ);
+
+    if (fd == -1)
+        return FALSE;
+
+
+    /* the loader keeps its own reference until it is done with the buffer */
+    buf->refCount++;
+    buf->loading = TRUE;
+    buf->loadFd = fd;
+    buf->nextLoad = NULL;
+
+    if (g_memFile.loadTail)
+        g_memFile.loadTail->nextLoad = buf;
+
+    else
+        g_memFile.loadHead = buf;
+
+    g_memFile.loadTail = buf;
+
+    NtSetEvent(g_memFile.loaderEvent, NULL);
+
+    return TRUE;
+}
+
+
+/* MEMFILE_prefetchList(): queues up each file in the semicolon separated list <list>
+     to be pulled into the system's file cache by the loader thread. */
+static void MEMFILE_prefetchList(const char *list){
+    const char *        end;
+    size_t              len;
+    PrefetchRequest_t * req;
+    PrefetchRequest_t **tail;
+    BOOL                queued = FALSE;
+
+
+    EnterCriticalSection(&g_memFile.cs);
+
+    tail = &g_memFile.prefetchList;
+
+    while (*tail)
+        tail = &(*tail)->next;
+
+
+    while (*list){
+        /* skip any separators and surrounding whitespace */
+        while (*list == ';' || *list == ' ' || *list == '\t')
+            list++;
+
+        end = strchr(list, ';');
+
+        if (end == NULL)
+            end = list + strlen(list);
+
+        len = end - list;
+
+        while (len && (list[len - 1] == ' ' || list[len - 1] == '\t'))
+            len--;
+
+
+        if (len){
+            req = (PrefetchRequest_t *)RtlAllocateHeap(GetProcessHeap(), 0, sizeof(PrefetchRequest_t) + len);
+
+            if (req == NULL){
+                ERR("could not allocate %ld bytes for a prefetch request\n", sizeof(PrefetchRequest_t) + len);
+                break;
+            }
+
+            memcpy(req->name, list, len);
+            req->name[len] = 0;
+            req->next = NULL;
+
+            *tail = req;
+            tail = &req->next;
+            queued = TRUE;
+        }
+
+        list = end;
+    }
+
+
+    if (queued){
+        if (MEMFILE_startLoader())
+            NtSetEvent(g_memFile.loaderEvent, NULL);
+
+        /* no loader thread to service the requests => just drop them */
+        else while (g_memFile.prefetchList){
+            req = g_memFile.prefetchList;
+            g_memFile.prefetchList = req->next;
+
+            RtlFreeHeap(GetProcessHeap(), 0, req);
+        }
+    }
+
+    LeaveCriticalSection(&g_memFile.cs);
+}
+
+/******************************************************************************/
+
+
 /* --------------------------------------------------------------
  * Create a new memory file associated with the given handle,
  * and read in its contents
@@ -1034,17 +1539,28 @@ BOOL MEMFILE_CreateMemFile(const char *filename, HANDLE hFile)
 
     EnterCriticalSection (&g_memFile.cs);
 
-    pData->Buffer = MEMFILE_createBuffer(filename, fileSize, &newBufferCreated);
+    pData->Buffer = MEMFILE_createBuffer(filename, fileSize, hFile, &newBufferCreated);
 
     if (pData->Buffer == NULL){
         ERR("Unable to allocate memory for memory file buffer! {size = %lld bytes}\n", fileSize.QuadPart);
 
         RtlFreeHeap(GetProcessHeap (), 0, pData);
+        LeaveCriticalSection (&g_memFile.cs);
         return FALSE;
     }
 
 
-    if (newBufferCreated){
+    /* mapped buffers already see the file's contents => nothing to read in */
+    if (newBufferCreated && pData->Buffer->mapped){
+        TRACE("mapped a view of '%s' {fileSize = %lld}\n", filename, fileSize.QuadPart);
+    }
+
+    /* large file => let the loader thread stream it in while the caller gets on with things */
+    else if (newBufferCreated && MEMFILE_queueLoad(pData->Buffer, hFile)){
+        TRACE("queued '%s' to be loaded in the background {fileSize = %lld}\n", filename, fileSize.QuadPart);
+    }
+
+    else if (newBufferCreated){
         TRACE("a new buffer was created to hold '%s' {fileSize = %lld}\n", filename, fileSize.QuadPart);
 
         if (!ReadFile(hFile, pData->Buffer->buffer, pData->Buffer->fileSize.u.LowPart,
@@ -1056,9 +1572,12 @@ BOOL MEMFILE_CreateMemFile(const char *filename, HANDLE hFile)
 
             MEMFILE_releaseBuffer(pData->Buffer);
             RtlFreeHeap(GetProcessHeap (), 0, pData);
+            LeaveCriticalSection (&g_memFile.cs);
 
             return FALSE;
         }
+
+        pData->Buffer->readyBytes = pData->Buffer->fileSize.u.LowPart;
     }
 
     else{
@@ -1211,24 +1730,92 @@ static void MEMFILE_DoPointerSync(MemFileData_t *pData)
 }
 
 
+/* filter for the faults raised by touching a mapped buffer past the end of a file
+   that was truncated after it was mapped */
+static WINE_EXCEPTION_FILTER(mapped_fault)
+{
+    if (GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ||
+        GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR)
+        return EXCEPTION_EXECUTE_HANDLER;
+
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+
+/* --------------------------------------------------------------
+ *              MEMFILE_copyFromBuffer()
+ *  Copies <count> bytes at <offset> out of the file buffer <buf>.
+ *  A mapped buffer can fault if another process truncated the file
+ *  since it was mapped.  In that case nothing useful is copied,
+ *  the buffer is marked as having no loaded data so every reader
+ *  goes to the file from then on, and FALSE is returned.
+ */
+static BOOL MEMFILE_copyFromBuffer(FileBuffer_t *buf, LPVOID dest, LONGLONG offset, DWORD count)
+{
+    BOOL copied = TRUE;
+
+
+    if (!buf->mapped){
+        memcpy(dest, buf->buffer + offset, count);
+        return TRUE;
+    }
+
+    __TRY
+    {
+        memcpy(dest, buf->buffer + offset, count);
+    }
+    __EXCEPT(mapped_fault)
+    {
+        WARN("'%s' was truncated while mapped.  Reading it from the file from now on\n", buf->filename);
+        InterlockedExchange((LONG *)&buf->readyBytes, 0);
+        copied = FALSE;
+    }
+    __ENDTRY
+
+    return copied;
+}
+
+
 /* --------------------------------------------------------------
  *              MEMFILE_doRead()
- *  Performs the actual work of reading from the memory file.
+ *  Performs the actual work of reading from the memory file.  If
+ *  the requested range has not been loaded into the buffer yet,
+ *  nothing is copied, the file position that the read should start
+ *  from is stored in <pDirectPos>, and FALSE is returned.  The
+ *  caller must then read the data straight from the file with
+ *  MEMFILE_doDirectRead() once <g_memFile.cs> has been released.
  *  NOTE: <g_memFile.cs> must be held before calling this function!
  */
-static void MEMFILE_doRead(MemFileData_t *pData, LPVOID Buffer, DWORD BytesToRead, LPDWORD BytesRead)
+static BOOL MEMFILE_doRead(MemFileData_t *pData, LPVOID Buffer, DWORD BytesToRead, LPDWORD BytesRead,
+                           PLARGE_INTEGER pDirectPos)
 {
     DWORD maxSize;
+    BOOL  loaded = TRUE;
 
 
     /* Determine how much data we can copy */
-    maxSize = pData->Buffer->fileSize.QuadPart - pData->CurPos.QuadPart;
+    if (pData->CurPos.QuadPart >= pData->Buffer->fileSize.QuadPart)
+        maxSize = 0;
+
+    else
+        maxSize = pData->Buffer->fileSize.QuadPart - pData->CurPos.QuadPart;
+
     if (maxSize < BytesToRead)
         BytesToRead = maxSize;
 
 
-    /* Copy data */
-    memcpy (Buffer, pData->Buffer->buffer + pData->CurPos.QuadPart, BytesToRead);
+    /* the loader thread hasn't gotten this far yet => the caller has to go to the file */
+    if (pData->CurPos.QuadPart + BytesToRead > pData->Buffer->readyBytes){
+        pDirectPos->QuadPart = pData->CurPos.QuadPart;
+        loaded = FALSE;
+    }
+
+    /* Copy data.  If the mapped file shrank under us, the caller has to go to the file too */
+    else if (!MEMFILE_copyFromBuffer(pData->Buffer, Buffer, pData->CurPos.QuadPart, BytesToRead)){
+        pDirectPos->QuadPart = pData->CurPos.QuadPart;
+        loaded = FALSE;
+    }
+
     pData->CurPos.QuadPart += BytesToRead;
 
     if (BytesRead)
@@ -1238,6 +1825,76 @@ static void MEMFILE_doRead(MemFileData_t *pData, LPVOID Buffer, DWORD BytesToRea
     /* move this file to the front of the list so the next access will 
        be faster and we'll have an ordering for an MRU list */
     MoveToFront(pData);
+
+    return loaded;
+}
+
+/* --------------------------------------------------------------
+ *              MEMFILE_doDirectRead()
+ *  Reads the part of a memory file that hasn't been loaded yet
+ *  straight from the file at <pos> without touching the handle's
+ *  real file pointer.  <Count> holds the number of bytes that
+ *  MEMFILE_doRead() reserved for the read on entry and the number
+ *  of bytes actually read on exit.
+ *  NOTE: <g_memFile.cs> must NOT be held while calling this!
+ */
+static void MEMFILE_doDirectRead(HANDLE hFile, LPVOID Buffer, LPDWORD Count, LARGE_INTEGER pos)
+{
+    DWORD   BytesToRead = *Count;
+    DWORD   total = 0;
+    ssize_t result;
+    int     fd;
+
+
+    fd = FILE_GetUnixHandle(hFile, GENERIC_READ);
+
+    if (fd != -1){
+        while (total < BytesToRead){
+            result = pread(fd, (BYTE *)Buffer + total, BytesToRead - total, pos.QuadPart + total);
+
+            if (result == -1 && errno == EINTR)
+                continue;
+
+            if (result <= 0)
+                break;
+
+            total += result;
+        }
+
+        close(fd);
+    }
+
+    if (total != BytesToRead)
+        WARN("short read from the file for handle %u {offset = %lld, requested = %ld, read = %ld}\n",
+                hFile, pos.QuadPart, BytesToRead, total);
+
+    *Count = total;
+}
+
+/* --------------------------------------------------------------
+ *              MEMFILE_endDirectRead()
+ *  Moves the position of the memory file for <hFile> back after
+ *  a direct read that started at <pos> and read <count> of the
+ *  <reserved> bytes MEMFILE_doRead() advanced the position by.
+ *  The position is left alone if another read or seek on the
+ *  handle got in since.
+ *  NOTE: <g_memFile.cs> must NOT be held while calling this!
+ */
+static void MEMFILE_endDirectRead(HANDLE hFile, LARGE_INTEGER pos, DWORD reserved, DWORD count)
+{
+    MemFileData_t * pData;
+
+
+    if (count == reserved)
+        return;
+
+    EnterCriticalSection (&g_memFile.cs);
+    pData = GetMemFile (hFile, FALSE);
+
+    if (pData && pData->CurPos.QuadPart == pos.QuadPart + reserved)
+        pData->CurPos.QuadPart = pos.QuadPart + count;
+
+    LeaveCriticalSection (&g_memFile.cs);
 }
 
 /* --------------------------------------------------------------
@@ -1247,6 +1904,9 @@ BOOL MEMFILE_ReadFile (HANDLE hFile, LPVOID Buffer, DWORD BytesToRead,
                        LPDWORD BytesRead)
 {
     MemFileData_t * pData;
+    LARGE_INTEGER   directPos;
+    DWORD           count;
+    BOOL            loaded;
 
 
     /* Optimization for common case - if no memory files, then no need
@@ -1264,9 +1924,21 @@ BOOL MEMFILE_ReadFile (HANDLE hFile, LPVOID Buffer, DWORD BytesToRead,
     }
 
 
-    MEMFILE_doRead(pData, Buffer, BytesToRead, BytesRead);
+    loaded = MEMFILE_doRead(pData, Buffer, BytesToRead, &count, &directPos);
 
     LeaveCriticalSection (&g_memFile.cs);
+
+
+    if (!loaded){
+        DWORD reserved = count;
+
+        MEMFILE_doDirectRead(hFile, Buffer, &count, directPos);
+        MEMFILE_endDirectRead(hFile, directPos, reserved, count);
+    }
+
+    if (BytesRead)
+        *BytesRead = count;
+
     return TRUE;
 }
 
@@ -1281,6 +1953,9 @@ BOOL MEMFILE_ReadFileFromOffset (HANDLE hFile, LPVOID Buffer, DWORD BytesToRead,
                                         LPDWORD BytesRead, LARGE_INTEGER offset)
 {
     MemFileData_t * pData;
+    LARGE_INTEGER   directPos;
+    DWORD           count;
+    BOOL            loaded;
 
 
     /* Optimization for common case - if no memory files, then no need
@@ -1302,9 +1977,21 @@ BOOL MEMFILE_ReadFileFromOffset (HANDLE hFile, LPVOID Buffer, DWORD BytesToRead,
     MEMFILE_doSeek(pData, offset, NULL, FILE_BEGIN);
     
     /* perform the read starting at the requested location */
-    MEMFILE_doRead(pData, Buffer, BytesToRead, BytesRead);
+    loaded = MEMFILE_doRead(pData, Buffer, BytesToRead, &count, &directPos);
     
     LeaveCriticalSection (&g_memFile.cs);
+
+
+    if (!loaded){
+        DWORD reserved = count;
+
+        MEMFILE_doDirectRead(hFile, Buffer, &count, directPos);
+        MEMFILE_endDirectRead(hFile, directPos, reserved, count);
+    }
+
+    if (BytesRead)
+        *BytesRead = count;
+
     return TRUE;
 }
 
@@ -1865,6 +1865,7 @@ static void MODULE_FlushModrefs(void)
                 if (wm->dlhandle) wine_dll_unload( wm->dlhandle );
                 else UnmapViewOfFile( (LPVOID)wm->module );
                 FreeLibrary16(wm->hDummyMod);
+                PE_FreeExportIndex( wm );
                 HeapFree( GetProcessHeap(), 0, wm->deps );
                 HeapFree( GetProcessHeap(), 0, wm );
 	}
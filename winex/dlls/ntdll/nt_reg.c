@@ -9,10 +9,12 @@
  * distribution of this software and related documentation without an express
  * license agreement from NVIDIA CORPORATION is strictly prohibited.
  */
+#include <stdio.h>
 #include "nt_reg.h"
 #include "wine/unicode.h"
 #include "wine/debug.h"
 #include "wine/nt_config.h"
+#include "ntdll_misc.h"
 
 
 WINE_DEFAULT_DEBUG_CHANNEL (reg);
@@ -20,6 +22,9 @@ WINE_DEFAULT_DEBUG_CHANNEL (reg);
 
 #define ARRAYSIZE(x)    (sizeof(x) / sizeof((x)[0]))
 
+
+static NTSTATUS queryValue(HKEY hkey, LPCWSTR name, LPBYTE data, DWORD *count, BOOL *cached);
+
 /* Nt_regCreateKeyExW(): a slightly modified version of the real implementation of RegCreateKeyExA().
      This version has been simplified to suit the needs of the memory files system.  This has been
      implemented here to avoid a dependency on 'advapi32.dll'. */
@@ -87,6 +92,13 @@ NTSTATUS Nt_regCloseKey(HKEY hkey){
      This version has been simplified to suit the needs of the memory files system.  This has been
      implemented here to avoid a dependency on 'advapi32.dll'. */
 NTSTATUS Nt_regQueryValueExW(HKEY hkey, LPCWSTR name, LPBYTE data, DWORD *count){
+    return queryValue(hkey, name, data, count, NULL);
+}
+
+/* queryValue(): Nt_regQueryValueExW(), also reporting in <cached> whether the value
+     came from the registry value cache.  Only the config key readers pass <cached>,
+     and only their reads use the cache unless WINEREGCACHE=all. */
+static NTSTATUS queryValue(HKEY hkey, LPCWSTR name, LPBYTE data, DWORD *count, BOOL *cached){
     NTSTATUS                        status;
     UNICODE_STRING                  nameW;
     DWORD                           total_size;
@@ -99,8 +111,8 @@ NTSTATUS Nt_regQueryValueExW(HKEY hkey, LPCWSTR name, LPBYTE data, DWORD *count)
     RtlInitUnicodeString( &nameW, name );
 
 
-    status = NtQueryValueKey( hkey, &nameW, KeyValuePartialInformation,
-                              buffer, sizeof(buffer), &total_size );
+    status = REG_QueryValueKey( hkey, &nameW, KeyValuePartialInformation,
+                                buffer, sizeof(buffer), &total_size, cached != NULL, cached );
 
     if (status && status != STATUS_BUFFER_OVERFLOW)
         return status;
@@ -232,14 +244,73 @@ BOOL Nt_getSingleConfigValueA(LPCSTR     section,
 
 /************************************** external config API functions *************************************/
 
+/* ConfigSection: the keys of a config section, kept open once the registry value cache
+     is up, so that reading a setting doesn't cost opening and closing two keys.  The
+     section is identified by its name, and the app name if app defaults are used (a
+     process can run several win16 tasks).  A section that is missing a key, or whose
+     key was deleted, is retired after REG_CACHE_TTL ms so the keys get opened again; it
+     is freed, and its keys closed, once the last context using it is closed. */
+typedef struct _ConfigSection{
+    struct _ConfigSection * next;
+    HKEY                    hkey;
+    HKEY                    appkey;
+    DWORD                   lastError;      /* from opening the keys */
+    DWORD                   time;           /* NtGetTickCount when the keys were opened */
+    LONG                    users;          /* open contexts, plus one while listed */
+    BOOL                    stale;          /* a key was deleted, reopen it */
+    DWORD                   hits;           /* value reads served from the cache */
+    DWORD                   misses;
+    WCHAR *                 appname;        /* points into <name>, NULL if no app defaults */
+    WCHAR                   name[1];
+} ConfigSection;
+
+
 /* ConfigData: internal struct for the config context handle. */
 typedef struct{
-    HKEY    hkey;
-    HKEY    appkey;
-    DWORD   lastError;
+    HKEY            hkey;
+    HKEY            appkey;
+    DWORD           lastError;
+    ConfigSection * section;        /* owner of the keys, NULL if they are ours */
 } ConfigData;
 
 
+static ConfigSection *      g_configSections;
+static CRITICAL_SECTION     g_configSectionsCS;
+static BOOL                 g_configCacheEnabled = FALSE;
+
+
+/* Nt_initConfigCache(): enables keeping config sections open.  Called once the registry
+     value cache is set up. */
+void Nt_initConfigCache(void){
+    RtlInitializeCriticalSection(&g_configSectionsCS);
+    CRITICAL_SECTION_NAME(&g_configSectionsCS, "g_configSectionsCS");
+    g_configCacheEnabled = TRUE;
+}
+
+
+/* Nt_reportConfigStats(): prints the value cache hit counts for each config section. */
+void Nt_reportConfigStats(void){
+    ConfigSection * section;
+
+
+    if (!g_configCacheEnabled)
+        return;
+
+    RtlEnterCriticalSection(&g_configSectionsCS);
+
+    for (section = g_configSections; section; section = section->next){
+        fprintf(stderr, "  config %s%s%s: hits %lu misses %lu\n",
+                debugstr_w(section->name),
+                section->appname ? " for " : "",
+                section->appname ? debugstr_w(section->appname) : "",
+                section->hits,
+                section->misses);
+    }
+
+    RtlLeaveCriticalSection(&g_configSectionsCS);
+}
+
+
 /* strdupAtoW(): converts an ANSI string to a wide character string in a new
      buffer.  A pointer to the new buffer is returned on success.  NULL is
      returned on failure (ie: out of memory).  The returned buffer must later
@@ -284,13 +355,132 @@ HCONFIG Nt_openConfigA(LPCSTR section, DWORD flags){
     return result;
 }
 
+/* releaseConfigSection(): drops a reference to a config section, freeing it and closing
+     its keys with the last one.  Must hold g_configSectionsCS. */
+static void releaseConfigSection(ConfigSection *cached){
+    if (--cached->users)
+        return;
+
+    if (cached->hkey)
+        Nt_regCloseKey(cached->hkey);
+
+    if (cached->appkey)
+        Nt_regCloseKey(cached->appkey);
+
+    RtlFreeHeap(GetProcessHeap(), 0, cached);
+}
+
+/* lookupConfigSection(): finds a listed config section.  Must hold g_configSectionsCS. */
+static ConfigSection **lookupConfigSection(LPCWSTR section, LPCWSTR appname){
+    ConfigSection ** pcached;
+
+
+    for (pcached = &g_configSections; *pcached; pcached = &(*pcached)->next){
+        if (strcmpiW((*pcached)->name, section))
+            continue;
+
+        if (appname ? ((*pcached)->appname && !strcmpiW((*pcached)->appname, appname)) : !(*pcached)->appname)
+            return pcached;
+    }
+
+    return NULL;
+}
+
+/* findConfigSection(): looks for an already open config section, and takes a reference
+     to it.  <appname> is NULL if app defaults aren't used.  Returns NULL if it isn't open
+     yet, is due to be reopened, or caching is disabled. */
+static ConfigSection *findConfigSection(LPCWSTR section, LPCWSTR appname){
+    ConfigSection ** pcached;
+    ConfigSection *  cached = NULL;
+
+
+    if (!g_configCacheEnabled)
+        return NULL;
+
+    RtlEnterCriticalSection(&g_configSectionsCS);
+
+    if ((pcached = lookupConfigSection(section, appname))){
+        cached = *pcached;
+
+        /* a missing key may have been created since, and a deleted one recreated */
+        if (cached->stale ||
+            ((!cached->hkey || (cached->appname && !cached->appkey)) &&
+             NtGetTickCount() - cached->time >= REG_CACHE_TTL))
+        {
+            *pcached = cached->next;
+            releaseConfigSection(cached);
+            cached = NULL;
+        }
+
+        else
+            cached->users++;
+    }
+
+    RtlLeaveCriticalSection(&g_configSectionsCS);
+
+    return cached;
+}
+
+/* addConfigSection(): hands the keys of a freshly opened config context over to the
+     section cache, so they stay open.  If another thread got there first, the context
+     keeps its own keys and closes them as usual. */
+static void addConfigSection(ConfigData *data, LPCWSTR section, LPCWSTR appname){
+    ConfigSection * cached;
+    DWORD           sectionLen = strlenW(section) + 1;
+    DWORD           appLen = appname ? strlenW(appname) + 1 : 0;
+
+
+    if (!g_configCacheEnabled)
+        return;
+
+    cached = RtlAllocateHeap(GetProcessHeap(), 0, sizeof(ConfigSection) + (sectionLen + appLen) * sizeof(WCHAR));
+
+    if (cached == NULL)
+        return;
+
+
+    cached->hkey = data->hkey;
+    cached->appkey = data->appkey;
+    cached->lastError = data->lastError;
+    cached->time = NtGetTickCount();
+    cached->users = 2;  /* the list and <data> */
+    cached->stale = FALSE;
+    cached->hits = 0;
+    cached->misses = 0;
+    strcpyW(cached->name, section);
+    cached->appname = NULL;
+
+    if (appname){
+        cached->appname = cached->name + sectionLen;
+        strcpyW(cached->appname, appname);
+    }
+
+
+    RtlEnterCriticalSection(&g_configSectionsCS);
+
+    if (lookupConfigSection(section, appname)){
+        RtlLeaveCriticalSection(&g_configSectionsCS);
+        RtlFreeHeap(GetProcessHeap(), 0, cached);
+
+        return;
+    }
+
+    cached->next = g_configSections;
+    g_configSections = cached;
+    data->section = cached;
+
+    RtlLeaveCriticalSection(&g_configSectionsCS);
+}
+
 /* Nt_openConfig(): opens the config file to the section <section> and prepares
      it for being read from.  Returns a handle to the config context if successful.
      Returns NULL on failure. */
 HCONFIG Nt_openConfigW(LPCWSTR section, DWORD flags){
     ConfigData *        data = RtlAllocateHeap(GetProcessHeap(), 0, sizeof(ConfigData));
+    ConfigSection *     cached;
     char                buffer[MAX_PATH];
     WCHAR               wbuffer[MAX_PATH + 64];
+    WCHAR *             appNameW = NULL;
     static const WCHAR  baseKeyName[] = {'S', 'o', 'f', 't', 'w', 'a', 'r', 'e', '\\',
                                          'W', 'i', 'n', 'e', '\\',
                                          'W', 'i', 'n', 'e', '\\',
@@ -310,28 +500,15 @@ HCONFIG Nt_openConfigW(LPCWSTR section, DWORD flags){
     data->hkey = 0;
     data->appkey = 0;
     data->lastError = STATUS_SUCCESS;
+    data->section = NULL;
 
 
-    /* create the section name and try to open the key */
-    snprintfW(wbuffer, ARRAYSIZE(wbuffer), keyFormat, baseKeyName, section);
-
-    data->lastError = Nt_regCreateKeyExW(   HKEY_LOCAL_MACHINE,
-                                            wbuffer,
-                                            REG_OPTION_VOLATILE,
-                                            KEY_ALL_ACCESS,
-                                            &data->hkey);
-
-    if (data->lastError != STATUS_SUCCESS)
-        ERR("Cannot create config registry key\n" );
-
-
-    /* open the app-specific key */
+    /* find the app name for the app-specific key */
     if (!(flags & CONFIG_FLAG_NOAPPDEFAULTS)){
         if (GetModuleFileName16(GetCurrentTask(), buffer, MAX_PATH) ||
             ((data->lastError = GetModuleFileNameA(0, buffer, MAX_PATH)) != 0 &&
              data->lastError != MAX_PATH))
         {
-            WCHAR * appNameW;
             char *  p;
             char *  appname = buffer;
 
@@ -347,25 +524,52 @@ HCONFIG Nt_openConfigW(LPCWSTR section, DWORD flags){
 
             if (appNameW == NULL)
                 ERR("could not convert the app name '%s'\n", appname);
+        }
 
-            snprintfW(  wbuffer, 
-                        ARRAYSIZE(wbuffer),
-                        appFormat,
-                        baseKeyName,
-                        baseAppName,
-                        appNameW,
-                        section);
+        else
+            ERR("could not retrieve the module file name (reason: '%s')\n", data->lastError == 0 ? "bad module" : "buffer too small");
+    }
 
-            RtlFreeHeap(GetProcessHeap(), 0, appNameW);
 
-            data->lastError = Nt_regOpenKeyExW(HKEY_LOCAL_MACHINE, wbuffer, KEY_ALL_ACCESS, &data->appkey);
+    /* already have this section open? */
+    if ((cached = findConfigSection(section, appNameW))){
+        data->hkey = cached->hkey;
+        data->appkey = cached->appkey;
+        data->lastError = cached->lastError;
+        data->section = cached;
+        RtlFreeHeap(GetProcessHeap(), 0, appNameW);
 
-            if (data->lastError != STATUS_SUCCESS)
-                data->appkey = 0;
-        }
-     
-        else
-            ERR("could not retrieve the module file name (reason: '%s')\n", data->lastError == 0 ? "bad module" : "buffer too small");
+        return data;
+    }
+
+
+    /* create the section name and try to open the key */
+    snprintfW(wbuffer, ARRAYSIZE(wbuffer), keyFormat, baseKeyName, section);
+
+    data->lastError = Nt_regCreateKeyExW(   HKEY_LOCAL_MACHINE,
+                                            wbuffer,
+                                            REG_OPTION_VOLATILE,
+                                            KEY_ALL_ACCESS,
+                                            &data->hkey);
+
+    if (data->lastError != STATUS_SUCCESS)
+        ERR("Cannot create config registry key\n" );
+
+
+    /* open the app-specific key */
+    if (appNameW){
+        snprintfW(  wbuffer, 
+                    ARRAYSIZE(wbuffer),
+                    appFormat,
+                    baseKeyName,
+                    baseAppName,
+                    appNameW,
+                    section);
+
+        data->lastError = Nt_regOpenKeyExW(HKEY_LOCAL_MACHINE, wbuffer, KEY_ALL_ACCESS, &data->appkey);
+
+        if (data->lastError != STATUS_SUCCESS)
+            data->appkey = 0;
     }
 
 
@@ -373,11 +577,18 @@ HCONFIG Nt_openConfigW(LPCWSTR section, DWORD flags){
     /* couldn't open either key => fail */
     if (data->hkey == 0 && data->appkey == 0){
         ERR("could not open the config {error = 0x%08x}\n", data->lastError);
+        RtlFreeHeap(GetProcessHeap(), 0, appNameW);
         RtlFreeHeap(GetProcessHeap(), 0, data);
 
-        data = NULL;
+        return NULL;
     }
 
+
+    /* keep the keys open for next time */
+    addConfigSection(data, section, appNameW);
+
+    RtlFreeHeap(GetProcessHeap(), 0, appNameW);
+
     return data;
 }
 
@@ -394,11 +605,20 @@ void Nt_closeConfig(HCONFIG config){
     }
 
 
-    if (data->hkey)
-        Nt_regCloseKey(data->hkey);
+    /* the section cache owns the keys */
+    if (data->section){
+        RtlEnterCriticalSection(&g_configSectionsCS);
+        releaseConfigSection(data->section);
+        RtlLeaveCriticalSection(&g_configSectionsCS);
+    }
+
+    else{
+        if (data->hkey)
+            Nt_regCloseKey(data->hkey);
 
-    if (data->appkey)
-        Nt_regCloseKey(data->appkey);
+        if (data->appkey)
+            Nt_regCloseKey(data->appkey);
+    }
 
     RtlFreeHeap(GetProcessHeap(), 0, data);
 }
@@ -459,6 +679,7 @@ BOOL Nt_getConfigKeyA(HCONFIG config, LPCSTR name, CHAR *buffer, DWORD size){
      value was successfully retrieved.  Returns FALSE otherwise. */
 BOOL Nt_getConfigKeyW(HCONFIG config, LPCWSTR name, WCHAR *buffer, DWORD size){
     ConfigData *data = (ConfigData *)config;
+    BOOL        cached = FALSE;
 
 
     if (data == NULL){
@@ -469,14 +690,30 @@ BOOL Nt_getConfigKeyW(HCONFIG config, LPCWSTR name, WCHAR *buffer, DWORD size){
 
 
     if (data->appkey){
-        data->lastError = Nt_regQueryValueExW(data->appkey, name, (LPBYTE)buffer, &size);
+        data->lastError = queryValue(data->appkey, name, (LPBYTE)buffer, &size, &cached);
 
         if (data->lastError == STATUS_SUCCESS)
-            return TRUE;
+            goto done;
+
+        if (data->lastError == STATUS_KEY_DELETED && data->section)
+            data->section->stale = TRUE;
     }
 
 
-    data->lastError = Nt_regQueryValueExW(data->hkey, name, (LPBYTE)buffer, &size);
+    data->lastError = queryValue(data->hkey, name, (LPBYTE)buffer, &size, &cached);
+
+done:
+    /* the counts are only a rough guide, don't bother locking */
+    if (data->section){
+        if (data->lastError == STATUS_KEY_DELETED)
+            data->section->stale = TRUE;
+
+        if (cached)
+            data->section->hits++;
+
+        else
+            data->section->misses++;
+    }
 
     return data->lastError == STATUS_SUCCESS;
 }
@@ -8,4 +8,32 @@
 extern LPCSTR debugstr_us( const UNICODE_STRING *str );
 extern void dump_ObjectAttributes (const OBJECT_ATTRIBUTES *ObjectAttributes);
 
+/* registry value cache */
+#define REG_CACHE_TTL       1000    /* ms, also for reopening missing config keys */
+
+extern void REG_Init(void);
+extern void REG_InvalidateHandle( HANDLE hkey );
+extern NTSTATUS REG_QueryValueKey( HANDLE handle, const UNICODE_STRING *name,
+                                   KEY_VALUE_INFORMATION_CLASS info_class,
+                                   void *info, DWORD length, DWORD *result_len,
+                                   BOOL use_cache, BOOL *cached );
+extern void Nt_initConfigCache(void);
+extern void Nt_reportConfigStats(void);
+
+/* event state mirror */
+#define SYNC_MIRROR_MANUAL      0x01    /* manual-reset event */
+#define SYNC_MIRROR_KNOWN       0x02    /* state below is known */
+#define SYNC_MIRROR_SIGNALED    0x04
+#define SYNC_MIRROR_DIRTY       0x08    /* changes in flight overlapped */
+#define SYNC_MIRROR_BUSY_SHIFT  8       /* number of changes in flight */
+#define SYNC_MIRROR_SEQ_SHIFT   16      /* sequence number */
+#define SYNC_MIRROR_FLAGS(val)  ((DWORD)((val) >> 32) & 0xff)
+#define SYNC_MIRROR_BUSY(val)   ((DWORD)((val) >> (32 + SYNC_MIRROR_BUSY_SHIFT)) & 0xff)
+
+extern void SYNC_Init(void);
+extern void SYNC_MirrorEvent( HANDLE handle, BOOL manual_reset, BOOL signaled );
+extern void SYNC_ForgetHandle( HANDLE handle );
+extern LONGLONG SYNC_MirrorGet( HANDLE handle );
+extern void SYNC_MirrorWaited( HANDLE handle, LONGLONG seen, BOOL signaled );
+
 #endif
@@ -12,6 +12,7 @@
 #include "winternl.h"
 #include "ntdll_misc.h"
 #include "wine/server.h"
+#include "wine/file.h"
 
 WINE_DEFAULT_DEBUG_CHANNEL(ntdll);
 
@@ -221,6 +222,11 @@ NTSTATUS WINAPI NtDuplicateObject(
 NTSTATUS WINAPI NtClose( HANDLE Handle )
 {
     NTSTATUS ret;
+
+    FILE_InvalidateHandleFd( Handle );
+    REG_InvalidateHandle( Handle );
+    SYNC_ForgetHandle( Handle );
+
     SERVER_START_REQ( close_handle )
     {
         req->handle = Handle;
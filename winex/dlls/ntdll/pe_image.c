@@ -128,6 +128,96 @@ void dump_exports( HMODULE hModule )
   }
 }
 
+/* Export lookup cache, built the first time a module is searched by name:
+ * an open addressing hash of the export names, and the resolved targets of
+ * forwarded entry points. Only accessed with the loader lock held.
+ */
+typedef struct
+{
+    DWORD hash;
+    DWORD index;             /* index in AddressOfNames + 1, 0 if free */
+} PE_EXPORT_SLOT;
+
+typedef struct
+{
+    DWORD   generation;      /* PE_forward_generation when resolved */
+    FARPROC proc[2];         /* without and with snooping */
+} PE_FORWARD;
+
+struct pe_export_index
+{
+    DWORD           mask;    /* number of slots - 1 */
+    PE_FORWARD     *forwards; /* by ordinal, allocated on first forward */
+    PE_EXPORT_SLOT  slots[1];
+};
+
+/* bumped whenever a module goes away, as forwards may point into it */
+static DWORD PE_forward_generation;
+
+static DWORD PE_HashName( const char *name )
+{
+    DWORD hash = 2166136261U;
+    while (*name) hash = (hash ^ (BYTE)*name++) * 16777619U;
+    return hash;
+}
+
+/***********************************************************************
+ *           PE_GetExportIndex
+ *
+ * Get the export name hash of a module, building it if needed.
+ * Returns NULL if it couldn't be allocated.
+ */
+static struct pe_export_index *PE_GetExportIndex( WINE_MODREF *wm,
+                                                  IMAGE_EXPORT_DIRECTORY *exports )
+{
+    unsigned int load_addr = wm->module;
+    struct pe_export_index *idx;
+    DWORD *name = RVA(exports->AddressOfNames);
+    DWORD i, size = 16;
+
+    if (wm->exports) return wm->exports;
+
+    while (size < 2 * exports->NumberOfNames) size <<= 1;
+    if (!(idx = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY,
+                           sizeof(*idx) + (size - 1) * sizeof(PE_EXPORT_SLOT) )))
+        return NULL;
+    idx->mask = size - 1;
+
+    for (i = 0; i < exports->NumberOfNames; i++)
+    {
+        char *ename = RVA(name[i]);
+        DWORD hash = PE_HashName( ename ), pos = hash & idx->mask;
+
+        /* keep the first of duplicate names, like the linear search did */
+        while (idx->slots[pos].index)
+        {
+            if (idx->slots[pos].hash == hash &&
+                !strcmp( RVA(name[idx->slots[pos].index - 1]), ename )) break;
+            pos = (pos + 1) & idx->mask;
+        }
+        if (idx->slots[pos].index) continue;
+        idx->slots[pos].hash  = hash;
+        idx->slots[pos].index = i + 1;
+    }
+    TRACE("%s: indexed %ld export names in %ld slots\n", wm->modname,
+          exports->NumberOfNames, size );
+    return (wm->exports = idx);
+}
+
+/***********************************************************************
+ *           PE_FreeExportIndex
+ *
+ * Release the export lookup cache of a module being unloaded.
+ */
+void PE_FreeExportIndex( WINE_MODREF *wm )
+{
+    PE_forward_generation++;
+    if (!wm->exports) return;
+    HeapFree( GetProcessHeap(), 0, wm->exports->forwards );
+    HeapFree( GetProcessHeap(), 0, wm->exports );
+    wm->exports = NULL;
+}
+
 /* Look up the specified function or ordinal in the export list:
  * If it is a string:
  * 	- look up the name in the name list.
@@ -150,6 +240,7 @@ static FARPROC PE_FindExportedFunction(
 	DWORD				rva_start, rva_end, addr;
 	char				* forward;
 	IMAGE_EXPORT_DIRECTORY *exports = get_exports(wm->module);
+	struct pe_export_index *idx;
 
 	if (HIWORD(funcName))
 		TRACE("(%s)\n",funcName);
@@ -172,7 +263,23 @@ static FARPROC PE_FindExportedFunction(
 	rva_end = rva_start + PE_HEADER(wm->module)->OptionalHeader
 		.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].Size;
 
-	if (HIWORD(funcName))
+	if (HIWORD(funcName) && (idx = PE_GetExportIndex( wm, exports )))
+        {
+            DWORD hash = PE_HashName( funcName ), pos = hash & idx->mask;
+
+            for (; idx->slots[pos].index; pos = (pos + 1) & idx->mask)
+            {
+                if (idx->slots[pos].hash != hash) continue;
+                ename = RVA(name[idx->slots[pos].index - 1]);
+                if (!strcmp( ename, funcName ))
+                {
+                    ordinal = ordinals[idx->slots[pos].index - 1];
+                    goto found;
+                }
+            }
+            return NULL;
+        }
+	else if (HIWORD(funcName))
         {
             /* first try a binary search */
             int min = 0, max = exports->NumberOfNames - 1;
@@ -240,6 +347,25 @@ static FARPROC PE_FindExportedFunction(
                 char *forward = RVA(addr);
 		char module[256];
 		char *end = strchr(forward, '.');
+		PE_FORWARD *fw = NULL;
+
+		/* finding the target module is expensive, remember the result */
+		if ((idx = PE_GetExportIndex( wm, exports )))
+		{
+		    if (!idx->forwards)
+			idx->forwards = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY,
+						   exports->NumberOfFunctions * sizeof(PE_FORWARD) );
+		    if (idx->forwards)
+		    {
+			fw = &idx->forwards[ordinal];
+			if (fw->generation != PE_forward_generation)
+			{
+			    fw->generation = PE_forward_generation;
+			    fw->proc[0] = fw->proc[1] = NULL;
+			}
+			if (fw->proc[snoop != 0]) return fw->proc[snoop != 0];
+		    }
+		}
 
 		if (!end) return NULL;
                 if (end - forward >= sizeof(module)) return NULL;
@@ -252,6 +378,9 @@ static FARPROC PE_FindExportedFunction(
                 }
 		if (!(proc = MODULE_GetProcAddress( wm_fw->module, end + 1, snoop )))
                     ERR("function not found for forward '%s' used by '%s'. If you are using builtin '%s', try using the native one instead.\n", forward, wm->modname, wm->modname );
+		/* the lookup may have loaded or freed modules, so recheck */
+		else if (fw && fw->generation == PE_forward_generation)
+		    fw->proc[snoop != 0] = proc;
 		return proc;
 	}
 }
@@ -265,7 +394,8 @@ DWORD PE_fixup_imports( WINE_MODREF *wm )
     unsigned int load_addr	= wm->module;
     int				i,characteristics_detection=1;
     IMAGE_IMPORT_DESCRIPTOR *imports = get_imports(wm->module);
-    int r = 0;
+    int r = 0, count = 0;
+    DWORD start_time = 0;
 
     /* first, count the number of imported non-internal modules */
     pe_imp = imports;
@@ -287,6 +417,8 @@ DWORD PE_fixup_imports( WINE_MODREF *wm )
     }
     if (!i) return 0;  /* no imports */
 
+    if (TRACE_ON(module)) start_time = NtGetTickCount();
+
     /* Allocate module dependency list */
     wm->nDeps = i;
     wm->deps  = HeapAlloc( GetProcessHeap(), 0, i*sizeof(WINE_MODREF *) );
@@ -345,8 +477,7 @@ DWORD PE_fixup_imports( WINE_MODREF *wm )
 
               TRACE("--- Ordinal %s,%d\n", name, ordinal);
               thunk_list->u1.Function =
-                 (PDWORD)MODULE_GetProcAddress (wmImp->module, (LPCSTR)ordinal,
-                                                TRUE);
+                 (PDWORD)wmImp->find_export (wmImp, (LPCSTR)ordinal, TRUE);
               if (!thunk_list->u1.Function)
               {
                  ERR_(fixup)("No implementation for %s.%d imported from %s, setting to 0xdeadbeef\n",
@@ -361,8 +492,7 @@ DWORD PE_fixup_imports( WINE_MODREF *wm )
               pe_name = (PIMAGE_IMPORT_BY_NAME)RVA(import_list->u1.AddressOfData);
               TRACE("--- %s %s.%d\n", pe_name->Name, name, pe_name->Hint);
               thunk_list->u1.Function =
-                 (PDWORD)MODULE_GetProcAddress (wmImp->module,
-                                                (LPCSTR)pe_name->Name, TRUE);
+                 (PDWORD)wmImp->find_export (wmImp, (LPCSTR)pe_name->Name, TRUE);
               if (!thunk_list->u1.Function)
               {
                  ERR_(fixup)("No implementation for %s.%d(%s) imported from %s, setting to 0xdeadbeef\n",
@@ -374,6 +504,7 @@ DWORD PE_fixup_imports( WINE_MODREF *wm )
            }
            import_list++;
            thunk_list++;
+           count++;
         }
 
         if (prot_size)
@@ -382,6 +513,9 @@ DWORD PE_fixup_imports( WINE_MODREF *wm )
               ERR ("Unable to restore protections on import list!\n");
         }
     }
+
+    TRACE_(module)( "%s: resolved %d imports in %ld ms\n",
+                    wm->modname, count, NtGetTickCount() - start_time );
     return r;
 }
 
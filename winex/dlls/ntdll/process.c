@@ -161,9 +161,14 @@ extern void VIRTUAL_Setup(void);
 extern void INSTR_Init(void);
 extern void LOADER_Init(void);
 extern void TIME_Init(void);
+extern void REG_Init(void);
+extern void SYNC_Init(void);
 extern void PROCESS_Init(void);
 extern void INIT_CritSects(void);
 extern void HEAP_Init (BOOL);
+extern void HEAP_StartReportService (void);
+extern void RELAY_StartProfileService(void);
+extern void DEBUG_StopTraceWriter(void);
 
 #ifdef USE_PTHREADS
 #define CHECK_ERR( op ) do { int err = (op); if( err ) { fprintf( stderr, "\"" # op "\" failed at %s:%d with %s\n",  __FILE__, __LINE__, strerror( err ) ); goto pthread_error; } } while(0)
@@ -316,6 +321,12 @@ static BOOL process_init( char *argv[] )
     
     /* setup the timer critical sections */
     TIME_Init();
+
+    /* setup the registry value cache */
+    REG_Init();
+
+    /* setup the event state mirror */
+    SYNC_Init();
     
     /* store the program name */
     argv0 = argv[0];
@@ -618,6 +629,8 @@ static void start_process(void)
     if (!SIGNAL_Init()) goto error;
 
     CLIENT_InitServerDone();
+    HEAP_StartReportService();
+    RELAY_StartProfileService();
 
     if (main_exe_file) CloseHandle( main_exe_file ); /* we no longer need it */
 
@@ -1521,6 +1534,9 @@ BOOL PROCESS_Create( HANDLE hFile, LPCSTR filename, LPSTR cmd_line, LPCSTR env,
  */
 void WINAPI ExitProcess( DWORD status )
 {
+    /* before the server kills it along with the other threads */
+    DEBUG_StopTraceWriter();
+
     SERVER_START_REQ( terminate_process )
     {
         /* send the exit code to the server */
@@ -71,13 +71,33 @@ typedef struct tagPROFILESECTION
 } PROFILESECTION;
 
 
+/* an entry in a profile's lookup index.  Section entries have a NULL <key>.  Key entries
+   are hashed on both the owning section and the key name */
+typedef struct tagPROFILEINDEXENTRY
+{
+    struct tagPROFILEINDEXENTRY *   next;
+    DWORD                           hash;
+    PROFILESECTION *                section;
+    PROFILEKEY *                    key;
+} PROFILEINDEXENTRY;
+
+typedef struct
+{
+    PROFILEINDEXENTRY **    buckets;
+    DWORD                   size;       /* number of buckets.  Always a power of 2 */
+    DWORD                   count;
+} PROFILEINDEX;
+
+
 typedef struct
 {
     BOOL            changed;
     PROFILESECTION *section;
     WCHAR *         filename;
+    DWORD           filenameHash;
     FILETIME        lastWriteTime;
     TextEncoding    originalEncoding;
+    PROFILEINDEX *  index;          /* built on the first lookup.  NULL if not built yet */
 } PROFILE;
 
 
@@ -90,7 +110,7 @@ static BYTE bom_ucs32be[] = {0x00, 0x00, 0xfe, 0xff};
 static BYTE bom_ucs32le[] = {0xff, 0xfe, 0x00, 0x00};
 
 
-#define N_CACHED_PROFILES 10
+#define N_CACHED_PROFILES 32
 
 /* Cached profile files */
 static PROFILE *MRUProfile[N_CACHED_PROFILES]={NULL};
@@ -102,6 +122,10 @@ static HKEY wine_profile_key;
 
 #define PROFILE_MAX_LINE_LEN   1024
 
+/* starting number of buckets in a profile's lookup index.  The index doubles in size
+   whenever it averages more than two entries per bucket */
+#define PROFILE_INDEX_MIN_SIZE 64
+
 /* Check for comments in profile */
 #define IS_ENTRY_COMMENT(str)  ((str)[0] == ';')
 
@@ -758,6 +782,203 @@ static void PROFILE_Save( HANDLE file, PROFILESECTION *section, TextEncoding enc
 }
 
 
+/***********************************************************************
+ *           PROFILE_HashName
+ *
+ * Case insensitive hash of the first <len> characters of <name>.  Names
+ * that compare equal with strncmpiW() always hash to the same value.
+ */
+static inline DWORD PROFILE_HashName( const WCHAR *name, int len, DWORD hash )
+{
+    int i;
+
+    for (i = 0; i < len && name[i]; i++)
+        hash = (hash ^ tolowerW( name[i] )) * 16777619;
+
+    return hash;
+}
+
+#define PROFILE_HASH_SEED   2166136261u
+#define PROFILE_KEY_HASH(section, name, len) \
+    PROFILE_HashName( (name), (len), PROFILE_HASH_SEED ^ (DWORD)(ULONG_PTR)(section) )
+
+
+/***********************************************************************
+ *           PROFILE_FreeIndex
+ *
+ * Throw away the lookup index of a profile.  It will be rebuilt on the
+ * next lookup.
+ */
+static void PROFILE_FreeIndex( PROFILE *profile )
+{
+    PROFILEINDEX *index = profile->index;
+    PROFILEINDEXENTRY *entry, *next;
+    DWORD i;
+
+    if (!index) return;
+
+    for (i = 0; i < index->size; i++)
+    {
+        for (entry = index->buckets[i]; entry; entry = next)
+        {
+            next = entry->next;
+            HeapFree( GetProcessHeap(), 0, entry );
+        }
+    }
+
+    HeapFree( GetProcessHeap(), 0, index->buckets );
+    HeapFree( GetProcessHeap(), 0, index );
+    profile->index = NULL;
+}
+
+
+/***********************************************************************
+ *           PROFILE_GrowIndex
+ *
+ * Double the number of buckets in a lookup index.
+ */
+static void PROFILE_GrowIndex( PROFILEINDEX *index )
+{
+    PROFILEINDEXENTRY **buckets, *entry, *next;
+    DWORD size = index->size * 2;
+    DWORD i;
+
+    /* can't grow the table => just live with longer chains */
+    if (!(buckets = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY, size * sizeof(*buckets) )))
+        return;
+
+    for (i = 0; i < index->size; i++)
+    {
+        for (entry = index->buckets[i]; entry; entry = next)
+        {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (size - 1)];
+            buckets[entry->hash & (size - 1)] = entry;
+        }
+    }
+
+    HeapFree( GetProcessHeap(), 0, index->buckets );
+    index->buckets = buckets;
+    index->size    = size;
+}
+
+
+/***********************************************************************
+ *           PROFILE_IndexFind
+ *
+ * Look up a section (<section> is NULL) or a key in a section in the
+ * lookup index.  <name> is compared on its first <len> characters.
+ */
+static PROFILEINDEXENTRY *PROFILE_IndexFind( PROFILEINDEX *index, PROFILESECTION *section,
+                                             const WCHAR *name, int len )
+{
+    PROFILEINDEXENTRY *entry;
+    const WCHAR *entry_name;
+    DWORD hash;
+
+    hash = section ? PROFILE_KEY_HASH( section, name, len )
+                   : PROFILE_HashName( name, len, PROFILE_HASH_SEED );
+
+    for (entry = index->buckets[hash & (index->size - 1)]; entry; entry = entry->next)
+    {
+        if (entry->hash != hash) continue;
+
+        if (section)
+        {
+            if (entry->section != section || !entry->key) continue;
+            entry_name = entry->key->name;
+        }
+        else
+        {
+            if (entry->key) continue;
+            entry_name = entry->section->name;
+        }
+
+        if (!strncmpiW( entry_name, name, len ) && entry_name[len] == '\0')
+            return entry;
+    }
+    return NULL;
+}
+
+
+/***********************************************************************
+ *           PROFILE_IndexAdd
+ *
+ * Add a section (<key> is NULL) or a key to the lookup index.  Only the
+ * first of several sections or keys with the same name is indexed, which
+ * matches the order a linear search of the profile tree would find them in.
+ */
+static void PROFILE_IndexAdd( PROFILEINDEX *index, PROFILESECTION *section, PROFILEKEY *key )
+{
+    PROFILEINDEXENTRY *entry;
+    const WCHAR *name = key ? key->name : section->name;
+    int len = strlenW( name );
+
+    if (PROFILE_IndexFind( index, key ? section : NULL, name, len )) return;
+
+    if (!(entry = HeapAlloc( GetProcessHeap(), 0, sizeof(*entry) )))
+    {
+        ERR("could not allocate %u bytes for a profile index entry\n", sizeof(*entry));
+        return;
+    }
+
+    entry->hash    = key ? PROFILE_KEY_HASH( section, name, len )
+                         : PROFILE_HashName( name, len, PROFILE_HASH_SEED );
+    entry->section = section;
+    entry->key     = key;
+    entry->next    = index->buckets[entry->hash & (index->size - 1)];
+    index->buckets[entry->hash & (index->size - 1)] = entry;
+
+    if (++index->count > index->size * 2) PROFILE_GrowIndex( index );
+}
+
+
+/***********************************************************************
+ *           PROFILE_GetIndex
+ *
+ * Retrieve the lookup index of a profile, building it from the profile
+ * tree if needed.  Returns NULL if the index could not be built; the
+ * caller should fall back to searching the tree in that case.
+ */
+static PROFILEINDEX *PROFILE_GetIndex( PROFILE *profile )
+{
+    PROFILEINDEX *index;
+    PROFILESECTION *section;
+    PROFILEKEY *key;
+
+    if (profile->index) return profile->index;
+
+    if (!(index = HeapAlloc( GetProcessHeap(), 0, sizeof(*index) ))) return NULL;
+
+    index->size  = PROFILE_INDEX_MIN_SIZE;
+    index->count = 0;
+
+    if (!(index->buckets = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY,
+                                      index->size * sizeof(*index->buckets) )))
+    {
+        HeapFree( GetProcessHeap(), 0, index );
+        return NULL;
+    }
+
+    for (section = profile->section; section; section = section->next)
+    {
+        /* the unnamed section holding the keys before the first header is never looked up */
+        if (!section->name[0]) continue;
+
+        PROFILE_IndexAdd( index, section, NULL );
+
+        for (key = section->key; key; key = key->next)
+            PROFILE_IndexAdd( index, section, key );
+    }
+
+    TRACE("built the lookup index for %s {entries = %lu, buckets = %lu}\n",
+          WFN(profile->filename), index->count, index->size);
+
+    profile->index = index;
+    return index;
+}
+
+
 /***********************************************************************
  *           PROFILE_Free
  *
@@ -1026,6 +1247,7 @@ static BOOL PROFILE_DeleteSection( PROFILESECTION **section, LPCWSTR name )
             PROFILESECTION *to_del = *section;
             *section = to_del->next;
             to_del->next = NULL;
+            PROFILE_FreeIndex( CurProfile );
             PROFILE_Free( to_del );
             return TRUE;
         }
@@ -1054,6 +1276,7 @@ static BOOL PROFILE_DeleteKey( PROFILESECTION **section,
                 {
                     PROFILEKEY *to_del = *key;
                     *key = to_del->next;
+                    PROFILE_FreeIndex( CurProfile );
                     if (to_del->value) HeapFree( GetProcessHeap(), 0, to_del->value);
                     HeapFree( GetProcessHeap(), 0, to_del );
                     return TRUE;
@@ -1075,6 +1298,7 @@ static BOOL PROFILE_DeleteKey( PROFILESECTION **section,
 void PROFILE_DeleteAllKeys( LPCWSTR section_name)
 {
     PROFILESECTION **section= &CurProfile->section;
+    PROFILE_FreeIndex( CurProfile );
     while (*section)
     {
         if ((*section)->name[0] && !strcmpiW( (*section)->name, section_name ))
@@ -1102,9 +1326,11 @@ void PROFILE_DeleteAllKeys( LPCWSTR section_name)
 static PROFILEKEY *PROFILE_Find( PROFILESECTION **section, const WCHAR *section_name,
                                  const WCHAR *key_name, BOOL create, BOOL create_always )
 {
-    const WCHAR *   p;
-    int             seclen;
-    int             keylen;
+    const WCHAR *       p;
+    int                 seclen;
+    int                 keylen;
+    PROFILEINDEX *      index = NULL;
+    PROFILEINDEXENTRY * entry;
 
 
     while (PROFILE_isspace(*section_name)) section_name++;
@@ -1117,6 +1343,38 @@ static PROFILEKEY *PROFILE_Find( PROFILESECTION **section, const WCHAR *section_
     while ((p > key_name) && PROFILE_isspace(*p)) p--;
     keylen = p - key_name + 1;
 
+    /* look the section and key up in the index, then fall through to the tree walk below
+       only to find the end of the list that a new section or key has to be added to */
+    if (section == &CurProfile->section && (index = PROFILE_GetIndex( CurProfile )))
+    {
+        if ((entry = PROFILE_IndexFind( index, NULL, section_name, seclen )))
+        {
+            PROFILESECTION *found = entry->section;
+            PROFILEKEY **key = &found->key;
+
+            if (!create_always && (entry = PROFILE_IndexFind( index, found, key_name, keylen )))
+                return entry->key;
+            if (!create) return NULL;
+
+            while (*key) key = &(*key)->next;
+
+            if (!(*key = HeapAlloc( GetProcessHeap(), 0, sizeof(PROFILEKEY) + sizeof(WCHAR) * strlenW(key_name) ))){
+                ERR("could not allocate %u bytes for the key name %s\n", sizeof(PROFILEKEY) + sizeof(WCHAR) * strlenW(key_name), debugstr_w(key_name));
+
+                return NULL;
+            }
+
+            strcpyW( (*key)->name, key_name );
+            (*key)->value = NULL;
+            (*key)->next  = NULL;
+            PROFILE_IndexAdd( index, found, *key );
+            return *key;
+        }
+
+        if (!create) return NULL;
+        while (*section) section = &(*section)->next;
+    }
+
     while (*section)
     {
         if ( ((*section)->name[0])
@@ -1173,6 +1431,7 @@ static PROFILEKEY *PROFILE_Find( PROFILESECTION **section, const WCHAR *section_
         ERR("could not allocate %u bytes for the key name %s\n", sizeof(PROFILEKEY) + sizeof(WCHAR) * strlenW(key_name), debugstr_w(key_name));
 
         HeapFree(GetProcessHeap(), 0, *section);
+        *section = NULL;
         return NULL;
     }
 
@@ -1180,6 +1439,12 @@ static PROFILEKEY *PROFILE_Find( PROFILESECTION **section, const WCHAR *section_
     strcpyW( (*section)->key->name, key_name );
     (*section)->key->value = NULL;
     (*section)->key->next  = NULL;
+
+    if (index && (*section)->name[0])
+    {
+        PROFILE_IndexAdd( index, *section, NULL );
+        PROFILE_IndexAdd( index, *section, (*section)->key );
+    }
     return (*section)->key;
 }
 
@@ -1255,11 +1520,13 @@ static BOOL PROFILE_FlushFile(void)
 static void PROFILE_ReleaseFile(void)
 {
     PROFILE_FlushFile();
+    PROFILE_FreeIndex( CurProfile );
     PROFILE_Free( CurProfile->section );
     if (CurProfile->filename) HeapFree( GetProcessHeap(), 0, CurProfile->filename );
     CurProfile->changed   = FALSE;
     CurProfile->section   = NULL;
     CurProfile->filename  = NULL;
+    CurProfile->filenameHash = 0;
     memset(&CurProfile->lastWriteTime, 0, sizeof(FILETIME));
     CurProfile->originalEncoding = ENCODING_UNKNOWN;
 }
@@ -1277,6 +1544,8 @@ static BOOL PROFILE_Open( LPCWSTR filename )
     int                         i, j;
     PROFILE *                   tempProfile;
     BY_HANDLE_FILE_INFORMATION  info;
+    const WCHAR *               p;
+    DWORD                       hash;
 
 
     TRACE("opening the file %s\n", WFN(filename));
@@ -1297,8 +1566,10 @@ static BOOL PROFILE_Open( LPCWSTR filename )
           MRUProfile[i]->changed=FALSE;
           MRUProfile[i]->section=NULL;
           MRUProfile[i]->filename=NULL;
+          MRUProfile[i]->filenameHash=0;
           memset(&MRUProfile[i]->lastWriteTime, 0, sizeof(FILETIME));
           MRUProfile[i]->originalEncoding = ENCODING_UNKNOWN;
+          MRUProfile[i]->index=NULL;
          }
 
 
@@ -1336,10 +1607,15 @@ static BOOL PROFILE_Open( LPCWSTR filename )
     }
 
 
-    /* attempt to find the profile in the cache */
+    /* attempt to find the profile in the cache.  The filename hash is case sensitive since
+       the names are compared with strcmpW() */
+    hash = PROFILE_HASH_SEED;
+    for (p = buffer; *p; p++) hash = (hash ^ *p) * 16777619;
+
     for(i=0;i<N_CACHED_PROFILES;i++)
       {
        if ( MRUProfile[i]->filename && 
+            MRUProfile[i]->filenameHash == hash &&
             !strcmpW( buffer, MRUProfile[i]->filename ) )
          {
           if(i)
@@ -1379,6 +1655,7 @@ static BOOL PROFILE_Open( LPCWSTR filename )
     }
 
     strcpyW( CurProfile->filename, buffer );
+    CurProfile->filenameHash = hash;
 
     
     TRACE("attempting to open the file %s\n", WFN(buffer));
@@ -13,6 +13,8 @@
   *	HKEY_CLASSES		\\REGISTRY\\MACHINE\\SOFTWARE\\CLASSES
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "wine/debug.h"
 #include "winreg.h"
@@ -27,6 +29,103 @@ WINE_DEFAULT_DEBUG_CHANNEL(reg);
 /* maximum length of a key/value name in bytes (without terminating null) */
 #define MAX_NAME_LENGTH ((MAX_PATH-1) * sizeof(WCHAR))
 
+/* Value cache. Settings are read over and over through the same key
+ * handles, so recent results (including "not found") are kept per handle
+ * and value name. Entries are dropped when the handle is closed, whenever
+ * this process writes to the registry (reg_cache_generation), and after
+ * REG_CACHE_TTL ms, since the server doesn't tell us about writes from
+ * other processes. As that means another process's writes can go unseen
+ * for up to REG_CACHE_TTL, only reads through the winex config keys are
+ * cached by default; WINEREGCACHE=all caches NtQueryValueKey on any key
+ * handle too. Set WINEREGCACHE=0 to disable it, and WINEREGSTATS to get
+ * hit counts at exit. */
+#define REG_CACHE_SIZE      64      /* must be a power of 2 */
+#define REG_CACHE_MAX_NAME  64      /* in WCHARs */
+#define REG_CACHE_MAX_DATA  256
+
+typedef struct
+{
+    HANDLE   hkey;                  /* 0 if the entry is free */
+    DWORD    generation;            /* reg_cache_generation when filled */
+    DWORD    time;                  /* NtGetTickCount when filled */
+    NTSTATUS status;                /* STATUS_SUCCESS or STATUS_OBJECT_NAME_NOT_FOUND */
+    int      type;
+    DWORD    total;                 /* data size */
+    USHORT   name_len;              /* in bytes */
+    WCHAR    name[REG_CACHE_MAX_NAME];
+    BYTE     data[REG_CACHE_MAX_DATA];
+} REG_CACHE_ENTRY;
+
+static REG_CACHE_ENTRY reg_cache[REG_CACHE_SIZE];
+static CRITICAL_SECTION reg_cache_cs;
+static BOOL reg_cache_enabled;
+static BOOL reg_cache_all_keys;     /* also cache application key handles */
+static LONG reg_cache_generation;
+static DWORD reg_cache_hits, reg_cache_misses;
+
+
+/* called at exit when WINEREGSTATS is set */
+static void REG_ReportStats(void)
+{
+    fprintf( stderr, "Registry value cache: hits %lu misses %lu\n",
+             reg_cache_hits, reg_cache_misses );
+    Nt_reportConfigStats();
+}
+
+
+/******************************************************************************
+ *     REG_Init
+ *
+ * Set up the registry value cache.
+ */
+void REG_Init(void)
+{
+    const char *env = getenv( "WINEREGCACHE" );
+
+    RtlInitializeCriticalSection( &reg_cache_cs );
+    CRITICAL_SECTION_NAME( &reg_cache_cs, "reg_cache_cs" );
+    reg_cache_enabled = !env || (*env != '0');
+    reg_cache_all_keys = reg_cache_enabled && env && !strcmp( env, "all" );
+    if (reg_cache_enabled) Nt_initConfigCache();
+    if (getenv( "WINEREGSTATS" )) atexit( REG_ReportStats );
+}
+
+
+/* something in the registry changed, forget all cached values */
+static inline void REG_InvalidateCache(void)
+{
+    if (reg_cache_enabled) InterlockedIncrement( &reg_cache_generation );
+}
+
+
+/******************************************************************************
+ *     REG_InvalidateHandle
+ *
+ * Drop the cached values of a key handle that is being closed, before its
+ * value can be reused for another key.
+ */
+void REG_InvalidateHandle( HANDLE hkey )
+{
+    int i;
+
+    if (!reg_cache_enabled) return;
+    RtlEnterCriticalSection( &reg_cache_cs );
+    for (i = 0; i < REG_CACHE_SIZE; i++)
+        if (reg_cache[i].hkey == hkey) reg_cache[i].hkey = 0;
+    RtlLeaveCriticalSection( &reg_cache_cs );
+}
+
+
+static REG_CACHE_ENTRY *REG_CacheSlot( HANDLE hkey, const UNICODE_STRING *name )
+{
+    DWORD hash = (DWORD)hkey * 2654435761U;
+    USHORT i;
+
+    for (i = 0; i < name->Length / sizeof(WCHAR); i++)
+        hash = (hash ^ name->Buffer[i]) * 16777619U;
+    return &reg_cache[hash & (REG_CACHE_SIZE - 1)];
+}
+
 
 /******************************************************************************
  * NtCreateKey [NTDLL.@]
@@ -114,6 +213,7 @@ NTSTATUS WINAPI NtDeleteKey( HANDLE hkey )
         ret = wine_server_call( req );
     }
     SERVER_END_REQ;
+    REG_InvalidateCache();
     return ret;
 }
 
@@ -136,6 +236,7 @@ NTSTATUS WINAPI NtDeleteValueKey( HANDLE hkey, const UNICODE_STRING *name )
         ret = wine_server_call( req );
     }
     SERVER_END_REQ;
+    REG_InvalidateCache();
     return ret;
 }
 
@@ -354,13 +455,34 @@ NTSTATUS WINAPI NtEnumerateValueKey( HANDLE handle, ULONG index,
 NTSTATUS WINAPI NtQueryValueKey( HANDLE handle, const UNICODE_STRING *name,
                                  KEY_VALUE_INFORMATION_CLASS info_class,
                                  void *info, DWORD length, DWORD *result_len )
+{
+    return REG_QueryValueKey( handle, name, info_class, info, length, result_len, FALSE, NULL );
+}
+
+
+/******************************************************************************
+ *     REG_QueryValueKey
+ *
+ * NtQueryValueKey, also telling whether the result came from the value
+ * cache. <use_cache> is set for the config keys; other keys only use the
+ * cache with WINEREGCACHE=all.
+ */
+NTSTATUS REG_QueryValueKey( HANDLE handle, const UNICODE_STRING *name,
+                            KEY_VALUE_INFORMATION_CLASS info_class,
+                            void *info, DWORD length, DWORD *result_len,
+                            BOOL use_cache, BOOL *cached )
 {
     NTSTATUS ret;
     UCHAR *data_ptr;
     int fixed_size = 0;
+    REG_CACHE_ENTRY *entry = NULL;
+    DWORD generation = 0, total = 0;
+    int type = 0;
 
     TRACE( "(0x%x,%s,%d,%p,%ld)\n", handle, debugstr_us(name), info_class, info, length );
 
+    if (cached) *cached = FALSE;
+
     if (name->Length > MAX_NAME_LENGTH) return STATUS_BUFFER_OVERFLOW;
 
     /* compute the length we want to retrieve */
@@ -383,6 +505,37 @@ NTSTATUS WINAPI NtQueryValueKey( HANDLE handle, const UNICODE_STRING *name,
         return STATUS_INVALID_PARAMETER;
     }
 
+    /* the basic class returns no data, don't bother caching it */
+    if ((use_cache || reg_cache_all_keys) && reg_cache_enabled && data_ptr &&
+        name->Length <= sizeof(entry->name))
+    {
+        entry = REG_CacheSlot( handle, name );
+        generation = reg_cache_generation;
+
+        RtlEnterCriticalSection( &reg_cache_cs );
+        if (entry->hkey == handle && entry->generation == generation &&
+            entry->name_len == name->Length &&
+            !memcmp( entry->name, name->Buffer, name->Length ) &&
+            NtGetTickCount() - entry->time < REG_CACHE_TTL)
+        {
+            reg_cache_hits++;
+            if (cached) *cached = TRUE;
+            if (!(ret = entry->status))
+            {
+                DWORD size = (length > fixed_size) ? min( length - fixed_size, entry->total ) : 0;
+
+                memcpy( data_ptr, entry->data, size );
+                copy_key_value_info( info_class, info, length, entry->type, 0, size );
+                *result_len = fixed_size + entry->total;
+                if (length < *result_len) ret = STATUS_BUFFER_OVERFLOW;
+            }
+            RtlLeaveCriticalSection( &reg_cache_cs );
+            return ret;
+        }
+        reg_cache_misses++;
+        RtlLeaveCriticalSection( &reg_cache_cs );
+    }
+
     SERVER_START_REQ( get_key_value )
     {
         req->hkey = handle;
@@ -394,9 +547,31 @@ NTSTATUS WINAPI NtQueryValueKey( HANDLE handle, const UNICODE_STRING *name,
                                  0, wine_server_reply_size(reply) );
             *result_len = fixed_size + reply->total;
             if (length < *result_len) ret = STATUS_BUFFER_OVERFLOW;
+
+            /* only cache what we got in full */
+            type  = reply->type;
+            total = reply->total;
+            if (total > sizeof(entry->data) || wine_server_reply_size(reply) != total)
+                entry = NULL;
         }
+        else if (ret != STATUS_OBJECT_NAME_NOT_FOUND) entry = NULL;
     }
     SERVER_END_REQ;
+
+    if (entry)
+    {
+        RtlEnterCriticalSection( &reg_cache_cs );
+        entry->type       = type;
+        entry->total      = total;
+        memcpy( entry->data, data_ptr, total );
+        entry->hkey       = handle;
+        entry->generation = generation;
+        entry->time       = NtGetTickCount();
+        entry->status     = ret;
+        entry->name_len   = name->Length;
+        memcpy( entry->name, name->Buffer, name->Length );
+        RtlLeaveCriticalSection( &reg_cache_cs );
+    }
     return ret;
 }
 
@@ -555,6 +730,7 @@ NTSTATUS WINAPI NtSetValueKey( HANDLE hkey, const UNICODE_STRING *name, ULONG Ti
         ret = wine_server_call( req );
     }
     SERVER_END_REQ;
+    REG_InvalidateCache();
     return ret;
 }
 
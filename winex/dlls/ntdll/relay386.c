@@ -10,11 +10,17 @@
 #include "config.h"
 
 #include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #include "winnt.h"
 #include "stackframe.h"
+#include "snoop.h"
+#include "services.h"
 #include "wine/module.h"
 #include "wine/port.h"
 #include "wine/hardware.h"
@@ -140,6 +146,306 @@ static void get_entry_point( char *buffer, DEBUG_ENTRY_POINT *relay )
 }
 
 
+/*
+ * Relay profile
+ *
+ * With WINERELAYPROF=<file>, the relay thunks of the builtin dlls and the
+ * snoop thunks of the native ones are set up even when the relay and snoop
+ * channels are off.  Instead of printing each call, they count the calls
+ * and the inclusive time spent in every export.  The profile, sorted by
+ * time, is written to <file> every WINERELAYPROF_INTERVAL seconds, on
+ * SIGQUIT and when the process exits.  The relay and snoop include/exclude
+ * lists still apply.  The thunks only update the counters; the profile is
+ * written from the service thread, which checks every RELAY_PROF_POLL ms
+ * whether a dump is due or was asked for by the signal.  SIGQUIT is shared
+ * with the heap report, so the previous handler is chained to.
+ */
+#define RELAY_PROF_DEFAULT_INTERVAL 10
+#define RELAY_PROF_SIGNAL           SIGQUIT
+#define RELAY_PROF_POLL             1000
+
+typedef struct relay_prof_dll
+{
+    struct relay_prof_dll  *next;
+    const char             *module;
+    IMAGE_EXPORT_DIRECTORY *exports;
+    DEBUG_ENTRY_POINT      *debug;     /* entry point of the first export */
+    RELAY_PROF_ENTRY        entries[1];
+} relay_prof_dll;
+
+typedef struct
+{
+    char        name[80];
+    LONG        calls;
+    LONGLONG    ticks;
+} relay_prof_line;
+
+static int relay_prof_state = -1;      /* -1 if not initialized yet */
+static char *relay_prof_file;
+static DWORD relay_prof_interval;      /* ms */
+static DWORD relay_prof_last_dump;     /* NtGetTickCount of the last dump */
+static ULONGLONG relay_prof_start;
+static double relay_prof_ticks_per_us;
+static LONG relay_prof_dumping;
+static volatile LONG relay_prof_pending;  /* dump asked for by signal */
+static struct sigaction relay_prof_old_action;
+static relay_prof_dll *relay_prof_dlls;
+static relay_prof_line *relay_prof_lines;
+static int relay_prof_nb_lines, relay_prof_max_lines;
+
+
+/***********************************************************************
+ *           relay_prof_calibrate
+ *
+ * Measure the time stamp counter rate.
+ */
+static void relay_prof_calibrate(void)
+{
+    struct timeval start, end;
+    ULONGLONG ticks;
+    long us;
+
+    gettimeofday( &start, NULL );
+    ticks = RELAY_ProfileNow();
+    usleep( 20000 );
+    ticks = RELAY_ProfileNow() - ticks;
+    gettimeofday( &end, NULL );
+
+    us = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+    relay_prof_ticks_per_us = (us > 0) ? (double)ticks / us : 1000.0;
+}
+
+
+/***********************************************************************
+ *           relay_prof_compare
+ */
+static int relay_prof_compare( const void *a, const void *b )
+{
+    const relay_prof_line *line1 = a, *line2 = b;
+
+    if (line1->ticks != line2->ticks) return (line1->ticks < line2->ticks) ? 1 : -1;
+    return line2->calls - line1->calls;
+}
+
+
+/***********************************************************************
+ *           RELAY_ProfileAdd
+ *
+ * Add the counters of an export to the profile being written.
+ */
+void RELAY_ProfileAdd( const char *dll, const char *func, DWORD ordinal,
+                       const RELAY_PROF_ENTRY *entry )
+{
+    relay_prof_line *line;
+
+    if (!entry->calls) return;
+
+    if (relay_prof_nb_lines == relay_prof_max_lines)
+    {
+        int max = relay_prof_max_lines ? relay_prof_max_lines * 2 : 256;
+
+        if (!(line = realloc( relay_prof_lines, max * sizeof(*line) ))) return;
+        relay_prof_lines = line;
+        relay_prof_max_lines = max;
+    }
+
+    line = &relay_prof_lines[relay_prof_nb_lines++];
+    if (func && func[0]) snprintf( line->name, sizeof(line->name), "%s.%s", dll, func );
+    else snprintf( line->name, sizeof(line->name), "%s.%ld", dll, ordinal );
+    line->calls = entry->calls;
+    line->ticks = entry->ticks;
+}
+
+
+/***********************************************************************
+ *           relay_prof_dump
+ *
+ * Write the relay profile out to the profile file.  The counters are
+ * read while other threads may be updating them, so a dump can be off by
+ * a call or so.
+ */
+static void relay_prof_dump( ULONGLONG now )
+{
+    relay_prof_dll *dll;
+    char tmpname[MAX_PATH];
+    const char *name;
+    FILE *file;
+    int i;
+
+    /* somebody else is already writing the profile out */
+    if (InterlockedCompareExchange( &relay_prof_dumping, 1, 0 )) return;
+
+    relay_prof_last_dump = NtGetTickCount();
+    relay_prof_nb_lines = 0;
+
+    for (dll = relay_prof_dlls; dll; dll = dll->next)
+    {
+        for (i = 0; i < dll->exports->NumberOfFunctions; i++)
+        {
+            if (!dll->entries[i].calls) continue;
+            name = find_exported_name( dll->module, dll->exports, i + dll->exports->Base );
+            RELAY_ProfileAdd( dll->module + dll->exports->Name, name,
+                              i + dll->exports->Base, &dll->entries[i] );
+        }
+    }
+    SNOOP_ProfileCollect();
+
+    qsort( relay_prof_lines, relay_prof_nb_lines, sizeof(relay_prof_lines[0]), relay_prof_compare );
+
+    /* write to a temporary file first so readers never see a partial profile */
+    snprintf( tmpname, sizeof(tmpname), "%s.tmp", relay_prof_file );
+    if (!(file = fopen( tmpname, "w" )))
+    {
+        ERR( "could not write the relay profile to '%s'\n", tmpname );
+        relay_prof_dumping = 0;
+        return;
+    }
+
+    fprintf( file, "# pid %d elapsed_us %.0f\n", (int)getpid(),
+             (now - relay_prof_start) / relay_prof_ticks_per_us );
+    fprintf( file, "calls\ttotal_us\tavg_us\tfunction\n" );
+    for (i = 0; i < relay_prof_nb_lines; i++)
+    {
+        const relay_prof_line *line = &relay_prof_lines[i];
+        double total = line->ticks / relay_prof_ticks_per_us;
+
+        fprintf( file, "%ld\t%.0f\t%.3f\t%s\n", line->calls, total, total / line->calls, line->name );
+    }
+
+    fclose( file );
+    if (rename( tmpname, relay_prof_file ) == -1)
+        ERR( "could not rename '%s' to '%s'\n", tmpname, relay_prof_file );
+
+    relay_prof_dumping = 0;
+}
+
+
+/***********************************************************************
+ *           relay_prof_exit
+ *
+ * Write out the final relay profile when the process exits.
+ */
+static void relay_prof_exit(void)
+{
+    relay_prof_dump( RELAY_ProfileNow() );
+}
+
+
+/* Only flag the dump; relay_prof_tick writes it from the service thread */
+static void relay_prof_handler( int sig )
+{
+    relay_prof_pending = 1;
+
+    /* let the heap report see the signal too */
+    if (!(relay_prof_old_action.sa_flags & SA_SIGINFO) &&
+        relay_prof_old_action.sa_handler != SIG_DFL &&
+        relay_prof_old_action.sa_handler != SIG_IGN)
+        relay_prof_old_action.sa_handler( sig );
+}
+
+
+/* Write the profile if the signal asked for it or the interval is up */
+static void CALLBACK relay_prof_tick( ULONG_PTR arg )
+{
+    if (InterlockedExchange( (LONG *)&relay_prof_pending, 0 ) ||
+        NtGetTickCount() - relay_prof_last_dump >= relay_prof_interval)
+        relay_prof_dump( RELAY_ProfileNow() );
+}
+
+
+/***********************************************************************
+ *           RELAY_ProfileEnabled
+ *
+ * Check whether calls are being profiled, and set things up the first
+ * time around.
+ */
+BOOL RELAY_ProfileEnabled(void)
+{
+    const char *filename, *interval;
+    int seconds = RELAY_PROF_DEFAULT_INTERVAL;
+    struct sigaction sig_act;
+
+    if (relay_prof_state >= 0) return relay_prof_state;
+
+    relay_prof_state = 0;
+    if (!(filename = getenv( "WINERELAYPROF" )) || !filename[0]) return FALSE;
+
+    if (!(relay_prof_file = malloc( strlen(filename) + 1 )))
+    {
+        ERR( "could not allocate the relay profile file name\n" );
+        return FALSE;
+    }
+    strcpy( relay_prof_file, filename );
+
+    if ((interval = getenv( "WINERELAYPROF_INTERVAL" )) && atoi( interval ) > 0)
+        seconds = atoi( interval );
+
+    relay_prof_calibrate();
+    relay_prof_interval = seconds * 1000;
+    relay_prof_start = RELAY_ProfileNow();
+    relay_prof_last_dump = NtGetTickCount();
+    atexit( relay_prof_exit );
+
+    memset( &sig_act, 0, sizeof(sig_act) );
+    sig_act.sa_handler = relay_prof_handler;
+    sigemptyset( &sig_act.sa_mask );
+    sig_act.sa_flags = SA_RESTART;
+    sigaction( RELAY_PROF_SIGNAL, &sig_act, &relay_prof_old_action );
+    relay_prof_state = 1;
+
+    MESSAGE( "wine: profiling relay calls into '%s' every %d seconds\n", relay_prof_file, seconds );
+    return TRUE;
+}
+
+
+/***********************************************************************
+ *           RELAY_ProfileRecord
+ *
+ * Count a call to the export of <entry> that started at <start>.
+ */
+void RELAY_ProfileRecord( RELAY_PROF_ENTRY *entry, ULONGLONG start )
+{
+    LONGLONG elapsed = RELAY_ProfileNow() - start, old;
+
+    InterlockedIncrement( &entry->calls );
+    do old = entry->ticks;
+    while (InterlockedCompareExchange64( &entry->ticks, old + elapsed, old ) != old);
+}
+
+
+/***********************************************************************
+ *           RELAY_StartProfileService
+ *
+ * Start writing the relay profile from the service thread.  Called once
+ * the process can create threads; until then it is only written at exit.
+ */
+void RELAY_StartProfileService(void)
+{
+    if (relay_prof_state > 0 &&
+        SERVICE_AddTimer( RELAY_PROF_POLL, relay_prof_tick, 0 ) == INVALID_HANDLE_VALUE)
+        ERR( "can't start the relay profile service\n" );
+}
+
+
+/***********************************************************************
+ *           relay_prof_entry
+ *
+ * Find the profile counters of a relay entry point.
+ */
+static RELAY_PROF_ENTRY *relay_prof_entry( DEBUG_ENTRY_POINT *relay )
+{
+    relay_prof_dll *dll;
+
+    if (relay_prof_state <= 0) return NULL;
+    for (dll = relay_prof_dlls; dll; dll = dll->next)
+    {
+        if (dll->debug <= relay && relay < dll->debug + dll->exports->NumberOfFunctions)
+            return &dll->entries[relay - dll->debug];
+    }
+    return NULL;
+}
+
+
 /***********************************************************************
  *           RELAY_PrintArgs
  */
@@ -279,24 +585,31 @@ LONGLONG __dynamicstackalign RELAY_CallFrom32( int ret_addr, ... )
     LONGLONG ret;
     char buffer[80];
     BOOL ret64;
+    ULONGLONG start = 0;
 
     int *args = &ret_addr + 1;
     /* Relay addr is the return address for this function */
     BYTE *relay_addr = (BYTE *)__builtin_return_address(0);
     DEBUG_ENTRY_POINT *relay = (DEBUG_ENTRY_POINT *)(relay_addr - 5); /* 5 is size of call instruction */
     WORD nb_args = relay->args / sizeof(int);
+    RELAY_PROF_ENTRY *prof = relay_prof_entry( relay );
 
-    get_entry_point( buffer, relay );
+    if (TRACE_ON(relay))
+    {
+        get_entry_point( buffer, relay );
 
-    if( TRACE_ON(timestamp) ) { DPRINTF( "%ld - ", NtGetTickCount() ); }
-    DPRINTF( "%04lx:Call(%u) %s(",
-             GetCurrentThreadId(),
-	     (NtCurrentTeb()->uRelayLevel)++,
-	     buffer );
-    RELAY_PrintArgs( args, nb_args, relay->argtypes );
-    DPRINTF( ") ret=%08x\n", ret_addr );
+        if( TRACE_ON(timestamp) ) { DPRINTF( "%ld - ", NtGetTickCount() ); }
+        DPRINTF( "%04lx:Call(%u) %s(",
+                 GetCurrentThreadId(),
+                 (NtCurrentTeb()->uRelayLevel)++,
+                 buffer );
+        RELAY_PrintArgs( args, nb_args, relay->argtypes );
+        DPRINTF( ") ret=%08x\n", ret_addr );
+    }
     ret64 = (relay->argtypes & 0x80000000) && (nb_args < 16);
 
+    if (prof) start = RELAY_ProfileNow();
+
     if (relay->ret == 0xc3) /* cdecl */
     {
         ret = call_cdecl_function( (LONGLONG_CPROC)relay->orig, nb_args, args );
@@ -306,6 +619,9 @@ LONGLONG __dynamicstackalign RELAY_CallFrom32( int ret_addr, ... )
         ret = call_stdcall_function( (LONGLONG_FARPROC)relay->orig, nb_args, args );
     }
 
+    if (prof) RELAY_ProfileRecord( prof, start );
+    if (!TRACE_ON(relay)) return ret;
+
     if( TRACE_ON(timestamp) ) { DPRINTF( "%ld - ", NtGetTickCount() ); }
     if (ret64)
         DPRINTF( "%04lx:Ret (%u) %s() retval=%08x%08x ret=%08x\n",
@@ -340,6 +656,8 @@ void WINAPI RELAY_DoCallFrom32Regs( CONTEXT86 *context )
     int* args;
     int args_copy[17];
     BYTE *entry_point;
+    RELAY_PROF_ENTRY *prof;
+    ULONGLONG start = 0;
 
     BYTE *relay_addr = *((BYTE **)context->Esp - 1);
     DEBUG_ENTRY_POINT *relay = (DEBUG_ENTRY_POINT *)(relay_addr - 5); /* 5 is size of call instruction */
@@ -351,29 +669,31 @@ void WINAPI RELAY_DoCallFrom32Regs( CONTEXT86 *context )
     if (relay->ret == 0xc2) /* stdcall */
         context->Esp += nb_args * sizeof(int);
 
-    assert(TRACE_ON(relay));
-
     entry_point = (BYTE *)relay->orig;
     assert( *entry_point == 0xe8 /* lcall */ );
 
-    get_entry_point( buffer, relay );
-
-    if( TRACE_ON(timestamp) ) { DPRINTF( "%ld - ", NtGetTickCount() ); }
-    DPRINTF( "%04lx:Call(%u) %s(",
-             GetCurrentThreadId(),
-	     (NtCurrentTeb()->uRelayLevel)++,
-	     buffer );
-    RELAY_PrintArgs( args, nb_args, relay->argtypes );
-    DPRINTF( ") ret=%08lx fs=%04lx\n", context->Eip, context->SegFs );
+    if (TRACE_ON(relay))
+    {
+        get_entry_point( buffer, relay );
 
-    DPRINTF(" eax=%08lx ebx=%08lx ecx=%08lx edx=%08lx esi=%08lx edi=%08lx\n",
-            context->Eax, context->Ebx, context->Ecx,
-            context->Edx, context->Esi, context->Edi );
-    DPRINTF(" ebp=%08lx esp=%08lx ds=%04lx es=%04lx gs=%04lx flags=%08lx\n",
-            context->Ebp, context->Esp, context->SegDs,
-            context->SegEs, context->SegGs, context->EFlags );
+        if( TRACE_ON(timestamp) ) { DPRINTF( "%ld - ", NtGetTickCount() ); }
+        DPRINTF( "%04lx:Call(%u) %s(",
+                 GetCurrentThreadId(),
+                 (NtCurrentTeb()->uRelayLevel)++,
+                 buffer );
+        RELAY_PrintArgs( args, nb_args, relay->argtypes );
+        DPRINTF( ") ret=%08lx fs=%04lx\n", context->Eip, context->SegFs );
+
+        DPRINTF(" eax=%08lx ebx=%08lx ecx=%08lx edx=%08lx esi=%08lx edi=%08lx\n",
+                context->Eax, context->Ebx, context->Ecx,
+                context->Edx, context->Esi, context->Edi );
+        DPRINTF(" ebp=%08lx esp=%08lx ds=%04lx es=%04lx gs=%04lx flags=%08lx\n",
+                context->Ebp, context->Esp, context->SegDs,
+                context->SegEs, context->SegGs, context->EFlags );
+    }
 
     /* Now call the real function */
+    if ((prof = relay_prof_entry( relay ))) start = RELAY_ProfileNow();
 
     memcpy( args_copy, args, nb_args * sizeof(args[0]) );
     args_copy[nb_args] = (int)context;  /* append context argument */
@@ -386,6 +706,9 @@ void WINAPI RELAY_DoCallFrom32Regs( CONTEXT86 *context )
         call_stdcall_function( *(LONGLONG_FARPROC *)(entry_point + 5), nb_args+1, args_copy );
     }
 
+    if (prof) RELAY_ProfileRecord( prof, start );
+    if (!TRACE_ON(relay)) return;
+
     if( TRACE_ON(timestamp) ) { DPRINTF( "%ld - ", NtGetTickCount() ); }
     DPRINTF( "%04lx:Ret (%u) %s() retval=%08lx ret=%08lx fs=%04lx\n",
              GetCurrentThreadId(),
@@ -426,6 +749,22 @@ void RELAY_SetupDLL( const char *module )
     funcs = (DWORD *)(module + exports->AddressOfFunctions);
     dllname = module + exports->Name;
 
+    if (RELAY_ProfileEnabled())
+    {
+        relay_prof_dll *dll;
+
+        dll = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY,
+                         sizeof(*dll) + exports->NumberOfFunctions * sizeof(dll->entries[0]) );
+        if (dll)
+        {
+            dll->module  = module;
+            dll->exports = exports;
+            dll->debug   = debug;
+            do dll->next = relay_prof_dlls;
+            while (InterlockedCompareExchangePointer( (PVOID *)&relay_prof_dlls, dll, dll->next ) != dll->next);
+        }
+    }
+
     for (i = 0; i < exports->NumberOfFunctions; i++, funcs++, debug++)
     {
         int on = 1;
@@ -465,4 +804,13 @@ void RELAY_SetupDLL( const char *module )
 {
 }
 
+BOOL RELAY_ProfileEnabled(void)
+{
+    return FALSE;
+}
+
+void RELAY_StartProfileService(void)
+{
+}
+
 #endif /* __i386__ */
@@ -11,6 +11,9 @@
  *  on the list are push-to-front and pop-from-front.  The length of the list may be queried at
  *  any time, but it is not threadsafe and is limited to 65535.
  *
+ *  The whole header (head pointer, depth and sequence) is always updated with a single 64-bit
+ *  compare-and-exchange, so the sequence number guards pops against ABA reuse of entries.
+ *
  *  Note: there are other vista+ interlocked functions that allow one list to be added to the
  *        start of another list.  These functions still need to be implemented.
  *
@@ -27,6 +30,7 @@
 #include <stdio.h>
 
 #include "winbase.h"
+#include "wine/exception.h"
 #include "wine/debug.h"
 
 WINE_DEFAULT_DEBUG_CHANNEL(ntdll);
@@ -56,27 +60,41 @@ WORD WINAPI RtlQueryDepthSList( PSLIST_HEADER ListHead )
 }
 
 
+/* Atomically replace the whole header (next pointer, depth and sequence) if
+   it still matches <oldHeader>. Comparing the sequence along with the
+   pointer is what protects a pop from the ABA problem: an entry can only
+   reappear at the head through a push, and every push bumps the sequence */
+static inline BOOL update_header( PSLIST_HEADER ListHead, const SLIST_HEADER *newHeader,
+                                  const SLIST_HEADER *oldHeader )
+{
+    return InterlockedCompareExchange64( (LONGLONG *)&ListHead->Alignment,
+                                         newHeader->Alignment,
+                                         oldHeader->Alignment ) == oldHeader->Alignment;
+}
+
+
 /***********************************************************************
  *           RtlInterlockedPushEntrySList    (NTDLL.@)
  */
 PSLIST_ENTRY WINAPI RtlInterlockedPushEntrySList( PSLIST_HEADER ListHead,
                     PSLIST_ENTRY ListEntry )
 {
-    PSLIST_ENTRY oldHead;
+    SLIST_HEADER oldHeader;
+    SLIST_HEADER newHeader;
 
     TRACE("push %p onto %p\n", ListEntry, ListHead);
 
-    /* put the new entry at the head of the list */
+    /* put the new entry at the head of the list, incrementing the depth and
+       sequence in the same operation */
     do {
-        oldHead = ListHead->s.Next.Next;
-        ListEntry->Next = oldHead;
-    } while (InterlockedCompareExchangePointer((PVOID*)&ListHead->s.Next.Next,
-             ListEntry, ListEntry->Next) != oldHead);
-
-    /* increment the depth and sequence */
-    InterlockedExchangeAdd((PLONG)&ListHead->s.Depth, (1<<16) + 1);
-
-    return oldHead;
+        oldHeader.Alignment = *(volatile ULONGLONG *)&ListHead->Alignment;
+        ListEntry->Next = oldHeader.s.Next.Next;
+        newHeader.s.Next.Next = ListEntry;
+        newHeader.s.Depth = oldHeader.s.Depth + 1;
+        newHeader.s.Sequence = oldHeader.s.Sequence + 1;
+    } while (!update_header(ListHead, &newHeader, &oldHeader));
+
+    return oldHeader.s.Next.Next;
 }
 
 
@@ -85,21 +103,43 @@ PSLIST_ENTRY WINAPI RtlInterlockedPushEntrySList( PSLIST_HEADER ListHead,
  */
 PSLIST_ENTRY WINAPI RtlInterlockedPopEntrySList( PSLIST_HEADER ListHead )
 {
+    SLIST_HEADER oldHeader;
+    SLIST_HEADER newHeader;
     PSLIST_ENTRY item;
+    BOOL faulted;
 
     TRACE("for %p\n", ListHead);
 
-    /* pop the first item from the list */
+    /* Another thread may pop and free the head entry between us reading the
+       header and reading item->Next. The update then fails on the sequence,
+       but the read itself can fault, in which case just start over; the
+       frame is set up once per call rather than once per attempt */
     do {
-        item = ListHead->s.Next.Next;
-        if (item == NULL)
-            return NULL;
-    } while (InterlockedCompareExchangePointer((PVOID*)&ListHead->s.Next.Next,
-             item->Next, item) != item);
-
-    /* decrement the depth (but not the sequence since testing shows that only
-       gets incremented for a push) */
-    InterlockedExchangeAdd((PLONG)&ListHead->s.Depth, -1);
+        faulted = FALSE;
+        item = NULL;
+
+        __TRY
+        {
+            /* pop the first item from the list (decrementing the depth but
+               not the sequence since testing shows that only gets
+               incremented for a push) */
+            do {
+                oldHeader.Alignment = *(volatile ULONGLONG *)&ListHead->Alignment;
+                item = oldHeader.s.Next.Next;
+                if (item == NULL)
+                    break;
+
+                newHeader.s.Next.Next = item->Next;
+                newHeader.s.Depth = oldHeader.s.Depth - 1;
+                newHeader.s.Sequence = oldHeader.s.Sequence;
+            } while (!update_header(ListHead, &newHeader, &oldHeader));
+        }
+        __EXCEPT_PAGE_FAULT
+        {
+            faulted = TRUE;
+        }
+        __ENDTRY
+    } while (faulted);
 
     return item;
 }
@@ -110,30 +150,21 @@ PSLIST_ENTRY WINAPI RtlInterlockedPopEntrySList( PSLIST_HEADER ListHead )
  */
 PSLIST_ENTRY WINAPI RtlInterlockedFlushSList( PSLIST_HEADER ListHead )
 {
-    PSLIST_ENTRY head;
-    PSLIST_ENTRY item;
-    WORD depth = 0;
+    SLIST_HEADER oldHeader;
+    SLIST_HEADER newHeader;
 
     TRACE("for %p\n", ListHead);
 
-    /* get the list head and set it to NULL */
+    /* detach the whole chain and zero the depth in one operation */
     do {
-      head = ListHead->s.Next.Next;
-      if (head == NULL)
-        return NULL;
-    } while (InterlockedCompareExchangePointer((PVOID*)&ListHead->s.Next.Next,
-             NULL, head) != head);
-
-    /* count the entries that were flushed from the list */
-    item = head;
-    while(item)
-    {
-        depth++;
-        item = item->Next;
-    }
-
-    /* decrement the depth to zero */
-    InterlockedExchangeAdd((PLONG)&ListHead->s.Depth, -depth);
-
-    return head;
+        oldHeader.Alignment = *(volatile ULONGLONG *)&ListHead->Alignment;
+        if (oldHeader.s.Next.Next == NULL)
+            return NULL;
+
+        newHeader.s.Next.Next = NULL;
+        newHeader.s.Depth = 0;
+        newHeader.s.Sequence = oldHeader.s.Sequence;
+    } while (!update_header(ListHead, &newHeader, &oldHeader));
+
+    return oldHeader.s.Next.Next;
 }
@@ -57,6 +57,7 @@ typedef	struct tagSNOOP_FUN {
 	int		nrofargs;
 	FARPROC	origfun;
 	char		*name;
+	RELAY_PROF_ENTRY prof;		/* relay profile counters */
 } SNOOP_FUN;
 
 typedef struct tagSNOOP_DLL {
@@ -81,6 +82,7 @@ typedef struct tagSNOOP_RETURNENTRY {
 	DWORD		ordinal;
 	DWORD		origESP;
 	DWORD		*args;		/* saved args across a stdcall */
+	ULONGLONG	start;		/* call time, for the relay profile */
 } SNOOP_RETURNENTRY;
 
 #define NUMENTRIES 10
@@ -145,7 +147,7 @@ SNOOP_RegisterDLL(HMODULE hmod,LPCSTR name,DWORD ordbase,DWORD nrofordinals) {
 	SNOOP_DLL	**dll = &(firstdll);
 	char		*s;
 
-	if (!TRACE_ON(snoop)) return;
+	if (!TRACE_ON(snoop) && !RELAY_ProfileEnabled()) return;
 	while (*dll) {
 		if ((*dll)->hmod == hmod)
 			return; /* already registered */
@@ -184,7 +186,7 @@ SNOOP_GetProcAddress(HMODULE hmod,LPCSTR name,DWORD ordinal,FARPROC origfun) {
 	int				j;
 	IMAGE_SECTION_HEADER		*pe_seg = PE_SECTIONS(hmod);
 
-	if (!TRACE_ON(snoop)) return origfun;
+	if (!TRACE_ON(snoop) && !RELAY_ProfileEnabled()) return origfun;
 	if (!*(LPBYTE)origfun) /* 0x00 is an imposs. opcode, poss. dataref. */
 		return origfun;
 	for (j=0;j<PE_HEADER(hmod)->FileHeader.NumberOfSections;j++)
@@ -231,6 +233,25 @@ SNOOP_GetProcAddress(HMODULE hmod,LPCSTR name,DWORD ordinal,FARPROC origfun) {
 }
 
 
+/***********************************************************************
+ *          SNOOP_ProfileCollect
+ *
+ * Add the relay profile counters of the snooped functions to the profile
+ * being written.
+ */
+void SNOOP_ProfileCollect(void)
+{
+	SNOOP_DLL	*dll;
+	DWORD		i;
+
+	for (dll = firstdll; dll; dll = dll->next)
+		for (i = 0; i < dll->nrofordinals; i++)
+			if (dll->funs[i].name && dll->funs[i].prof.calls)
+				RELAY_ProfileAdd(dll->name, dll->funs[i].name,
+				                 dll->ordbase + i, &dll->funs[i].prof);
+}
+
+
 void SNOOP_ThreadExit ()
 {
    SNOOP_ThreadData_t *pThreadData;
@@ -394,6 +415,12 @@ void WINAPI SNOOP_DoEntry( CONTEXT86 *context )
 
 	context->Eip = (DWORD)fun->origfun;
 
+	if (!TRACE_ON(snoop)) {
+		/* only here for the relay profile */
+		ret->start = RELAY_ProfileNow();
+		return;
+	}
+
 	if( TRACE_ON(timestamp) ) DPRINTF( "%ld - \n", NtGetTickCount() );
 	DPRINTF("%04lx:CALL(%u) %s.%ld: %s(",GetCurrentThreadId(), (NtCurrentTeb()->uRelayLevel)++,
 	               dll->name,dll->ordbase+ordinal,fun->name);
@@ -409,6 +436,7 @@ void WINAPI SNOOP_DoEntry( CONTEXT86 *context )
 		memcpy(ret->args,(LPBYTE)(context->Esp + 4),sizeof(DWORD)*16);
 	}
 	DPRINTF(") ret=%08lx\n",(DWORD)ret->origreturn);
+	ret->start = RELAY_ProfileNow();
 }
 
 
@@ -427,7 +455,14 @@ void WINAPI SNOOP_DoReturn( CONTEXT86 *context )
 	if (ret->dll->funs[ret->ordinal].nrofargs<0)
 		ret->dll->funs[ret->ordinal].nrofargs=(context->Esp - ret->origESP-4)/4;
 	context->Eip = (DWORD)ret->origreturn;
-	
+
+	if (RELAY_ProfileEnabled())
+		RELAY_ProfileRecord(&ret->dll->funs[ret->ordinal].prof, ret->start);
+	if (!TRACE_ON(snoop)) {
+		ret->origreturn = NULL; /* mark as empty */
+		return;
+	}
+
 	if( TRACE_ON(timestamp) ) DPRINTF( "%ld - \n", NtGetTickCount() );
 	if (ret->args) {
 		int	i,max;
@@ -105,6 +105,210 @@ NTSTATUS WINAPI NtReleaseSemaphore( HANDLE handle, ULONG count, PULONG previous
     return ret;
 }
 
+/*
+ *	Event state mirror
+ *
+ * Events this process creates without a name and without inheritance can
+ * only be reached through its own handles, so as long as those handles
+ * aren't duplicated the process sees every change to their state.  The
+ * state is mirrored here so that waits can be resolved without a server
+ * call when the answer doesn't change the state: zero-timeout polls of
+ * unsignaled events, and waits on signaled manual-reset events.
+ *
+ * The server still does every state change.  An entry loses its known
+ * state while a change is in flight, and stays unknown if changes overlap,
+ * until the next one.  Each entry packs the handle into the low 32 bits,
+ * then the SYNC_MIRROR_* flags, the number of changes in flight, and a
+ * sequence number bumped by every change.  An entry of 0 is empty.
+ *
+ * Handles passed to server calls that make the server signal the event
+ * itself (socket events) are dropped from the mirror.  What can't be seen
+ * from here is another process duplicating the handle out of this one
+ * and changing the event through its copy, so the mirror would answer
+ * waits wrongly for an application that does that.  It is therefore only
+ * used when WINEFASTWAIT=1 says the application doesn't; by default every
+ * wait goes to the server.
+ */
+#define SYNC_MIRROR_SIZE        256  /* must be a power of 2 */
+
+static LONGLONG sync_mirror[SYNC_MIRROR_SIZE];
+static BOOL sync_mirror_enabled;
+
+static inline LONGLONG *SYNC_MirrorSlot( HANDLE handle )
+{
+    return &sync_mirror[((UINT_PTR)handle >> 2) & (SYNC_MIRROR_SIZE - 1)];
+}
+
+static inline LONGLONG SYNC_MirrorRead( LONGLONG *entry )
+{
+    return InterlockedCompareExchange64( entry, 0, 0 );
+}
+
+/******************************************************************************
+ *     SYNC_Init
+ */
+void SYNC_Init(void)
+{
+    const char *env = getenv( "WINEFASTWAIT" );
+
+    sync_mirror_enabled = env && (*env == '1');
+}
+
+/******************************************************************************
+ *     SYNC_MirrorEvent
+ *
+ * Start mirroring the state of a private event that was just created.
+ */
+void SYNC_MirrorEvent( HANDLE handle, BOOL manual_reset, BOOL signaled )
+{
+    LONGLONG *entry = SYNC_MirrorSlot( handle ), old, new;
+    DWORD flags = SYNC_MIRROR_KNOWN;
+
+    if (!sync_mirror_enabled || !handle) return;
+
+    if (manual_reset) flags |= SYNC_MIRROR_MANUAL;
+    if (signaled) flags |= SYNC_MIRROR_SIGNALED;
+    new = ((LONGLONG)flags << 32) | (DWORD)handle;
+
+    /* may replace another handle's entry, which then just goes to the server */
+    do old = SYNC_MirrorRead( entry );
+    while (InterlockedCompareExchange64( entry, new, old ) != old);
+}
+
+/******************************************************************************
+ *     SYNC_ForgetHandle
+ *
+ * Stop mirroring a handle that is being closed, duplicated or handed to
+ * something that can change the state behind our back.
+ */
+void SYNC_ForgetHandle( HANDLE handle )
+{
+    LONGLONG *entry = SYNC_MirrorSlot( handle ), old;
+
+    if (!sync_mirror_enabled) return;
+    for (;;)
+    {
+        old = SYNC_MirrorRead( entry );
+        if (!old || (DWORD)old != (DWORD)handle) return;
+        if (InterlockedCompareExchange64( entry, 0, old ) == old) return;
+    }
+}
+
+/******************************************************************************
+ *     SYNC_MirrorGet
+ *
+ * Get the mirror entry of a handle, 0 if it isn't mirrored.
+ */
+LONGLONG SYNC_MirrorGet( HANDLE handle )
+{
+    LONGLONG value;
+
+    if (!sync_mirror_enabled || !handle) return 0;
+    value = SYNC_MirrorRead( SYNC_MirrorSlot( handle ));
+    return ((DWORD)value == (DWORD)handle) ? value : 0;
+}
+
+/******************************************************************************
+ *     SYNC_MirrorWaited
+ *
+ * A server wait found the event of <seen> signaled or not; a signaled
+ * auto-reset event has been reset by the wait.  Nothing is recorded if
+ * the entry changed since <seen> was read.  If the server disagrees with
+ * an entry that didn't change, something we don't see (another process,
+ * the server itself) changed the event, so stop mirroring it.
+ */
+void SYNC_MirrorWaited( HANDLE handle, LONGLONG seen, BOOL signaled )
+{
+    DWORD flags = SYNC_MIRROR_FLAGS( seen );
+    LONGLONG new;
+
+    if (!(flags & SYNC_MIRROR_KNOWN) || SYNC_MIRROR_BUSY( seen )) return;
+
+    if (!(flags & SYNC_MIRROR_SIGNALED) != !signaled) new = 0;
+    else if (signaled && !(flags & SYNC_MIRROR_MANUAL))
+        new = seen & ~((LONGLONG)SYNC_MIRROR_SIGNALED << 32);
+    else return;
+
+    InterlockedCompareExchange64( SYNC_MirrorSlot( handle ), new, seen );
+}
+
+/* an event operation is about to be sent to the server */
+static void SYNC_MirrorOpStart( HANDLE handle )
+{
+    LONGLONG *entry = SYNC_MirrorSlot( handle ), old;
+    DWORD hi;
+
+    if (!sync_mirror_enabled) return;
+    for (;;)
+    {
+        old = SYNC_MirrorRead( entry );
+        if (!old || (DWORD)old != (DWORD)handle) return;
+
+        hi = (DWORD)(old >> 32);
+        if (SYNC_MIRROR_BUSY( old ) == 0xff)
+        {
+            /* too many changes in flight to count, give up on this one */
+            if (InterlockedCompareExchange64( entry, 0, old ) == old) return;
+            continue;
+        }
+        if (SYNC_MIRROR_BUSY( old )) hi |= SYNC_MIRROR_DIRTY;
+        hi = (hi & ~SYNC_MIRROR_KNOWN) + (1 << SYNC_MIRROR_BUSY_SHIFT);
+
+        if (InterlockedCompareExchange64( entry, ((LONGLONG)hi << 32) | (DWORD)handle, old ) == old)
+            return;
+    }
+}
+
+/* an event operation is done; <state> is the resulting state, or -1 if unknown */
+static void SYNC_MirrorOpEnd( HANDLE handle, int state )
+{
+    LONGLONG *entry = SYNC_MirrorSlot( handle ), old;
+    DWORD hi;
+
+    if (!sync_mirror_enabled) return;
+    for (;;)
+    {
+        old = SYNC_MirrorRead( entry );
+        if (!old || (DWORD)old != (DWORD)handle || !SYNC_MIRROR_BUSY( old )) return;
+
+        hi = (DWORD)(old >> 32) - (1 << SYNC_MIRROR_BUSY_SHIFT) + (1 << SYNC_MIRROR_SEQ_SHIFT);
+        if (!SYNC_MIRROR_BUSY( (LONGLONG)hi << 32 ))
+        {
+            /* the last change in flight; if there were others, nobody knows the order */
+            if (!(hi & SYNC_MIRROR_DIRTY) && state >= 0)
+            {
+                hi = (hi & ~SYNC_MIRROR_SIGNALED) | SYNC_MIRROR_KNOWN;
+                if (state) hi |= SYNC_MIRROR_SIGNALED;
+            }
+            hi &= ~SYNC_MIRROR_DIRTY;
+        }
+
+        if (InterlockedCompareExchange64( entry, ((LONGLONG)hi << 32) | (DWORD)handle, old ) == old)
+            return;
+    }
+}
+
+/******************************************************************************
+ *     SYNC_EventOperation
+ *
+ * Send an event operation to the server, keeping the mirror up to date.
+ */
+NTSTATUS SYNC_EventOperation( HANDLE handle, enum event_op op )
+{
+    NTSTATUS ret;
+
+    SYNC_MirrorOpStart( handle );
+    SERVER_START_REQ( event_op )
+    {
+        req->handle = handle;
+        req->op     = op;
+        ret = wine_server_call( req );
+    }
+    SERVER_END_REQ;
+    SYNC_MirrorOpEnd( handle, ret ? -1 : (op == SET_EVENT) );
+    return ret;
+}
+
 /*
  *	Events
  */
@@ -133,6 +337,9 @@ NTSTATUS WINAPI NtCreateEvent(
         *EventHandle = reply->handle;
     }
     SERVER_END_REQ;
+
+    if (!ret && !len && !(attr && (attr->Attributes & OBJ_INHERIT)))
+        SYNC_MirrorEvent( *EventHandle, ManualReset, InitialState );
     return ret;
 }
 
@@ -167,18 +374,9 @@ NTSTATUS WINAPI NtOpenEvent(
  */
 NTSTATUS WINAPI NtSetEvent( HANDLE handle, PULONG NumberOfThreadsReleased )
 {
-    NTSTATUS ret;
-
     /* FIXME: set NumberOfThreadsReleased */
 
-    SERVER_START_REQ( event_op )
-    {
-        req->handle = handle;
-        req->op     = SET_EVENT;
-        ret = wine_server_call( req );
-    }
-    SERVER_END_REQ;
-    return ret;
+    return SYNC_EventOperation( handle, SET_EVENT );
 }
 
 /******************************************************************************
@@ -186,19 +384,10 @@ NTSTATUS WINAPI NtSetEvent( HANDLE handle, PULONG NumberOfThreadsReleased )
  */
 NTSTATUS WINAPI NtResetEvent( HANDLE handle, PULONG NumberOfThreadsReleased )
 {
-    NTSTATUS ret;
-
     /* resetting an event can't release any thread... */
     if (NumberOfThreadsReleased) *NumberOfThreadsReleased = 0;
 
-    SERVER_START_REQ( event_op )
-    {
-        req->handle = handle;
-        req->op     = RESET_EVENT;
-        ret = wine_server_call( req );
-    }
-    SERVER_END_REQ;
-    return ret;
+    return SYNC_EventOperation( handle, RESET_EVENT );
 }
 
 /******************************************************************************
@@ -220,16 +409,8 @@ NTSTATUS WINAPI NtClearEvent ( HANDLE handle )
  */
 NTSTATUS WINAPI NtPulseEvent( HANDLE handle, PULONG PulseCount )
 {
-    NTSTATUS ret;
     FIXME("(0x%08x,%p)\n", handle, PulseCount);
-    SERVER_START_REQ( event_op )
-    {
-        req->handle = handle;
-        req->op     = PULSE_EVENT;
-        ret = wine_server_call( req );
-    }
-    SERVER_END_REQ;
-    return ret;
+    return SYNC_EventOperation( handle, PULSE_EVENT );
 }
 
 /******************************************************************************
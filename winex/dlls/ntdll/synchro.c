@@ -22,6 +22,7 @@
 #include "wine/server.h"
 #include "async.h"
 #include "wine/debug.h"
+#include "ntdll_misc.h"
 
 WINE_DEFAULT_DEBUG_CHANNEL(sync);
 
@@ -447,6 +448,100 @@ DWORD WINAPI WaitForMultipleObjects( DWORD count, const HANDLE *handles,
 }
 
 
+/* waits answered from the event state mirror before one goes to the server
+ * anyway, so that system APCs queued for the thread still get to run */
+#define FAST_WAIT_LIMIT  64
+
+/***********************************************************************
+ *           wait_from_mirror
+ *
+ * Try to answer a wait from the event state mirror (see ntdll/sync.c).
+ * Returns STATUS_PENDING if the server has to be asked.  The mirror
+ * entries of the handles are returned in <seen> in any case.
+ */
+static DWORD wait_from_mirror( DWORD count, const HANDLE *handles, BOOL wait_all,
+                               DWORD timeout, BOOL alertable, LONGLONG *seen )
+{
+    TEB *teb = NtCurrentTeb();
+    DWORD i, j, flags, ret = WAIT_TIMEOUT;
+
+    for (i = 0; i < count; i++) seen[i] = SYNC_MirrorGet( handles[i] );
+
+    if (teb->fast_waits >= FAST_WAIT_LIMIT || teb->pending_list) return STATUS_PENDING;
+
+    if (wait_all)
+    {
+        /* the server fails waits on bad handles, or on the same handle twice */
+        for (i = 0; i < count; i++)
+        {
+            if (!seen[i]) return STATUS_PENDING;
+            for (j = 0; j < i; j++)
+                if (handles[i] == handles[j]) return STATUS_PENDING;
+        }
+
+        /* one unsignaled event is enough to time out, whatever the others are */
+        ret = WAIT_OBJECT_0;
+        for (i = 0; i < count; i++)
+        {
+            flags = SYNC_MIRROR_FLAGS( seen[i] );
+            if ((flags & SYNC_MIRROR_KNOWN) && !(flags & SYNC_MIRROR_SIGNALED))
+            {
+                ret = WAIT_TIMEOUT;
+                break;
+            }
+            if ((flags & (SYNC_MIRROR_KNOWN | SYNC_MIRROR_MANUAL)) !=
+                (SYNC_MIRROR_KNOWN | SYNC_MIRROR_MANUAL))
+                ret = STATUS_PENDING;
+        }
+    }
+    else
+    {
+        /* objects are checked in order, like the server does */
+        for (i = 0; i < count; i++)
+        {
+            flags = SYNC_MIRROR_FLAGS( seen[i] );
+            if (!(flags & SYNC_MIRROR_KNOWN)) return STATUS_PENDING;
+            if (!(flags & SYNC_MIRROR_SIGNALED)) continue;
+            /* a signaled auto-reset event has to be reset by the server */
+            if (!(flags & SYNC_MIRROR_MANUAL)) return STATUS_PENDING;
+            ret = WAIT_OBJECT_0 + i;
+            break;
+        }
+    }
+
+    /* an alertable wait that times out has to look for APCs */
+    if (ret == WAIT_TIMEOUT && (timeout || alertable)) return STATUS_PENDING;
+    if (ret != STATUS_PENDING) teb->fast_waits++;
+    return ret;
+}
+
+
+/***********************************************************************
+ *           wait_update_mirror
+ *
+ * Tell the event state mirror what a server wait found out.
+ */
+static void wait_update_mirror( DWORD count, const HANDLE *handles, BOOL wait_all,
+                                DWORD ret, const LONGLONG *seen )
+{
+    DWORD i;
+
+    if (wait_all)
+    {
+        /* all of them were signaled; if it timed out we don't know which wasn't */
+        if (ret == WAIT_OBJECT_0)
+            for (i = 0; i < count; i++) SYNC_MirrorWaited( handles[i], seen[i], TRUE );
+    }
+    else if (ret == WAIT_TIMEOUT || ret < WAIT_OBJECT_0 + count)
+    {
+        /* the ones before the object that satisfied the wait weren't signaled */
+        for (i = 0; i < count && i != ret - WAIT_OBJECT_0; i++)
+            SYNC_MirrorWaited( handles[i], seen[i], FALSE );
+        if (i < count) SYNC_MirrorWaited( handles[i], seen[i], TRUE );
+    }
+}
+
+
 /***********************************************************************
  *           do_multiple_wait
  */
@@ -456,6 +551,18 @@ static DWORD do_multiple_wait (DWORD count, const HANDLE *handles,
 {
     int ret, cookie;
     struct timeval tv;
+    LONGLONG seen[MAXIMUM_WAIT_OBJECTS];
+    BOOL mirrored = FALSE;
+
+    if (hSignalObject)
+        SYNC_ForgetHandle( hSignalObject );
+    else if (count && count <= MAXIMUM_WAIT_OBJECTS)
+    {
+        ret = wait_from_mirror( count, handles, wait_all, timeout, alertable, seen );
+        if (ret != STATUS_PENDING) return ret;
+        mirrored = TRUE;
+    }
+    NtCurrentTeb()->fast_waits = 0;
 
     if (timeout == INFINITE) tv.tv_sec = tv.tv_usec = 0;
     else get_timeout( &tv, timeout );
@@ -531,6 +638,7 @@ static DWORD do_multiple_wait (DWORD count, const HANDLE *handles,
         SetLastError( RtlNtStatusToDosError(ret) );
         ret = WAIT_FAILED;
     }
+    else if (mirrored) wait_update_mirror( count, handles, wait_all, ret, seen );
     return ret;
 }
 
@@ -240,6 +240,8 @@ static inline char *get_temp_stack(void)
 }
 
 extern void VIRTUAL_FreeMemory( LPVOID addr );
+extern void HEAP_ThreadDetach(void);
+extern void HEAP_ThreadAbort(void);
 extern BOOL use_memory_manager;
 
 #if !defined( USE_PTHREADS )
@@ -471,6 +473,9 @@ void SYSDEPS_ExitThread( int status )
     if (teb->TlsExpansionSlots)
         HeapFree(GetProcessHeap(), 0, teb->TlsExpansionSlots);
 
+    /* give the thread's heap cache back; later heap calls bypass the cache */
+    HEAP_ThreadDetach();
+
     SIGNAL_Reset();
 
     if (!use_memory_manager) {
@@ -543,6 +548,7 @@ void SYSDEPS_AbortThread( int status )
     if (__get_fs() == 0)
         _exit( status);
 
+    HEAP_ThreadAbort();
     SIGNAL_Reset();
 
     close( NtCurrentTeb()->wait_fd[0] );
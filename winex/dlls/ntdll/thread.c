@@ -37,6 +37,7 @@ WINE_DEFAULT_DEBUG_CHANNEL(thread);
 WINE_DECLARE_DEBUG_CHANNEL(relay);
 
 extern void ERRNO_init(void);
+extern void DEBUG_ThreadDetach(void);
 
 /* TEB of the initial thread */
 static TEB initial_teb;
@@ -611,6 +612,7 @@ void WINAPI ExitThread( DWORD code ) /* [in] Exit code for this thread */
     {
         MODULE_DllThreadDetach( NULL );
         if (!(NtCurrentTeb()->tibflags & TEBF_WIN32)) TASK_ExitTask();
+        DEBUG_ThreadDetach();
         SYSDEPS_ExitThread( code );
     }
 }
@@ -22,9 +22,15 @@
 #ifdef HAVE_SYS_TYPES_H
 # include <sys/types.h>
 #endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
 #ifdef HAVE_SYS_MMAN_H
 #include <sys/mman.h>
 #endif
+#include <sys/time.h>
+#include <dirent.h>
+#include <time.h>
 #include "winnls.h"
 #include "winbase.h"
 #include "wine/winbase16.h"
@@ -51,6 +57,12 @@ typedef struct _FV
 {
     struct _FV   *next;        /* Next view */
     struct _FV   *prev;        /* Prev view */
+    struct _FV   *left;        /* Tree links, see VIRTUAL_ViewTree */
+    struct _FV   *right;
+    struct _FV   *parent;
+    int           height;      /* Height of the subtree */
+    UINT          gap;         /* Free space between the previous view and this one */
+    UINT          max_gap;     /* Largest gap in the subtree */
     void         *base;        /* Base address */
     UINT          size;        /* Size in bytes */
     UINT          flags;       /* Allocation flags */
@@ -88,6 +100,11 @@ static const BYTE VIRTUAL_Win32Flags[16] =
 
 
 static FILE_VIEW *VIRTUAL_FirstView;
+/* The views are also kept in an AVL tree ordered by base address, so that
+   finding one doesn't mean walking the list. Each node tracks the largest
+   free gap below any view in its subtree, so VIRTUAL_GenerateView can skip
+   over fully used parts of the address space */
+static FILE_VIEW *VIRTUAL_ViewTree;
 static CRITICAL_SECTION csVirtual;
 #define ENTER_VIRTUAL() EnterCriticalSection(&csVirtual)
 #define LEAVE_VIRTUAL() LeaveCriticalSection(&csVirtual)
@@ -180,6 +197,279 @@ static void VIRTUAL_DumpView( FILE_VIEW *view )
 }
 
 
+/***********************************************************************
+ *           VIRTUAL_ViewGap
+ *
+ * Free space between the end of the previous view and the start of this one.
+ */
+static UINT VIRTUAL_ViewGap( const FILE_VIEW *view )
+{
+    char *prev_end = view->prev ? (char *)view->prev->base + view->prev->size : NULL;
+
+    return ((char *)view->base > prev_end) ? (char *)view->base - prev_end : 0;
+}
+
+
+static inline int VIRTUAL_TreeHeight( const FILE_VIEW *view )
+{
+    return view ? view->height : 0;
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_UpdateNode
+ *
+ * Recompute the height and largest gap of a tree node from its children.
+ */
+static void VIRTUAL_UpdateNode( FILE_VIEW *view )
+{
+    int left = VIRTUAL_TreeHeight( view->left ), right = VIRTUAL_TreeHeight( view->right );
+
+    view->max_gap = view->gap;
+    if (view->left && view->left->max_gap > view->max_gap) view->max_gap = view->left->max_gap;
+    if (view->right && view->right->max_gap > view->max_gap) view->max_gap = view->right->max_gap;
+    view->height = 1 + max( left, right );
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_ReplaceChild
+ */
+static void VIRTUAL_ReplaceChild( FILE_VIEW *parent, FILE_VIEW *old, FILE_VIEW *new )
+{
+    if (!parent) VIRTUAL_ViewTree = new;
+    else if (parent->left == old) parent->left = new;
+    else parent->right = new;
+    if (new) new->parent = parent;
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_RotateLeft
+ *
+ * Rotate the right child of a node into its place. Returns the new
+ * subtree root.
+ */
+static FILE_VIEW *VIRTUAL_RotateLeft( FILE_VIEW *view )
+{
+    FILE_VIEW *right = view->right;
+
+    VIRTUAL_ReplaceChild( view->parent, view, right );
+    if ((view->right = right->left)) view->right->parent = view;
+    right->left = view;
+    view->parent = right;
+    VIRTUAL_UpdateNode( view );
+    VIRTUAL_UpdateNode( right );
+    return right;
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_RotateRight
+ *
+ * Rotate the left child of a node into its place. Returns the new
+ * subtree root.
+ */
+static FILE_VIEW *VIRTUAL_RotateRight( FILE_VIEW *view )
+{
+    FILE_VIEW *left = view->left;
+
+    VIRTUAL_ReplaceChild( view->parent, view, left );
+    if ((view->left = left->right)) view->left->parent = view;
+    left->right = view;
+    view->parent = left;
+    VIRTUAL_UpdateNode( view );
+    VIRTUAL_UpdateNode( left );
+    return left;
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_Rebalance
+ *
+ * Update the nodes from a given one up to the root, rebalancing on the
+ * way. Must hold csVirtual.
+ */
+static void VIRTUAL_Rebalance( FILE_VIEW *view )
+{
+    while (view)
+    {
+        int balance = VIRTUAL_TreeHeight( view->left ) - VIRTUAL_TreeHeight( view->right );
+
+        if (balance > 1)
+        {
+            if (VIRTUAL_TreeHeight( view->left->left ) < VIRTUAL_TreeHeight( view->left->right ))
+                VIRTUAL_RotateLeft( view->left );
+            view = VIRTUAL_RotateRight( view );
+        }
+        else if (balance < -1)
+        {
+            if (VIRTUAL_TreeHeight( view->right->right ) < VIRTUAL_TreeHeight( view->right->left ))
+                VIRTUAL_RotateRight( view->right );
+            view = VIRTUAL_RotateLeft( view );
+        }
+        else VIRTUAL_UpdateNode( view );
+        view = view->parent;
+    }
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_FindFloorView
+ *
+ * Find the last view starting at or below a given address. Must hold
+ * csVirtual.
+ */
+static FILE_VIEW *VIRTUAL_FindFloorView( const void *addr )
+{
+    FILE_VIEW *view = VIRTUAL_ViewTree, *floor = NULL;
+
+    while (view)
+    {
+        if (view->base <= addr)
+        {
+            floor = view;
+            view = view->right;
+        }
+        else view = view->left;
+    }
+    return floor;
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_InsertView
+ *
+ * Link a view in after <prev> (at the start if NULL), both in the list
+ * and the tree. Must hold csVirtual.
+ */
+static void VIRTUAL_InsertView( FILE_VIEW *view, FILE_VIEW *prev )
+{
+    FILE_VIEW *parent;
+
+    view->prev = prev;
+    view->next = prev ? prev->next : VIRTUAL_FirstView;
+    if (view->next) view->next->prev = view;
+    if (prev) prev->next = view;
+    else VIRTUAL_FirstView = view;
+
+    /* The in-order successor slot of prev */
+    view->left = view->right = NULL;
+    if (!prev)
+    {
+        for (parent = VIRTUAL_ViewTree; parent && parent->left; parent = parent->left);
+        if (parent) parent->left = view;
+        else VIRTUAL_ViewTree = view;
+    }
+    else if (!prev->right)
+    {
+        parent = prev;
+        prev->right = view;
+    }
+    else
+    {
+        for (parent = prev->right; parent->left; parent = parent->left);
+        parent->left = view;
+    }
+    view->parent = parent;
+    view->gap = VIRTUAL_ViewGap( view );
+    VIRTUAL_Rebalance( view );
+
+    if (view->next)
+    {
+        view->next->gap = VIRTUAL_ViewGap( view->next );
+        VIRTUAL_Rebalance( view->next );
+    }
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_RemoveView
+ *
+ * Unlink a view from the list and the tree. Must hold csVirtual.
+ */
+static void VIRTUAL_RemoveView( FILE_VIEW *view )
+{
+    FILE_VIEW *next = view->next, *fix;
+
+    if (view->next) view->next->prev = view->prev;
+    if (view->prev) view->prev->next = view->next;
+    else VIRTUAL_FirstView = view->next;
+
+    if (!view->left || !view->right)
+    {
+        fix = view->parent;
+        VIRTUAL_ReplaceChild( fix, view, view->left ? view->left : view->right );
+    }
+    else
+    {
+        /* Put the successor in the view's place */
+        FILE_VIEW *succ;
+
+        for (succ = view->right; succ->left; succ = succ->left);
+        if (succ->parent != view)
+        {
+            fix = succ->parent;
+            VIRTUAL_ReplaceChild( fix, succ, succ->right );
+            succ->right = view->right;
+            succ->right->parent = succ;
+        }
+        else fix = succ;
+        succ->left = view->left;
+        succ->left->parent = succ;
+        VIRTUAL_ReplaceChild( view->parent, view, succ );
+    }
+    VIRTUAL_Rebalance( fix );
+
+    if (next)
+    {
+        next->gap = VIRTUAL_ViewGap( next );
+        VIRTUAL_Rebalance( next );
+    }
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_FindFreeGap
+ *
+ * Find the first view in a subtree with room for <size> bytes, aligned to
+ * the allocation granularity, between the previous view and itself and at
+ * or above <start>. Returns the view and the address to use, or NULL.
+ * Must hold csVirtual.
+ */
+static FILE_VIEW *VIRTUAL_FindFreeGap( FILE_VIEW *view, char *start, UINT size,
+                                       char **base )
+{
+    FILE_VIEW *found;
+
+    while (view && view->max_gap >= size)
+    {
+        /* Views starting at or below start, and everything before them,
+           can't have room above it */
+        if ((char *)view->base > start)
+        {
+            if ((found = VIRTUAL_FindFreeGap( view->left, start, size, base )))
+                return found;
+
+            if (view->gap >= size)
+            {
+                char *addr = view->prev ? (char *)view->prev->base + view->prev->size : NULL;
+
+                if (addr < start) addr = start;
+                addr = (char *)(((UINT_PTR)addr + granularity_mask) & ~granularity_mask);
+                if ((addr <= (char *)view->base) && ((UINT)((char *)view->base - addr) >= size))
+                {
+                    *base = addr;
+                    return view;
+                }
+            }
+        }
+        view = view->right;
+    }
+    return NULL;
+}
+
+
 /***********************************************************************
  *           VIRTUAL_Dump
  */
@@ -212,17 +502,8 @@ static FILE_VIEW *VIRTUAL_FindView( const void *addr ) /* [in] Address */
     FILE_VIEW *view;
 
     ENTER_VIRTUAL();
-    view = VIRTUAL_FirstView;
-    while (view)
-    {
-        if (view->base > addr)
-        {
-            view = NULL;
-            break;
-        }
-        if (view->base + view->size > addr) break;
-        view = view->next;
-    }
+    view = VIRTUAL_FindFloorView( addr );
+    if (view && (view->base + view->size <= addr)) view = NULL;
     LEAVE_VIRTUAL();
     return view;
 }
@@ -382,7 +663,7 @@ static void VIRTUAL_FreeView( FILE_VIEW *view )
 static FILE_VIEW *VIRTUAL_CreateView( void *base, UINT size, UINT flags,
                                       BYTE vprot, HANDLE mapping )
 {
-    FILE_VIEW *view, *prev;
+    FILE_VIEW *view;
 
     /* Allocate view */
 
@@ -391,22 +672,7 @@ static FILE_VIEW *VIRTUAL_CreateView( void *base, UINT size, UINT flags,
     /* Insert view in the linked list */
 
     ENTER_VIRTUAL();
-    if (!VIRTUAL_FirstView || (VIRTUAL_FirstView->base > base))
-    {
-        view->next = VIRTUAL_FirstView;
-        view->prev = NULL;
-        if (view->next) view->next->prev = view;
-        VIRTUAL_FirstView = view;
-    }
-    else
-    {
-        prev = VIRTUAL_FirstView;
-        while (prev->next && (prev->next->base <= base)) prev = prev->next;
-        view->next = prev->next;
-        view->prev = prev;
-        if (view->next) view->next->prev = view;
-        prev->next  = view;
-    }
+    VIRTUAL_InsertView( view, VIRTUAL_FindFloorView( base ) );
     LEAVE_VIRTUAL();
     VIRTUAL_DEBUG_DUMP_VIEW( view );
     return view;
@@ -443,9 +709,7 @@ BOOL VIRTUAL_AddLoadedView (void *base, DWORD size, DWORD protect)
 static void VIRTUAL_DeleteBadView( FILE_VIEW *view )
 {
     ENTER_VIRTUAL();
-    if (view->next) view->next->prev = view->prev;
-    if (view->prev) view->prev->next = view->next;
-    else VIRTUAL_FirstView = view->next;
+    VIRTUAL_RemoveView( view );
     LEAVE_VIRTUAL();
     if (view->mapping) NtClose( view->mapping );
     free( view );
@@ -493,7 +757,7 @@ void VIRTUAL_FreeMemory( LPVOID addr )
 static FILE_VIEW *VIRTUAL_TryCreateView( void *base, UINT size, UINT flags,
                                          BYTE vprot, HANDLE mapping )
 {
-    FILE_VIEW *view;
+    FILE_VIEW *view, *prev, *next;
     const void *end = (const char*)base + size;
 
     /* Allocate view */
@@ -503,35 +767,15 @@ static FILE_VIEW *VIRTUAL_TryCreateView( void *base, UINT size, UINT flags,
     /* Insert view in the linked list */
 
     ENTER_VIRTUAL();
-    if (!VIRTUAL_FirstView || (VIRTUAL_FirstView->base > base))
-    {
-        if (VIRTUAL_FirstView && (VIRTUAL_FirstView->base < end))
-            goto in_use;
-
-        view->next = VIRTUAL_FirstView;
-        view->prev = NULL;
-        if (view->next) view->next->prev = view;
-        VIRTUAL_FirstView = view;
-    }
-    else
-    {
-        FILE_VIEW *prev;
-        void *prev_end;
-
-        prev = VIRTUAL_FirstView;
-        while (prev->next && (prev->next->base <= base)) prev = prev->next;
+    prev = VIRTUAL_FindFloorView( base );
+    next = prev ? prev->next : VIRTUAL_FirstView;
 
-        prev_end = (char*)prev->base + prev->size;
-        if (prev_end > base)
-            goto in_use;
-        if (prev->next && (prev->next->base < end))
-            goto in_use;
+    if (prev && ((char*)prev->base + prev->size > (char*)base))
+        goto in_use;
+    if (next && (next->base < end))
+        goto in_use;
 
-        view->next = prev->next;
-        view->prev = prev;
-        if (view->next) view->next->prev = view;
-        prev->next  = view;
-    }
+    VIRTUAL_InsertView( view, prev );
     LEAVE_VIRTUAL();
     VIRTUAL_DEBUG_DUMP_VIEW( view );
     return view;
@@ -550,10 +794,10 @@ in_use:
 static FILE_VIEW *VIRTUAL_GenerateView( UINT size, UINT flags,
                                         BYTE vprot, HANDLE mapping )
 {
-    FILE_VIEW *view;
+    FILE_VIEW *view, *prev, *next;
     /* we must reserve everything below 0x110000 for DOS memory */
-    void *start = (void*)0x110000;
-    void *end = (char*)start + size;
+    char *start = (char*)0x110000;
+    char *base;
 
     if (!use_memory_manager)
         return NULL;
@@ -565,44 +809,22 @@ static FILE_VIEW *VIRTUAL_GenerateView( UINT size, UINT flags,
     /* Find somewhere to insert it */
 
     ENTER_VIRTUAL();
-    if (!VIRTUAL_FirstView || (VIRTUAL_FirstView->base >= end))
-    {
-        view->base = start;
-        view->next = VIRTUAL_FirstView;
-        view->prev = NULL;
-        if (view->next) view->next->prev = view;
-        VIRTUAL_FirstView = view;
-    }
+    if ((next = VIRTUAL_FindFreeGap( VIRTUAL_ViewTree, start, size, &base )))
+        prev = next->prev;
     else
     {
-        FILE_VIEW *prev;
-
-        prev = VIRTUAL_FirstView;
-
-        /* don't want to allocate below 0x110000 */
-        while (prev->next && (prev->next->base < start)) prev = prev->next;
-
-        end = (char*)prev->base + prev->size;
-        if (start < end) start = end;
+        /* no room between views, go after the last one */
+        for (prev = VIRTUAL_ViewTree; prev && prev->right; prev = prev->right);
 
-        for (;;)
-        {
-            start = (char*)(((UINT_PTR)start + granularity_mask) & ~granularity_mask);
-            end = (char*)start + size;
-            if (!prev->next || (prev->next->base >= end))
-                break;
-            prev = prev->next;
-            start = (char*)prev->base + prev->size;
-        }
-
-        /* FIXME: check if start is above a certain threshold
-         * (winver-dependent), and fail the allocation if so */
-        view->base = start;
-        view->next = prev->next;
-        view->prev = prev;
-        if (view->next) view->next->prev = view;
-        prev->next  = view;
+        base = prev ? (char*)prev->base + prev->size : NULL;
+        if (base < (char*)start) base = start;
+        base = (char*)(((UINT_PTR)base + granularity_mask) & ~granularity_mask);
     }
+
+    /* FIXME: check if start is above a certain threshold
+     * (winver-dependent), and fail the allocation if so */
+    view->base = base;
+    VIRTUAL_InsertView( view, prev );
     LEAVE_VIRTUAL();
     VIRTUAL_DEBUG_DUMP_VIEW( view );
     return view;
@@ -960,6 +1182,367 @@ static BOOL VIRTUAL_MakeWriteable_FaultHandler(LPVOID section, LPCVOID addr)
     return FALSE;
 }
 
+/***********************************************************************
+ *           Relocated image cache
+ *
+ * Images that can't be loaded at their preferred base have every page
+ * with fixups dirtied by do_relocations, on every launch. To avoid that,
+ * the relocated image is saved in <config dir>/reloccache, one file per
+ * source file and load address, and mapped straight from there the next
+ * time the image lands at the same address. The pages then stay clean and
+ * are shared between processes. The file holds the image as laid out in
+ * memory (zero pages left as holes), followed by a RELOC_CACHE_INFO
+ * describing the source; entries whose source changed are rewritten.
+ * Saving happens on a writer thread, from a snapshot of the image, so
+ * the load doesn't wait for the disk. Entries are dropped least recently
+ * used first once the directory grows past WINERELOCCACHESIZE megabytes
+ * (default 256, 0 for no limit). Set WINERELOCCACHE=0 to disable the
+ * cache.
+ */
+#define RELOC_CACHE_MAGIC   0x43525857  /* "WXRC" */
+#define RELOC_CACHE_VERSION 2
+#define RELOC_CACHE_DEFAULT_SIZE 256    /* MB */
+#define RELOC_CACHE_TOUCH   3600        /* seconds between LRU stamps of an entry */
+
+#ifdef __APPLE__
+# define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+# define ST_CTIME_NSEC(st) ((st)->st_ctimespec.tv_nsec)
+#else
+# define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+# define ST_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#endif
+
+typedef struct
+{
+    DWORD     magic;
+    DWORD     version;
+    DWORD     total_size;    /* size of the image */
+    DWORD     image_base;    /* preferred base */
+    DWORD     load_base;     /* base the image was relocated to */
+    DWORD     mtime_nsec;
+    ULONGLONG dev;           /* source file identity */
+    ULONGLONG ino;
+    ULONGLONG size;
+    LONGLONG  mtime;
+    LONGLONG  ctime;         /* changes on any write, and can't be set back */
+    DWORD     ctime_nsec;
+    DWORD     unused;
+} RELOC_CACHE_INFO;
+
+/* an image waiting for the writer thread */
+typedef struct reloc_cache_job
+{
+    struct reloc_cache_job *next;
+    char                   *image;   /* private copy, unmapped once written */
+    RELOC_CACHE_INFO        info;
+    char                    name[MAX_PATH];
+} RELOC_CACHE_JOB;
+
+static int reloc_cache_enabled = -1;
+static ULONGLONG reloc_cache_max_size;
+static CRITICAL_SECTION reloc_cache_cs;
+static RELOC_CACHE_JOB *reloc_cache_jobs;
+static HANDLE reloc_cache_event;
+static BOOL reloc_cache_writer_started;
+
+/***********************************************************************
+ *           VIRTUAL_GetRelocCacheName
+ *
+ * Build the cache file name for an image file and load address. Fills
+ * in the info describing the source. Returns FALSE if caching is off.
+ */
+static BOOL VIRTUAL_GetRelocCacheName( int fd, char *ptr, char *base, DWORD total_size,
+                                       char *name, size_t len, RELOC_CACHE_INFO *info )
+{
+    struct stat st;
+
+    if (reloc_cache_enabled == -1)
+    {
+        const char *env = getenv( "WINERELOCCACHE" );
+        reloc_cache_enabled = !env || (*env != '0');
+        env = getenv( "WINERELOCCACHESIZE" );
+        reloc_cache_max_size = (ULONGLONG)(env ? atoi( env ) : RELOC_CACHE_DEFAULT_SIZE) << 20;
+    }
+    if (!reloc_cache_enabled) return FALSE;
+    if (fstat( fd, &st ) == -1 || !S_ISREG(st.st_mode)) return FALSE;
+
+    memset( info, 0, sizeof(*info) );
+    info->magic      = RELOC_CACHE_MAGIC;
+    info->version    = RELOC_CACHE_VERSION;
+    info->total_size = total_size;
+    info->image_base = (DWORD)base;
+    info->load_base  = (DWORD)ptr;
+    info->dev        = st.st_dev;
+    info->ino        = st.st_ino;
+    info->size       = st.st_size;
+    info->mtime      = st.st_mtime;
+    info->mtime_nsec = ST_MTIME_NSEC(&st);
+    info->ctime      = st.st_ctime;
+    info->ctime_nsec = ST_CTIME_NSEC(&st);
+
+    return snprintf( name, len, "%s/reloccache/%llx-%llx-%08lx", get_config_dir(),
+                     info->dev, info->ino, (DWORD)ptr ) < len;
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_MapRelocCache
+ *
+ * Map a previously relocated copy of the image at ptr, if there is a
+ * valid one. The range must already be reserved.
+ */
+static BOOL VIRTUAL_MapRelocCache( int fd, char *ptr, char *base, DWORD total_size )
+{
+    RELOC_CACHE_INFO info, cached;
+    char name[MAX_PATH];
+    struct stat st;
+    int cache_fd;
+    BOOL ret = FALSE;
+
+    if (!VIRTUAL_GetRelocCacheName( fd, ptr, base, total_size, name, sizeof(name), &info ))
+        return FALSE;
+    if ((cache_fd = open( name, O_RDONLY )) == -1) return FALSE;
+
+    if (pread( cache_fd, &cached, sizeof(cached), total_size ) == sizeof(cached) &&
+        !memcmp( &cached, &info, sizeof(info) ))
+    {
+        if (mmap( ptr, total_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                  MAP_PRIVATE | MAP_FIXED, cache_fd, 0 ) == ptr)
+        {
+            TRACE_(module)( "mapped relocated image %s at %p\n", name, ptr );
+            ret = TRUE;
+
+            /* the mtime of an entry is its last use, for VIRTUAL_TrimRelocCache */
+            if (!fstat( cache_fd, &st ) && st.st_mtime + RELOC_CACHE_TOUCH < time(NULL))
+                futimes( cache_fd, NULL );
+        }
+    }
+    else TRACE_(module)( "stale relocation cache %s\n", name );
+
+    close( cache_fd );
+    return ret;
+}
+
+
+typedef struct
+{
+    time_t    mtime;
+    ULONGLONG size;
+    char      name[64];
+} RELOC_CACHE_ENTRY;
+
+static int reloc_cache_entry_cmp( const void *a, const void *b )
+{
+    const RELOC_CACHE_ENTRY *ea = a, *eb = b;
+
+    if (ea->mtime != eb->mtime) return ea->mtime < eb->mtime ? -1 : 1;
+    return 0;
+}
+
+/***********************************************************************
+ *           VIRTUAL_TrimRelocCache
+ *
+ * Delete the least recently used entries until the cache directory is
+ * back under reloc_cache_max_size. Temp files left by a writer that
+ * died are removed once they are an hour old.
+ */
+static void VIRTUAL_TrimRelocCache(void)
+{
+    RELOC_CACHE_ENTRY *entries = NULL, *new_entries;
+    ULONGLONG total = 0;
+    char dir[MAX_PATH], path[MAX_PATH];
+    struct dirent *de;
+    struct stat st;
+    int count = 0, max = 0, i;
+    time_t now = time(NULL);
+    DIR *dirp;
+
+    if (!reloc_cache_max_size) return;
+    snprintf( dir, sizeof(dir), "%s/reloccache", get_config_dir() );
+    if (!(dirp = opendir( dir ))) return;
+
+    while ((de = readdir( dirp )))
+    {
+        if (de->d_name[0] == '.' || strlen( de->d_name ) >= sizeof(entries->name)) continue;
+        snprintf( path, sizeof(path), "%s/%s", dir, de->d_name );
+        if (stat( path, &st ) == -1 || !S_ISREG(st.st_mode)) continue;
+        if (strchr( de->d_name, '.' ))
+        {
+            if (st.st_mtime + 3600 < now) unlink( path );
+            continue;
+        }
+
+        if (count == max)
+        {
+            max = max ? max * 2 : 64;
+            if (entries)
+                new_entries = HeapReAlloc( GetProcessHeap(), 0, entries, max * sizeof(*entries) );
+            else
+                new_entries = HeapAlloc( GetProcessHeap(), 0, max * sizeof(*entries) );
+            if (!new_entries) break;
+            entries = new_entries;
+        }
+        entries[count].mtime = st.st_mtime;
+        entries[count].size  = (ULONGLONG)st.st_blocks * 512;  /* holes don't count */
+        strcpy( entries[count].name, de->d_name );
+        total += entries[count].size;
+        count++;
+    }
+    closedir( dirp );
+
+    if (total > reloc_cache_max_size)
+    {
+        qsort( entries, count, sizeof(*entries), reloc_cache_entry_cmp );
+        for (i = 0; i < count && total > reloc_cache_max_size; i++)
+        {
+            snprintf( path, sizeof(path), "%s/%s", dir, entries[i].name );
+            if (unlink( path ) == -1) continue;
+            TRACE_(module)( "evicted relocation cache %s\n", path );
+            total -= entries[i].size;
+        }
+    }
+    if (entries) HeapFree( GetProcessHeap(), 0, entries );
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_WriteRelocCache
+ *
+ * Write a snapshot of a relocated image to its cache file, and free the
+ * job.
+ */
+static void VIRTUAL_WriteRelocCache( RELOC_CACHE_JOB *job )
+{
+    DWORD total_size = job->info.total_size;
+    char tmp[MAX_PATH + 16];
+    DWORD pos, i;
+    int cache_fd;
+
+    /* write to a temp file and rename it, so readers never see half a file */
+    snprintf( tmp, sizeof(tmp), "%s/reloccache", get_config_dir() );
+    mkdir( tmp, 0777 );
+    snprintf( tmp, sizeof(tmp), "%s.%d", job->name, getpid() );
+    if ((cache_fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600 )) == -1)
+    {
+        WARN_(module)( "can't create relocation cache %s\n", tmp );
+        goto done;
+    }
+
+    for (pos = 0; pos < total_size; pos += page_size)
+    {
+        const DWORD *page = (const DWORD *)(job->image + pos);
+
+        for (i = 0; i < page_size / sizeof(DWORD); i++) if (page[i]) break;
+        if (i == page_size / sizeof(DWORD)) continue;  /* leave a hole */
+        if (pwrite( cache_fd, page, page_size, pos ) != page_size) goto failed;
+    }
+    if (pwrite( cache_fd, &job->info, sizeof(job->info), total_size ) != sizeof(job->info))
+        goto failed;
+    close( cache_fd );
+    if (rename( tmp, job->name ) == -1) unlink( tmp );
+    else TRACE_(module)( "saved relocated image %s\n", job->name );
+    VIRTUAL_TrimRelocCache();
+    goto done;
+
+ failed:
+    WARN_(module)( "failed to write relocation cache %s\n", tmp );
+    close( cache_fd );
+    unlink( tmp );
+ done:
+    munmap( job->image, total_size );
+    HeapFree( GetProcessHeap(), 0, job );
+}
+
+
+static DWORD CALLBACK VIRTUAL_RelocCacheWriter( LPVOID arg )
+{
+    RELOC_CACHE_JOB *job;
+
+    for (;;)
+    {
+        WaitForSingleObject( reloc_cache_event, INFINITE );
+        for (;;)
+        {
+            EnterCriticalSection( &reloc_cache_cs );
+            if ((job = reloc_cache_jobs)) reloc_cache_jobs = job->next;
+            LeaveCriticalSection( &reloc_cache_cs );
+            if (!job) break;
+            VIRTUAL_WriteRelocCache( job );
+        }
+    }
+    return 0;
+}
+
+/* start the writer thread; must hold reloc_cache_cs */
+static BOOL VIRTUAL_StartRelocCacheWriter(void)
+{
+    HANDLE thread;
+
+    if (reloc_cache_writer_started) return TRUE;
+    if (!reloc_cache_event &&
+        NtCreateEvent( &reloc_cache_event, EVENT_ALL_ACCESS, NULL, FALSE, FALSE ) != STATUS_SUCCESS)
+    {
+        reloc_cache_event = 0;
+        return FALSE;
+    }
+    if (!(thread = CreateThread( NULL, 0, VIRTUAL_RelocCacheWriter, NULL, 0, NULL )))
+        return FALSE;
+    CloseHandle( thread );
+    reloc_cache_writer_started = TRUE;
+    return TRUE;
+}
+
+
+/***********************************************************************
+ *           VIRTUAL_SaveRelocCache
+ *
+ * Queue the freshly relocated image at ptr to be saved for the next
+ * launches. Must be called before the section protections are applied,
+ * so that everything is still readable. Only non-zero pages are copied;
+ * the file is written by the writer thread, or right here if it can't
+ * be started.
+ */
+static void VIRTUAL_SaveRelocCache( int fd, char *ptr, char *base, DWORD total_size )
+{
+    RELOC_CACHE_JOB *job;
+    DWORD pos, i;
+
+    if (!(job = HeapAlloc( GetProcessHeap(), 0, sizeof(*job) ))) return;
+    if (!VIRTUAL_GetRelocCacheName( fd, ptr, base, total_size, job->name,
+                                    sizeof(job->name), &job->info ))
+    {
+        HeapFree( GetProcessHeap(), 0, job );
+        return;
+    }
+    if ((job->image = wine_anon_mmap( NULL, total_size, PROT_READ | PROT_WRITE, 0 )) == (char *)-1)
+    {
+        HeapFree( GetProcessHeap(), 0, job );
+        return;
+    }
+
+    /* untouched pages of the copy read back as zero */
+    for (pos = 0; pos < total_size; pos += page_size)
+    {
+        const DWORD *page = (const DWORD *)(ptr + pos);
+
+        for (i = 0; i < page_size / sizeof(DWORD); i++) if (page[i]) break;
+        if (i < page_size / sizeof(DWORD)) memcpy( job->image + pos, page, page_size );
+    }
+
+    EnterCriticalSection( &reloc_cache_cs );
+    if (VIRTUAL_StartRelocCacheWriter())
+    {
+        job->next = reloc_cache_jobs;
+        reloc_cache_jobs = job;
+        job = NULL;
+        NtSetEvent( reloc_cache_event, NULL );
+    }
+    LeaveCriticalSection( &reloc_cache_cs );
+
+    if (job) VIRTUAL_WriteRelocCache( job );
+}
+
+
 /***********************************************************************
  *           map_image
  *
@@ -978,6 +1561,8 @@ static LPVOID map_image( HANDLE hmapping, int fd, char *base, DWORD total_size,
     FILE_VIEW *view = NULL;
     char *ptr = NULL;
     int shared_fd = -1;
+    /* shared sections must stay shared, and removable media may go away */
+    BOOL use_reloc_cache = !shared_size && !removable;
 
     SetLastError( ERROR_BAD_EXE_FORMAT );  /* generic error */
 
@@ -1012,6 +1597,16 @@ static LPVOID map_image( HANDLE hmapping, int fd, char *base, DWORD total_size,
     else ptr = view->base;
     TRACE_(module)( "mapped PE file at %p-%p\n", ptr, ptr + total_size );
 
+    /* use the already relocated copy if we have one */
+
+    if (ptr != base && use_reloc_cache &&
+        VIRTUAL_MapRelocCache( fd, ptr, base, total_size ))
+    {
+        dos = (IMAGE_DOS_HEADER *)ptr;
+        nt = (IMAGE_NT_HEADERS *)(ptr + dos->e_lfanew);
+        goto set_protections;
+    }
+
     /* map the header */
 
     if (VIRTUAL_mmap( fd, ptr, header_size, 0, 0, PROT_READ,
@@ -1119,8 +1714,12 @@ static LPVOID map_image( HANDLE hmapping, int fd, char *base, DWORD total_size,
 
     /* Do relocations if necessary */
     if (ptr != base)
-       do_relocations (ptr, nt);
+    {
+        if (do_relocations (ptr, nt) && use_reloc_cache)
+            VIRTUAL_SaveRelocCache( fd, ptr, base, total_size );
+    }
 
+ set_protections:
     /* Set the protection on the PE header READONLY rather than what we just set when we created the view */
     VIRTUAL_SetProt( view, ptr, header_size, VPROT_READ|VPROT_COMMITTED );
 
@@ -1190,6 +1789,8 @@ void VIRTUAL_Init(void)
 
     InitializeCriticalSection( &csVirtual );
     CRITICAL_SECTION_NAME( &csVirtual, "csVirtual" );
+    InitializeCriticalSection( &reloc_cache_cs );
+    CRITICAL_SECTION_NAME( &reloc_cache_cs, "reloc_cache_cs" );
 
     if (wine_main_preload_info) {
         /* mark the spot where preloaded memory ends, so we can avoid crossing it. */
@@ -1929,28 +2530,21 @@ DWORD WINAPI VirtualQuery(
     /* Find the view containing the address */
 
     ENTER_VIRTUAL();
-    view = VIRTUAL_FirstView;
-    for (;;)
+    if ((view = VIRTUAL_FindFloorView( base )) &&
+        ((char *)view->base + view->size > base))
     {
-        if (!view)
-        {
-            size = (char *)0xffff0000 - alloc_base;
-            break;
-        }
-        if ((char *)view->base > base)
-        {
-            size = (char *)view->base - alloc_base;
-            view = NULL;
-            break;
-        }
-        if ((char *)view->base + view->size > base)
-        {
-            alloc_base = view->base;
-            size = view->size;
-            break;
-        }
-        alloc_base = (char *)view->base + view->size;
-        view = view->next;
+        alloc_base = view->base;
+        size = view->size;
+    }
+    else
+    {
+        /* in the free range between two views */
+        FILE_VIEW *next = view ? view->next : VIRTUAL_FirstView;
+
+        if (view) alloc_base = (char *)view->base + view->size;
+        if (next) size = (char *)next->base - alloc_base;
+        else size = (char *)0xffff0000 - alloc_base;
+        view = NULL;
     }
     LEAVE_VIRTUAL();
 
@@ -87,6 +87,7 @@ extern DWORD WineEngGetGlyphOutline(GdiFont, UINT glyph, UINT format,
                                     const MAT2*);
 extern UINT WineEngGetOutlineTextMetrics(GdiFont, UINT, LPOUTLINETEXTMETRICW);
 extern BOOL WineEngGetTextExtentPoint(GdiFont, LPCWSTR, INT, LPSIZE);
+extern BOOL WineEngGetTextExtentExPoint(GdiFont, LPCWSTR, INT, INT, LPINT, LPINT, LPSIZE);
 extern BOOL WineEngGetTextExtentPointI(GdiFont, LPWORD, INT, LPSIZE);
 extern BOOL WineEngGetTextMetrics(GdiFont, LPTEXTMETRICW);
 extern INT WineEngAddFontResourceEx(LPCWSTR str, DWORD fl, PVOID pv);
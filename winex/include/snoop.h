@@ -12,4 +12,28 @@ extern void SNOOP16_RegisterDLL(NE_MODULE*,LPCSTR);
 extern FARPROC16 SNOOP16_GetProcAddress16(HMODULE16,DWORD,FARPROC16);
 extern int SNOOP_ShowDebugmsgSnoop(const char *dll,int ord,const char *fname);
 extern void SNOOP_ThreadExit ();
+extern void SNOOP_ProfileCollect(void);
+
+/* relay profile counters of one export */
+typedef struct
+{
+    LONG        calls;
+    LONGLONG    ticks;  /* inclusive, in time stamp counter ticks */
+} RELAY_PROF_ENTRY;
+
+extern BOOL RELAY_ProfileEnabled(void);
+extern void RELAY_ProfileRecord(RELAY_PROF_ENTRY *entry, ULONGLONG start);
+extern void RELAY_ProfileAdd(const char *dll, const char *func, DWORD ordinal,
+                             const RELAY_PROF_ENTRY *entry);
+
+static inline ULONGLONG RELAY_ProfileNow(void)
+{
+#ifdef __i386__
+    ULONGLONG ticks;
+    __asm__ __volatile__( "rdtsc" : "=A" (ticks) );
+    return ticks;
+#else
+    return 0;
+#endif
+}
 #endif
@@ -123,10 +123,14 @@ typedef struct _TEB
     DWORD        has_peb;        /* --3 290 1 if 'process' union contains a
                                     PEB, 0 if PDB */
     struct _PEB *PEB;            /* --3 294 internal pointer to PEB */
+    void        *heap_cache;     /* --3 298 per-thread process heap cache */
+    void        *server_prof;    /* --3 29c per-thread server call profile */
+    DWORD        fast_waits;     /* --3 2a0 waits answered without the server */
+    LONG         gdi_dc_locks;   /* --3 2a4 GDI DC locks held by the thread */
 
     /* here is plenty space for wine specific fields (don't forget to change pad6!!) */
     /* the following are nt specific fields */
-    DWORD        pad6[600];                  /* --n 298 */
+    DWORD        pad6[596];                  /* --n 2a8 */
     UNICODE_STRING StaticUnicodeString;      /* -2- bf8 used by advapi32 */
     USHORT       StaticUnicodeBuffer[261];   /* -2- c00 used by advapi32 */
     DWORD        pad7;                       /* --n e0c */
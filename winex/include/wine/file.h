@@ -56,6 +56,7 @@ extern int FILE_strncasecmp( const char *str1, const char *str2, int len );
 extern void FILE_SetDosError(void);
 extern HANDLE FILE_DupUnixHandle( int fd, DWORD access, BOOL inherit );
 extern int FILE_GetUnixHandle( HANDLE handle, DWORD access );
+extern void FILE_InvalidateHandleFd( HANDLE handle );
 extern BOOL FILE_Stat( LPCSTR unixName, BY_HANDLE_FILE_INFORMATION *info );
 extern HFILE16 FILE_Dup2( HFILE16 hFile1, HFILE16 hFile2 );
 extern HANDLE FILE_CreateFile( LPCSTR filename, DWORD access, DWORD sharing,
@@ -121,6 +121,7 @@ typedef struct _wine_modref
 	int                  tlsindex;  /* TLS index or -1 if none */
 
 	FARPROC            (*find_export)( struct _wine_modref *wm, LPCSTR func, BOOL snoop );
+	struct pe_export_index *exports; /* export lookup cache, see pe_image.c */
 
 	int			nDeps;
 	struct _wine_modref	**deps;
@@ -235,6 +236,7 @@ extern WINE_MODREF *PE_CreateModule( HMODULE hModule, LPCSTR filename,
 extern void PE_InitTls(void);
 extern BOOL PE_InitDLL( const WINE_MODREF* wm, DWORD type, LPVOID lpReserved );
 extern DWORD PE_fixup_imports(WINE_MODREF *wm);
+extern void PE_FreeExportIndex( WINE_MODREF *wm );
 
 /* loader/loadorder.c */
 extern void MODULE_InitLoadOrder(void);
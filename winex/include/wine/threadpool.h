@@ -14,6 +14,6 @@
 #ifndef _WINE_THREADPOOL_H_
 #define _WINE_THREADPOOL_H_
 
-extern void CleanupThreadPool ();
+extern void CleanupThreadPool (BOOL bProcessTerminating);
 
 #endif
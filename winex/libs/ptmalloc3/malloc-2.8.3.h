@@ -467,6 +467,17 @@ void* mspace_realloc(mspace msp, void* mem, size_t newsize, int inplaceonly);
 /* Check if piece of mem is valid and belongs to the given mspace */
 int mspace_validate (mspace msp, const void *mem);
 
+/* Lock free check that mem is an in use chunk in one of the regular
+   segments of the given mspace; sets *size to its usable size */
+int mspace_owns (mspace msp, const void *mem, size_t *size);
+
+/*
+  mspace_walk steps through every chunk of the given space. Start with
+  *mem == 0; each call sets *mem, *size (the chunk size) and *inuse for
+  the next chunk and returns 0 once all have been visited.
+*/
+int mspace_walk (mspace msp, void **mem, size_t *size, int *inuse);
+
 /*
   mspace_calloc behaves as calloc, but operates within
   the given space.
@@ -499,6 +510,12 @@ void** mspace_independent_comalloc(mspace msp, size_t n_elements,
 */
 size_t mspace_footprint(mspace msp);
 
+/*
+  mspace_max_footprint() returns the peak number of bytes obtained from the
+  system for this space.
+*/
+size_t mspace_max_footprint(mspace msp);
+
 
 #if !NO_MALLINFO
 /*
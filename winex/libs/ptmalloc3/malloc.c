@@ -523,6 +523,7 @@ MAX_RELEASE_CHECK_RATE   default: 255 unless not HAVE_MMAP
 #include "winbase.h"
 #include "wine/debug.h"
 #include <unistd.h>
+#include <sched.h>
 
 WINE_DEFAULT_DEBUG_CHANNEL(heap);
 WINE_DECLARE_DEBUG_CHANNEL(heapcheck);
@@ -2400,6 +2401,10 @@ struct malloc_state {
   msegment   seg;
   lmsegmentptr large_seg; /* list of directly mmap'd large allocations */
   size_t     exts;
+#ifdef TGCHANGES
+  LONG       seg_readers;  /* mspace_owns calls walking the segments */
+  LONG       seg_changing; /* set while a segment is added or released */
+#endif
 };
 
 typedef struct malloc_state*    mstate;
@@ -2496,6 +2501,26 @@ static msegmentptr segment_holding(mstate m, char* addr) {
   }
 }
 
+#ifdef TGCHANGES
+/* mspace_owns walks the segment list without the mspace lock, so
+   anything that moves a segment boundary, links a segment record or
+   unmaps a segment first waits for those walkers to leave, and new ones
+   back off until it is done. Callers hold the mspace lock */
+static void begin_segment_change(mstate m) {
+  int spins = 0;
+  InterlockedExchange(&m->seg_changing, 1);
+  while (*(volatile LONG *)&m->seg_readers) {
+    if ((++spins & 63) == 0)
+      sched_yield();
+  }
+}
+
+#define end_segment_change(m) InterlockedExchange(&(m)->seg_changing, 0)
+#else /* TGCHANGES */
+#define begin_segment_change(m)
+#define end_segment_change(m)
+#endif /* TGCHANGES */
+
 /* Return true if segment contains a segment link */
 static int has_segment_link(mstate m, msegmentptr ss) {
   msegmentptr sp = &m->seg;
@@ -3790,11 +3815,13 @@ static void add_segment(mstate m, char* tbase, size_t tsize, flag_t mmapped) {
   /* Set up segment record */
   assert(is_aligned(ss));
   set_size_and_pinuse_of_inuse_chunk(m, sp, ssize);
+  begin_segment_change(m);
   *ss = m->seg; /* Push current record */
   m->seg.base = tbase;
   m->seg.size = tsize;
   m->seg.sflags = mmapped;
   m->seg.next = ss;
+  end_segment_change(m);
 
   /* Insert trailing fenceposts */
   for (;;) {
@@ -3983,7 +4010,9 @@ static void* sys_alloc(mstate m, size_t nb) {
           !is_extern_segment(sp) &&
           (sp->sflags & IS_MMAPPED_BIT) == mmap_flag &&
           segment_holds(sp, m->top)) { /* append */
+        begin_segment_change(m);
         sp->size += tsize;
+        end_segment_change(m);
         init_top(m, m->top, m->topsize + tsize);
       }
       else {
@@ -3996,8 +4025,10 @@ static void* sys_alloc(mstate m, size_t nb) {
             !is_extern_segment(sp) &&
             (sp->sflags & IS_MMAPPED_BIT) == mmap_flag) {
           char* oldbase = sp->base;
+          begin_segment_change(m);
           sp->base = tbase;
           sp->size += tsize;
+          end_segment_change(m);
           return prepend_alloc(m, tbase, oldbase, nb);
         }
         else
@@ -4048,14 +4079,17 @@ static size_t release_unused_segments(mstate m) {
         else {
           unlink_large_chunk(m, tp);
         }
+        begin_segment_change(m);
         if (CALL_MUNMAP(base, size) == 0) {
           released += size;
           m->footprint -= size;
           /* unlink obsoleted record */
           sp = pred;
           sp->next = next;
+          end_segment_change(m);
         }
         else { /* back out if cannot unmap */
+          end_segment_change(m);
           insert_large_chunk(m, tp, psize);
         }
       }
@@ -4083,6 +4117,7 @@ static int sys_trim(mstate m, size_t pad) {
                       SIZE_T_ONE) * unit;
       msegmentptr sp = segment_holding(m, (char*)m->top);
 
+      begin_segment_change(m);
       if (!is_extern_segment(sp)) {
         if (is_mmapped_segment(sp)) {
           if (HAVE_MMAP &&
@@ -4120,6 +4155,7 @@ static int sys_trim(mstate m, size_t pad) {
         init_top(m, m->top, m->topsize - released);
         check_top_chunk(m, m->top);
       }
+      end_segment_change(m);
     }
 
     /* Unmap any unused mmapped segments */
@@ -5452,6 +5488,129 @@ int mspace_validate (mspace msp, const void *mem)
    return cinuse (p);
 }
 
+/* Lock free version of mspace_validate for regular segments. Sets *size
+   to the usable size of the chunk when mem is an in use chunk of msp.
+   Chunks in directly mmap'd large segments aren't looked at and give 0,
+   as does any segment change in progress; the caller can then take the
+   lock and use mspace_validate */
+int mspace_owns (mspace msp, const void *mem, size_t *size)
+{
+   mchunkptr p = mem2chunk(mem);
+   mstate ms = (mstate)msp;
+   msegmentptr pSeg;
+   size_t ChunkSize;
+   size_t head;
+   int ret = 0;
+
+   InterlockedIncrement (&ms->seg_readers);
+   if (*(volatile LONG *)&ms->seg_changing)
+      goto done;
+
+   pSeg = segment_holding (ms, (char *)p);
+   if (!pSeg || (((char *)p + sizeof (mchunk)) >= (pSeg->base + pSeg->size)))
+      goto done;
+
+   /* Other threads can be changing the header under the lock, so it is
+      read once and the footer is found from that copy */
+   head = *(volatile size_t *)&p->head;
+   ChunkSize = head & ~(FLAG_BITS);
+   if (!(head & CINUSE_BIT) ||
+       (ChunkSize > HALF_MAX_SIZE_T) ||
+       (((char *)p + ChunkSize) > (pSeg->base + pSeg->size)) ||
+       (((char *)p + ChunkSize) < (char *)p))
+      goto done;
+
+#if FOOTERS
+   if ((mstate)(((mchunkptr)((char *)p + ChunkSize))->prev_foot ^
+                mparams.magic) != ms)
+      goto done;
+#endif
+
+   *size = ChunkSize - CHUNK_OVERHEAD;
+   ret = 1;
+
+done:
+   InterlockedDecrement (&ms->seg_readers);
+   return ret;
+}
+
+/* Step to the chunk after *mem in msp, or to the first chunk if *mem is 0.
+   Chunks are visited segment by segment in address order, with the top
+   chunk reported as free, and then the directly mmap'd chunks. Returns 0
+   once there are no more chunks. The caller must keep the space from
+   changing between calls */
+int mspace_walk (mspace msp, void **mem, size_t *size, int *inuse)
+{
+   mstate ms = (mstate)msp;
+   msegmentptr pSeg;
+   lmsegmentptr lseg;
+   mchunkptr q = 0;
+
+   if (!ok_magic (ms))
+   {
+      USAGE_ERROR_ACTION (ms, ms);
+      return 0;
+   }
+
+   if (!is_initialized (ms))
+      return 0;
+
+   lseg = ms->large_seg;
+
+   if (!*mem)
+   {
+      pSeg = &ms->seg;
+      q = align_as_chunk (pSeg->base);
+   }
+   else if ((pSeg = segment_holding (ms, (char *)mem2chunk (*mem))) != 0)
+   {
+      mchunkptr p = mem2chunk (*mem);
+
+      /* Nothing but the footer follows top */
+      if (p != ms->top)
+         q = next_chunk (p);
+   }
+   else
+   {
+      while (lseg && (lseg->base != (char *)*mem))
+         lseg = lseg->next;
+      if (!lseg)
+         return 0;
+      lseg = lseg->next;
+   }
+
+   for (; pSeg; pSeg = pSeg->next, q = pSeg ? align_as_chunk (pSeg->base) : 0)
+   {
+      /* The space's own malloc_state sits in the first chunk of the
+         segment it was created in; it isn't a block anyone allocated */
+      if (q && (chunk2mem (q) == (void *)ms))
+         q = next_chunk (q);
+      if (!q || !segment_holds (pSeg, q) || (q->head == FENCEPOST_HEAD))
+         continue;
+
+      *mem = chunk2mem (q);
+      if (q == ms->top)
+      {
+         *size = ms->topsize;
+         *inuse = 0;
+      }
+      else
+      {
+         *size = chunksize (q);
+         *inuse = cinuse (q) != 0;
+      }
+      return 1;
+   }
+
+   if (!lseg)
+      return 0;
+
+   *mem = lseg->base;
+   *size = lseg->size;
+   *inuse = 1;
+   return 1;
+}
+
 
 int mspace_mallopt(int param_number, int value) {
   return change_mparam(param_number, value);